@@ -255,7 +255,9 @@
 #endif
             if (pretty) {
                 NSString* contentType = (_response.headers)[@"Content-Type"];
-                if ([contentType hasPrefix: @"application/json"] && _data.length < 100000) {
+                // (A body that was streamed, such as a query with ?stream=true, isn't in _response)
+                if ([contentType hasPrefix: @"application/json"] && _response.body
+                        && _data.length < 100000) {
                     LogTo(CBLListenerVerbose, @"%@ prettifying response body", self);
                     _data = [_response.body.asPrettyJSON mutableCopy];
                 }
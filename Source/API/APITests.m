@@ -786,6 +786,42 @@ TestCase(API_AsyncViewQuery) {
 }
 
 
+TestCase(API_BackgroundIndexing) {
+    RequireTestCase(API_CreateView);
+    CBLDatabase* db = createEmptyDB();
+    CBLView* view = [db viewNamed: @"vu"];
+    [view setMapBlock: MAPBLOCK({
+        emit(doc[@"sequence"], nil);
+    }) version: @"1"];
+    view.backgroundIndexDelay = 0.1;
+    view.updatesIndexInBackground = YES;
+
+    // More documents than are indexed in one chunk:
+    static const NSUInteger kNDocs = 1200;
+    createDocuments(db, kNDocs);
+    CAssert(view.stale);
+
+    LogMY(@"Waiting for background indexing...");
+    NSDate* timeout = [NSDate dateWithTimeIntervalSinceNow: 10.0];
+    while (view.stale && timeout.timeIntervalSinceNow > 0.0) {
+        if (![[NSRunLoop currentRunLoop] runMode: NSDefaultRunLoopMode
+                                      beforeDate: [NSDate dateWithTimeIntervalSinceNow: 0.1]])
+            break;
+    }
+    CAssert(!view.stale, @"Background indexing timed out!");
+
+    CBLQuery* query = [view createQuery];
+    query.indexUpdateMode = kCBLUpdateIndexNever;
+    query.startKey = @23;
+    query.endKey = @33;
+    NSError* error;
+    CAssertEq([query run: &error].count, (NSUInteger)11);
+
+    view.updatesIndexInBackground = NO;
+    closeTestDB(db);
+}
+
+
 // Make sure that a database's map/reduce functions are shared with the shadow database instance
 // running in the background server.
 TestCase(API_SharedMapBlocks) {
@@ -957,6 +993,7 @@ TestCase(API) {
     RequireTestCase(API_ViewWithLinkedDocs);
     RequireTestCase(API_SharedMapBlocks);
     RequireTestCase(API_LiveQuery);
+    RequireTestCase(API_BackgroundIndexing);
     RequireTestCase(API_Model);
 
     RequireTestCase(API_Replicator);
@@ -21,6 +21,21 @@ typedef void (^CBLValidationBlock) (CBLRevision* newRevision,
 #define VALIDATIONBLOCK(BLOCK) ^void(CBLRevision* newRevision, id<CBLValidationContext> context)\
                                     {BLOCK}
 
+/** How revision bodies are compressed in the database file. */
+typedef enum {
+    kCBLBodyCompressionNone,        /**< Bodies are stored as plain JSON */
+    kCBLBodyCompressionDeflate,     /**< Bodies are compressed with zlib */
+    kCBLBodyCompressionDictionary   /**< Bodies are compressed with zlib, using a dictionary trained
+                                         from the database's own documents */
+} CBLBodyCompression;
+
+/** Progress of an incremental compaction, as reported by -compactIncrementally:progress:error:. */
+typedef struct {
+    BOOL finished;                  /**< YES once the compaction is complete */
+    float fractionComplete;         /**< Rough estimate of the work done so far, from 0 to 1 */
+    UInt64 bytesReclaimed;          /**< Space returned to the filesystem so far */
+} CBLCompactionProgress;
+
 /** Filter block, used in changes feeds and replication. */
 typedef BOOL (^CBLFilterBlock) (CBLSavedRevision* revision, NSDictionary* params);
 
@@ -66,11 +81,42 @@ typedef BOOL (^CBLFilterBlock) (CBLSavedRevision* revision, NSDictionary* params
     the maxRevTreeDepth, deleting unused attachment files, and vacuuming the SQLite database. */
 - (BOOL) compact: (NSError**)outError;
 
+/** Performs part of a compaction, taking roughly `timeBudget` seconds, and returns. The work is
+    done in short transactions, and instead of rewriting the whole file with VACUUM, freed pages are
+    returned to the filesystem a few at a time, so other database access is never blocked for long.
+    Call this repeatedly until progress->finished is YES; a later call continues where the previous
+    one left off.
+    Only databases created with (or converted by a -compact: in) this version use incremental
+    vacuuming; in older ones, space freed by an incremental compaction is reused but not returned. */
+- (BOOL) compactIncrementally: (NSTimeInterval)timeBudget
+                     progress: (CBLCompactionProgress*)outProgress
+                        error: (NSError**)outError;
+
+/** Runs an incremental compaction to completion on a background thread (using the manager's
+    background instance of this database), taking one step of `stepTime` seconds at a time and
+    leaving at least as long between steps for other work.
+    The onProgress block, if given, is called on this database's thread or queue after each step. */
+- (void) compactInBackground: (NSTimeInterval)stepTime
+                  onProgress: (void(^)(CBLCompactionProgress progress))onProgress;
+
 /** The maximum depth of a document's revision tree (or, max length of its revision history.)
     Revisions older than this limit will be deleted during a -compact: operation. 
     Smaller values save space, at the expense of making document conflicts somewhat more likely. */
 @property NSUInteger maxRevTreeDepth;
 
+/** How revision bodies are compressed when saved. Compression is transparent to readers, and is
+    most effective with documents that have many property names in common.
+    Changing this only affects revisions saved afterwards; the next -compact: operation converts
+    the existing ones. Defaults to kCBLBodyCompressionNone.
+    Databases with compressed bodies can't be read by earlier versions of Couchbase Lite. */
+@property CBLBodyCompression bodyCompression;
+
+/** If YES, revision bodies are stored in a binary format whose properties can be read without
+    parsing JSON, which speeds up view indexing. Bodies in this format aren't compressed.
+    Like bodyCompression, this affects revisions saved afterwards, and -compact: converts the
+    existing ones. Defaults to NO. */
+@property BOOL binaryBodyFormat;
+
 /** Deletes the database. */
 - (BOOL) deleteDatabase: (NSError**)outError;
 
@@ -142,6 +188,14 @@ typedef BOOL (^CBLFilterBlock) (CBLSavedRevision* revision, NSDictionary* params
 /** Returns the existing CBLView with the given name, or nil if none. */
 - (CBLView*) existingViewNamed: (NSString*)name                         __attribute__((nonnull));
 
+/** Brings the indexes of several views up to date at once. The documents changed since the least
+    recently updated view was indexed are read, and parsed, only once, and passed to the map
+    function of each view that hasn't yet indexed them. The views are updated in one transaction.
+    @param views  The views to update, or nil to update all views whose map blocks are set.
+    @param outError  On return, the error if any.
+    @return  YES on success (including if no views needed updating), NO on error. */
+- (BOOL) updateIndexesOfViews: (NSArray*)views error: (NSError**)outError;
+
 /** Returns a CBLShowFunction object for the show function with the given name.
  (This succeeds even if the show function doesn't already exist */
 - (CBLShowFunction*) showFunctionNamed: (NSString*)name                         __attribute__((nonnull));
@@ -189,6 +243,16 @@ typedef BOOL (^CBLFilterBlock) (CBLSavedRevision* revision, NSDictionary* params
     overhead of multiple SQLite commits, greatly improving performance. */
 - (BOOL) inTransaction: (BOOL(^)(void))block                        __attribute__((nonnull(1)));
 
+/** Queues the block to be run within a transaction on the database's thread or queue, where it
+    will share a single commit with other queued blocks ("group commit"). This is faster than
+    calling -inTransaction: for each of many small writes, at the cost of a short delay before the
+    block runs. If the block returns NO, only its own changes are rolled back.
+    The onCompletion block is called on the database's thread or queue after the changes have been
+    committed (or not), with YES if the block's changes were saved.
+    Unlike the rest of the API, this can be called from any thread. */
+- (void) queueTransaction: (BOOL(^)(void))block
+             onCompletion: (void(^)(BOOL success))onCompletion      __attribute__((nonnull(1)));
+
 /** Runs the block asynchronously on the database's dispatch queue or thread.
     Unlike the rest of the API, this can be called from any thread, and provides a limited form
     of multithreaded access to Couchbase Lite. */
@@ -26,6 +26,7 @@
 #import "CBLCache.h"
 #import "CBLManager+Internal.h"
 #import "CBLMisc.h"
+#import "CBLBodyCodec.h"
 #import "MYBlockUtils.h"
 
 #if TARGET_OS_IPHONE
@@ -167,6 +168,18 @@ static id<CBLFilterCompiler> sFilterCompiler;
 }
 
 
+- (void) queueTransaction: (BOOL(^)(void))block
+             onCompletion: (void(^)(BOOL success))onCompletion
+{
+    [self _queueTransaction: ^CBLStatus {
+        return block() ? 200 : 999;
+    } onCompletion: ^(CBLStatus status) {
+        if (onCompletion)
+            onCompletion(status == 200);
+    }];
+}
+
+
 - (BOOL) create: (NSError**)outError {
     return [self open: outError];
 }
@@ -224,10 +237,91 @@ static id<CBLFilterCompiler> sFilterCompiler;
     return YES;
 }
 
+- (BOOL) compactIncrementally: (NSTimeInterval)timeBudget
+                     progress: (CBLCompactionProgress*)outProgress
+                        error: (NSError**)outError
+{
+    CBLStatus status = [self compactIncrementally: timeBudget progress: outProgress];
+    if (CBLStatusIsError(status)) {
+        if (outError)
+            *outError = CBLStatusToNSError(status, nil);
+        return NO;
+    }
+    return YES;
+}
+
+- (void) compactInBackground: (NSTimeInterval)stepTime
+                  onProgress: (void(^)(CBLCompactionProgress progress))onProgress
+{
+    // The steps run on the background server's instance of this database, so they don't hold up
+    // this one's thread (the main thread, for the main database); progress is reported back here.
+    void (^report)(CBLCompactionProgress) = nil;
+    if (onProgress) {
+        report = ^(CBLCompactionProgress progress) {
+            [self doAsync: ^{
+                onProgress(progress);
+            }];
+        };
+    }
+    if (_manager) {
+        [_manager backgroundTellDatabaseNamed: _name to: ^(CBLDatabase* bgdb) {
+            [bgdb compactInSteps: stepTime onProgress: report];
+        }];
+    } else {
+        // A database without a manager (only created by unit tests) has no background thread:
+        [self doAsync: ^{
+            [self compactInSteps: stepTime onProgress: report];
+        }];
+    }
+}
+
+// Takes one step of an incremental compaction, then schedules the next one on the current thread
+// (after a pause of stepTime, so other work can run) until it's finished.
+- (void) compactInSteps: (NSTimeInterval)stepTime
+             onProgress: (void(^)(CBLCompactionProgress progress))onProgress
+{
+    if (!_isOpen)
+        return;
+    CBLCompactionProgress progress;
+    CBLStatus status = [self compactIncrementally: stepTime progress: &progress];
+    if (CBLStatusIsError(status)) {
+        Warn(@"%@: Incremental compaction failed (status %d)", self, status);
+        return;
+    }
+    if (onProgress)
+        onProgress(progress);
+    if (!progress.finished) {
+        [self doAsyncAfterDelay: stepTime block: ^{
+            [self compactInSteps: stepTime onProgress: onProgress];
+        }];
+    }
+}
+
 - (NSUInteger) maxRevTreeDepth {
     return [[self infoForKey: @"max_revs"] intValue] ?: kDefaultMaxRevs;
 }
 
+- (CBLBodyCompression) bodyCompression {
+    return _bodyCodec.compression;
+}
+
+- (void) setBodyCompression: (CBLBodyCompression)compression {
+    CBLStatus status = [self _setBodyCompression: compression];
+    if (CBLStatusIsError(status))
+        Warn(@"%@: Couldn't change body compression (status %d)", self, status);
+}
+
+- (BOOL) binaryBodyFormat {
+    return _bodyCodec.binaryFormat;
+}
+
+- (void) setBinaryBodyFormat: (BOOL)binary {
+    CBLStatus status = [self _setBinaryBodyFormat: binary];
+    if (CBLStatusIsError(status))
+        Warn(@"%@: Couldn't change body format (status %d)", self, status);
+}
+
+
 - (void) setMaxRevTreeDepth: (NSUInteger)maxRevs {
     [self setInfo: $sprintf(@"%lu", (unsigned long)maxRevs) forKey: @"max_revs"];
     // This property is looked up by pruneRevsToMaxDepth:
@@ -381,6 +475,22 @@ static NSString* makeLocalDocID(NSString* docID) {
 }
 
 
+- (BOOL) updateIndexesOfViews: (NSArray*)views error: (NSError**)outError {
+    if (!views) {
+        views = [self.allViews my_filter: ^int(CBLView* view) {
+            return view.mapBlock != nil;
+        }];
+    }
+    CBLStatus status = [CBLView updateIndexes: views];
+    if (CBLStatusIsError(status)) {
+        if (outError)
+            *outError = CBLStatusToNSError(status, nil);
+        return NO;
+    }
+    return YES;
+}
+
+
 - (CBLQuery*) slowQueryWithMap: (CBLMapBlock)mapBlock {
     return [[CBLQuery alloc] initWithDatabase: self mapBlock: mapBlock];
 }
@@ -63,6 +63,14 @@ static NSUInteger utf8BytesToChars(const void* bytes, NSUInteger byteStart, NSUI
     return self;
 }
 
+- (id) copyWithZone: (NSZone*)zone {
+    CBLFullTextQueryRow* copy = [super copyWithZone: zone];
+    copy->_fullTextID = _fullTextID;
+    copy->_matchOffsets = _matchOffsets;
+    copy->_snippet = _snippet;
+    return copy;
+}
+
 - (NSString*) fullText {
     NSString* fullText = _fullText;
     if (!fullText) {
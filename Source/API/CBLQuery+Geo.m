@@ -61,6 +61,14 @@
 }
 
 
+- (id) copyWithZone: (NSZone*)zone {
+    CBLGeoQueryRow* copy = [super copyWithZone: zone];
+    copy->_boundingBox = _boundingBox;
+    copy->_geoJSONData = _geoJSONData;
+    return copy;
+}
+
+
 - (BOOL) isEqual:(id)object {
     if (![super isEqual: object] || ![object isKindOfClass: [CBLGeoQueryRow class]])
         return NO;
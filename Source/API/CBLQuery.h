@@ -9,7 +9,7 @@
 #import <Foundation/Foundation.h>
 
 @class CBLDatabase, CBLDocument;
-@class CBLLiveQuery, CBLQueryEnumerator, CBLQueryRow;
+@class CBLLiveQuery, CBLLiveQueryChanges, CBLQueryEnumerator, CBLQueryRow;
 
 
 typedef enum {
@@ -58,6 +58,12 @@ typedef enum {
     (Useful if the view contains multiple identical keys, making .endKey ambiguous.) */
 @property (copy) NSString* endKeyDocID;
 
+/** If non-nil, the query starts just after the last row of an earlier result of the same query
+    (the .cursor of its CBLQueryEnumerator), instead of at .startKey, .startKeyDocID and .skip.
+    This is the efficient way to page through many rows, since each page starts by seeking in the
+    index rather than by skipping over all the rows before it. */
+@property (copy) NSString* startCursor;
+
 /** Determines whether or when the view index is updated. By default, the index will be updated
     if necessary before the query runs -- this guarantees up-to-date results but can cause a
     delay. The "Never" mode skips updating the index, so it's faster but can return out of date
@@ -81,6 +87,19 @@ typedef enum {
     contents of each document. */
 @property BOOL prefetch;
 
+/** If non-nil, only rows for which this predicate evaluates to true are returned. It's evaluated
+    against each CBLQueryRow, so its key paths can refer to "key", "value" (and properties of the
+    value, like "value.name"), "documentID", "sequenceNumber", and, if .prefetch is set,
+    "documentProperties.<property>". It can't refer to "document".
+    The .skip and .limit apply to the rows that pass the filter. */
+@property (copy) NSPredicate* postFilter;
+
+/** If non-nil, an array of NSSortDescriptors that the rows are sorted by, instead of by key. Their
+    key paths are relative to CBLQueryRow, as with .postFilter; rows that compare equal stay in
+    index order. The .skip and .limit apply to the sorted rows, and only that many rows are kept
+    in memory while the query runs, so sorting a large view with a small limit is cheap. */
+@property (copy) NSArray* sortDescriptors;
+
 /** Changes the behavior of a query created by -queryAllDocuments.
     * In mode kCBLAllDocs (the default), the query simply returns all non-deleted documents.
     * In mode kCBLIncludeDeleted, it also returns deleted documents.
@@ -91,6 +110,19 @@ typedef enum {
       conflicts as they happen, i.e. when they're pulled in by a replication.) */
 @property CBLAllDocsMode allDocsMode;
 
+/** If set to YES, the enumerator returned by -run: or -runAsync: reads each row from the database
+    when it's requested, instead of reading all of them into memory first. The first rows are
+    then available sooner, and rows after the point where the caller stops enumerating are
+    never read or parsed (nor are their documents, with .prefetch.) The rows that have been read
+    are kept, so the enumerator otherwise behaves as usual: -count, -rowAtIndex:, -isEqual: and
+    -copy first read any remaining rows, and -reset starts again from the first.
+    Until it's read the last row (or is deallocated) the enumerator keeps a read-only database
+    connection open, so it should be used promptly and on only one thread at a time.
+    Its .cursor is always nil.
+    Reduced, grouped, full-text, filtered and sorted queries (and all-docs queries with .keys)
+    can't be streamed; their enumerators behave as usual. This property is ignored by CBLLiveQuery. */
+@property BOOL streamsRows;
+
 /** Sends the query to the server and returns an enumerator over the result rows (Synchronous).
     Note: In a CBLLiveQuery you should access the .rows property instead. */
 - (CBLQueryEnumerator*) run: (NSError**)outError;
@@ -141,6 +173,11 @@ typedef enum {
     If nil, the last execution of the query was successful. */
 @property (readonly) NSError* lastError;
 
+/** How the rows changed in the latest update: which were removed, inserted or moved. This is set
+    just before .rows changes, so it can be used by a KVO observer of .rows (for example to animate
+    a table view.) It's nil until the rows have been updated for the first time. */
+@property (readonly) CBLLiveQueryChanges* lastChanges;
+
 #ifdef CBL_DEPRECATED
 @property (readonly) NSError* error __attribute__((deprecated("renamed lastError")));
 #endif
@@ -148,6 +185,25 @@ typedef enum {
 @end
 
 
+/** Describes how the rows of a CBLLiveQuery changed from one update to the next (see its
+    .lastChanges property.) Rows are matched up by key and source document ID, so a row whose value
+    or document changed counts as removed and inserted again. */
+@interface CBLLiveQueryChanges : NSObject
+
+/** The indexes in the old rows of the rows that were removed. */
+@property (readonly) NSIndexSet* removedIndexes;
+
+/** The indexes in the new rows of the rows that were inserted. */
+@property (readonly) NSIndexSet* insertedIndexes;
+
+/** The rows that moved relative to the others, as a dictionary that maps each one's index in the
+    old rows to its index in the new rows (both as NSNumbers.) Rows that only shifted because of
+    removals and insertions before them aren't included. */
+@property (readonly) NSDictionary* movedIndexes;
+
+@end
+
+
 /** Enumerator on a CBLQuery's result rows.
     The objects returned are instances of CBLQueryRow. */
 @interface CBLQueryEnumerator : NSEnumerator <NSCopying>
@@ -161,6 +217,12 @@ typedef enum {
 /** YES if the database has changed since the view was generated. */
 @property (readonly) BOOL stale;
 
+/** A token for the position just after the last row, which can be set as a query's .startCursor
+    to get the next page of rows. It's nil if there are no more rows after these (for instance if
+    the query has no .limit), or if the query can't be resumed that way (a reduced, grouped,
+    full-text or geo query, or one with .keys.) */
+@property (readonly) NSString* cursor;
+
 /** The next result row. This is the same as -nextObject but with a checked return type. */
 - (CBLQueryRow*) nextRow;
 
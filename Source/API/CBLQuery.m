@@ -19,14 +19,28 @@
 #import "CBLDatabase.h"
 #import "CBL_Server.h"
 #import "MYBlockUtils.h"
+#import <objc/runtime.h>
 
 
 // Querying utilities for CBLDatabase. Defined down below.
 @interface CBLDatabase (Views)
-- (NSArray*) queryViewNamed: (NSString*)viewName
-                    options: (CBLQueryOptions)options
-               lastSequence: (SequenceNumber*)outLastSequence
-                     status: (CBLStatus*)outStatus;
+/** Looks up a view and updates its index if the options call for it.
+    Must be called on the database's thread. */
+- (CBLView*) viewNamed: (NSString*)viewName
+      preparedForQuery: (const CBLQueryOptions*)options
+                status: (CBLStatus*)outStatus;
+/** Queries a view (or _all_docs if the view is nil) without updating its index.
+    Must be called on the database's thread. */
+- (NSArray*) queryView: (CBLView*)view
+               options: (CBLQueryOptions)options
+          lastSequence: (SequenceNumber*)outLastSequence
+                status: (CBLStatus*)outStatus;
+/** Like -queryView:..., but returns an enumerator that reads the rows as they're requested.
+    Must be called on the database's thread. */
+- (NSEnumerator*) streamView: (CBLView*)view
+                     options: (CBLQueryOptions)options
+                lastSequence: (SequenceNumber*)outLastSequence
+                      status: (CBLStatus*)outStatus;
 @end
 
 
@@ -34,6 +48,21 @@
 - (instancetype) initWithDatabase: (CBLDatabase*)db
                              rows: (NSArray*)rows
                    sequenceNumber: (SequenceNumber)sequenceNumber;
+- (instancetype) initWithDatabase: (CBLDatabase*)db
+                        rowStream: (NSEnumerator*)stream
+                   sequenceNumber: (SequenceNumber)sequenceNumber;
+- (instancetype) copyWithSequenceNumber: (SequenceNumber)sequenceNumber;
+@property (readwrite, copy) NSString* cursor;
+@end
+
+
+@interface CBLQuery ()
+@property (readonly) CBLView* view;
+/** Like -runAsync:, except that if the view's index hasn't changed since the given sequence in any
+    way that can affect the results, it doesn't run the query, and calls the block with nil rows
+    and error. The block's last parameter is the sequence the index is now up to date with. */
+- (void) runAsyncIfChangedSince: (SequenceNumber)indexSequence
+                     onComplete: (void (^)(CBLQueryEnumerator*, NSError*, SequenceNumber))onComplete;
 @end
 
 
@@ -52,10 +81,16 @@
     id _startKey, _endKey;
     NSString* _startKeyDocID;
     NSString* _endKeyDocID;
+    NSString* _startCursor;
+    id _cursorStartKey;         // startKey, startKeyDocID and skip decoded from _startCursor
+    NSString* _cursorStartKeyDocID;
+    unsigned _cursorSkip;
     CBLIndexUpdateMode _indexUpdateMode;
-    BOOL _descending, _prefetch, _mapOnly;
+    BOOL _descending, _prefetch, _mapOnly, _streamsRows;
     CBLAllDocsMode _allDocsMode;
     NSArray *_keys;
+    NSPredicate* _postFilter;
+    NSArray* _sortDescriptors;
     NSUInteger _groupLevel;
     SInt64 _lastSequence;       // The db's lastSequence the last time -rows was called
 }
@@ -103,11 +138,14 @@
         _mapOnly = query.mapOnly;
         self.startKeyDocID = query.startKeyDocID;
         self.endKeyDocID = query.endKeyDocID;
+        self.startCursor = query.startCursor;
         _indexUpdateMode = query.indexUpdateMode;
         _fullTextQuery = query.fullTextQuery;
         _fullTextRanking = query.fullTextRanking;
         _fullTextSnippets = query.fullTextSnippets;
         _allDocsMode = query.allDocsMode;
+        self.postFilter = query.postFilter;
+        self.sortDescriptors = query.sortDescriptors;
         
     }
     return self;
@@ -124,21 +162,45 @@
 @synthesize  limit=_limit, skip=_skip, descending=_descending, startKey=_startKey, endKey=_endKey,
             prefetch=_prefetch, keys=_keys, groupLevel=_groupLevel, startKeyDocID=_startKeyDocID,
             endKeyDocID=_endKeyDocID, indexUpdateMode=_indexUpdateMode, mapOnly=_mapOnly,
-            database=_database, allDocsMode=_allDocsMode;
+            database=_database, allDocsMode=_allDocsMode, view=_view, streamsRows=_streamsRows,
+            postFilter=_postFilter, sortDescriptors=_sortDescriptors;
 
 
 - (CBLLiveQuery*) asLiveQuery {
     return [[CBLLiveQuery alloc] initWithQuery: self];
 }
 
+- (NSString*) startCursor {
+    return _startCursor;
+}
+
+- (void) setStartCursor: (NSString*)cursor {
+    id startKey = nil;
+    NSString* startKeyDocID = nil;
+    unsigned skip = 0;
+    if (cursor && !CBLQueryCursorDecode(cursor, &startKey, &startKeyDocID, &skip)) {
+        Warn(@"%@: Invalid startCursor \"%@\"", self, cursor);
+        cursor = nil;
+    }
+    _startCursor = [cursor copy];
+    _cursorStartKey = startKey;
+    _cursorStartKeyDocID = startKeyDocID;
+    _cursorSkip = skip;
+}
+
+
 - (CBLQueryOptions) queryOptions {
-    return (CBLQueryOptions) {
+    CBLQueryOptions options = {
         .startKey = _startKey,
         .endKey = _endKey,
         .keys = _keys,
+        .startKeyDocID = _startKeyDocID,
+        .endKeyDocID = _endKeyDocID,
         .fullTextQuery = _fullTextQuery,
         .fullTextSnippets = _fullTextSnippets,
         .fullTextRanking = _fullTextRanking,
+        .postFilter = _postFilter,
+        .sortDescriptors = _sortDescriptors,
         .bbox = (_isGeoQuery ? &_boundingBox : NULL),
         .skip = (unsigned)_skip,
         .limit = (unsigned)_limit,
@@ -152,40 +214,117 @@
         .allDocsMode = _allDocsMode,
         .indexUpdateMode = _indexUpdateMode
     };
+    if (_startCursor) {
+        options.startKey = _cursorStartKey;
+        options.startKeyDocID = _cursorStartKeyDocID;
+        options.skip = _cursorSkip;
+    }
+    return options;
 }
 
 
 - (CBLQueryEnumerator*) run: (NSError**)outError {
     CBLStatus status;
-    NSArray* rows = [_database queryViewNamed: _view.name
-                                      options: self.queryOptions
-                                 lastSequence: &_lastSequence
-                                       status: &status];
+    CBLQueryOptions options = self.queryOptions;
+    CBLView* view = nil;
+    if (_view) {
+        view = [_database viewNamed: _view.name preparedForQuery: &options status: &status];
+        if (!view) {
+            if (outError)
+                *outError = CBLStatusToNSError(status, nil);
+            return nil;
+        }
+    }
+    if (self.streamsRows) {
+        NSEnumerator* stream = [_database streamView: view options: options
+                                        lastSequence: &_lastSequence status: &status];
+        if (!stream) {
+            if (outError)
+                *outError = CBLStatusToNSError(status, nil);
+            return nil;
+        }
+        return [[CBLQueryEnumerator alloc] initWithDatabase: _database
+                                                  rowStream: stream
+                                             sequenceNumber: _lastSequence];
+    }
+    // Query for one more row than the limit, to find out whether there's a next page:
+    NSArray* rows = [_database queryView: view
+                                 options: CBLQueryOptionsWithExtraRow(&options, view)
+                            lastSequence: &_lastSequence
+                                  status: &status];
     if (!rows) {
         if (outError)
             *outError = CBLStatusToNSError(status, nil);
         return nil;
     }
-    return [[CBLQueryEnumerator alloc] initWithDatabase: _database
-                                                   rows: rows
-                                         sequenceNumber: _lastSequence];
+    NSString* cursor = CBLQueryCursorAfterRows(&rows, &options, view);
+    CBLQueryEnumerator* e = [[CBLQueryEnumerator alloc] initWithDatabase: _database
+                                                                    rows: rows
+                                                          sequenceNumber: _lastSequence];
+    e.cursor = cursor;
+    return e;
 }
 
 
 - (void) runAsync: (void (^)(CBLQueryEnumerator*, NSError*))onComplete {
+    [self runAsyncIfChangedSince: 0 onComplete: ^(CBLQueryEnumerator* rows, NSError* error,
+                                                  SequenceNumber indexSequence) {
+        onComplete(rows, error);
+    }];
+}
+
+
+- (void) runAsyncIfChangedSince: (SequenceNumber)indexSequence
+                     onComplete: (void (^)(CBLQueryEnumerator*, NSError*, SequenceNumber))onComplete
+{
     LogTo(Query, @"%@: Async query %@/%@...", self, _database.name, (_view.name ?: @"_all_docs"));
     NSThread *callingThread = [NSThread currentThread];
     NSString* viewName = _view.name;
     CBLQueryOptions options = self.queryOptions;
+    BOOL streamsRows = self.streamsRows;
     
     [_database.manager backgroundTellDatabaseNamed: _database.name to: ^(CBLDatabase *bgdb) {
-        // On the background server thread, run the query:
-        CBLStatus status;
+        // On the background server thread, update the view's index (that's a write, so it has to
+        // be done on the database's thread):
+        __block CBLStatus status = kCBLStatusOK;
+        CBLView* view = nil;
+        if (viewName) {
+            view = [bgdb viewNamed: viewName preparedForQuery: &options status: &status];
+            if (!view) {
+                MYOnThread(callingThread, ^{
+                    onComplete(nil, CBLStatusToNSError(status, nil), 0);
+                });
+                return;
+            }
+            // Skip the query if the index updates since last time can't have changed the result:
+            if (indexSequence > 0
+                    && ![view _indexChangesFromSequence: indexSequence mayAffectQuery: &options]) {
+                SequenceNumber lastSequence = view.lastSequenceIndexed;
+                LogTo(Query, @"%@: ...index changes since %lld don't affect the query",
+                      self, indexSequence);
+                MYOnThread(callingThread, ^{
+                    onComplete(nil, nil, lastSequence);
+                });
+                return;
+            }
+        }
+        // Then run the query itself, still on the server thread: the CBLView object (its index
+        // state and query cache) is shared with the indexer and isn't thread-safe.
         SequenceNumber lastSequence;
-        NSArray* rows = [bgdb queryViewNamed: viewName
-                                     options: options
-                                lastSequence: &lastSequence
-                                      status: &status];
+        NSArray* rows = nil;
+        NSEnumerator* stream = nil;
+        NSString* cursor = nil;
+        if (streamsRows) {
+            stream = [bgdb streamView: view options: options
+                         lastSequence: &lastSequence status: &status];
+        } else {
+            rows = [bgdb queryView: view
+                           options: CBLQueryOptionsWithExtraRow(&options, view)
+                      lastSequence: &lastSequence
+                            status: &status];
+            if (rows)
+                cursor = CBLQueryCursorAfterRows(&rows, &options, view);
+        }
         MYOnThread(callingThread, ^{
             // Back on original thread, call the onComplete block:
             LogTo(Query, @"%@: ...async query finished (%u rows)", self, (unsigned)rows.count);
@@ -193,11 +332,17 @@
             CBLQueryEnumerator* e = nil;
             if (CBLStatusIsError(status))
                 error = CBLStatusToNSError(status, nil);
-            else
+            else if (stream) {
+                e = [[CBLQueryEnumerator alloc] initWithDatabase: _database
+                                                       rowStream: stream
+                                                  sequenceNumber: lastSequence];
+            } else {
                 e = [[CBLQueryEnumerator alloc] initWithDatabase: _database
                                                             rows: rows
                                                   sequenceNumber: lastSequence];
-            onComplete(e, error);
+                e.cursor = cursor;
+            }
+            onComplete(e, error, lastSequence);
         });
     }];
 }
@@ -239,7 +384,7 @@
 }
 
 
-@synthesize lastError=_lastError;
+@synthesize lastError=_lastError, lastChanges=_lastChanges;
 @dynamic error;
 
 - (void) dealloc {
@@ -254,6 +399,7 @@
                                                  selector: @selector(databaseChanged)
                                                      name: kCBLDatabaseChangeNotification 
                                                    object: self.database];
+        [self.view _trackIndexChanges];
         [self update];
     }
 }
@@ -285,6 +431,12 @@
 }
 
 
+// A live query compares each result with the last, so it needs all the rows anyway:
+- (BOOL) streamsRows {
+    return NO;
+}
+
+
 - (CBLQueryEnumerator*) rows {
     [self start];
     // Have to return a copy because the enumeration has to start at item #0 every time
@@ -315,15 +467,43 @@
 }
 
 
+// The index sequence the current rows are up to date with, or 0 if the query has to be run
+// again after any change.
+- (SequenceNumber) indexSequence {
+    if (!_rows || _lastError)
+        return 0;
+    // Rows with linked documents (whose documentID isn't the sourceDocumentID) can be affected by
+    // changes to documents that don't update the index:
+    if (self.prefetch) {
+        for (NSUInteger i = 0; i < _rows.count; ++i) {
+            CBLQueryRow* row = [_rows rowAtIndex: i];
+            if (!$equal(row.documentID, row.sourceDocumentID))
+                return 0;
+        }
+    }
+    return (SequenceNumber)_rows.sequenceNumber;
+}
+
+
 - (void) update {
     _willUpdate = NO;
-    [self runAsync: ^(CBLQueryEnumerator *rows, NSError* error) {
+    [self runAsyncIfChangedSince: self.indexSequence
+                      onComplete: ^(CBLQueryEnumerator *rows, NSError* error,
+                                    SequenceNumber indexSequence) {
         _lastError = error;
         if (error) {
             Warn(@"%@: Error updating rows: %@", self, error);
+        } else if (!rows) {
+            // Unaffected by the changes; just note that the rows are still current:
+            _rows = [_rows copyWithSequenceNumber: indexSequence];
         } else if(![rows isEqual: _rows]) {
             LogTo(Query, @"%@: ...Rows changed! (now %lu)", self, (unsigned long)rows.count);
+            _lastChanges = _rows ? [[CBLLiveQueryChanges alloc] initWithOldRows: _rows
+                                                                        newRows: rows]
+                                 : nil;
             self.rows = rows;   // Triggers KVO notification
+        } else {
+            _rows = rows;       // Same rows, but up to date with a later sequence
         }
     }];
 }
@@ -352,12 +532,14 @@
 {
     CBLDatabase* _database;
     NSArray* _rows;
+    NSEnumerator* _stream;      // Rows not yet read, if streaming (then _rows has those read)
     NSUInteger _nextRow;
     UInt64 _sequenceNumber;
+    NSString* _cursor;
 }
 
 
-@synthesize sequenceNumber=_sequenceNumber;
+@synthesize sequenceNumber=_sequenceNumber, cursor=_cursor;
 
 
 - (instancetype) initWithDatabase: (CBLDatabase*)database
@@ -380,10 +562,28 @@
     return self;
 }
 
+- (instancetype) initWithDatabase: (CBLDatabase*)database
+                        rowStream: (NSEnumerator*)stream
+                   sequenceNumber: (SequenceNumber)sequenceNumber
+{
+    self = [self initWithDatabase: database rows: @[] sequenceNumber: sequenceNumber];
+    if (self) {
+        _rows = [NSMutableArray array];
+        _stream = stream;
+    }
+    return self;
+}
+
 - (id) copyWithZone: (NSZone*)zone {
-    return [[[self class] alloc] initWithDatabase: _database
-                                             rows: _rows
-                                   sequenceNumber: _sequenceNumber];
+    return [self copyWithSequenceNumber: _sequenceNumber];
+}
+
+- (instancetype) copyWithSequenceNumber: (SequenceNumber)sequenceNumber {
+    CBLQueryEnumerator* copy = [[[self class] alloc] initWithDatabase: _database
+                                                                 rows: self.allRows
+                                                       sequenceNumber: sequenceNumber];
+    copy->_cursor = _cursor;
+    return copy;
 }
 
 
@@ -393,7 +593,29 @@
     if (![object isKindOfClass: [CBLQueryEnumerator class]])
         return NO;
     CBLQueryEnumerator* otherEnum = object;
-    return [otherEnum->_rows isEqual: _rows];
+    return [otherEnum.allRows isEqual: self.allRows];
+}
+
+
+// Reads the next row from the stream and adds it to _rows; at the end, closes the stream.
+- (CBLQueryRow*) readStreamedRow {
+    CBLQueryRow* row = _stream.nextObject;
+    if (!row) {
+        _stream = nil;
+        _rows = [_rows copy];
+        return nil;
+    }
+    row.database = _database;
+    [(NSMutableArray*)_rows addObject: row];
+    return row;
+}
+
+
+// The rows as an array. If streaming, first reads the remaining rows into memory.
+- (NSArray*) allRows {
+    while (_stream)
+        [self readStreamedRow];
+    return _rows;
 }
 
 
@@ -403,16 +625,20 @@
 
 
 - (NSUInteger) count {
-    return _rows.count;
+    return self.allRows.count;
 }
 
 
 - (CBLQueryRow*) rowAtIndex: (NSUInteger)index {
-    return _rows[index];
+    return self.allRows[index];
 }
 
 
 - (CBLQueryRow*) nextRow {
+    if (_nextRow >= _rows.count && _stream) {
+        if (![self readStreamedRow])
+            return nil;
+    }
     if (_nextRow >= _rows.count)
         return nil;
     return [self rowAtIndex:_nextRow++];
@@ -434,6 +660,123 @@
 
 
 
+
+@implementation CBLLiveQueryChanges
+
+@synthesize removedIndexes=_removedIndexes, insertedIndexes=_insertedIndexes,
+            movedIndexes=_movedIndexes;
+
+
+// Identifies each row by its key and source document ID, plus a counter to tell apart rows
+// emitted with the same key by the same document.
+static NSArray* rowIdentities(CBLQueryEnumerator* rows) {
+    NSUInteger count = rows.count;
+    NSMutableArray* identities = [NSMutableArray arrayWithCapacity: count];
+    NSCountedSet* seen = [[NSCountedSet alloc] init];
+    for (NSUInteger i = 0; i < count; ++i) {
+        CBLQueryRow* row = [rows rowAtIndex: i];
+        NSArray* identity = @[row.key ?: $null, row.sourceDocumentID ?: $null];
+        [seen addObject: identity];
+        [identities addObject: [identity arrayByAddingObject: @([seen countForObject: identity])]];
+    }
+    return identities;
+}
+
+
+// Marks the items of the longest strictly increasing subsequence of 'values' in 'inSequence'.
+static void findLongestIncreasing(const NSUInteger* values, NSUInteger count, BOOL* inSequence) {
+    // tails[k] is the index of the smallest value ending an increasing subsequence of length k+1;
+    // prev[i] is the index of the item before item i in the longest subsequence ending at i.
+    NSUInteger* tails = malloc(count * sizeof(NSUInteger));
+    NSUInteger* prev = malloc(count * sizeof(NSUInteger));
+    NSUInteger length = 0;
+    for (NSUInteger i = 0; i < count; ++i) {
+        NSUInteger lo = 0, hi = length;
+        while (lo < hi) {
+            NSUInteger mid = (lo + hi) / 2;
+            if (values[tails[mid]] < values[i])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        prev[i] = (lo > 0) ? tails[lo - 1] : NSNotFound;
+        tails[lo] = i;
+        if (lo == length)
+            ++length;
+        inSequence[i] = NO;
+    }
+    for (NSUInteger i = (length > 0) ? tails[length - 1] : NSNotFound; i != NSNotFound; i = prev[i])
+        inSequence[i] = YES;
+    free(tails);
+    free(prev);
+}
+
+
+- (instancetype) initWithOldRows: (CBLQueryEnumerator*)oldRows
+                         newRows: (CBLQueryEnumerator*)newRows
+{
+    self = [super init];
+    if (self) {
+        NSArray* oldIDs = rowIdentities(oldRows);
+        NSArray* newIDs = rowIdentities(newRows);
+        NSMutableDictionary* newIndexes = [NSMutableDictionary dictionaryWithCapacity: newIDs.count];
+        [newIDs enumerateObjectsUsingBlock: ^(id identity, NSUInteger i, BOOL *stop) {
+            newIndexes[identity] = @(i);
+        }];
+
+        // Find the rows that are in both, unchanged; the others were removed or inserted:
+        NSMutableIndexSet* removed = [NSMutableIndexSet indexSet];
+        NSMutableIndexSet* kept = [NSMutableIndexSet indexSet];
+        NSUInteger nOld = oldIDs.count, nKept = 0;
+        NSUInteger* keptOld = malloc(MAX(nOld, 1u) * sizeof(NSUInteger));
+        NSUInteger* keptNew = malloc(MAX(nOld, 1u) * sizeof(NSUInteger));
+        for (NSUInteger i = 0; i < nOld; ++i) {
+            NSNumber* newIndex = newIndexes[oldIDs[i]];
+            NSUInteger j = newIndex.unsignedIntegerValue;
+            if (newIndex && [[oldRows rowAtIndex: i] isEqual: [newRows rowAtIndex: j]]) {
+                keptOld[nKept] = i;
+                keptNew[nKept++] = j;
+                [kept addIndex: j];
+            } else {
+                [removed addIndex: i];
+            }
+        }
+        NSMutableIndexSet* inserted = [NSMutableIndexSet indexSetWithIndexesInRange:
+                                                            NSMakeRange(0, newIDs.count)];
+        [inserted removeIndexes: kept];
+
+        // Of the rows kept, the ones whose new indexes form the longest increasing sequence stay
+        // in order; the rest have moved:
+        NSMutableDictionary* moved = $mdict();
+        BOOL* inOrder = malloc(MAX(nKept, 1u) * sizeof(BOOL));
+        findLongestIncreasing(keptNew, nKept, inOrder);
+        for (NSUInteger k = 0; k < nKept; ++k) {
+            if (!inOrder[k])
+                moved[@(keptOld[k])] = @(keptNew[k]);
+        }
+        free(inOrder);
+        free(keptOld);
+        free(keptNew);
+
+        _removedIndexes = [removed copy];
+        _insertedIndexes = [inserted copy];
+        _movedIndexes = [moved copy];
+    }
+    return self;
+}
+
+
+- (NSString*) description {
+    return $sprintf(@"%@[removed %@, inserted %@, moved %@]", self.class,
+                    _removedIndexes, _insertedIndexes, _movedIndexes);
+}
+
+
+@end
+
+
+
+
 static id fromJSON( NSData* json ) {
     if (!json)
         return nil;
@@ -482,6 +825,19 @@ static id fromJSON( NSData* json ) {
 }
 
 
+// Returns a new row with the same contents, but no database yet. (A view's query result cache
+// hands out copies of its rows, since rows are modified by the enumerators they're returned by.)
+- (id) copyWithZone: (NSZone*)zone {
+    CBLQueryRow* copy = [[[self class] allocWithZone: zone] init];
+    copy->_key = _key;
+    copy->_value = _value;
+    copy->_sequence = _sequence;
+    copy->_sourceDocID = _sourceDocID;
+    copy->_documentProperties = _documentProperties;
+    return copy;
+}
+
+
 // This is used implicitly by -[CBLLiveQuery update] to decide whether the query result has changed
 // enough to notify the client. So it's important that it not give false positives, else the app
 // won't get notified of changes.
@@ -594,6 +950,26 @@ static id fromJSON( NSData* json ) {
 
 
 // This is used by the router
+// Approximate size of an object (other than data or a string) in a row:
+#define kEstimatedObjectSize 32
+
+static size_t estimatedSize(id object) {
+    if (!object)
+        return 0;
+    else if ([object isKindOfClass: [NSData class]])
+        return kEstimatedObjectSize + [object length];
+    else if ([object isKindOfClass: [NSString class]])
+        return kEstimatedObjectSize + [object length] * sizeof(unichar);
+    else
+        return kEstimatedObjectSize;
+}
+
+- (size_t) estimatedMemorySize {
+    return class_getInstanceSize([self class]) + estimatedSize(_sourceDocID)
+         + estimatedSize(_key) + estimatedSize(_value);
+}
+
+
 - (NSDictionary*) asJSONDictionary {
     if (_value || _sourceDocID) {
         return $dict({@"key", self.key},
@@ -629,35 +1005,44 @@ static id fromJSON( NSData* json ) {
 
 @implementation CBLDatabase (Views)
 
-- (NSArray*) queryViewNamed: (NSString*)viewName
-                    options: (CBLQueryOptions)options
-               lastSequence: (SequenceNumber*)outLastSequence
-                     status: (CBLStatus*)outStatus
+- (CBLView*) viewNamed: (NSString*)viewName
+      preparedForQuery: (const CBLQueryOptions*)options
+                status: (CBLStatus*)outStatus
 {
-    CBLStatus status;
-    NSArray* rows = nil;
-    SequenceNumber lastSequence = 0;
-    do {
-        if (viewName) {
-            CBLView* view = [self viewNamed: viewName];
-            if (!view) {
-                status = kCBLStatusNotFound;
-                break;
-            }
+    CBLView* view = [self viewNamed: viewName];
+    if (!view) {
+        *outStatus = kCBLStatusNotFound;
+        return nil;
+    }
+    *outStatus = kCBLStatusOK;
+    SequenceNumber lastSequence = view.lastSequenceIndexed;
+    if (options->indexUpdateMode == kCBLUpdateIndexBefore || lastSequence <= 0) {
+        CBLStatus status = [view updateIndex];
+        if (CBLStatusIsError(status)) {
+            Warn(@"Failed to update view index: %d", status);
+            *outStatus = status;
+            return nil;
+        }
+    } else if (options->indexUpdateMode == kCBLUpdateIndexAfter &&
+               lastSequence < self.lastSequenceNumber) {
+        [self doAsync: ^{
+            [view updateIndex];
+        }];
+    }
+    return view;
+}
+
+- (NSArray*) queryView: (CBLView*)view
+               options: (CBLQueryOptions)options
+          lastSequence: (SequenceNumber*)outLastSequence
+                status: (CBLStatus*)outStatus
+{
+    __block NSArray* rows = nil;
+    __block SequenceNumber lastSequence = 0;
+    CBLStatus status = [self _inReadTransaction: ^CBLStatus {
+        CBLStatus status;
+        if (view) {
             lastSequence = view.lastSequenceIndexed;
-            if (options.indexUpdateMode == kCBLUpdateIndexBefore || lastSequence <= 0) {
-                status = [view updateIndex];
-                if (CBLStatusIsError(status)) {
-                    Warn(@"Failed to update view index: %d", status);
-                    break;
-                }
-                lastSequence = view.lastSequenceIndexed;
-            } else if (options.indexUpdateMode == kCBLUpdateIndexAfter &&
-                       lastSequence < self.lastSequenceNumber) {
-                [self doAsync: ^{
-                    [view updateIndex];
-                }];
-            }
             rows = [view _queryWithOptions: &options status: &status];
         } else {
             // nil view means query _all_docs
@@ -665,7 +1050,8 @@ static id fromJSON( NSData* json ) {
             status = rows ? kCBLStatusOK :self.lastDbError; //FIX: getALlDocs should return status
             lastSequence = self.lastSequenceNumber;
         }
-    } while(false); // just to allow 'break' within the block
+        return status;
+    }];
 
     if (outLastSequence)
         *outLastSequence = lastSequence;
@@ -674,4 +1060,27 @@ static id fromJSON( NSData* json ) {
     return rows;
 }
 
+- (NSEnumerator*) streamView: (CBLView*)view
+                     options: (CBLQueryOptions)options
+                lastSequence: (SequenceNumber*)outLastSequence
+                      status: (CBLStatus*)outStatus
+{
+    CBLStatus status;
+    NSEnumerator* rows;
+    SequenceNumber lastSequence;
+    if (view) {
+        lastSequence = view.lastSequenceIndexed;
+        rows = [view _streamRowsWithOptions: &options status: &status];
+    } else {
+        // nil view means query _all_docs
+        lastSequence = self.lastSequenceNumber;
+        rows = [self streamAllDocs: &options status: &status];
+    }
+    if (outLastSequence)
+        *outLastSequence = lastSequence;
+    if (outStatus)
+        *outStatus = status;
+    return rows;
+}
+
 @end
@@ -34,6 +34,18 @@ typedef id (^CBLReduceBlock)(NSArray* keys, NSArray* values, BOOL rereduce);
     the full-text indexer. Used inside a map block, like so: `emit(CBLTextKey(longText), value);` */
 id CBLTextKey(NSString* text);
 
+/** This notification is posted by a CBLView while its index is being updated, each time a chunk
+    of the update has been committed. (Long updates are split into chunks, each in its own
+    transaction, so that other writers aren't locked out and the progress isn't lost if the app
+    quits.) It's posted on the thread doing the indexing; views updated in the background (see
+    -updatesIndexInBackground) are indexed by a separate CBLView instance with the same name.
+    The userInfo dictionary contains:
+        "sequence": The sequence number the index is now up to date with;
+        "endSequence": The sequence number the update will finish at;
+        "rate": The number of sequences per second indexed in the last chunk. */
+extern NSString* const kCBLViewIndexProgressNotification;
+
+
 /** An external object that knows how to map source code of some sort into executable functions. */
 @protocol CBLViewCompiler <NSObject>
 - (CBLMapBlock) compileMapFunction: (NSString*)mapSource language: (NSString*)language;
@@ -77,6 +89,52 @@ id CBLTextKey(NSString* text);
 - (BOOL) setMapBlock: (CBLMapBlock)mapBlock
              version: (NSString*)version                            __attribute__((nonnull(1,2)));
 
+/** The maximum number of threads that may call the map block at once while the index is being
+    updated. The emitted rows are still written to the index in the same order as when mapping
+    serially.
+    Defaults to 1, i.e. the map block is called serially on the database's thread. Views compiled
+    from JavaScript are always mapped serially.
+    The document dictionaries passed to the map block are immutable, all the way down, since the
+    same dictionary may be mapped by several views' map blocks at once. Like the map block, this
+    is shared by every CBLView object for this view, but must be set on every launch. */
+@property NSUInteger mapParallelism;
+
+/** If YES, the index also stores each key in a binary form whose byte order is the collation
+    order, so queries can compare and sort keys without parsing their JSON. This makes range
+    queries on large indexes much faster, at the cost of some extra space.
+    This setting is persistent, and can only be made once the map block has been set. Changing it
+    clears the index, which will be rebuilt when next updated.
+    With the default (Unicode) collation, strings containing non-ASCII characters are ordered
+    case- and diacritic-insensitively by code point, rather than according to the current locale. */
+@property BOOL binaryKeyFormat;
+
+/** If YES, the reduced value of every distinct key in the index is stored persistently, and kept
+    up to date as the index is updated: new rows are reduced and then rereduced together with
+    the stored value, and keys whose rows were removed are reduced again from their remaining
+    rows. Reduced and grouped queries (without a 'keys', 'skip' or 'limit' option) then rereduce
+    the stored values, instead of reducing every row in the key range.
+    The reduce block must therefore support rereduce: called with rereduce=YES, it must combine
+    previously reduced values (for example, counts must be summed rather than counted.)
+    Defaults to NO. This setting is persistent, and can only be made once the map block has been
+    set. Changing it to NO discards the stored reductions. */
+@property BOOL materializesReductions;
+
+/** If YES, the index is kept up to date in the background, so that queries seldom have to wait
+    for it to be updated. After the database changes, the index is updated on a low-priority
+    background thread, a limited number of revisions at a time, once no further changes have
+    arrived for backgroundIndexDelay seconds (or, if changes keep arriving, once the oldest change
+    not yet indexed is backgroundIndexMaxLag seconds old.)
+    Defaults to NO. Like the map block, this must be set on every launch. */
+@property BOOL updatesIndexInBackground;
+
+/** How long the database must go without changes before the index is updated in the background
+    (see -updatesIndexInBackground). Defaults to 1 second. */
+@property NSTimeInterval backgroundIndexDelay;
+
+/** The longest the background update of the index will be put off while changes keep arriving
+    (see -updatesIndexInBackground). Defaults to 10 seconds. */
+@property NSTimeInterval backgroundIndexMaxLag;
+
 /** Is the view's index currently out of date? */
 @property (readonly) BOOL stale;
 
@@ -95,6 +153,13 @@ id CBLTextKey(NSString* text);
 /** Utility function to use in reduce blocks. Totals an array of NSNumbers. */
 + (NSNumber*) totalValues: (NSArray*)values;
 
+/** Returns one of the built-in reduce functions, given its CouchDB name:
+    "_count" (the number of rows), "_sum" (the total of the values, which should be numbers), or
+    "_stats" (a dictionary of the values' "sum", "count", "min", "max" and "sumsqr".)
+    Returns nil for any other name. Reduced queries of views that use one of these are computed
+    by SQLite directly from the index, without loading the rows. */
++ (CBLReduceBlock) reduceBlockNamed: (NSString*)name;
+
 /** Registers an object that can compile map/reduce functions from source code. */
 + (void) setCompiler: (id<CBLViewCompiler>)compiler;
 
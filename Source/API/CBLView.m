@@ -20,12 +20,16 @@
 #import "CBLCollateJSON.h"
 #import "CBLCanonicalJSON.h"
 #import "CBLMisc.h"
+#import "CBLViewIndexUpdater.h"
 
 #import "FMDatabase.h"
 #import "FMDatabaseAdditions.h"
 #import "FMResultSet.h"
 
 
+NSString* const kCBLViewIndexProgressNotification = @"CBLViewIndexProgress";
+
+
 @implementation CBLView
 
 
@@ -42,12 +46,15 @@
             _mapContentOptions = 0;
         }
         _expectsJSONStringsInEmit = NO;
+        _backgroundIndexDelay = 1.0;
+        _backgroundIndexMaxLag = 10.0;
     }
     return self;
 }
 
 
 @synthesize name=_name;
+@synthesize backgroundIndexDelay=_backgroundIndexDelay, backgroundIndexMaxLag=_backgroundIndexMaxLag;
 
 
 - (CBLDatabase*) database {
@@ -78,6 +85,22 @@
 }
 
 
+// Like the map block, this is shared by all CBLView objects for this view, whichever thread
+// ends up updating the index.
+- (NSUInteger) mapParallelism {
+    CBLDatabase* db = _weakDB;
+    NSNumber* n = [db.shared valueForType: @"mapParallelism" name: _name
+                          inDatabaseNamed: db.name];
+    return n ? n.unsignedIntegerValue : 1;
+}
+
+- (void) setMapParallelism: (NSUInteger)mapParallelism {
+    CBLDatabase* db = _weakDB;
+    [db.shared setValue: @(mapParallelism)
+                forType: @"mapParallelism" name: _name inDatabaseNamed: db.name];
+}
+
+
 - (BOOL) setMapBlock: (CBLMapBlock)mapBlock
          reduceBlock: (CBLReduceBlock)reduceBlock
              version: (NSString *)version
@@ -91,6 +114,7 @@
              forType: @"map" name: _name inDatabaseNamed: db.name];
     [shared setValue: [reduceBlock copy]
              forType: @"reduce" name: _name inDatabaseNamed: db.name];
+    [self _invalidateQueryCache];   // in case the reduce block changed without the version
 
     if (![db open: nil])
         return NO;
@@ -116,6 +140,73 @@
 }
 
 
+- (BOOL) binaryKeyFormat {
+    return [_weakDB.fmdb boolForQuery: @"SELECT binary_keys FROM views WHERE name=?", _name];
+}
+
+
+- (void) setBinaryKeyFormat: (BOOL)binaryKeyFormat {
+    if (self.viewID <= 0 || binaryKeyFormat == self.binaryKeyFormat)
+        return;
+    // The existing index rows don't have keys in the new format, so the index has to be rebuilt:
+    CBLDatabase* db = _weakDB;
+    CBLStatus status = [db _inTransaction: ^CBLStatus {
+        CBLStatus status = [self _dropIndexTable];
+        if (CBLStatusIsError(status))
+            return status;
+        [db.fmdb executeUpdate: @"UPDATE views SET binary_keys=?, lastSequence=0 WHERE view_id=?",
+                                 @(binaryKeyFormat), @(_viewID)];
+        return db.lastDbStatus;
+    }];
+    if (CBLStatusIsError(status))
+        Warn(@"Error status %d changing key format of %@", status, self);
+    [self _invalidateQueryCache];
+}
+
+
+- (BOOL) materializesReductions {
+    return [_weakDB.fmdb boolForQuery: @"SELECT stored_reductions FROM views WHERE name=?", _name];
+}
+
+
+- (void) setMaterializesReductions: (BOOL)materializesReductions {
+    if (self.viewID <= 0 || materializesReductions == self.materializesReductions)
+        return;
+    // Turning this off discards the stored reductions; turning it on creates them the next time
+    // the index is updated.
+    CBLDatabase* db = _weakDB;
+    CBLStatus status = [db _inTransaction: ^CBLStatus {
+        if (!materializesReductions) {
+            CBLStatus status = [self _dropReduceTable];
+            if (CBLStatusIsError(status))
+                return status;
+        }
+        [db.fmdb executeUpdate: @"UPDATE views SET stored_reductions=? WHERE view_id=?",
+                                 @(materializesReductions), @(_viewID)];
+        return db.lastDbStatus;
+    }];
+    if (CBLStatusIsError(status))
+        Warn(@"Error status %d changing stored reductions of %@", status, self);
+    [self _invalidateQueryCache];
+}
+
+
+- (BOOL) updatesIndexInBackground {
+    return _updatesIndexInBackground;
+}
+
+- (void) setUpdatesIndexInBackground: (BOOL)updatesIndexInBackground {
+    if (updatesIndexInBackground == _updatesIndexInBackground)
+        return;
+    _updatesIndexInBackground = updatesIndexInBackground;
+    CBLViewIndexUpdater* updater = _weakDB.indexUpdater;
+    if (updatesIndexInBackground)
+        [updater addView: self];
+    else
+        [updater removeView: self];
+}
+
+
 - (BOOL) stale {
     return self.lastSequenceIndexed < _weakDB.lastSequenceNumber;
 }
@@ -126,21 +217,22 @@
         return;
     CBLDatabase* db = _weakDB;
     CBLStatus status = [db _inTransaction: ^CBLStatus {
-        if ([db.fmdb executeUpdate: @"DELETE FROM maps WHERE view_id=?",
-                                     @(_viewID)]) {
-            [db.fmdb executeUpdate: @"UPDATE views SET lastsequence=0 WHERE view_id=?",
-                                     @(_viewID)];
-        }
+        CBLStatus status = [self _dropIndexTable];
+        if (CBLStatusIsError(status))
+            return status;
+        [db.fmdb executeUpdate: @"UPDATE views SET lastsequence=0 WHERE view_id=?", @(_viewID)];
         return db.lastDbStatus;
     }];
     if (CBLStatusIsError(status))
         Warn(@"Error status %d removing index of %@", status, self);
+    [self _invalidateQueryCache];
 }
 
 
 - (void) deleteView {
     [_weakDB deleteViewNamed: _name];
     _viewID = 0;
+    [self _invalidateQueryCache];
 }
 
 
@@ -163,6 +255,44 @@
 }
 
 
++ (CBLReduceBlock) reduceBlockNamed: (NSString*)name {
+    static NSDictionary* sBuiltInReduceBlocks;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        CBLReduceBlock count = ^id(NSArray* keys, NSArray* values, BOOL rereduce) {
+            return rereduce ? [CBLView totalValues: values] : @(values.count);
+        };
+        CBLReduceBlock sum = ^id(NSArray* keys, NSArray* values, BOOL rereduce) {
+            return [CBLView totalValues: values];
+        };
+        CBLReduceBlock stats = ^id(NSArray* keys, NSArray* values, BOOL rereduce) {
+            double sum = 0, sumsqr = 0, min = INFINITY, max = -INFINITY, count = 0;
+            for (id value in values) {
+                if (rereduce) {
+                    NSDictionary* stats = $castIf(NSDictionary, value);
+                    sum += [stats[@"sum"] doubleValue];
+                    sumsqr += [stats[@"sumsqr"] doubleValue];
+                    count += [stats[@"count"] doubleValue];
+                    min = MIN(min, [stats[@"min"] doubleValue]);
+                    max = MAX(max, [stats[@"max"] doubleValue]);
+                } else {
+                    double n = $castIf(NSNumber, value).doubleValue;
+                    sum += n;
+                    sumsqr += n * n;
+                    count++;
+                    min = MIN(min, n);
+                    max = MAX(max, n);
+                }
+            }
+            return @{@"sum": @(sum), @"count": @(count), @"min": @(min), @"max": @(max),
+                     @"sumsqr": @(sumsqr)};
+        };
+        sBuiltInReduceBlocks = @{@"_count": count, @"_sum": sum, @"_stats": stats};
+    });
+    return sBuiltInReduceBlocks[name];
+}
+
+
 static id<CBLViewCompiler> sCompiler;
 
 
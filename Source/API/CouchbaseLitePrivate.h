@@ -101,13 +101,21 @@
 @end
 
 
-@interface CBLQueryRow ()
+@interface CBLLiveQueryChanges ()
+- (instancetype) initWithOldRows: (CBLQueryEnumerator*)oldRows
+                         newRows: (CBLQueryEnumerator*)newRows;
+@end
+
+
+@interface CBLQueryRow () <NSCopying>
 - (instancetype) initWithDocID: (NSString*)docID
                       sequence: (SequenceNumber)sequence
                            key: (id)key
                          value: (id)value
                  docProperties: (NSDictionary*)docProperties;
 @property (readonly, nonatomic) NSDictionary* asJSONDictionary;
+/** Rough number of bytes of memory used by the row (for a view's query result cache.) */
+@property (readonly, nonatomic) size_t estimatedMemorySize;
 @end
 
 @interface CBLFullTextQueryRow ()
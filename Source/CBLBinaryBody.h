@@ -0,0 +1,69 @@
+//
+//  CBLBinaryBody.h
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** The table of property names shared by all binary bodies in a database. Each name is identified
+    by its index. Names are only ever appended (or truncated after a rollback), and lookups are
+    thread-safe. */
+@interface CBLBinaryKeyTable : NSObject
+
+@property (readonly) NSUInteger count;
+
+/** Returns the name with the given ID, or nil if out of range. */
+- (NSString*) nameForID: (uint32_t)keyID;
+
+/** Returns the ID of a name, or NSNotFound if it isn't in the table. */
+- (NSUInteger) idForName: (NSString*)name;
+
+/** Appends a name, returning its new ID. Returns NSNotFound if the table is full or the name is
+    too long to be worth sharing. */
+- (NSUInteger) addName: (NSString*)name;
+
+/** Adds names whose IDs were assigned elsewhere, consecutively from startID (for instance when
+    reloading the table from storage.) Names whose IDs are already in the table are skipped. */
+- (void) addNames: (NSArray*)names fromID: (NSUInteger)startID;
+
+/** Removes all names with IDs >= count. */
+- (void) truncateToCount: (NSUInteger)count;
+
+/** All names with IDs >= startID, in order. */
+- (NSArray*) namesFromID: (NSUInteger)startID;
+
+@end
+
+
+/** A binary encoding of JSON-compatible objects that can be read in place, without parsing.
+    Arrays and dictionaries begin with a table of offsets to their items, so any single value can
+    be found directly; dictionary keys are IDs in a shared CBLBinaryKeyTable.
+    An encoded body starts with the byte kCBLBinaryBodyMarker (so it can't be confused with JSON.) */
+@interface CBLBinaryBody : NSObject
+
+/** Encodes a dictionary, adding any new property names to the key table. */
++ (NSData*) encodeProperties: (NSDictionary*)properties
+                    keyTable: (CBLBinaryKeyTable*)keyTable;
+
+/** Returns YES if the data is an encoded body. */
++ (BOOL) isBinaryBody: (NSData*)data;
+
+/** Returns the number of names a key table needs to have for all the shared keys of an encoded
+    body to be in it, i.e. one more than the highest key ID the body uses (or 0.) */
++ (NSUInteger) keyCountNeededByBody: (NSData*)data;
+
+/** Returns a read-only NSDictionary backed by an encoded body. Values are decoded only when
+    accessed; nested arrays and dictionaries are also decoded lazily.
+    The overlay, if given, contains extra entries that take precedence over the encoded ones.
+    Returns nil if the data is corrupt, or uses key IDs that aren't in the key table. */
++ (NSDictionary*) propertiesOfBody: (NSData*)data
+                          keyTable: (CBLBinaryKeyTable*)keyTable
+                           overlay: (NSDictionary*)overlay;
+
+@end
+
+
+#define kCBLBinaryBodyMarker 0x03
@@ -0,0 +1,662 @@
+//
+//  CBLBinaryBody.m
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CBLBinaryBody.h"
+#import <libkern/OSAtomic.h>
+
+
+/*  ENCODING FORMAT (all integers little-endian):
+        body   := kCBLBinaryBodyMarker value            (the value is always a dictionary)
+        value  := tag payload
+    Tags and their payloads:
+        null, false, true   -- none
+        int8, int32, int64  -- a signed integer of that size
+        double              -- 8-byte IEEE double
+        string              -- uint32 byte count, then UTF-8
+        array               -- uint32 count; uint32 offset[count]; the items
+        dict                -- uint32 count; {uint32 key, uint32 offset}[count]; the values
+    Offsets are relative to the array/dict's tag byte. A dict key is an ID in the shared key table;
+    if kInlineKeyFlag is set, the rest of it is instead the offset of a string value holding the
+    key (used for names that aren't worth adding to the shared table.) */
+
+enum {
+    kTagNull,
+    kTagFalse,
+    kTagTrue,
+    kTagInt8,
+    kTagInt32,
+    kTagInt64,
+    kTagDouble,
+    kTagString,
+    kTagArray,
+    kTagDict,
+};
+
+#define kInlineKeyFlag 0x80000000u
+
+#define kMaxSharedKeys 4096
+#define kMaxSharedKeyLength 64
+
+// Dictionaries with at least this many entries get an index of their shared keys on first lookup:
+#define kMinIndexedDictCount 8
+
+
+@interface CBLBinaryArray : NSArray
+- (instancetype) initWithData: (NSData*)data position: (NSUInteger)pos count: (uint32_t)count
+                     keyTable: (CBLBinaryKeyTable*)keys;
+@end
+
+@interface CBLBinaryDictionary : NSDictionary
+- (instancetype) initWithData: (NSData*)data position: (NSUInteger)pos count: (uint32_t)count
+                     keyTable: (CBLBinaryKeyTable*)keys overlay: (NSDictionary*)overlay;
+@end
+
+
+
+@implementation CBLBinaryKeyTable
+{
+    NSMutableArray* _names;
+    NSMutableDictionary* _ids;
+}
+
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _names = [[NSMutableArray alloc] init];
+        _ids = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+
+- (NSUInteger) count {
+    @synchronized(self) {
+        return _names.count;
+    }
+}
+
+
+- (NSString*) nameForID: (uint32_t)keyID {
+    @synchronized(self) {
+        return keyID < _names.count ? _names[keyID] : nil;
+    }
+}
+
+
+- (NSUInteger) idForName: (NSString*)name {
+    @synchronized(self) {
+        NSNumber* keyID = _ids[name];
+        return keyID ? keyID.unsignedIntegerValue : NSNotFound;
+    }
+}
+
+
+- (NSUInteger) addName: (NSString*)name {
+    if ([name lengthOfBytesUsingEncoding: NSUTF8StringEncoding] > kMaxSharedKeyLength)
+        return NSNotFound;
+    @synchronized(self) {
+        NSNumber* keyID = _ids[name];
+        if (keyID)
+            return keyID.unsignedIntegerValue;
+        if (_names.count >= kMaxSharedKeys)
+            return NSNotFound;
+        name = [name copy];
+        _ids[name] = @(_names.count);
+        [_names addObject: name];
+        return _names.count - 1;
+    }
+}
+
+
+- (void) addNames: (NSArray*)names fromID: (NSUInteger)startID {
+    @synchronized(self) {
+        NSUInteger keyID = startID;
+        for (NSString* name in names) {
+            if (keyID++ == _names.count)
+                [self addName: name];
+        }
+    }
+}
+
+
+- (void) truncateToCount: (NSUInteger)count {
+    @synchronized(self) {
+        while (_names.count > count) {
+            [_ids removeObjectForKey: _names.lastObject];
+            [_names removeLastObject];
+        }
+    }
+}
+
+
+- (NSArray*) namesFromID: (NSUInteger)startID {
+    @synchronized(self) {
+        if (startID >= _names.count)
+            return @[];
+        return [_names subarrayWithRange: NSMakeRange(startID, _names.count - startID)];
+    }
+}
+
+
+@end
+
+
+
+#pragma mark - ENCODING:
+
+
+static void appendU32(NSMutableData* out, uint32_t n) {
+    n = NSSwapHostIntToLittle(n);
+    [out appendBytes: &n length: sizeof(n)];
+}
+
+static void writeU32(NSMutableData* out, NSUInteger pos, uint32_t n) {
+    n = NSSwapHostIntToLittle(n);
+    [out replaceBytesInRange: NSMakeRange(pos, sizeof(n)) withBytes: &n];
+}
+
+static void appendTag(NSMutableData* out, uint8_t tag) {
+    [out appendBytes: &tag length: 1];
+}
+
+static void appendString(NSMutableData* out, NSString* str) {
+    NSData* utf8 = [str dataUsingEncoding: NSUTF8StringEncoding];
+    appendTag(out, kTagString);
+    appendU32(out, (uint32_t)utf8.length);
+    [out appendData: utf8];
+}
+
+
+static BOOL encodeValue(id value, NSMutableData* out, CBLBinaryKeyTable* keys) {
+    if ([value isKindOfClass: [NSString class]]) {
+        appendString(out, value);
+    } else if ([value isKindOfClass: [NSNumber class]]) {
+        if ((__bridge CFBooleanRef)value == kCFBooleanTrue) {
+            appendTag(out, kTagTrue);
+        } else if ((__bridge CFBooleanRef)value == kCFBooleanFalse) {
+            appendTag(out, kTagFalse);
+        } else if (CFNumberIsFloatType((__bridge CFNumberRef)value)) {
+            NSSwappedDouble d = NSSwapHostDoubleToLittle([value doubleValue]);
+            appendTag(out, kTagDouble);
+            [out appendBytes: &d length: sizeof(d)];
+        } else {
+            int64_t n = [value longLongValue];
+            if (n >= INT8_MIN && n <= INT8_MAX) {
+                int8_t n8 = (int8_t)n;
+                appendTag(out, kTagInt8);
+                [out appendBytes: &n8 length: 1];
+            } else if (n >= INT32_MIN && n <= INT32_MAX) {
+                appendTag(out, kTagInt32);
+                appendU32(out, (uint32_t)(int32_t)n);
+            } else {
+                uint64_t n64 = NSSwapHostLongLongToLittle((uint64_t)n);
+                appendTag(out, kTagInt64);
+                [out appendBytes: &n64 length: sizeof(n64)];
+            }
+        }
+    } else if ([value isKindOfClass: [NSNull class]]) {
+        appendTag(out, kTagNull);
+    } else if ([value isKindOfClass: [NSArray class]]) {
+        NSUInteger start = out.length;
+        uint32_t count = (uint32_t)[value count];
+        appendTag(out, kTagArray);
+        appendU32(out, count);
+        NSUInteger table = out.length;
+        [out increaseLengthBy: 4 * count];
+        uint32_t i = 0;
+        for (id item in value) {
+            writeU32(out, table + 4 * i++, (uint32_t)(out.length - start));
+            if (!encodeValue(item, out, keys))
+                return NO;
+        }
+    } else if ([value isKindOfClass: [NSDictionary class]]) {
+        NSUInteger start = out.length;
+        uint32_t count = (uint32_t)[value count];
+        appendTag(out, kTagDict);
+        appendU32(out, count);
+        NSUInteger table = out.length;
+        [out increaseLengthBy: 8 * count];
+        uint32_t i = 0;
+        for (NSString* key in value) {
+            if (![key isKindOfClass: [NSString class]])
+                return NO;
+            uint32_t keyRef;
+            NSUInteger keyID = [keys idForName: key];
+            if (keyID == NSNotFound)
+                keyID = [keys addName: key];
+            if (keyID != NSNotFound) {
+                keyRef = (uint32_t)keyID;
+            } else {
+                keyRef = (uint32_t)(out.length - start) | kInlineKeyFlag;
+                appendString(out, key);
+            }
+            writeU32(out, table + 8 * i, keyRef);
+            writeU32(out, table + 8 * i + 4, (uint32_t)(out.length - start));
+            ++i;
+            if (!encodeValue(value[key], out, keys))
+                return NO;
+        }
+    } else {
+        return NO;
+    }
+    return YES;
+}
+
+
+#pragma mark - DECODING:
+
+
+static inline uint32_t readU32(const uint8_t* p) {
+    uint32_t n;
+    memcpy(&n, p, sizeof(n));
+    return NSSwapLittleIntToHost(n);
+}
+
+
+// Returns the length of the value at 'pos' that can be read safely, or 0 if out of range.
+static inline NSUInteger available(NSData* data, NSUInteger pos) {
+    return pos < data.length ? data.length - pos : 0;
+}
+
+
+// Decodes the value at 'pos'. Returns nil if the data is corrupt.
+static id decodeValue(NSData* data, NSUInteger pos, CBLBinaryKeyTable* keys) {
+    NSUInteger avail = available(data, pos);
+    if (avail == 0)
+        return nil;
+    const uint8_t* p = (const uint8_t*)data.bytes + pos;
+    --avail;    // (not counting the tag)
+    switch (p[0]) {
+        case kTagNull:
+            return [NSNull null];
+        case kTagFalse:
+            return @NO;
+        case kTagTrue:
+            return @YES;
+        case kTagInt8:
+            return avail >= 1 ? @((int8_t)p[1]) : nil;
+        case kTagInt32:
+            return avail >= 4 ? @((int32_t)readU32(p + 1)) : nil;
+        case kTagInt64: {
+            if (avail < 8)
+                return nil;
+            uint64_t n;
+            memcpy(&n, p + 1, sizeof(n));
+            return @((int64_t)NSSwapLittleLongLongToHost(n));
+        }
+        case kTagDouble: {
+            if (avail < 8)
+                return nil;
+            NSSwappedDouble d;
+            memcpy(&d, p + 1, sizeof(d));
+            return @(NSSwapLittleDoubleToHost(d));
+        }
+        case kTagString: {
+            if (avail < 4)
+                return nil;
+            uint32_t length = readU32(p + 1);
+            if (avail - 4 < length)
+                return nil;
+            return [[NSString alloc] initWithBytes: p + 5 length: length
+                                          encoding: NSUTF8StringEncoding];
+        }
+        case kTagArray: {
+            if (avail < 4)
+                return nil;
+            uint32_t count = readU32(p + 1);
+            if ((avail - 4) / 4 < count)
+                return nil;
+            return [[CBLBinaryArray alloc] initWithData: data position: pos count: count
+                                               keyTable: keys];
+        }
+        case kTagDict: {
+            if (avail < 4)
+                return nil;
+            uint32_t count = readU32(p + 1);
+            if ((avail - 4) / 8 < count)
+                return nil;
+            return [[CBLBinaryDictionary alloc] initWithData: data position: pos count: count
+                                                    keyTable: keys overlay: nil];
+        }
+        default:
+            return nil;
+    }
+}
+
+
+// Returns the number of entries the key table needs for every shared key used by the value at
+// 'pos' to be found in it (i.e. one more than the highest key ID), without decoding any values.
+// Corrupt parts are skipped, since decoding them fails anyway.
+static uint32_t keyCountNeeded(NSData* data, NSUInteger pos) {
+    NSUInteger avail = available(data, pos);
+    if (avail < 5)
+        return 0;
+    const uint8_t* p = (const uint8_t*)data.bytes + pos;
+    uint32_t count = readU32(p + 1);
+    uint32_t needed = 0;
+    if (p[0] == kTagArray && (avail - 5) / 4 >= count) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t offset = readU32(p + 5 + 4 * i);
+            if (offset > 0)     // (a zero offset would recurse forever)
+                needed = MAX(needed, keyCountNeeded(data, pos + offset));
+        }
+    } else if (p[0] == kTagDict && (avail - 5) / 8 >= count) {
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t keyRef = readU32(p + 5 + 8 * i), offset = readU32(p + 9 + 8 * i);
+            if (!(keyRef & kInlineKeyFlag))
+                needed = MAX(needed, keyRef + 1);
+            if (offset > 0)
+                needed = MAX(needed, keyCountNeeded(data, pos + offset));
+        }
+    }
+    return needed;
+}
+
+
+
+@implementation CBLBinaryArray
+{
+    NSData* _data;
+    NSUInteger _pos;
+    uint32_t _count;
+    CBLBinaryKeyTable* _keys;
+}
+
+- (instancetype) initWithData: (NSData*)data position: (NSUInteger)pos count: (uint32_t)count
+                     keyTable: (CBLBinaryKeyTable*)keys
+{
+    self = [super init];
+    if (self) {
+        _data = data;
+        _pos = pos;
+        _count = count;
+        _keys = keys;
+    }
+    return self;
+}
+
+- (NSUInteger) count {
+    return _count;
+}
+
+- (id) objectAtIndex: (NSUInteger)index {
+    if (index >= _count)
+        [NSException raise: NSRangeException format: @"Index %lu out of range",
+                                                     (unsigned long)index];
+    const uint8_t* table = (const uint8_t*)_data.bytes + _pos + 5;
+    uint32_t offset = readU32(table + 4 * index);
+    return decodeValue(_data, _pos + offset, _keys) ?: [NSNull null];
+}
+
+- (id) copyWithZone: (NSZone*)zone {
+    return self;    // immutable
+}
+
+@end
+
+
+
+// An entry of a CBLBinaryDictionary's key index.
+typedef struct {
+    uint32_t keyID;
+    uint32_t offset;        // Offset of the value
+} KeyIndexEntry;
+
+
+@implementation CBLBinaryDictionary
+{
+    NSData* _data;
+    NSUInteger _pos;
+    uint32_t _count;
+    CBLBinaryKeyTable* _keys;
+    NSDictionary* _overlay;
+    NSArray* _allKeys;
+    KeyIndexEntry* volatile _index;     // Shared-key entries sorted by key ID; [0] holds the count
+}
+
+- (instancetype) initWithData: (NSData*)data position: (NSUInteger)pos count: (uint32_t)count
+                     keyTable: (CBLBinaryKeyTable*)keys overlay: (NSDictionary*)overlay
+{
+    self = [super init];
+    if (self) {
+        _data = data;
+        _pos = pos;
+        _count = count;
+        _keys = keys;
+        _overlay = overlay.count ? [overlay copy] : nil;
+    }
+    return self;
+}
+
+- (void) dealloc {
+    free(_index);
+}
+
+- (const uint8_t*) entryAtIndex: (uint32_t)i {
+    return (const uint8_t*)_data.bytes + _pos + 5 + 8 * i;
+}
+
+- (NSString*) keyOfEntry: (const uint8_t*)entry {
+    uint32_t keyRef = readU32(entry);
+    if (keyRef & kInlineKeyFlag)
+        return $castIf(NSString, decodeValue(_data, _pos + (keyRef & ~kInlineKeyFlag), _keys));
+    NSString* key = [_keys nameForID: keyRef];
+    if (!key)
+        Warn(@"CBLBinaryDictionary: Unknown key ID %u", keyRef);
+    return key;
+}
+
+- (NSArray*) allKeys {
+    if (!_allKeys) {
+        NSMutableArray* keys = [[NSMutableArray alloc] initWithCapacity: _count + _overlay.count];
+        [keys addObjectsFromArray: _overlay.allKeys];
+        for (uint32_t i = 0; i < _count; i++) {
+            NSString* key = [self keyOfEntry: [self entryAtIndex: i]];
+            if (key && !_overlay[key])
+                [keys addObject: key];
+        }
+        _allKeys = [keys copy];
+    }
+    return _allKeys;
+}
+
+- (NSUInteger) count {
+    return _overlay ? self.allKeys.count : _count;
+}
+
+static int compareKeyIndexEntries(const void* a, const void* b) {
+    uint32_t idA = ((const KeyIndexEntry*)a)->keyID, idB = ((const KeyIndexEntry*)b)->keyID;
+    return idA < idB ? -1 : (idA > idB ? 1 : 0);
+}
+
+// Returns the index of the entries with shared keys, sorted by key ID, building it the first
+// time. Element 0's keyID is the number of entries that follow it. (Thread-safe: if two threads
+// build it at once, one of them just throws its copy away.)
+- (const KeyIndexEntry*) keyIndex {
+    KeyIndexEntry* index = _index;
+    OSMemoryBarrier();
+    if (index)
+        return index;
+    index = malloc((_count + 1) * sizeof(KeyIndexEntry));
+    if (!index)
+        return NULL;
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < _count; i++) {
+        const uint8_t* entry = [self entryAtIndex: i];
+        uint32_t keyRef = readU32(entry);
+        if (!(keyRef & kInlineKeyFlag))
+            index[1 + n++] = (KeyIndexEntry){keyRef, readU32(entry + 4)};
+    }
+    index[0].keyID = n;
+    qsort(&index[1], n, sizeof(KeyIndexEntry), compareKeyIndexEntries);
+    if (!OSAtomicCompareAndSwapPtrBarrier(NULL, index, (void* volatile*)&_index)) {
+        free(index);
+        index = _index;
+    }
+    return index;
+}
+
+- (id) objectForKey: (id)key {
+    id value = _overlay[key];
+    if (value || ![key isKindOfClass: [NSString class]])
+        return value;
+    NSUInteger keyID = [_keys idForName: key];
+    const KeyIndexEntry* index = (_count >= kMinIndexedDictCount) ? [self keyIndex] : NULL;
+    if (index) {
+        // Binary-search the shared keys; only scan the entries if there are any inline keys:
+        uint32_t nShared = index[0].keyID;
+        if (keyID != NSNotFound) {
+            KeyIndexEntry target = {(uint32_t)keyID, 0};
+            const KeyIndexEntry* found = bsearch(&target, &index[1], nShared,
+                                                 sizeof(KeyIndexEntry), compareKeyIndexEntries);
+            if (found)
+                return decodeValue(_data, _pos + found->offset, _keys) ?: [NSNull null];
+        }
+        if (nShared == _count)
+            return nil;
+    }
+    for (uint32_t i = 0; i < _count; i++) {
+        const uint8_t* entry = [self entryAtIndex: i];
+        uint32_t keyRef = readU32(entry);
+        BOOL match;
+        if (keyRef & kInlineKeyFlag)
+            match = [[self keyOfEntry: entry] isEqualToString: key];
+        else
+            match = !index && (keyRef == keyID);
+        if (match)
+            return decodeValue(_data, _pos + readU32(entry + 4), _keys) ?: [NSNull null];
+    }
+    return nil;
+}
+
+- (NSEnumerator*) keyEnumerator {
+    return self.allKeys.objectEnumerator;
+}
+
+- (id) copyWithZone: (NSZone*)zone {
+    return self;    // immutable
+}
+
+@end
+
+
+
+@implementation CBLBinaryBody
+
+
++ (NSData*) encodeProperties: (NSDictionary*)properties
+                    keyTable: (CBLBinaryKeyTable*)keyTable
+{
+    NSMutableData* out = [NSMutableData dataWithCapacity: 1024];
+    appendTag(out, kCBLBinaryBodyMarker);
+    if (!encodeValue(properties, out, keyTable))
+        return nil;
+    return out;
+}
+
+
++ (BOOL) isBinaryBody: (NSData*)data {
+    return data.length > 1 && *(const uint8_t*)data.bytes == kCBLBinaryBodyMarker;
+}
+
+
++ (NSUInteger) keyCountNeededByBody: (NSData*)data {
+    if (![self isBinaryBody: data])
+        return 0;
+    return keyCountNeeded(data, 1);
+}
+
+
++ (NSDictionary*) propertiesOfBody: (NSData*)data
+                          keyTable: (CBLBinaryKeyTable*)keyTable
+                           overlay: (NSDictionary*)overlay
+{
+    if (![self isBinaryBody: data])
+        return nil;
+    if (keyCountNeeded(data, 1) > keyTable.count)
+        return nil;     // Uses property names that aren't in the table (yet)
+    // Copy the bytes, since the caller's data may not own them (e.g. from -dataNoCopyForColumn:)
+    data = [NSData dataWithBytes: data.bytes length: data.length];
+    const uint8_t* bytes = data.bytes;
+    if (data.length < 6 || bytes[1] != kTagDict)
+        return nil;
+    uint32_t count = readU32(bytes + 2);
+    if ((data.length - 6) / 8 < count)
+        return nil;
+    return [[CBLBinaryDictionary alloc] initWithData: data position: 1 count: count
+                                            keyTable: keyTable overlay: overlay];
+}
+
+
+@end
+
+
+
+TestCase(CBLBinaryBody) {
+    CBLBinaryKeyTable* keys = [[CBLBinaryKeyTable alloc] init];
+    NSString* longKey = [@"" stringByPaddingToLength: 100 withString: @"k" startingAtIndex: 0];
+    NSDictionary* props = $dict({@"type", @"contact"},
+                                {@"age", @(42)},
+                                {@"big", @(1234567)},
+                                {@"huge", @(123456789012345ll)},
+                                {@"negative", @(-3)},
+                                {@"pi", @(3.14159)},
+                                {@"yes", $true},
+                                {@"no", $false},
+                                {@"nothing", $null},
+                                {@"name", @"Zoë"},
+                                {longKey, @"inline key"},
+                                {@"tags", @[@"a", @(1), @[], $dict({@"type", @"nested"})]},
+                                {@"empty", @{}});
+    NSData* body = [CBLBinaryBody encodeProperties: props keyTable: keys];
+    CAssert([CBLBinaryBody isBinaryBody: body]);
+    CAssertEq(keys.count, props.count - 1);     // all but the long key are shared
+    CAssert([keys idForName: @"type"] < keys.count);
+
+    NSDictionary* decoded = [CBLBinaryBody propertiesOfBody: body keyTable: keys overlay: nil];
+    CAssertEq(decoded.count, props.count);
+    CAssertEqual(decoded[@"name"], @"Zoë");
+    CAssertEqual(decoded[@"huge"], @(123456789012345ll));
+    CAssertEqual(decoded[longKey], @"inline key");
+    CAssertNil(decoded[@"missing"]);
+    CAssertEqual(decoded[@"tags"][3][@"type"], @"nested");
+    CAssertEqual(decoded, props);
+    for (NSString* key in props)
+        CAssertEqual(decoded[key], props[key]);     // (an indexed lookup, since count >= 8)
+    NSData* json = [CBLJSON dataWithJSONObject: decoded options: 0 error: NULL];
+    CAssertEqual([CBLJSON JSONObjectWithData: json options: 0 error: NULL], props);
+
+    // Overlay:
+    decoded = [CBLBinaryBody propertiesOfBody: body keyTable: keys
+                                      overlay: $dict({@"_id", @"foo"}, {@"type", @"other"})];
+    CAssertEq(decoded.count, props.count + 1);
+    CAssertEqual(decoded[@"_id"], @"foo");
+    CAssertEqual(decoded[@"type"], @"other");
+    CAssertEqual(decoded[@"age"], @(42));
+
+    // Key IDs missing from the table:
+    CAssertEq([CBLBinaryBody keyCountNeededByBody: body], keys.count);
+    CBLBinaryKeyTable* partialKeys = [[CBLBinaryKeyTable alloc] init];
+    [partialKeys addNames: [keys namesFromID: 0] fromID: 0];
+    [partialKeys truncateToCount: keys.count - 1];
+    CAssertNil([CBLBinaryBody propertiesOfBody: body keyTable: partialKeys overlay: nil]);
+
+    // Corrupt data:
+    NSData* truncated = [body subdataWithRange: NSMakeRange(0, 8)];
+    CAssertNil([CBLBinaryBody propertiesOfBody: truncated keyTable: keys overlay: nil]);
+    [keys truncateToCount: 1];
+    CAssertEq(keys.count, 1u);
+    CAssertEq([keys idForName: @"age"], (NSUInteger)NSNotFound);
+}
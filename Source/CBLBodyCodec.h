@@ -0,0 +1,66 @@
+//
+//  CBLBodyCodec.h
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+
+#import "CBLDatabase.h"
+@class CBLBinaryKeyTable;
+
+
+/** Compresses and decompresses revision bodies as stored in the 'json' column of the 'revs' table.
+    A stored body is either plain JSON (which always starts with "{"), or a one-byte header followed
+    by a zlib stream, or by JSON that compression was tried on but didn't make smaller. With kCBLBodyCompressionDictionary the stream is compressed using a preset
+    dictionary trained from the database's own documents; the zlib header identifies the dictionary
+    by checksum, so bodies encoded with older dictionaries remain readable.
+    Alternatively a body can be stored in the binary format of CBLBinaryBody, which can be read
+    without parsing; this takes precedence over compression when binaryFormat is set.
+    Decoding is thread-safe; encoding and adding dictionaries should be done on one thread. */
+@interface CBLBodyCodec : NSObject
+
+- (instancetype) initWithCompression: (CBLBodyCompression)compression;
+
+/** The compression applied by -encode:. */
+@property CBLBodyCompression compression;
+
+/** If YES, -encode: produces the binary format instead of (possibly compressed) JSON. */
+@property BOOL binaryFormat;
+
+/** The property names used by binary bodies. New names are added to it by -encode:. */
+@property (readonly) CBLBinaryKeyTable* keyTable;
+
+/** Registers a dictionary so that bodies compressed with it can be decoded. The most recently
+    added dictionary is the one used for encoding. */
+- (void) addDictionary: (NSData*)dictionary;
+
+/** The dictionary that will be used for encoding, if any. */
+@property (readonly) NSData* encodingDictionary;
+
+/** Encodes a JSON body for storage. Returns the input unchanged if compression is disabled or
+    the body is too short to be worth compressing; if compression wouldn't make it smaller, the
+    JSON is returned with a header marking it as such. */
+- (NSData*) encode: (NSData*)json;
+
+/** Decodes a stored body back to JSON. Returns the input unchanged if it isn't compressed,
+    or nil if it's corrupt or uses an unknown dictionary. */
+- (NSData*) decode: (NSData*)stored;
+
+/** Returns a stored body's properties, with the entries of 'extra' added to them, as a mutable
+    dictionary with mutable containers (as parsed from JSON.) Returns nil if the body is corrupt. */
+- (NSDictionary*) propertiesOfBody: (NSData*)stored extra: (NSDictionary*)extra;
+
+/** Like -propertiesOfBody:extra:, but returns immutable containers, for callers that won't
+    modify the properties. A binary body is decoded lazily, into a dictionary backed by the
+    stored bytes. (The 'extra' values are added as-is, so they should be immutable too.) */
+- (NSDictionary*) readOnlyPropertiesOfBody: (NSData*)stored extra: (NSDictionary*)extra;
+
+/** Returns YES if the stored body is in the format -encode: would currently produce
+    (or if it's in a format -encode: would leave it in, such as short uncompressed JSON.) */
+- (BOOL) isEncodedInCurrentFormat: (NSData*)stored;
+
+/** Builds a compression dictionary out of the strings (mostly property names) that appear most
+    often in the given JSON documents. */
++ (NSData*) trainDictionaryFromSamples: (NSArray*)jsonSamples maxSize: (size_t)maxSize;
+
+@end
@@ -0,0 +1,405 @@
+//
+//  CBLBodyCodec.m
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CBLBodyCodec.h"
+#import "CBLBinaryBody.h"
+#import "CBLCanonicalJSON.h"
+#import "CBLBase64.h"
+#import <zlib.h>
+
+
+// First byte of a stored body, identifying its format. (Uncompressed JSON starts with '{'.)
+enum {
+    kBodyFormatDeflate = 0x01,          // zlib stream
+    kBodyFormatDictionary = 0x02,       // zlib stream using a preset dictionary
+    kBodyFormatBinary = kCBLBinaryBodyMarker, // CBLBinaryBody encoding
+    kBodyFormatUncompressed = 0x04,     // JSON that compression didn't make smaller
+};
+
+#define kMinCompressSize 64             // Bodies shorter than this aren't worth compressing
+#define kMaxTokenLength 64              // Longest string the dictionary trainer will consider
+
+
+@implementation CBLBodyCodec
+{
+    CBLBodyCompression _compression;
+    BOOL _binaryFormat;
+    CBLBinaryKeyTable* _keyTable;
+    NSDictionary* _dictionaries;        // Maps zlib dictionary checksum -> dictionary data
+    NSData* _encodingDictionary;
+    uLong _encodingDictionaryID;
+}
+
+
+@synthesize compression=_compression, binaryFormat=_binaryFormat, keyTable=_keyTable;
+
+
+- (instancetype) initWithCompression: (CBLBodyCompression)compression {
+    self = [super init];
+    if (self) {
+        _compression = compression;
+        _dictionaries = @{};
+        _keyTable = [[CBLBinaryKeyTable alloc] init];
+    }
+    return self;
+}
+
+
+- (void) addDictionary: (NSData*)dictionary {
+    uLong dictID = adler32(adler32(0, NULL, 0), dictionary.bytes, (uInt)dictionary.length);
+    @synchronized(self) {
+        NSMutableDictionary* dicts = [_dictionaries mutableCopy];
+        dicts[@(dictID)] = dictionary;
+        _dictionaries = [dicts copy];
+        _encodingDictionary = dictionary;
+        _encodingDictionaryID = dictID;
+    }
+}
+
+
+- (NSData*) encodingDictionary {
+    @synchronized(self) {
+        return _encodingDictionary;
+    }
+}
+
+
+- (NSData*) dictionaryWithID: (uLong)dictID {
+    @synchronized(self) {
+        return _dictionaries[@(dictID)];
+    }
+}
+
+
+#pragma mark - ENCODING:
+
+
+- (NSData*) encode: (NSData*)json {
+    if (_binaryFormat && json.length > 0) {
+        NSDictionary* properties = $castIf(NSDictionary,
+                                           [CBLJSON JSONObjectWithData: json options: 0 error: NULL]);
+        NSData* binary = properties ? [CBLBinaryBody encodeProperties: properties
+                                                             keyTable: _keyTable] : nil;
+        if (binary)
+            return binary;
+    }
+    if (_compression == kCBLBodyCompressionNone || json.length < kMinCompressSize)
+        return json;
+    NSData* dictionary = nil;
+    uint8_t format = kBodyFormatDeflate;
+    if (_compression == kCBLBodyCompressionDictionary) {
+        dictionary = self.encodingDictionary;
+        if (dictionary)
+            format = kBodyFormatDictionary;
+    }
+
+    z_stream strm;
+    bzero(&strm, sizeof(strm));
+    if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return json;
+    if (dictionary && deflateSetDictionary(&strm, dictionary.bytes,
+                                           (uInt)dictionary.length) != Z_OK) {
+        deflateEnd(&strm);
+        return json;
+    }
+    // Only keep the result if it's smaller, so the output buffer needn't be any bigger:
+    NSMutableData* output = [NSMutableData dataWithLength: json.length];
+    uint8_t* outBytes = output.mutableBytes;
+    outBytes[0] = format;
+    strm.next_in = (Bytef*)json.bytes;
+    strm.avail_in = (uInt)json.length;
+    strm.next_out = outBytes + 1;
+    strm.avail_out = (uInt)json.length - 1;
+    int err = deflate(&strm, Z_FINISH);
+    NSUInteger outLength = 1 + strm.total_out;
+    deflateEnd(&strm);
+    if (err != Z_STREAM_END) {
+        // Didn't fit, i.e. compression didn't help. Mark the JSON as such, so compaction
+        // doesn't keep trying to compress it again:
+        output.length = 1;
+        outBytes = output.mutableBytes;
+        outBytes[0] = kBodyFormatUncompressed;
+        [output appendData: json];
+        return output;
+    }
+    output.length = outLength;
+    return output;
+}
+
+
+- (BOOL) isEncodedInCurrentFormat: (NSData*)stored {
+    if (stored.length == 0)
+        return YES;
+    const uint8_t* bytes = stored.bytes;
+    if (_binaryFormat)
+        return bytes[0] == kBodyFormatBinary;
+    else if (bytes[0] == kBodyFormatBinary)
+        return NO;
+    switch (_compression) {
+        case kCBLBodyCompressionNone:
+            return bytes[0] == '{';
+        case kCBLBodyCompressionDeflate:
+            return bytes[0] == kBodyFormatDeflate || bytes[0] == kBodyFormatUncompressed
+                || stored.length < kMinCompressSize;
+        case kCBLBodyCompressionDictionary: {
+            if (bytes[0] == kBodyFormatUncompressed)
+                return YES;
+            if (bytes[0] != kBodyFormatDictionary || stored.length < 7)
+                return stored.length < kMinCompressSize;
+            // The zlib header's DICTID field is the dictionary's Adler-32 checksum:
+            uLong dictID = ((uLong)bytes[3] << 24) | ((uLong)bytes[4] << 16)
+                         | ((uLong)bytes[5] << 8)  |  (uLong)bytes[6];
+            @synchronized(self) {
+                return dictID == _encodingDictionaryID;
+            }
+        }
+    }
+    return NO;
+}
+
+
+#pragma mark - DECODING:
+
+
+- (NSData*) decode: (NSData*)stored {
+    if (stored.length == 0)
+        return stored;
+    const uint8_t* bytes = stored.bytes;
+    uint8_t format = bytes[0];
+    if (format == kBodyFormatBinary) {
+        NSDictionary* properties = [CBLBinaryBody propertiesOfBody: stored keyTable: _keyTable
+                                                           overlay: nil];
+        NSData* json = properties ? [CBLCanonicalJSON canonicalData: properties] : nil;
+        if (!json)
+            Warn(@"CBLBodyCodec: Couldn't decode binary body");
+        return json;
+    } else if (format == kBodyFormatUncompressed) {
+        return [stored subdataWithRange: NSMakeRange(1, stored.length - 1)];
+    } else if (format != kBodyFormatDeflate && format != kBodyFormatDictionary) {
+        return stored;      // Not compressed
+    }
+
+    z_stream strm;
+    bzero(&strm, sizeof(strm));
+    if (inflateInit(&strm) != Z_OK)
+        return nil;
+    strm.next_in = (Bytef*)bytes + 1;
+    strm.avail_in = (uInt)stored.length - 1;
+    NSMutableData* output = [NSMutableData dataWithLength: 4 * stored.length];
+    int err;
+    do {
+        if (strm.total_out >= output.length)
+            output.length *= 2;
+        strm.next_out = (Bytef*)output.mutableBytes + strm.total_out;
+        strm.avail_out = (uInt)(output.length - strm.total_out);
+        err = inflate(&strm, Z_NO_FLUSH);
+        if (err == Z_NEED_DICT) {
+            NSData* dictionary = [self dictionaryWithID: strm.adler];
+            if (!dictionary) {
+                Warn(@"CBLBodyCodec: Body uses unknown dictionary %08lx", strm.adler);
+                break;
+            }
+            err = inflateSetDictionary(&strm, dictionary.bytes, (uInt)dictionary.length);
+        }
+    } while (err == Z_OK || (err == Z_BUF_ERROR && strm.avail_out == 0));
+    NSUInteger outLength = strm.total_out;
+    inflateEnd(&strm);
+    if (err != Z_STREAM_END) {
+        Warn(@"CBLBodyCodec: Couldn't decompress body (zlib error %d)", err);
+        return nil;
+    }
+    output.length = outLength;
+    return output;
+}
+
+
+- (NSDictionary*) readOnlyPropertiesOfBody: (NSData*)stored extra: (NSDictionary*)extra {
+    if ([CBLBinaryBody isBinaryBody: stored])
+        return [CBLBinaryBody propertiesOfBody: stored keyTable: _keyTable overlay: extra];
+    NSData* json = [self decode: stored];
+    if (!json)
+        return nil;
+    NSDictionary* properties = nil;
+    if (json.length > 0 && !(json.length==2 && memcmp(json.bytes, "{}", 2)==0)) {
+        properties = [CBLJSON JSONObjectWithData: json options: 0 error: NULL];
+        if (![properties isKindOfClass: [NSDictionary class]])
+            return nil;
+    }
+    if (extra.count == 0)
+        return properties ?: @{};
+    if (!properties)
+        return [extra copy];
+    NSMutableDictionary* merged = [properties mutableCopy];
+    [merged addEntriesFromDictionary: extra];
+    return [merged copy];
+}
+
+
+- (NSDictionary*) propertiesOfBody: (NSData*)stored extra: (NSDictionary*)extra {
+    NSData* json = [self decode: stored];
+    if (!json)
+        return nil;
+    NSMutableDictionary* properties;
+    if (json.length == 0 || (json.length==2 && memcmp(json.bytes, "{}", 2)==0)) {
+        properties = $mdict();      // optimization, and workaround for issue #44
+    } else {
+        properties = [CBLJSON JSONObjectWithData: json
+                                         options: CBLJSONReadingMutableContainers
+                                           error: NULL];
+        if (![properties isKindOfClass: [NSMutableDictionary class]])
+            return nil;
+    }
+    [properties addEntriesFromDictionary: extra];
+    return properties;
+}
+
+
+#pragma mark - DICTIONARY TRAINING:
+
+
++ (NSData*) trainDictionaryFromSamples: (NSArray*)jsonSamples maxSize: (size_t)maxSize {
+    // Count the JSON strings in the samples, including the colon after a property name:
+    NSCountedSet* tokens = [[NSCountedSet alloc] init];
+    for (NSData* json in jsonSamples) {
+        const char* bytes = json.bytes;
+        size_t length = json.length;
+        for (size_t i = 0; i < length; i++) {
+            if (bytes[i] != '"')
+                continue;
+            size_t start = i;
+            for (++i; i < length && bytes[i] != '"'; i++) {
+                if (bytes[i] == '\\')
+                    i++;
+            }
+            if (i >= length)
+                break;
+            size_t end = i + 1;
+            if (end < length && bytes[end] == ':')
+                end++;
+            if (end - start <= kMaxTokenLength)
+                [tokens addObject: [NSData dataWithBytes: bytes + start length: end - start]];
+        }
+    }
+
+    // Rank the repeated ones by the number of bytes they account for:
+    NSMutableArray* ranked = $marray();
+    for (NSData* token in tokens) {
+        if ([tokens countForObject: token] > 1)
+            [ranked addObject: token];
+    }
+    [ranked sortUsingComparator: ^NSComparisonResult(NSData* a, NSData* b) {
+        NSUInteger scoreA = [tokens countForObject: a] * a.length;
+        NSUInteger scoreB = [tokens countForObject: b] * b.length;
+        return scoreA > scoreB ? NSOrderedAscending
+                               : (scoreA < scoreB ? NSOrderedDescending : NSOrderedSame);
+    }];
+
+    // Take as many as fit, then put the most valuable ones last, since zlib encodes matches
+    // against the end of the dictionary most cheaply:
+    NSMutableArray* chosen = $marray();
+    size_t size = 0;
+    for (NSData* token in ranked) {
+        if (size + token.length > maxSize)
+            break;
+        [chosen addObject: token];
+        size += token.length;
+    }
+    NSMutableData* dictionary = [NSMutableData dataWithCapacity: size];
+    for (NSData* token in chosen.reverseObjectEnumerator)
+        [dictionary appendData: token];
+    return dictionary;
+}
+
+
+@end
+
+
+
+TestCase(CBLBodyCodec) {
+    NSMutableArray* samples = $marray();
+    for (int i = 0; i < 100; i++) {
+        NSDictionary* doc = $dict({@"type", @"contact"}, {@"firstName", $sprintf(@"Name%d", i)},
+                                  {@"lastName", @"Smith"}, {@"emailAddress", @"a@example.com"},
+                                  {@"phoneNumbers", @[@"+1-555-1234", $sprintf(@"%d", i)]});
+        [samples addObject: [CBLJSON dataWithJSONObject: doc options: 0 error: NULL]];
+    }
+    NSData* json = samples[7];
+
+    CBLBodyCodec* codec = [[CBLBodyCodec alloc] initWithCompression: kCBLBodyCompressionNone];
+    CAssert([codec encode: json] == json);
+    CAssert([codec decode: json] == json);
+    CAssert([codec isEncodedInCurrentFormat: json]);
+
+    codec.compression = kCBLBodyCompressionDeflate;
+    NSData* deflated = [codec encode: json];
+    CAssert(deflated.length < json.length);
+    CAssertEqual([codec decode: deflated], json);
+    CAssert([codec isEncodedInCurrentFormat: deflated]);
+    CAssert(![codec isEncodedInCurrentFormat: json]);
+
+    NSData* dictionary = [CBLBodyCodec trainDictionaryFromSamples: samples maxSize: 1024];
+    CAssert(dictionary.length > 0 && dictionary.length <= 1024);
+    codec.compression = kCBLBodyCompressionDictionary;
+    [codec addDictionary: dictionary];
+    NSData* compressed = [codec encode: json];
+    CAssert(compressed.length < deflated.length);
+    CAssertEqual([codec decode: compressed], json);
+    CAssert([codec isEncodedInCurrentFormat: compressed]);
+    CAssert(![codec isEncodedInCurrentFormat: deflated]);
+    CAssertEqual([codec decode: deflated], json);  // older formats remain readable
+
+    // Binary format takes precedence over compression, and decodes back to canonical JSON:
+    codec.binaryFormat = YES;
+    NSData* binary = [codec encode: json];
+    CAssert(binary.length > 0 && ((const uint8_t*)binary.bytes)[0] == kBodyFormatBinary);
+    CAssert([codec isEncodedInCurrentFormat: binary]);
+    CAssert(![codec isEncodedInCurrentFormat: compressed]);
+    NSDictionary* properties = [codec propertiesOfBody: binary extra: @{@"_id": @"x"}];
+    CAssertEqual(properties[@"lastName"], @"Smith");
+    CAssertEqual(properties[@"_id"], @"x");
+    CAssert([properties isKindOfClass: [NSMutableDictionary class]]);
+    CAssert([properties[@"phoneNumbers"] isKindOfClass: [NSMutableArray class]]);
+    NSDictionary* readOnly = [codec readOnlyPropertiesOfBody: binary extra: @{@"_id": @"x"}];
+    CAssert(![readOnly isKindOfClass: [NSMutableDictionary class]]);
+    CAssertEqual(readOnly, properties);
+    NSDictionary* readOnlyJSON = [codec readOnlyPropertiesOfBody: json
+                                                           extra: @{@"_id": @"x"}];
+    CAssertEqual(readOnlyJSON, properties);
+    CAssertEqual([codec decode: binary], [CBLCanonicalJSON canonicalData:
+                                  [CBLJSON JSONObjectWithData: json options: 0 error: NULL]]);
+    CAssertEqual([codec propertiesOfBody: compressed extra: nil], [codec propertiesOfBody: binary
+                                                                                    extra: nil]);
+    codec.binaryFormat = NO;
+
+    // JSON that doesn't compress is marked, so it counts as being in the current format:
+    NSMutableData* random = [NSMutableData dataWithLength: 60];
+    arc4random_buf(random.mutableBytes, random.length);
+    NSData* incompressible = [CBLJSON dataWithJSONObject: @{@"r": [CBLBase64 encode: random]}
+                                                 options: 0 error: NULL];
+    codec.compression = kCBLBodyCompressionDeflate;
+    NSData* uncompressed = [codec encode: incompressible];
+    CAssertEq(uncompressed.length, incompressible.length + 1);
+    CAssert(![codec isEncodedInCurrentFormat: incompressible]);
+    CAssert([codec isEncodedInCurrentFormat: uncompressed]);
+    CAssertEqual([codec decode: uncompressed], incompressible);
+    CAssertEqual([codec propertiesOfBody: uncompressed extra: nil],
+                 [CBLJSON JSONObjectWithData: incompressible options: 0 error: NULL]);
+    codec.compression = kCBLBodyCompressionNone;
+    CAssert(![codec isEncodedInCurrentFormat: uncompressed]);
+
+    // A codec that doesn't know the dictionary can't decode it:
+    CBLBodyCodec* codec2 = [[CBLBodyCodec alloc] initWithCompression: kCBLBodyCompressionNone];
+    CAssertNil([codec2 decode: compressed]);
+    CAssertEqual([codec2 decode: deflated], json);
+}
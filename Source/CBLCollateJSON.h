@@ -23,6 +23,17 @@ int CBLCollateJSONLimited(void *context,
                          int len2, const void * chars2,
                          unsigned arrayLimit);
 
+/** Encodes a JSON-compatible object as a binary key whose byte-wise (memcmp) order is the order
+    CBLCollateJSON gives the object's JSON, in the given collation mode. Such keys can be indexed
+    and compared by SQLite with plain BINARY collation.
+    The one difference is that in Unicode mode, strings with non-ASCII characters are ordered
+    case- and diacritic-insensitively by code point, not by the current locale.
+    Returns nil if the object isn't JSON-compatible. */
+NSData* CBLCollatableKey(id object, void* context);
+
+/** Same as CBLCollatableKey, but takes the object as a JSON string (fragments allowed.) */
+NSData* CBLCollatableKeyFromJSON(NSString* json, void* context);
+
 // CouchDB's default collation rules, including Unicode collation for strings
 #define kCBLCollateJSON_Unicode ((void*)0)
 
@@ -392,6 +392,177 @@ int CBLCollateJSON(void *context,
 }
 
 
+#pragma mark - COLLATABLE KEYS:
+
+
+// Type tags of collatable keys, in the order of the collation mode. The end of an array or
+// object is 0, so it sorts before any further item.
+#define kKeyEnd 0
+
+static const uint8_t kUnicodeKeyTags[] = {
+    // null, false, true, number, string, array, object
+    0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B
+};
+
+static const uint8_t kRawKeyTags[] = {
+    // null, false, true, number, string, array, object
+    0x07, 0x06, 0x08, 0x05, 0x0B, 0x0A, 0x09
+};
+
+typedef enum {kTagNull, kTagFalse, kTagTrue, kTagNumber, kTagString, kTagArray, kTagObject} KeyTag;
+
+
+static void appendTag(NSMutableData* key, KeyTag tag, void* context) {
+    uint8_t byte = (context == kCBLCollateJSON_Raw) ? kRawKeyTags[tag] : kUnicodeKeyTags[tag];
+    [key appendBytes: &byte length: 1];
+}
+
+
+// Appends bytes followed by a 0 terminator. Bytes 0 and 1 in the input are escaped as 01 01 and
+// 01 02, so a string sorts before any longer string it's a prefix of.
+static void appendTerminatedBytes(NSMutableData* key, const uint8_t* bytes, size_t length) {
+    size_t start = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (bytes[i] <= 1) {
+            [key appendBytes: bytes + start length: i - start];
+            uint8_t escape[2] = {1, (uint8_t)(bytes[i] + 1)};
+            [key appendBytes: escape length: 2];
+            start = i + 1;
+        }
+    }
+    [key appendBytes: bytes + start length: length - start];
+    uint8_t terminator = kKeyEnd;
+    [key appendBytes: &terminator length: 1];
+}
+
+
+static void appendTerminatedString(NSMutableData* key, NSString* str) {
+    NSData* utf8 = [str dataUsingEncoding: NSUTF8StringEncoding];
+    appendTerminatedBytes(key, utf8.bytes, utf8.length);
+}
+
+
+// Unicode collation compares case-insensitively first, then lets lowercase sort before uppercase
+// at the first difference (see compareStringsUnicodeFast.) So the key is the uppercased string,
+// followed by the string with its ASCII letters' case swapped.
+static void appendUnicodeString(NSMutableData* key, NSString* str) {
+    NSData* utf8 = [str dataUsingEncoding: NSUTF8StringEncoding];
+    const uint8_t* bytes = utf8.bytes;
+    size_t length = utf8.length;
+    BOOL ascii = YES;
+    for (size_t i = 0; i < length; ++i) {
+        if (bytes[i] & 0x80) {
+            ascii = NO;
+            break;
+        }
+    }
+
+    if (ascii) {
+        uint8_t* primary = malloc(length ?: 1);
+        uint8_t* tieBreak = malloc(length ?: 1);
+        if (!primary || !tieBreak) {
+            free(primary);
+            free(tieBreak);
+            return;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            uint8_t c = bytes[i];
+            if (c >= 'a' && c <= 'z') {
+                primary[i] = c - 32;
+                tieBreak[i] = c - 32;
+            } else if (c >= 'A' && c <= 'Z') {
+                primary[i] = c;
+                tieBreak[i] = c + 32;
+            } else {
+                primary[i] = tieBreak[i] = c;
+            }
+        }
+        appendTerminatedBytes(key, primary, length);
+        appendTerminatedBytes(key, tieBreak, length);
+        free(primary);
+        free(tieBreak);
+    } else {
+        // Non-ASCII: CBLCollateJSON uses -localizedCompare:, which depends on the current locale
+        // and can't be reproduced byte-wise. Instead, order by the string with case, diacritics
+        // and width folded away, then by the precomposed string itself.
+        NSString* folded = [str stringByFoldingWithOptions: NSDiacriticInsensitiveSearch |
+                                                            NSWidthInsensitiveSearch
+                                                    locale: nil];
+        appendTerminatedString(key, [folded uppercaseString]);
+        appendTerminatedString(key, [str precomposedStringWithCanonicalMapping]);
+    }
+}
+
+
+static void appendNumber(NSMutableData* key, double n) {
+    // Flip the sign bit of positive numbers and all the bits of negative ones, so that the
+    // big-endian bytes of the IEEE double sort in numeric order:
+    if (n == 0.0)
+        n = 0.0;    // turns -0 into 0
+    union {double d; uint64_t bits;} u = {n};
+    u.bits = (u.bits & 0x8000000000000000ull) ? ~u.bits : (u.bits | 0x8000000000000000ull);
+    uint64_t bigEndian = NSSwapHostLongLongToBig(u.bits);
+    [key appendBytes: &bigEndian length: sizeof(bigEndian)];
+}
+
+
+static BOOL appendCollatableKey(NSMutableData* key, id object, void* context) {
+    if (object == nil || object == [NSNull null]) {
+        appendTag(key, kTagNull, context);
+    } else if ([object isKindOfClass: [NSString class]]) {
+        appendTag(key, kTagString, context);
+        if (context == kCBLCollateJSON_Unicode)
+            appendUnicodeString(key, object);
+        else
+            appendTerminatedString(key, object);
+    } else if ([object isKindOfClass: [NSNumber class]]) {
+        if (CFGetTypeID((__bridge CFTypeRef)object) == CFBooleanGetTypeID()) {
+            appendTag(key, ([object boolValue] ? kTagTrue : kTagFalse), context);
+        } else {
+            appendTag(key, kTagNumber, context);
+            appendNumber(key, [object doubleValue]);
+        }
+    } else if ([object isKindOfClass: [NSArray class]]) {
+        appendTag(key, kTagArray, context);
+        for (id item in object)
+            if (!appendCollatableKey(key, item, context))
+                return NO;
+        uint8_t end = kKeyEnd;
+        [key appendBytes: &end length: 1];
+    } else if ([object isKindOfClass: [NSDictionary class]]) {
+        appendTag(key, kTagObject, context);
+        for (NSString* name in [[object allKeys] sortedArrayUsingSelector: @selector(compare:)]) {
+            if (!appendCollatableKey(key, name, context)
+                    || !appendCollatableKey(key, object[name], context))
+                return NO;
+        }
+        uint8_t end = kKeyEnd;
+        [key appendBytes: &end length: 1];
+    } else {
+        return NO;
+    }
+    return YES;
+}
+
+
+NSData* CBLCollatableKey(id object, void* context) {
+    NSMutableData* key = [NSMutableData dataWithCapacity: 32];
+    if (!appendCollatableKey(key, object, context))
+        return nil;
+    return key;
+}
+
+
+NSData* CBLCollatableKeyFromJSON(NSString* json, void* context) {
+    id object = [CBLJSON JSONObjectWithData: [json dataUsingEncoding: NSUTF8StringEncoding]
+                                    options: CBLJSONReadingAllowFragments
+                                      error: NULL];
+    if (!object)
+        return nil;
+    return CBLCollatableKey(object, context);
+}
+
+
 #pragma mark - UNIT TESTS:
 
 
@@ -531,6 +702,55 @@ TestCase(CBLCollateLimited) {
     CAssertEq(collateLimited(mode, "[5,\"wow\"]", "[5,\"MOM\"]", 2), 1);
 }
 
+static int compareKeys(NSData* key1, NSData* key2) {
+    int diff = memcmp(key1.bytes, key2.bytes, MIN(key1.length, key2.length));
+    if (diff == 0)
+        diff = cmp((int)key1.length, (int)key2.length);
+    return (diff > 0) - (diff < 0);
+}
+
+TestCase(CBLCollatableKey) {
+    RequireTestCase(CBLCollateScalars);
+    RequireTestCase(CBLCollateRaw);
+    // Every pair of these must compare the same way as keys as they do as JSON:
+    NSArray* samples = @[$null, $false, $true, @0, @(-0.0), @1, @(-1), @1.5, @(-1.5), @123, @1e20,
+                         @(-1e-20), @"", @"a", @"A", @"aa", @"aA", @"Aa", @"b", @"B", @"_", @"1234",
+                         @"123", @"12/34", @"\t", @" ", @"\001",
+                         [NSString stringWithFormat: @"a%Cb", (unichar)0],
+                         [NSString stringWithFormat: @"a%C", (unichar)0],
+                         @[], @[$null], @[$false], @[@123], @[@45], @[@45, @67], @[@5, @"wow"],
+                         @[@5, @"WOW"], @[@5], @[@[]], @[@1, @[@2, @3], @4],
+                         @[@1, @[@2, @3.1], @4, @5, @6], @{}, @{@"a": @1}, @{@"a": @2},
+                         @{@"a": @1, @"b": @2}];
+    for (NSValue* modeValue in @[[NSValue valueWithPointer: kCBLCollateJSON_Unicode],
+                                 [NSValue valueWithPointer: kCBLCollateJSON_Raw],
+                                 [NSValue valueWithPointer: kCBLCollateJSON_ASCII]]) {
+        void* mode = modeValue.pointerValue;
+        for (id obj1 in samples) {
+            NSData* key1 = CBLCollatableKey(obj1, mode);
+            CAssert(key1);
+            for (id obj2 in samples) {
+                NSData* key2 = CBLCollatableKey(obj2, mode);
+                if ([obj1 isKindOfClass: [NSDictionary class]] && [obj1 count] > 0
+                        && [obj2 isKindOfClass: [NSDictionary class]] && [obj2 count] > 0)
+                    continue;   // JSON property order is arbitrary, so objects don't compare alike
+                int expected = collate(mode, encode(obj1), encode(obj2));
+                CAssertEq(compareKeys(key1, key2), expected,
+                          @"Mode %p: %@ vs %@", mode, obj1, obj2);
+            }
+        }
+    }
+    CAssertEqual(CBLCollatableKeyFromJSON(@"[5,\"wow\"]", kCBLCollateJSON_Unicode),
+                 CBLCollatableKey(@[@5, @"wow"], kCBLCollateJSON_Unicode));
+    // Non-ASCII strings in Unicode collation:
+    CAssertEq(compareKeys(CBLCollatableKey(@"ømø", kCBLCollateJSON_Unicode),
+                          CBLCollatableKey(@"omo", kCBLCollateJSON_Unicode)), 1);
+    CAssertEq(compareKeys(CBLCollatableKey(@"fréd", kCBLCollateJSON_Unicode),
+                          CBLCollatableKey(@"Fred", kCBLCollateJSON_Unicode)), 1);
+    CAssertEq(compareKeys(CBLCollatableKey(@"fréd", kCBLCollateJSON_Unicode),
+                          CBLCollatableKey(@"frog", kCBLCollateJSON_Unicode)), -1);
+}
+
 TestCase(CBLCollateJSON) {
     RequireTestCase(CBLCollateScalars);
     RequireTestCase(CBLCollateASCII);
@@ -539,5 +759,6 @@ TestCase(CBLCollateJSON) {
     RequireTestCase(CBLCollateNestedArrays);
     RequireTestCase(CBLCollateUnicodeStrings);
     RequireTestCase(CBLCollateLimited);
+    RequireTestCase(CBLCollatableKey);
 }
 #endif
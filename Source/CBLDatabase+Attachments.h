@@ -41,6 +41,11 @@ typedef enum {
 - (NSDictionary*) getAttachmentDictForSequence: (SequenceNumber)sequence
                                        options: (CBLContentOptions)options;
 
+/** Constructs the "_attachments" dictionaries of many revisions at once. Returns a dictionary
+    mapping each sequence (as an NSNumber) that has attachments to its "_attachments" dictionary. */
+- (NSDictionary*) getAttachmentDictsForSequences: (NSArray*)sequences
+                                         options: (CBLContentOptions)options;
+
 /** Modifies a CBL_Revision's _attachments dictionary by changing all attachments into stubs.
     Attachments without a "revpos" property will be assigned one with rev's generation. */
 + (void) stubOutAttachments: (NSDictionary*)attachments
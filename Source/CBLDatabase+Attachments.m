@@ -228,7 +228,7 @@ static bool digestToBlobKey(NSString* digest, CBLBlobKey* key) {
     Assert(sequence > 0);
     Assert(filename);
     NSString* filePath = nil;
-    CBL_FMResultSet* r = [_fmdb executeQuery:
+    CBL_FMResultSet* r = [self.fmdb executeQuery:
                       @"SELECT key, type, encoding FROM attachments WHERE sequence=? AND filename=?",
                       @(sequence), filename];
     if (!r) {
@@ -297,7 +297,7 @@ static bool digestToBlobKey(NSString* digest, CBLBlobKey* key) {
 
 
 - (BOOL) sequenceHasAttachments: (SequenceNumber)sequence {
-    return [_fmdb boolForQuery: @"SELECT 1 FROM attachments WHERE sequence=? LIMIT 1", @(sequence)];
+    return [self.fmdb boolForQuery: @"SELECT 1 FROM attachments WHERE sequence=? LIMIT 1", @(sequence)];
 }
 
 
@@ -306,63 +306,76 @@ static bool digestToBlobKey(NSString* digest, CBLBlobKey* key) {
                                        options: (CBLContentOptions)options
 {
     Assert(sequence > 0);
-    CBL_FMResultSet* r = [_fmdb executeQuery:
-                      @"SELECT filename, key, type, encoding, length, encoded_length, revpos "
-                       "FROM attachments WHERE sequence=?",
-                      @(sequence)];
-    if (!r)
-        return nil;
-    if (![r next]) {
-        [r close];
-        return nil;
-    }
+    return [self getAttachmentDictsForSequences: @[@(sequence)] options: options][@(sequence)];
+}
+
+
+/** Constructs the "_attachments" dictionaries of many revisions, with one query per batch of
+    sequences (see CBLBatchMatch). The result maps sequences (NSNumbers) to dictionaries; revisions
+    without attachments are omitted. */
+- (NSDictionary*) getAttachmentDictsForSequences: (NSArray*)sequences
+                                         options: (CBLContentOptions)options
+{
+    NSMutableDictionary* result = $mdict();
     BOOL decodeAttachments = !(options & kCBLLeaveAttachmentsEncoded);
-    NSMutableDictionary* attachments = $mdict();
-    do {
-        NSData* keyData = [r dataNoCopyForColumnIndex: 1];
-        NSString* digestStr = blobKeyToDigest(*(CBLBlobKey*)keyData.bytes);
-        CBLAttachmentEncoding encoding = [r intForColumnIndex: 3];
-        UInt64 length = [r longLongIntForColumnIndex: 4];
-        UInt64 encodedLength = [r longLongIntForColumnIndex: 5];
-        
-        // Get the attachment contents if asked to:
-        NSData* data = nil;
-        BOOL dataSuppressed = NO;
-        if (options & kCBLIncludeAttachments) {
-            UInt64 effectiveLength = (encoding && !decodeAttachments) ? encodedLength : length;
-            if ((options & kCBLBigAttachmentsFollow) && effectiveLength >= kBigAttachmentLength) {
-                dataSuppressed = YES;
-            } else {
-                data = [_attachments blobForKey: *(CBLBlobKey*)keyData.bytes];
-                if (!data)
-                    Warn(@"CBLDatabase: Failed to get attachment for key %@", keyData);
+    for (NSUInteger start = 0; start < sequences.count; ) {
+        NSArray* args;
+        NSString* sql = $sprintf(@"SELECT sequence, filename, key, type, encoding, length, "
+                                  "encoded_length, revpos FROM attachments WHERE %@",
+                                 CBLBatchMatch(@"sequence", sequences, &start, &args));
+        CBL_FMResultSet* r = [self.fmdb executeQuery: sql withArgumentsInArray: args];
+        if (!r)
+            return nil;
+        while ([r next]) {
+            NSNumber* sequence = @([r longLongIntForColumnIndex: 0]);
+            NSData* keyData = [r dataNoCopyForColumnIndex: 2];
+            NSString* digestStr = blobKeyToDigest(*(CBLBlobKey*)keyData.bytes);
+            CBLAttachmentEncoding encoding = [r intForColumnIndex: 4];
+            UInt64 length = [r longLongIntForColumnIndex: 5];
+            UInt64 encodedLength = [r longLongIntForColumnIndex: 6];
+
+            // Get the attachment contents if asked to:
+            NSData* data = nil;
+            BOOL dataSuppressed = NO;
+            if (options & kCBLIncludeAttachments) {
+                UInt64 effectiveLength = (encoding && !decodeAttachments) ? encodedLength : length;
+                if ((options & kCBLBigAttachmentsFollow) && effectiveLength >= kBigAttachmentLength) {
+                    dataSuppressed = YES;
+                } else {
+                    data = [_attachments blobForKey: *(CBLBlobKey*)keyData.bytes];
+                    if (!data)
+                        Warn(@"CBLDatabase: Failed to get attachment for key %@", keyData);
+                }
             }
-        }
-        
-        NSString* encodingStr = nil;
-        id encodedLengthObj = nil;
-        if (encoding != kCBLAttachmentEncodingNone) {
-            // Decode the attachment if it's included in the dict:
-            if (data && decodeAttachments) {
-                data = [self decodeAttachment: data encoding: encoding];
-            } else {
-                encodingStr = @"gzip";  // the only encoding I know
-                encodedLengthObj = @(encodedLength);
+
+            NSString* encodingStr = nil;
+            id encodedLengthObj = nil;
+            if (encoding != kCBLAttachmentEncodingNone) {
+                // Decode the attachment if it's included in the dict:
+                if (data && decodeAttachments) {
+                    data = [self decodeAttachment: data encoding: encoding];
+                } else {
+                    encodingStr = @"gzip";  // the only encoding I know
+                    encodedLengthObj = @(encodedLength);
+                }
             }
-        }
 
-        attachments[[r stringForColumnIndex: 0]] = $dict({@"stub", ((data || dataSuppressed) ? nil : $true)},
-                                      {@"data", (data ? [CBLBase64 encode: data] : nil)},
-                                      {@"follows", (dataSuppressed ? $true : nil)},
-                                      {@"digest", digestStr},
-                                      {@"content_type", [r stringForColumnIndex: 2]},
-                                      {@"encoding", encodingStr},
-                                      {@"length", @(length)},
-                                      {@"encoded_length", encodedLengthObj},
-                                      {@"revpos", @([r intForColumnIndex: 6])});
-    } while ([r next]);
-    [r close];
-    return attachments;
+            NSMutableDictionary* attachments = result[sequence];
+            if (!attachments)
+                result[sequence] = attachments = $mdict();
+            attachments[[r stringForColumnIndex: 1]] = $dict({@"stub", ((data || dataSuppressed) ? nil : $true)},
+                                          {@"data", (data ? [CBLBase64 encode: data] : nil)},
+                                          {@"follows", (dataSuppressed ? $true : nil)},
+                                          {@"digest", digestStr},
+                                          {@"content_type", [r stringForColumnIndex: 3]},
+                                          {@"encoding", encodingStr},
+                                          {@"length", @(length)},
+                                          {@"encoded_length", encodedLengthObj},
+                                          {@"revpos", @([r intForColumnIndex: 7])});
+        }
+        [r close];
+    }
+    return result;
 }
 
 
@@ -35,9 +35,25 @@
 /** Parses the _revisions dict from a document into an array of revision ID strings */
 + (NSArray*) parseCouchDBRevisionHistory: (NSDictionary*)docProperties;
 
-/** Compacts the database storage by removing the bodies and attachments of obsolete revisions. */
+/** Compacts the database storage by removing the bodies and attachments of obsolete revisions,
+    and recompressing current bodies to match the bodyCompression setting. */
 - (CBLStatus) compact;
 
+/** Performs part of a compaction, in steps that each take about timeBudget seconds. Unlike
+    -compact, it doesn't VACUUM or reopen the database; it reclaims free pages incrementally. */
+- (CBLStatus) compactIncrementally: (NSTimeInterval)timeBudget
+                          progress: (CBLCompactionProgress*)outProgress;
+
+/** Changes the compression applied to newly saved revision bodies, and saves the setting.
+    Switching to dictionary compression trains a dictionary from the current documents. */
+- (CBLStatus) _setBodyCompression: (CBLBodyCompression)compression;
+
+/** Changes whether newly saved revision bodies use the binary format, and saves the setting. */
+- (CBLStatus) _setBinaryBodyFormat: (BOOL)binary;
+
+/** Rewrites stored revision bodies that aren't in the current format or compression. */
+- (CBLStatus) recompressBodies;
+
 /** Removes old revisions such that no leaf revision has a tree deeper than maxDepth. */
 - (CBLStatus) pruneRevsToMaxDepth: (NSUInteger)maxDepth
                      numberPruned: (NSUInteger*)outPruned;
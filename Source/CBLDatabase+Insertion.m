@@ -25,6 +25,9 @@
 #import "CBL_Shared.h"
 #import "CBLInternal.h"
 #import "CBLMisc.h"
+#import "CBLDocIDMap.h"
+#import "CBLBodyCodec.h"
+#import "CBLBinaryBody.h"
 #import "Test.h"
 #import "ExceptionUtils.h"
 
@@ -138,8 +141,9 @@
     if (![_fmdb executeUpdate: @"INSERT INTO docs (docid) VALUES (?)", docID])
         return -1;
     SInt64 row = _fmdb.lastInsertRowId;
-    Assert(![_docIDs objectForKey: docID]);
-    [_docIDs setObject: @(row) forKey: docID];
+    [_docIDMap setDocNumericID: row forDocID: docID];
+    if (_transactionLevel > 0)
+        [_insertedDocIDs addObject: docID];   // so it can be forgotten if the transaction fails
     return row;
 }
 
@@ -234,6 +238,66 @@
 }
 
 
+/** Looks up the winning revision of a document and caches it, along with whether it's deleted
+    and whether the document is in conflict, in the document's row of the 'docs' table.
+    Must be called (within the same transaction) after any change to the doc's current revisions. */
+- (CBLStatus) updateWinningRevisionOfDocNumericID: (SInt64)docNumericID {
+    BOOL wasLive = [_fmdb boolForQuery: @"SELECT winning_revid IS NOT NULL AND winning_deleted=0"
+                                         " FROM docs WHERE doc_id=?", @(docNumericID)];
+    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT revid, sequence, deleted FROM revs"
+                                           " WHERE doc_id=? and current=1"
+                                           " ORDER BY deleted asc, revid desc LIMIT 2",
+                                          @(docNumericID)];
+    if (!r)
+        return self.lastDbError;
+    NSString* revID = nil;
+    SequenceNumber sequence = 0;
+    BOOL deleted = NO, inConflict = NO;
+    if ([r next]) {
+        revID = [r stringForColumnIndex: 0];
+        sequence = [r longLongIntForColumnIndex: 1];
+        deleted = [r boolForColumnIndex: 2];
+        // The document is in conflict if there are two+ result rows that are not deletions.
+        inConflict = !deleted && [r next] && ![r boolForColumnIndex: 2];
+    }
+    [r close];
+
+    if (![_fmdb executeUpdate: @"UPDATE docs SET winning_revid=?, winning_seq=?, "
+                                "winning_deleted=?, in_conflict=? WHERE doc_id=?",
+                               revID,
+                               (sequence ? @(sequence) : nil),
+                               (revID ? @(deleted) : nil),
+                               @(inConflict),
+                               @(docNumericID)])
+        return self.lastDbError;
+
+    BOOL isLive = (revID != nil && !deleted);
+    if (isLive != wasLive)
+        [self adjustDocumentCount: (isLive ? 1 : -1)];
+    return kCBLStatusOK;
+}
+
+
+/** Encodes a revision body for the 'json' column of 'revs'. In binary format this saves any new
+    property names to the 'bodykeys' table, so it must be called within a transaction.
+    Returns nil on error. */
+- (NSData*) encodeBody: (NSData*)json {
+    if (!_bodyCodec.binaryFormat)
+        return [_bodyCodec encode: json];
+    if (![self loadBodyKeys])       // another instance may have added names; don't reuse their IDs
+        return nil;
+    CBLBinaryKeyTable* keyTable = _bodyCodec.keyTable;
+    NSUInteger keyID = keyTable.count;
+    NSData* body = [_bodyCodec encode: json];
+    for (NSString* name in [keyTable namesFromID: keyID]) {
+        if (![_fmdb executeUpdate: @"INSERT INTO bodykeys (key_id, name) VALUES (?, ?)",
+                                   @(keyID++), name])
+            return nil;
+    }
+    return body;
+}
+
+
 // Raw row insertion. Returns new sequence, or 0 on error
 - (SequenceNumber) insertRevision: (CBL_Revision*)rev
                      docNumericID: (SInt64)docNumericID
@@ -242,6 +306,9 @@
                    hasAttachments: (BOOL)hasAttachments
                              JSON: (NSData*)json
 {
+    NSData* body = json;
+    if (json && !(body = [self encodeBody: json]))
+        return 0;
     if (![_fmdb executeUpdate: @"INSERT INTO revs (doc_id, revid, parent, current, deleted, "
                                                   "no_attachments, json) "
                                 "VALUES (?, ?, ?, ?, ?, ?, ?)",
@@ -251,9 +318,11 @@
                                @(current),
                                @(rev.deleted),
                                @(!hasAttachments),
-                               json])
+                               body])
         return 0;
-    return rev.sequence = _fmdb.lastInsertRowId;
+    SequenceNumber sequence = _fmdb.lastInsertRowId;
+    [self noteInsertedSequence: sequence];
+    return rev.sequence = sequence;
 }
 
 
@@ -295,7 +364,6 @@
         NSString* oldWinningRevID = nil;
         if (docNumericID > 0) {
             // Look up which rev is the winner, before this insertion
-            //OPT: This rev ID could be cached in the 'docs' row
             oldWinningRevID = [self winningRevIDOfDocNumericID: docNumericID
                                                      isDeleted: &oldWinnerWasDeletion
                                                     isConflict: &wasConflicted];
@@ -437,6 +505,9 @@
             return status;
 
         // Figure out what the new winning rev ID is:
+        status = [self updateWinningRevisionOfDocNumericID: docNumericID];
+        if (CBLStatusIsError(status))
+            return status;
         winningRev = [self winnerWithDocID: docNumericID
                                  oldWinner: oldWinningRevID oldDeleted: oldWinnerWasDeletion
                                     newRev: newRev];
@@ -507,7 +578,6 @@
         }
         
         // Look up which rev is the winner, before this insertion
-        //OPT: This rev ID could be cached in the 'docs' row
         BOOL oldWinnerWasDeletion;
         NSString* oldWinningRevID = [self winningRevIDOfDocNumericID: docNumericID
                                                            isDeleted: &oldWinnerWasDeletion
@@ -592,6 +662,9 @@
         }
 
         // Figure out what the new winning rev ID is:
+        CBLStatus status = [self updateWinningRevisionOfDocNumericID: docNumericID];
+        if (CBLStatusIsError(status))
+            return status;
         winningRev = [self winnerWithDocID: docNumericID
                                  oldWinner: oldWinningRevID oldDeleted: oldWinnerWasDeletion
                                     newRev: rev];
@@ -623,22 +696,160 @@
 #pragma mark - PURGING / COMPACTING:
 
 
+#define kBodyDictionarySampleCount 500
+#define kBodyDictionaryMaxSize (16*1024)
+#define kRecompressBatchSize 1000
+#define kCompactionBatchSize 1000       // Revisions whose old bodies are cleared per transaction
+#define kPruneBatchSize 1000            // Documents whose revision trees are pruned per transaction
+#define kVacuumPagesPerStep 2048        // Max pages freed by a single 'incremental_vacuum'
+
+
+// Phases of an incremental compaction, in order (see -compactIncrementally:progress:)
+enum {
+    kCompactionIdle,
+    kCompactionPruneRevs,               // Prune revision trees to maxRevTreeDepth
+    kCompactionClearBodies,             // Clear the bodies of non-current revisions
+    kCompactionRecompress,              // Rewrite bodies not in the current format
+    kCompactionAttachments,             // Delete unreferenced attachments
+    kCompactionVacuum,                  // Return free pages to the filesystem
+    kCompactionCheckpoint,              // Copy the WAL into the database file
+    kNumCompactionPhases = kCompactionCheckpoint
+};
+
+
+- (CBLStatus) _setBodyCompression: (CBLBodyCompression)compression {
+    static NSString* const kCodecNames[] = {@"none", @"deflate", @"dictionary"};
+    if ((unsigned)compression > kCBLBodyCompressionDictionary)
+        return kCBLStatusBadParam;
+    return [self _inTransaction: ^CBLStatus {
+        if (compression == kCBLBodyCompressionDictionary && !_bodyCodec.encodingDictionary) {
+            // Train a dictionary from a sample of the most recent current revisions:
+            NSMutableArray* samples = $marray();
+            CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT json FROM revs "
+                                                       "WHERE current=1 AND length(json) > 0 "
+                                                       "ORDER BY sequence DESC LIMIT ?",
+                                                      @(kBodyDictionarySampleCount)];
+            if (!r)
+                return self.lastDbError;
+            while ([r next]) {
+                NSData* stored = [r dataForColumnIndex: 0];
+                NSData* json = [self loadBodyKeysForBody: stored] ? [_bodyCodec decode: stored]
+                                                                  : nil;
+                if (json)
+                    [samples addObject: json];
+            }
+            [r close];
+            NSData* dictionary = [CBLBodyCodec trainDictionaryFromSamples: samples
+                                                                  maxSize: kBodyDictionaryMaxSize];
+            if (dictionary.length > 0) {
+                if (![_fmdb executeUpdate: @"INSERT INTO bodydicts (data) VALUES (?)", dictionary])
+                    return self.lastDbError;
+                [_bodyCodec addDictionary: dictionary];
+                LogTo(CBLDatabase, @"%@: Trained %u-byte body dictionary from %u docs",
+                      self, (unsigned)dictionary.length, (unsigned)samples.count);
+            }
+        }
+        CBLStatus status = [self setInfo: kCodecNames[compression] forKey: @"body_codec"];
+        if (!CBLStatusIsError(status))
+            _bodyCodec.compression = compression;
+        return status;
+    }];
+}
+
+
+- (CBLStatus) _setBinaryBodyFormat: (BOOL)binary {
+    CBLStatus status = [self setInfo: (binary ? @"binary" : @"json") forKey: @"body_format"];
+    if (!CBLStatusIsError(status))
+        _bodyCodec.binaryFormat = binary;
+    return status;
+}
+
+
+/** Rewrites the bodies in one batch of revisions after *ioLastSequence that aren't in the current
+    format, in a transaction. Advances *ioLastSequence, and sets *outDone after the last batch. */
+- (CBLStatus) recompressBodiesAfter: (SequenceNumber*)ioLastSequence
+                          rewritten: (NSUInteger*)ioRewritten
+                               done: (BOOL*)outDone
+{
+    return [self _inTransaction: ^CBLStatus {
+        CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT sequence, json FROM revs "
+                                                   "WHERE sequence > ? AND length(json) > 0 "
+                                                   "ORDER BY sequence LIMIT ?",
+                                                  @(*ioLastSequence), @(kRecompressBatchSize)];
+        if (!r)
+            return self.lastDbError;
+        NSMutableArray* updates = $marray();
+        NSUInteger count = 0;
+        while ([r next]) {
+            ++count;
+            SequenceNumber sequence = [r longLongIntForColumnIndex: 0];
+            *ioLastSequence = sequence;
+            NSData* stored = [r dataNoCopyForColumnIndex: 1];
+            if (![_bodyCodec isEncodedInCurrentFormat: stored]) {
+                if (![self loadBodyKeysForBody: stored]) {
+                    [r close];
+                    return kCBLStatusCorruptError;
+                }
+                NSData* json = [_bodyCodec decode: stored];
+                NSData* encoded = json ? [self encodeBody: json] : nil;
+                if (encoded && ![encoded isEqual: stored])
+                    [updates addObject: @[@(sequence), encoded]];
+            }
+        }
+        [r close];
+        *outDone = (count < kRecompressBatchSize);
+
+        for (NSArray* update in updates) {
+            if (![_fmdb executeUpdate: @"UPDATE revs SET json=? WHERE sequence=?",
+                                       update[1], update[0]])
+                return self.lastDbError;
+        }
+        *ioRewritten += updates.count;
+        return kCBLStatusOK;
+    }];
+}
+
+
+- (CBLStatus) recompressBodies {
+    SequenceNumber lastSequence = 0;
+    NSUInteger rewritten = 0;
+    BOOL done = NO;
+    while (!done) {
+        CBLStatus status = [self recompressBodiesAfter: &lastSequence rewritten: &rewritten
+                                                  done: &done];
+        if (CBLStatusIsError(status))
+            return status;
+    }
+    LogTo(CBLDatabase, @"%@: Recompressed %u revision bodies", self, (unsigned)rewritten);
+    return kCBLStatusOK;
+}
+
+
 - (CBLStatus) compact {
+    _compactionPhase = kCompactionIdle;     // this supersedes any incremental compaction
+
     // Can't delete any rows because that would lose revision tree history.
     // But we can remove the JSON of non-current revisions, which is most of the space.
     LogMY(@"CBLDatabase: Deleting JSON of old revisions...");
     if (![_fmdb executeUpdate: @"UPDATE revs SET json=null WHERE current=0"])
         return self.lastDbError;
 
+    LogMY(@"Recompressing document bodies...");
+    CBLStatus status = [self recompressBodies];
+    if (CBLStatusIsError(status))
+        return status;
+
     LogMY(@"Deleting old attachments...");
-    CBLStatus status = [self garbageCollectAttachments];
+    status = [self garbageCollectAttachments];
 
     LogMY(@"Flushing SQLite WAL...");
     if (![_fmdb executeUpdate: @"PRAGMA wal_checkpoint(RESTART)"])
         return self.lastDbError;
 
+    // (Setting auto_vacuum first makes the VACUUM convert older databases to incremental vacuuming)
     LogMY(@"Vacuuming SQLite database...");
-    if (![_fmdb executeUpdate: @"VACUUM"])
+    if (![_fmdb executeUpdate: @"PRAGMA auto_vacuum = INCREMENTAL"] ||
+            ![_fmdb executeUpdate: @"VACUUM"])
         return self.lastDbError;
 
     LogMY(@"Closing and re-opening database...");
@@ -651,6 +862,147 @@
 }
 
 
+/** Performs one unit of work of an incremental compaction, advancing to the next phase when the
+    current one is done. Each unit is either a short transaction or a bounded amount of vacuuming. */
+- (CBLStatus) compactionStepWithDeadline: (CFAbsoluteTime)deadline {
+    switch (_compactionPhase) {
+        case kCompactionPruneRevs: {
+            // (_compactionSequence is the last doc_id pruned, during this phase)
+            NSUInteger pruned = 0;
+            BOOL done = NO;
+            CBLStatus status = [self pruneRevsToMaxDepth: self.maxRevTreeDepth
+                                              afterDocID: &_compactionSequence
+                                            numberPruned: &pruned done: &done];
+            if (CBLStatusIsError(status))
+                return status;
+            if (done) {
+                _compactionSequence = 0;
+                ++_compactionPhase;
+            }
+            break;
+        }
+        case kCompactionClearBodies: {
+            SequenceNumber start = _compactionSequence, end = start + kCompactionBatchSize;
+            CBLStatus status = [self _inTransaction: ^CBLStatus {
+                if (![_fmdb executeUpdate: @"UPDATE revs SET json=null WHERE current=0 "
+                                            "AND json IS NOT NULL AND sequence > ? AND sequence <= ?",
+                                           @(start), @(end)])
+                    return self.lastDbError;
+                return kCBLStatusOK;
+            }];
+            if (CBLStatusIsError(status))
+                return status;
+            _compactionSequence = end;
+            if (end >= _compactionEndSequence) {
+                _compactionSequence = 0;
+                ++_compactionPhase;
+            }
+            break;
+        }
+        case kCompactionRecompress: {
+            NSUInteger rewritten = 0;
+            BOOL done = NO;
+            CBLStatus status = [self recompressBodiesAfter: &_compactionSequence
+                                                 rewritten: &rewritten done: &done];
+            if (CBLStatusIsError(status))
+                return status;
+            if (done)
+                ++_compactionPhase;
+            break;
+        }
+        case kCompactionAttachments: {
+            CBLStatus status = [self garbageCollectAttachments];
+            if (CBLStatusIsError(status))
+                return status;
+            ++_compactionPhase;
+            break;
+        }
+        case kCompactionVacuum: {
+            // 'incremental_vacuum' frees one page per result row, so it can be stopped at any time:
+            if ([_fmdb intForQuery: @"PRAGMA auto_vacuum"] != 2) {
+                LogTo(CBLDatabase, @"%@: Can't vacuum incrementally until next full compaction",
+                      self);
+                ++_compactionPhase;
+                break;
+            }
+            if (_compactionFreePages == 0)
+                _compactionFreePages = [_fmdb longLongForQuery: @"PRAGMA freelist_count"];
+            UInt64 pageSize = [_fmdb longLongForQuery: @"PRAGMA page_size"];
+            CBL_FMResultSet* r = [_fmdb executeQuery:
+                        $sprintf(@"PRAGMA incremental_vacuum(%d)", kVacuumPagesPerStep)];
+            if (!r)
+                return self.lastDbError;
+            NSUInteger freed = 0;
+            BOOL more = NO;
+            while ([r next]) {
+                if (++freed % 64 == 0 && CFAbsoluteTimeGetCurrent() >= deadline) {
+                    more = YES;
+                    break;
+                }
+            }
+            [r close];
+            _compactionProgress.bytesReclaimed += freed * pageSize;
+            if (!more && freed < kVacuumPagesPerStep)
+                ++_compactionPhase;
+            break;
+        }
+        case kCompactionCheckpoint: {
+            // PASSIVE doesn't wait for readers; it also truncates the file if it's been shrunk.
+            if (![_fmdb executeUpdate: @"PRAGMA wal_checkpoint(PASSIVE)"])
+                return self.lastDbError;
+            _compactionPhase = kCompactionIdle;
+            _compactionProgress.finished = YES;
+            break;
+        }
+    }
+    return kCBLStatusOK;
+}
+
+
+- (CBLStatus) compactIncrementally: (NSTimeInterval)timeBudget
+                          progress: (CBLCompactionProgress*)outProgress
+{
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeBudget;
+    if (_compactionPhase == kCompactionIdle) {
+        LogTo(CBLDatabase, @"%@: Starting incremental compaction", self);
+        _compactionPhase = kCompactionPruneRevs;
+        _compactionSequence = 0;
+        _compactionEndSequence = self.lastSequenceNumber;
+        _compactionFreePages = 0;
+        memset(&_compactionProgress, 0, sizeof(_compactionProgress));
+    }
+
+    // Always take at least one step, so every call makes progress:
+    CBLStatus status;
+    do {
+        status = [self compactionStepWithDeadline: deadline];
+    } while (!CBLStatusIsError(status) && _compactionPhase != kCompactionIdle
+                                       && CFAbsoluteTimeGetCurrent() < deadline);
+
+    // Estimate progress as the fraction of phases done plus the fraction of the current one:
+    float phaseFraction = 0.0;
+    if (_compactionPhase == kCompactionClearBodies || _compactionPhase == kCompactionRecompress) {
+        if (_compactionEndSequence > 0)
+            phaseFraction = MIN(1.0, _compactionSequence / (float)_compactionEndSequence);
+    } else if (_compactionPhase == kCompactionVacuum && _compactionFreePages > 0) {
+        UInt64 pageSize = [_fmdb longLongForQuery: @"PRAGMA page_size"];
+        phaseFraction = MIN(1.0, _compactionProgress.bytesReclaimed
+                                        / (float)(_compactionFreePages * pageSize));
+    }
+    if (_compactionProgress.finished) {
+        _compactionProgress.fractionComplete = 1.0;
+        LogTo(CBLDatabase, @"%@: Finished incremental compaction; reclaimed %llu bytes",
+              self, _compactionProgress.bytesReclaimed);
+    } else {
+        _compactionProgress.fractionComplete = (_compactionPhase - 1 + phaseFraction)
+                                                    / kNumCompactionPhases;
+    }
+    if (outProgress)
+        *outProgress = _compactionProgress;
+    return status;
+}
+
+
 - (CBLStatus) purgeRevisions: (NSDictionary*)docsToRevs
                      result: (NSDictionary**)outResult
 {
@@ -732,6 +1084,11 @@
                 }
                 revsPurged = revsToPurge.allObjects;
             }
+            if (revsPurged.count > 0) {
+                CBLStatus status = [self updateWinningRevisionOfDocNumericID: docNumericID];
+                if (CBLStatusIsError(status))
+                    return status;
+            }
             result[docID] = revsPurged;
         }
         return kCBLStatusOK;
@@ -739,45 +1096,68 @@
 }
 
 
-- (CBLStatus) pruneRevsToMaxDepth: (NSUInteger)maxDepth numberPruned: (NSUInteger*)outPruned {
+/** Prunes the revision trees of one batch of documents whose numeric IDs are after *ioLastDocID,
+    in a transaction. Advances *ioLastDocID, and sets *outDone after the last batch. */
+- (CBLStatus) pruneRevsToMaxDepth: (NSUInteger)maxDepth
+                       afterDocID: (SInt64*)ioLastDocID
+                     numberPruned: (NSUInteger*)ioPruned
+                             done: (BOOL*)outDone
+{
     // TODO: This implementation is a bit simplistic. It won't do quite the right thing in
     // histories with branches, if one branch stops much earlier than another. The shorter branch
     // will be deleted entirely except for its leaf revision. A more accurate pruning
     // would require an expensive full tree traversal. Hopefully this way is good enough.
-    if (maxDepth == 0)
-        maxDepth = self.maxRevTreeDepth;
-
-    *outPruned = 0;
-    // First find which docs need pruning, and by how much:
-    NSMutableDictionary* toPrune = $mdict();
-    NSString* sql = @"SELECT doc_id, MIN(revid), MAX(revid) FROM revs GROUP BY doc_id";
-    CBL_FMResultSet* r = [_fmdb executeQuery: sql];
-    while ([r next]) {
-        UInt64 docNumericID = [r longLongIntForColumnIndex: 0];
-        unsigned minGen = [CBL_Revision generationFromRevID: [r stringForColumnIndex: 1]];
-        unsigned maxGen = [CBL_Revision generationFromRevID: [r stringForColumnIndex: 2]];
-        if ((maxGen - minGen + 1) > maxDepth)
-            toPrune[@(docNumericID)] = @(maxGen - maxDepth);
-    }
-    [r close];
-
-    if (toPrune.count == 0)
-        return kCBLStatusOK;
-
-    // Now prune:
     return [self _inTransaction:^CBLStatus{
+        // First find which docs in the batch need pruning, and by how much:
+        NSMutableDictionary* toPrune = $mdict();
+        CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT doc_id, MIN(revid), MAX(revid) "
+                                                   "FROM revs WHERE doc_id > ? "
+                                                   "GROUP BY doc_id ORDER BY doc_id LIMIT ?",
+                                                  @(*ioLastDocID), @(kPruneBatchSize)];
+        if (!r)
+            return self.lastDbError;
+        NSUInteger count = 0;
+        while ([r next]) {
+            ++count;
+            SInt64 docNumericID = [r longLongIntForColumnIndex: 0];
+            *ioLastDocID = docNumericID;
+            unsigned minGen = [CBL_Revision generationFromRevID: [r stringForColumnIndex: 1]];
+            unsigned maxGen = [CBL_Revision generationFromRevID: [r stringForColumnIndex: 2]];
+            if ((maxGen - minGen + 1) > maxDepth)
+                toPrune[@(docNumericID)] = @(maxGen - maxDepth);
+        }
+        [r close];
+        *outDone = (count < kPruneBatchSize);
+
+        // Now prune:
         for (id docNumericID in toPrune) {
             NSString* minIDToKeep = $sprintf(@"%d-", [toPrune[docNumericID] intValue] + 1);
             if (![_fmdb executeUpdate: @"DELETE FROM revs WHERE doc_id=? AND revid < ? AND current=0",
                                        docNumericID, minIDToKeep])
                 return self.lastDbError;
-            *outPruned += _fmdb.changes;
+            *ioPruned += _fmdb.changes;
         }
         return kCBLStatusOK;
     }];
 }
 
 
+- (CBLStatus) pruneRevsToMaxDepth: (NSUInteger)maxDepth numberPruned: (NSUInteger*)outPruned {
+    if (maxDepth == 0)
+        maxDepth = self.maxRevTreeDepth;
+    *outPruned = 0;
+    SInt64 lastDocID = 0;
+    BOOL done = NO;
+    while (!done) {
+        CBLStatus status = [self pruneRevsToMaxDepth: maxDepth afterDocID: &lastDocID
+                                        numberPruned: outPruned done: &done];
+        if (CBLStatusIsError(status))
+            return status;
+    }
+    return kCBLStatusOK;
+}
+
+
 #pragma mark - VALIDATION:
 
 
@@ -9,7 +9,7 @@
 #import "CBL_Revision.h"
 #import "CBLStatus.h"
 #import "CBLDatabase.h"
-@class CBL_FMDatabase, CBLView, CBLShowFunction, CBLListFunction, CBL_BlobStore, CBLDocument, CBLCache, CBLDatabase, CBLDatabaseChange, CBL_Shared;
+@class CBL_FMDatabase, CBLView, CBLShowFunction, CBLListFunction, CBL_BlobStore, CBLDocument, CBLCache, CBLDatabase, CBLDatabaseChange, CBL_Shared, CBLReaderPool, CBLDocIDMap, CBLBodyCodec, CBLViewIndexUpdater;
 struct CBLQueryOptions;      // declared in CBLView+Internal.h
 
 
@@ -53,6 +53,14 @@ typedef struct CBLChangesOptions {
 extern const CBLChangesOptions kDefaultCBLChangesOptions;
 
 
+/** For reading the rows matching a list of values, a batch per query: returns an SQL condition
+    matching the values from *ioStart on ("column=?" for a single value, else "column IN (?,...)"),
+    sets *outArgs to the arguments to bind to it, and advances *ioStart past them. A partial batch
+    is padded to one of a few fixed sizes, so there are only a few distinct statements, and they
+    can all be cached. */
+NSString* CBLBatchMatch(NSString* column, NSArray* values, NSUInteger* ioStart, NSArray** outArgs);
+
+
 
 // Additional instance variable and property declarations
 @interface CBLDatabase ()
@@ -63,13 +71,30 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
     CBLManager* _manager;
     NSString* _encryptionKey;
     CBL_FMDatabase *_fmdb;
+    CBLReaderPool* _readerPool;         // Read-only connections, so queries don't wait for writers
+    NSString* _readerKey;               // Thread-dictionary key of a thread's current reader
+    int32_t _activeReaders;             // Number of threads currently using a reader
     BOOL _readOnly;
     BOOL _isOpen;
     int _transactionLevel;
+    NSThread* _transactionThread;       // Thread that has the outermost transaction open
+    NSMutableData* _savepoints;         // State to restore if a savepoint rolls back (CBLSavepoint)
+    NSMutableArray* _queuedTransactions;    // Blocks waiting for group commit (see -_queueTransaction:)
+    BOOL _flushScheduled;
     NSThread* _thread;
     dispatch_queue_t _dispatchQueue;    // One and only one of _thread or _dispatchQueue is set
-    NSCache* _docIDs;
+    CBLDocIDMap* _docIDMap;             // Caches docID -> doc_id mappings from the 'docs' table
+    NSMutableArray* _insertedDocIDs;    // docIDs added to 'docs' in the current transaction
+    NSUInteger _documentCount;          // Number of non-deleted docs (persisted in 'info' on commit)
+    SequenceNumber _lastSequence;       // Highest sequence number in 'revs'
+    volatile int32_t _countersStale;    // Another instance changed the db; reload the above
+    CBLBodyCodec* _bodyCodec;           // Compresses/decompresses the 'json' column of 'revs'
+    int _compactionPhase;               // State of an incremental compaction in progress:
+    SequenceNumber _compactionSequence, _compactionEndSequence;
+    UInt64 _compactionFreePages;
+    CBLCompactionProgress _compactionProgress;
     NSMutableDictionary* _views;
+    CBLViewIndexUpdater* _indexUpdater; // Updates indexes in the background (created on demand)
     NSMutableDictionary* _showFunctions;
     NSMutableDictionary* _listFunctions;
     CBL_BlobStore* _attachments;
@@ -110,6 +135,8 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
 - (BOOL) open: (NSError**)outError;
 - (BOOL) closeInternal;
 
+/** The SQLite connection to use. Normally this is the database's own (read-write) connection,
+    but within a call to -_inReadTransaction: on another thread it's a pooled read-only one. */
 @property (nonatomic, readonly) CBL_FMDatabase* fmdb;
 @property (nonatomic, readonly) CBL_BlobStore* attachmentStore;
 @property (nonatomic, readonly) CBL_Shared* shared;
@@ -119,6 +146,9 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
 @property (nonatomic, readonly) int schemaVersion;
 @property (nonatomic, readonly) NSDate* startTime;
 
+/** Statistics of the in-memory docID map (entry count, memory used, hits, misses, evictions.) */
+@property (nonatomic, readonly) NSDictionary* docIDMapStats;
+
 /** The status of the last SQLite call, either kCBLStatusOK on success, or some error (generally
     kCBLStatusDBBusy or kCBLStatusDBError.)
     If you already know there's been an error, you should use lastDbError instead. */
@@ -137,11 +167,55 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
 
 /** Executes the block within a database transaction.
     If the block returns a non-OK status, the transaction is aborted/rolled back.
-    If the block returns kCBLStatusDBBusy, the block will also be retried after a short delay;
-    if 10 retries all fail, the kCBLStatusDBBusy will be returned to the caller.
+    SQLite calls wait (with backoff) for other connections' locks, for up to five seconds. If the
+    block returns kCBLStatusDBBusy because another connection changed the database after this
+    transaction started reading, the block will be retried; if 10 retries all fail, or the lock
+    wait timed out, the kCBLStatusDBBusy will be returned to the caller.
     Any exception raised by the block will be caught and treated as kCBLStatusException. */
 - (CBLStatus) _inTransaction: (CBLStatus(^)())block;
 
+/** Is a transaction open on the database's own connection? */
+@property (readonly) BOOL isInTransaction;
+
+/** Queues the block to be run inside a transaction on the database's thread, batched together
+    with other queued blocks so that they share a single commit. The batch is committed when it
+    reaches a maximum size, or after a short delay at the most.
+    Each block runs in its own nested transaction, so if it returns an error status only its own
+    changes (and change notifications) are rolled back. The onCompletion block is called on the
+    database's thread after the batch has been committed, with the block's status or with the
+    error that prevented the commit. Can be called on any thread. */
+- (void) _queueTransaction: (CBLStatus(^)())block
+              onCompletion: (void(^)(CBLStatus))onCompletion;
+
+/** Immediately runs and commits all blocks queued by -_queueTransaction:.
+    Must be called on the database's thread. */
+- (void) flushQueuedTransactions;
+
+/** Executes the block within a read-only transaction on a pooled connection, so that all its
+    queries see the same consistent snapshot of the database, and don't block (or get blocked by)
+    writers on other threads. Unlike most CBLDatabase methods, this may be called on any thread;
+    while the block runs, the read-only methods that go through .fmdb may be called on this thread.
+    If the current thread is already in a transaction, the block is just called directly. */
+- (CBLStatus) _inReadTransaction: (CBLStatus(^)())block;
+
+/** Begins a read-only transaction on a pooled connection and returns the connection, for a caller
+    that needs one consistent snapshot across several calls, possibly on different threads (such
+    as a streaming query.) Run code in the snapshot with -_inReadSnapshot:do:, and pass it to
+    -_endReadSnapshot: when done; until then the connection isn't available to other readers.
+    It never takes the pool's last free connection (see -[CBLReaderPool checkOutSpare]), so
+    snapshots left open can't block -_inReadTransaction:. May be called on any thread.
+    Returns nil if there's no connection to spare, or on error; the caller should then do its
+    reading in a -_inReadTransaction: instead. */
+- (CBL_FMDatabase*) _beginReadSnapshot;
+
+/** Calls the block within a snapshot from -_beginReadSnapshot; while it runs, the read-only
+    methods that go through .fmdb may be called on this thread. The snapshot must only be used by
+    one thread at a time. */
+- (CBLStatus) _inReadSnapshot: (CBL_FMDatabase*)reader do: (CBLStatus(^)())block;
+
+/** Ends a snapshot from -_beginReadSnapshot, returning its connection to the pool. */
+- (void) _endReadSnapshot: (CBL_FMDatabase*)reader;
+
 - (void) notifyChange: (CBLDatabaseChange*)change;
 
 // DOCUMENTS:
@@ -162,19 +236,44 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
                                 options: (CBLContentOptions)options
                                  status: (CBLStatus*)outStatus;
 
+/** Loads the bodies of many CBL_MutableRevisions, which must have their sequences set, using a
+    fixed number of queries per batch rather than several per revision. Revisions that aren't
+    found are left without bodies. */
+- (CBLStatus) loadRevisionBodies: (NSArray*)revs
+                         options: (CBLContentOptions)options;
+
 - (SInt64) getDocNumericID: (NSString*)docID;
+- (void) adjustDocumentCount: (NSInteger)delta;
+- (void) noteInsertedSequence: (SequenceNumber)sequence;
+- (BOOL) loadBodyKeys;
+- (BOOL) loadBodyKeysForBody: (NSData*)stored;
 - (SequenceNumber) getSequenceOfDocument: (SInt64)docNumericID
                                 revision: (NSString*)revID
                              onlyCurrent: (BOOL)onlyCurrent;
 - (CBL_RevisionList*) getAllRevisionsOfDocumentID: (NSString*)docID
                                       numericID: (SInt64)docNumericID
                                     onlyCurrent: (BOOL)onlyCurrent;
-- (NSMutableDictionary*) documentPropertiesFromJSON: (NSData*)json
-                                              docID: (NSString*)docID
-                                              revID: (NSString*)revID
-                                            deleted: (BOOL)deleted
-                                           sequence: (SequenceNumber)sequence
-                                            options: (CBLContentOptions)options;
+/** Returns a stored body's properties plus the special ones the options call for, as a mutable
+    dictionary with mutable containers. */
+- (NSDictionary*) documentPropertiesFromJSON: (NSData*)json
+                                       docID: (NSString*)docID
+                                       revID: (NSString*)revID
+                                     deleted: (BOOL)deleted
+                                    sequence: (SequenceNumber)sequence
+                                     options: (CBLContentOptions)options;
+/** Like the above, but the result is immutable, including nested collections, so it can safely
+    be read from several threads at once. A binary body's properties are decoded lazily as
+    they're accessed. Used for map functions and query rows. */
+- (NSDictionary*) readOnlyDocumentPropertiesFromJSON: (NSData*)json
+                                               docID: (NSString*)docID
+                                               revID: (NSString*)revID
+                                             deleted: (BOOL)deleted
+                                            sequence: (SequenceNumber)sequence
+                                             options: (CBLContentOptions)options;
+/** Batch version of the above: 'jsons' has an NSData or NSNull for each CBL_Revision in 'revs'. */
+- (NSArray*) readOnlyDocumentPropertiesFromJSONs: (NSArray*)jsons
+                                       revisions: (NSArray*)revs
+                                         options: (CBLContentOptions)options;
 - (NSString*) winningRevIDOfDocNumericID: (SInt64)docNumericID
                                isDeleted: (BOOL*)outIsDeleted
                               isConflict: (BOOL*)outIsConflict;
@@ -185,10 +284,18 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
     starting with the given revision. */
 - (NSArray*) getRevisionHistory: (CBL_Revision*)rev;
 
+/** Returns the histories of many revisions (as from -getRevisionHistory:), reading the revision
+    trees of all their documents together. */
+- (NSArray*) getRevisionHistories: (NSArray*)revs;
+
 /** Returns the revision history as a _revisions dictionary, as returned by the REST API's ?revs=true option. If 'ancestorRevIDs' is present, the revision history will only go back as far as any of the revision ID strings in that array. */
 - (NSDictionary*) getRevisionHistoryDict: (CBL_Revision*)rev
                        startingFromAnyOf: (NSArray*)ancestorRevIDs;
 
+/** Converts a revision history, as returned by -getRevisionHistory:, to a _revisions dictionary. */
++ (NSDictionary*) makeRevisionHistoryDict: (NSArray*)history
+                        startingFromAnyOf: (NSArray*)ancestorRevIDs;
+
 /** Returns all the known revisions (or all current/conflicting revisions) of a document. */
 - (CBL_RevisionList*) getAllRevisionsOfDocumentID: (NSString*)docID
                                     onlyCurrent: (BOOL)onlyCurrent;
@@ -209,9 +316,21 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
 
 - (CBLStatus) deleteViewNamed: (NSString*)name;
 
-/** Returns the value of an _all_docs query, as an array of CBLQueryRow. */
+/** Updates the indexes of views whose updatesIndexInBackground property is set. */
+@property (readonly) CBLViewIndexUpdater* indexUpdater;
+
+/** Returns the value of an _all_docs query, as an array of CBLQueryRow.
+    Runs in a read transaction (see -_inReadTransaction:), so it isn't blocked by another
+    instance's writes; but like other CBLDatabase methods it must be called on the database's
+    thread. */
 - (NSArray*) getAllDocs: (const struct CBLQueryOptions*)options;
 
+/** Like -getAllDocs:, but returns an enumerator that reads each CBLQueryRow from SQLite as it's
+    requested (see -[CBLView _streamRowsWithOptions:status:].) If the options have 'keys', the
+    rows are read into an array first, since they have to be returned in the keys' order. */
+- (NSEnumerator*) streamAllDocs: (const struct CBLQueryOptions*)options
+                         status: (CBLStatus*)outStatus;
+
 - (CBLView*) makeAnonymousView;
 
 /** Returns the view with the given name. If there is none, and the name is in CouchDB
@@ -233,6 +352,9 @@ extern const CBLChangesOptions kDefaultCBLChangesOptions;
 
 //@property (readonly) NSArray* allViews;
 
+/** Returns the revisions added since a sequence. Runs in a read transaction (see
+    -_inReadTransaction:), so it isn't blocked by another instance's writes. Must be called on the
+    database's thread. */
 - (CBL_RevisionList*) changesSinceSequence: (SequenceNumber)lastSequence
                                  options: (const CBLChangesOptions*)options
                                   filter: (CBLFilterBlock)filter
@@ -29,6 +29,13 @@
 
 #import "FMDatabase.h"
 #import "FMDatabaseAdditions.h"
+#import "CBLReaderPool.h"
+#import "CBLDocIDMap.h"
+#import "CBLBodyCodec.h"
+#import "CBLBinaryBody.h"
+#import "CBLViewIndexUpdater.h"
+#import "CBLQueryRowStream.h"
+#import <libkern/OSAtomic.h>
 #import "MYBlockUtils.h"
 #import "ExceptionUtils.h"
 
@@ -37,12 +44,69 @@ NSString* const CBL_DatabaseChangesNotification = @"CBLDatabaseChanges";
 NSString* const CBL_DatabaseWillCloseNotification = @"CBL_DatabaseWillClose";
 NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDeleted";
 
-#define kDocIDCacheSize 1000
+#if TARGET_OS_IPHONE
+#define kDocIDMapMemoryLimit (2*1024*1024)
+#else
+#define kDocIDMapMemoryLimit (16*1024*1024)
+#endif
 
 #define kSQLiteBusyTimeout 5.0 // seconds
+#define kSQLiteBusyMinDelay 0.001
+#define kSQLiteBusyMaxDelay 0.050
 
 #define kTransactionMaxRetries 10
-#define kTransactionRetryDelay 0.050
+
+#define kGroupCommitDelay 0.010
+#define kGroupCommitMaxBatch 100
+
+#define kMaxDocsPerQuery 500    // Max number of revisions whose bodies are expanded in one batch
+
+#ifndef SQLITE_BUSY_SNAPSHOT    // (not defined by SQLite versions before 3.8.0)
+#define SQLITE_BUSY_SNAPSHOT (SQLITE_BUSY | (2<<8))
+#endif
+
+
+// In-memory state saved at the start of each savepoint, to be restored if it's rolled back.
+typedef struct {
+    NSUInteger changesToNotify;     // _changesToNotify.count
+    NSUInteger insertedDocIDs;      // _insertedDocIDs.count
+    NSUInteger documentCount;
+    SequenceNumber lastSequence;
+    NSUInteger bodyKeyCount;        // _bodyCodec.keyTable.count
+} CBLSavepoint;
+
+
+// A row of the 'revs' table, as read by -getRevisionTreesOfDocumentIDs:onlyCurrent:
+@interface CBLRevisionTreeNode : NSObject
+@property CBL_Revision* rev;
+@property SequenceNumber parent;
+@property BOOL current;
+@end
+
+@implementation CBLRevisionTreeNode
+@synthesize rev=_rev, parent=_parent, current=_current;
+@end
+
+
+static NSArray* historyFromRevisionTree(NSArray* tree, NSString* revID);
+static NSDictionary* makeRevisionHistoryDict(NSArray* history, NSArray* ancestorRevIDs);
+
+
+static NSTimeInterval busyDelay(int count) {
+    return MIN(kSQLiteBusyMinDelay * (1 << MIN(count, 16)), kSQLiteBusyMaxDelay);
+}
+
+/** SQLite busy handler: Waits for another connection to release its lock, sleeping with
+    exponential backoff, and gives up after a total of kSQLiteBusyTimeout. */
+static int busyHandler(void* context, int count) {
+    NSTimeInterval waited = 0;
+    for (int i = 0; i < count; ++i)
+        waited += busyDelay(i);
+    if (waited >= kSQLiteBusyTimeout)
+        return 0;
+    usleep((useconds_t)(busyDelay(count) * 1.0e6));
+    return 1;
+}
 
 
 @implementation CBLDatabase (Internal)
@@ -60,6 +124,12 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 
 
 - (CBL_FMDatabase*) fmdb {
+    if (_activeReaders > 0) {
+        // If this thread is inside -_inReadTransaction:, use its pooled read-only connection:
+        CBL_FMDatabase* reader = [NSThread currentThread].threadDictionary[_readerKey];
+        if (reader)
+            return reader;
+    }
     return _fmdb;
 }
 
@@ -122,15 +192,17 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
         _name = name ?: [path.lastPathComponent.stringByDeletingPathExtension copy];
         _readOnly = readOnly;
         _fmdb = [[CBL_FMDatabase alloc] initWithPath: _path];
-        _fmdb.busyRetryTimeout = kSQLiteBusyTimeout;
 #if DEBUG
         _fmdb.logsErrors = YES;
 #else
         _fmdb.logsErrors = WillLogTo(CBLDatabase);
 #endif
         _fmdb.traceExecution = WillLogTo(CBLDatabaseVerbose);
-        _docIDs = [[NSCache alloc] init];
-        _docIDs.countLimit = kDocIDCacheSize;
+        _readerKey = $sprintf(@"CBLDatabase.reader<%p>", self);
+        _docIDMap = [[CBLDocIDMap alloc] initWithMemoryLimit: kDocIDMapMemoryLimit];
+        _insertedDocIDs = [[NSMutableArray alloc] init];
+        _savepoints = [[NSMutableData alloc] init];
+        _queuedTransactions = [[NSMutableArray alloc] init];
         _dispatchQueue = manager.dispatchQueue;
         if (!_dispatchQueue)
             _thread = [NSThread currentThread];
@@ -182,6 +254,38 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 }
 
 
+/** Registers the collations and SQL functions that the schema and queries depend on, and gives
+    SQLCipher the encryption key. Every connection to the database file needs this. */
+- (BOOL) setUpConnection: (CBL_FMDatabase*)fmdb {
+    // Register CouchDB-compatible JSON collation functions:
+    sqlite3_create_collation(fmdb.sqliteHandle, "JSON", SQLITE_UTF8,
+                             kCBLCollateJSON_Unicode, CBLCollateJSON);
+    sqlite3_create_collation(fmdb.sqliteHandle, "JSON_RAW", SQLITE_UTF8,
+                             kCBLCollateJSON_Raw, CBLCollateJSON);
+    sqlite3_create_collation(fmdb.sqliteHandle, "JSON_ASCII", SQLITE_UTF8,
+                             kCBLCollateJSON_ASCII, CBLCollateJSON);
+    sqlite3_create_collation(fmdb.sqliteHandle, "REVID", SQLITE_UTF8,
+                             NULL, CBLCollateRevIDs);
+
+    // Wait for locks held by other connections (this replaces any busy timeout):
+    sqlite3_busy_handler(fmdb.sqliteHandle, busyHandler, NULL);
+
+    [CBLView registerFunctions: fmdb];
+    
+    // Give SQLCipher the encryption key, if provided:
+    if (_encryptionKey) {
+        // http://sqlcipher.net/sqlcipher-api/#key
+        NSString* pragma = $sprintf(@"PRAGMA key = '%@'", [_encryptionKey stringByReplacingOccurrencesOfString: @"'" withString: @"''"]);
+        
+        if (![fmdb executeUpdate: pragma]) {
+            Warn(@"CBLDatabase: Couldn't give encryption key; SQLite may not be built with SQLCipher");
+            return NO;
+        }
+    }
+    return YES;
+}
+
+
 - (BOOL) openFMDB: (NSError**)outError {
     // Without the -ObjC linker flag, object files containing only category methods, not any
     // class's main implementation, will be dead-stripped. This breaks several pieces of CBL.
@@ -200,28 +304,8 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
         return NO;
     }
 
-    // Register CouchDB-compatible JSON collation functions:
-    sqlite3_create_collation(_fmdb.sqliteHandle, "JSON", SQLITE_UTF8,
-                             kCBLCollateJSON_Unicode, CBLCollateJSON);
-    sqlite3_create_collation(_fmdb.sqliteHandle, "JSON_RAW", SQLITE_UTF8,
-                             kCBLCollateJSON_Raw, CBLCollateJSON);
-    sqlite3_create_collation(_fmdb.sqliteHandle, "JSON_ASCII", SQLITE_UTF8,
-                             kCBLCollateJSON_ASCII, CBLCollateJSON);
-    sqlite3_create_collation(_fmdb.sqliteHandle, "REVID", SQLITE_UTF8,
-                             NULL, CBLCollateRevIDs);
-
-    [CBLView registerFunctions: self];
-    
-    // Give SQLCipher the encryption key, if provided:
-    if (_encryptionKey) {
-        // http://sqlcipher.net/sqlcipher-api/#key
-        NSString* pragma = $sprintf(@"PRAGMA key = '%@'", [_encryptionKey stringByReplacingOccurrencesOfString: @"'" withString: @"''"]);
-        
-        if (![_fmdb executeUpdate: pragma]) {
-            Warn(@"CBLDatabase: Couldn't give encryption key; SQLite may not be built with SQLCipher");
-            return NO;
-        }
-    }
+    if (![self setUpConnection: _fmdb])
+        return NO;
 
     // Verify that encryption key is correct (or db is unencrypted, if no key given):
     if ([_fmdb intForQuery: @"SELECT count(*) FROM sqlite_master"] == 0 && _fmdb.lastErrorCode != 0) {
@@ -264,7 +348,9 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     }
 
     BOOL isNew = (dbVersion == 0);
-    if (isNew && ![self initialize: @"BEGIN TRANSACTION" error: outError])
+    // Incremental vacuuming has to be enabled before any tables are created (or else by a VACUUM):
+    if (isNew && ![self initialize: @"PRAGMA auto_vacuum = INCREMENTAL; BEGIN TRANSACTION"
+                             error: outError])
         return NO;
 
     if (dbVersion < 1) {
@@ -426,6 +512,171 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
         dbVersion = 11;
     }
 
+    if (dbVersion < 12) {
+        // Version 12: Cache each doc's winning revision in its 'docs' row, so reading the current
+        // revision doesn't have to sort the doc's current revs by revID.
+        NSString* sql = @"ALTER TABLE docs ADD COLUMN winning_revid TEXT; \
+                          ALTER TABLE docs ADD COLUMN winning_seq INTEGER; \
+                          ALTER TABLE docs ADD COLUMN winning_deleted BOOLEAN; \
+                          ALTER TABLE docs ADD COLUMN in_conflict BOOLEAN DEFAULT 0; \
+                          UPDATE docs SET winning_seq = (SELECT sequence FROM revs \
+                                WHERE revs.doc_id=docs.doc_id AND current=1 \
+                                ORDER BY deleted ASC, revid DESC LIMIT 1); \
+                          UPDATE docs SET \
+                                winning_revid = (SELECT revid FROM revs \
+                                                 WHERE sequence=docs.winning_seq), \
+                                winning_deleted = (SELECT deleted FROM revs \
+                                                   WHERE sequence=docs.winning_seq), \
+                                in_conflict = ((SELECT count(*) FROM revs \
+                                                WHERE revs.doc_id=docs.doc_id \
+                                                AND current=1 AND deleted=0) > 1); \
+                          PRAGMA user_version = 12";
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 12;
+    }
+
+    if (dbVersion < 13) {
+        // Version 13: Store the document count, so it doesn't have to be computed by a scan.
+        NSString* sql = @"INSERT INTO info (key, value) \
+                              SELECT 'doc_count', COUNT(*) FROM docs WHERE winning_deleted=0; \
+                          PRAGMA user_version = 13";
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 13;
+    }
+
+    if (dbVersion < 14) {
+        // Version 14: Optional compression of revision bodies, and the dictionaries it uses.
+        NSString* sql = @"CREATE TABLE bodydicts ( \
+                              dict_id INTEGER PRIMARY KEY, \
+                              data BLOB NOT NULL); \
+                          INSERT INTO info (key, value) VALUES ('body_codec', 'none'); \
+                          PRAGMA user_version = 14";
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 14;
+    }
+
+    if (dbVersion < 15) {
+        // Version 15: Optional binary format of revision bodies, and the property names it uses.
+        NSString* sql = @"CREATE TABLE bodykeys ( \
+                              key_id INTEGER PRIMARY KEY, \
+                              name TEXT NOT NULL); \
+                          INSERT INTO info (key, value) VALUES ('body_format', 'json'); \
+                          PRAGMA user_version = 15";
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 15;
+    }
+
+    if (dbVersion < 16) {
+        // Version 16: Optional binary view keys, which sort with BINARY collation (see
+        // CBLCollatableKey) instead of calling CBLCollateJSON for every comparison.
+        NSString* sql = @"ALTER TABLE views ADD COLUMN binary_keys BOOLEAN DEFAULT 0; \
+                          ALTER TABLE maps ADD COLUMN ckey BLOB; \
+                          CREATE INDEX maps_ckeys ON maps(view_id, ckey); \
+                          PRAGMA user_version = 16";
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 16;
+    }
+
+    if (dbVersion < 17) {
+        // Version 17: Each view's index gets its own table, "maps_" + view_id. Each view's rows
+        // are copied from the shared 'maps' table into a table with the default (JSON) collation,
+        // recomputing their binary keys as it goes; -[CBLView _indexTableMatchesCollation] makes
+        // a view with another collation rebuild its index the next time it's updated.
+        NSMutableString* sql = [NSMutableString stringWithString:
+                                    @"DELETE FROM maps WHERE view_id NOT IN \
+                                            (SELECT view_id FROM views); "];
+        CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT view_id, binary_keys FROM views"];
+        while ([r next]) {
+            int viewID = [r intForColumnIndex: 0];
+            NSString* table = $sprintf(@"maps_%d", viewID);
+            [sql appendFormat: @"CREATE TABLE %@ ( \
+                                    sequence INTEGER NOT NULL REFERENCES revs(sequence) \
+                                                              ON DELETE CASCADE, \
+                                    key TEXT NOT NULL COLLATE JSON, \
+                                    value TEXT, \
+                                    fulltext_id INTEGER, \
+                                    bbox_id INTEGER, \
+                                    geokey BLOB, \
+                                    ckey BLOB); \
+                                 INSERT INTO %@ (sequence, key, value, fulltext_id, bbox_id, \
+                                                 geokey, ckey) \
+                                       SELECT sequence, key, value, fulltext_id, bbox_id, \
+                                              geokey, %@ \
+                                       FROM maps WHERE view_id=%d; \
+                                 CREATE INDEX %@_keys ON %@(key); \
+                                 CREATE INDEX %@_sequence ON %@(sequence); \
+                                 CREATE INDEX %@_fulltext ON %@(fulltext_id); \
+                                 CREATE TRIGGER del_%@_fulltext DELETE ON %@ \
+                                       WHEN old.fulltext_id not null \
+                                       BEGIN DELETE FROM fulltext WHERE rowid=old.fulltext_id| END; \
+                                 CREATE TRIGGER del_%@_bbox DELETE ON %@ \
+                                       WHEN old.bbox_id not null \
+                                       BEGIN DELETE FROM bboxes WHERE rowid=old.bbox_id| END; ",
+                              table, table,
+                              ([r boolForColumnIndex: 1] ? @"collatablekey(key)" : @"NULL"),
+                              viewID, table, table, table, table, table, table,
+                              table, table, table, table];
+            if ([r boolForColumnIndex: 1])
+                [sql appendFormat: @"CREATE INDEX %@_ckeys ON %@(ckey); ", table, table];
+        }
+        [r close];
+        // (Dropping 'maps' doesn't fire its delete triggers, so the copied rows' full-text and
+        // geo entries stay.)
+        [sql appendString: @"DROP TABLE maps; \
+                             PRAGMA user_version = 17"];
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 17;
+    }
+
+    if (dbVersion < 18) {
+        // Version 18: Index rows store their document's ID, and each index table's key index
+        // covers the columns queries return, so queries without include_docs don't have to join
+        // the 'revs' and 'docs' tables.
+        NSMutableString* sql = [NSMutableString string];
+        CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT views.view_id, binary_keys "
+                                                   "FROM views, sqlite_master "
+                                                   "WHERE sqlite_master.type='table' AND "
+                                                   "sqlite_master.name='maps_' || views.view_id"];
+        while ([r next]) {
+            NSString* table = $sprintf(@"maps_%d", [r intForColumnIndex: 0]);
+            [sql appendFormat: @"ALTER TABLE %@ ADD COLUMN docid TEXT NOT NULL DEFAULT ''; \
+                                 UPDATE %@ SET docid=(SELECT docid FROM revs, docs \
+                                       WHERE revs.sequence=%@.sequence \
+                                       AND docs.doc_id=revs.doc_id); \
+                                 DROP INDEX IF EXISTS %@_keys; \
+                                 CREATE INDEX %@_covering ON %@(key, docid, sequence, value); ",
+                              table, table, table, table, table, table];
+            if ([r boolForColumnIndex: 1])
+                [sql appendFormat: @"DROP INDEX IF EXISTS %@_ckeys; \
+                                     CREATE INDEX %@_ckeys_covering \
+                                            ON %@(ckey, key, docid, sequence, value); ",
+                                  table, table, table];
+        }
+        [r close];
+        [sql appendString: @"PRAGMA user_version = 18"];
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 18;
+    }
+
+    if (dbVersion < 19) {
+        // Version 19: Whether a view stores its reductions is persistent, rather than a setting
+        // of each CBLView object. Views that have a table of reductions already store them.
+        NSString* sql = @"ALTER TABLE views ADD COLUMN stored_reductions BOOLEAN DEFAULT 0; \
+                          UPDATE views SET stored_reductions=1 WHERE 'reduce_' || view_id IN \
+                                (SELECT name FROM sqlite_master WHERE type='table'); \
+                          PRAGMA user_version = 19";
+        if (![self initialize: sql error: outError])
+            return NO;
+        dbVersion = 19;
+    }
+
     if (isNew && ![self initialize: @"END TRANSACTION" error: outError])
         return NO;
 
@@ -447,6 +698,25 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 
     _fmdb.shouldCacheStatements = YES;      // Saves the time to recompile SQL statements
 
+    if (![self loadBodyCodec] || ![self loadCounts]) {
+        if (outError)
+            *outError = self.fmdbError;
+        [_fmdb close];
+        return NO;
+    }
+    [self preloadDocIDMap];
+
+    // Create the pool of read-only connections used by -_inReadTransaction:
+    __weak CBLDatabase* weakSelf = self;
+    NSUInteger maxReaders = MAX([NSProcessInfo processInfo].activeProcessorCount, 2u);
+    _readerPool = [[CBLReaderPool alloc] initWithPath: _path
+                                           maxReaders: maxReaders
+                                                setup: ^BOOL(CBL_FMDatabase* reader) {
+        reader.logsErrors = WillLogTo(CBLDatabase);
+        reader.traceExecution = WillLogTo(CBLDatabaseVerbose);
+        return [weakSelf setUpConnection: reader];
+    }];
+
     // Listen for _any_ CBLDatabase changing, so I can detect changes made to my database
     // file by other instances (running on other threads presumably.)
     [[NSNotificationCenter defaultCenter] addObserver: self
@@ -465,6 +735,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
         return NO;
     
     LogTo(CBLDatabase, @"Closing <%p> %@", self, _path);
+    [self flushQueuedTransactions];
     Assert(_transactionLevel == 0, @"Can't close database while %u transactions active",
             _transactionLevel);
     [[NSNotificationCenter defaultCenter] postNotificationName: CBL_DatabaseWillCloseNotification
@@ -475,6 +746,8 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     [[NSNotificationCenter defaultCenter] removeObserver: self
                                                     name: CBL_DatabaseWillBeDeletedNotification
                                                   object: nil];
+    [_indexUpdater stop];
+    _indexUpdater = nil;
     for (CBLView* view in _views.allValues)
         [view databaseClosing];
     
@@ -483,6 +756,10 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
         [repl databaseClosing];
     
     _activeReplicators = nil;
+
+    [_readerPool close];
+    _readerPool = nil;
+    [_docIDMap removeAllDocIDs];
     
     if (![_fmdb close])
         return NO;
@@ -493,7 +770,8 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 
 
 - (CBLStatus) lastDbStatus {
-    switch (_fmdb.lastErrorCode) {
+    CBL_FMDatabase* fmdb = self.fmdb;
+    switch (fmdb.lastErrorCode) {
         case SQLITE_OK:
         case SQLITE_ROW:
         case SQLITE_DONE:
@@ -504,7 +782,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
         case SQLITE_CORRUPT:
             return kCBLStatusCorruptError;
         default:
-            LogTo(CBLDatabase, @"Other _fmdb.lastErrorCode %d", _fmdb.lastErrorCode);
+            LogTo(CBLDatabase, @"Other _fmdb.lastErrorCode %d", fmdb.lastErrorCode);
             return kCBLStatusDBError;
     }
 }
@@ -547,11 +825,18 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 
 
 - (BOOL) beginTransaction {
+    // If another instance has changed the database, reload the counters before they're changed:
+    if (_transactionLevel == 0 && _countersStale)
+        [self loadCounts];
     if (![_fmdb executeUpdate: $sprintf(@"SAVEPOINT tdb%d", _transactionLevel + 1)]) {
         Warn(@"Failed to create savepoint transaction!");
         return NO;
     }
-    ++_transactionLevel;
+    if (++_transactionLevel == 1)
+        _transactionThread = [NSThread currentThread];
+    CBLSavepoint savepoint = {_changesToNotify.count, _insertedDocIDs.count,
+                              _documentCount, _lastSequence, _bodyCodec.keyTable.count};
+    [_savepoints appendBytes: &savepoint length: sizeof(savepoint)];
     LogTo(CBLDatabase, @"Begin transaction (level %d)...", _transactionLevel);
     return YES;
 }
@@ -559,21 +844,52 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 - (BOOL) endTransaction: (BOOL)commit {
     Assert(_transactionLevel > 0);
     BOOL ok = YES;
+    CBLSavepoint savepoint;
+    NSRange savepointRange = NSMakeRange(_savepoints.length - sizeof(savepoint), sizeof(savepoint));
+    [_savepoints getBytes: &savepoint range: savepointRange];
+    [_savepoints replaceBytesInRange: savepointRange withBytes: NULL length: 0];
     if (commit) {
         LogTo(CBLDatabase, @"Commit transaction (level %d)", _transactionLevel);
+        if (_transactionLevel == 1 && _documentCount != savepoint.documentCount) {
+            // Save the change as a delta, in case another instance committed changes to the count
+            // after it was loaded:
+            NSInteger delta = (NSInteger)_documentCount - (NSInteger)savepoint.documentCount;
+            if (![_fmdb executeUpdate: @"UPDATE info SET value=value+? WHERE key='doc_count'",
+                                        @(delta)])
+                ok = NO;
+        }
     } else {
         LogTo(CBLDatabase, @"CANCEL transaction (level %d)", _transactionLevel);
         if (![_fmdb executeUpdate: $sprintf(@"ROLLBACK TO tdb%d", _transactionLevel)]) {
             Warn(@"Failed to rollback transaction!");
             ok = NO;
         }
-        [_changesToNotify removeAllObjects];
+        // Forget only the changes made within this savepoint, not any made before it:
+        NSUInteger notifyMark = savepoint.changesToNotify;
+        if (_changesToNotify.count > notifyMark)
+            [_changesToNotify removeObjectsInRange: NSMakeRange(notifyMark,
+                                                        _changesToNotify.count - notifyMark)];
+        // ...and forget the docIDs it added to the 'docs' table, since those rows are gone:
+        NSRange rolledBack = NSMakeRange(savepoint.insertedDocIDs,
+                                         _insertedDocIDs.count - savepoint.insertedDocIDs);
+        for (NSString* docID in [_insertedDocIDs subarrayWithRange: rolledBack])
+            [_docIDMap removeDocID: docID];
+        [_insertedDocIDs removeObjectsInRange: rolledBack];
+        _documentCount = savepoint.documentCount;
+        _lastSequence = savepoint.lastSequence;
+        // ...and the body property names it added, whose 'bodykeys' rows are gone too:
+        // (Any loaded from another instance's commits are reloaded when a body uses them.)
+        if (_bodyCodec.keyTable.count > savepoint.bodyKeyCount)
+            [_bodyCodec.keyTable truncateToCount: savepoint.bodyKeyCount];
     }
     if (![_fmdb executeUpdate: $sprintf(@"RELEASE tdb%d", _transactionLevel)]) {
         Warn(@"Failed to release transaction!");
         ok = NO;
     }
-    --_transactionLevel;
+    if (--_transactionLevel == 0) {
+        _transactionThread = nil;
+        [_insertedDocIDs removeAllObjects];
+    }
     [self postChangeNotifications];
     return ok;
 }
@@ -584,30 +900,167 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     do {
         if (![self beginTransaction])
             return self.lastDbError;
+        BOOL staleSnapshot = NO;
         @try {
             status = block();
         } @catch (NSException* x) {
             MYReportException(x, @"CBLDatabase transaction");
             status = kCBLStatusException;
         } @finally {
+            if (status == kCBLStatusDBBusy)
+                staleSnapshot = (sqlite3_extended_errcode(_fmdb.sqliteHandle)
+                                    == SQLITE_BUSY_SNAPSHOT);
             [self endTransaction: !CBLStatusIsError(status)];
         }
         if (status == kCBLStatusDBBusy) {
-            // retry if locked out:
-            if (_transactionLevel > 1)
+            // The busy handler already waited for the lock, so a plain SQLITE_BUSY means we've
+            // timed out. But SQLITE_BUSY_SNAPSHOT means another connection wrote to the database
+            // after this transaction started reading, so it can succeed if retried immediately
+            // (from the outermost transaction, which is the one that has the stale snapshot.)
+            if (_transactionLevel > 0 || !staleSnapshot)
                 break;
             if (++retries > kTransactionMaxRetries) {
                 Warn(@"%@: Db busy, too many retries, giving up", self);
                 break;
             }
-            LogMY(@"%@: Db busy, retrying transaction (#%d)...", self, retries);
-            [NSThread sleepForTimeInterval: kTransactionRetryDelay];
+            LogMY(@"%@: Db snapshot is stale, retrying transaction (#%d)...", self, retries);
         }
     } while (status == kCBLStatusDBBusy);
     return status;
 }
 
 
+- (BOOL) isInTransaction {
+    return _transactionLevel > 0;
+}
+
+
+- (void) _queueTransaction: (CBLStatus(^)())block
+              onCompletion: (void(^)(CBLStatus))onCompletion
+{
+    NSArray* item = @[[block copy], (onCompletion ? [onCompletion copy] : $null)];
+    BOOL flushNow = NO, scheduleFlush = NO;
+    @synchronized(_queuedTransactions) {
+        [_queuedTransactions addObject: item];
+        if (_queuedTransactions.count >= kGroupCommitMaxBatch)
+            flushNow = YES;
+        else if (!_flushScheduled)
+            scheduleFlush = _flushScheduled = YES;
+    }
+    if (flushNow) {
+        [self doAsync: ^{
+            [self flushQueuedTransactions];
+        }];
+    } else if (scheduleFlush) {
+        // (Hop to the database's thread first, since -doAsyncAfterDelay: schedules the block on
+        // the current thread.)
+        [self doAsync: ^{
+            [self doAsyncAfterDelay: kGroupCommitDelay block: ^{
+                [self flushQueuedTransactions];
+            }];
+        }];
+    }
+}
+
+
+- (void) flushQueuedTransactions {
+    NSArray* batch;
+    @synchronized(_queuedTransactions) {
+        batch = [_queuedTransactions copy];
+        [_queuedTransactions removeAllObjects];
+        _flushScheduled = NO;
+    }
+    if (batch.count == 0)
+        return;
+    LogTo(CBLDatabase, @"%@: Group-committing %u queued transactions",
+          self, (unsigned)batch.count);
+
+    // Run all the queued blocks inside one transaction, each in its own nested one:
+    CBLStatus* statuses = calloc(batch.count, sizeof(CBLStatus));
+    CBLStatus status = [self _inTransaction: ^CBLStatus {
+        NSUInteger i = 0;
+        for (NSArray* item in batch) {
+            CBLStatus (^block)() = item[0];
+            statuses[i] = [self _inTransaction: block];
+            if (statuses[i++] == kCBLStatusDBBusy)
+                return kCBLStatusDBBusy;    // Abort the whole batch so it can be retried
+        }
+        return kCBLStatusOK;
+    }];
+
+    NSUInteger i = 0;
+    for (NSArray* item in batch) {
+        CBLStatus itemStatus = CBLStatusIsError(status) ? status : statuses[i];
+        ++i;
+        if (item[1] != $null) {
+            void (^onCompletion)(CBLStatus) = item[1];
+            @try {
+                onCompletion(itemStatus);
+            } @catch (NSException* x) {
+                MYReportException(x, @"CBLDatabase queued transaction completion");
+            }
+        }
+    }
+    free(statuses);
+}
+
+
+- (CBLStatus) _inReadTransaction: (CBLStatus(^)())block {
+    NSThread* thread = [NSThread currentThread];
+    NSMutableDictionary* threadDict = thread.threadDictionary;
+    if (_transactionThread == thread || (_activeReaders > 0 && threadDict[_readerKey]))
+        return block();     // Already in a transaction on this thread, so just use that
+
+    CBL_FMDatabase* reader = [self _beginReadSnapshot];
+    if (!reader)
+        return kCBLStatusDBError;
+    CBLStatus status = [self _inReadSnapshot: reader do: block];
+    [self _endReadSnapshot: reader];
+    return status;
+}
+
+
+- (CBL_FMDatabase*) _beginReadSnapshot {
+    CBL_FMDatabase* reader = [_readerPool checkOutSpare];
+    if (!reader)
+        return nil;
+    if (![reader executeUpdate: @"BEGIN DEFERRED TRANSACTION"]) {
+        Warn(@"%@: Failed to begin read transaction", self);
+        [_readerPool checkIn: reader];
+        return nil;
+    }
+    return reader;
+}
+
+
+- (CBLStatus) _inReadSnapshot: (CBL_FMDatabase*)reader do: (CBLStatus(^)())block {
+    NSMutableDictionary* threadDict = [NSThread currentThread].threadDictionary;
+    CBL_FMDatabase* outerReader = threadDict[_readerKey];   // this thread may be in another one
+    threadDict[_readerKey] = reader;
+    OSAtomicIncrement32Barrier(&_activeReaders);
+    CBLStatus status;
+    @try {
+        status = block();
+    } @catch (NSException* x) {
+        MYReportException(x, @"CBLDatabase read transaction");
+        status = kCBLStatusException;
+    } @finally {
+        OSAtomicDecrement32Barrier(&_activeReaders);
+        if (outerReader)
+            threadDict[_readerKey] = outerReader;
+        else
+            [threadDict removeObjectForKey: _readerKey];
+    }
+    return status;
+}
+
+
+- (void) _endReadSnapshot: (CBL_FMDatabase*)reader {
+    [reader executeUpdate: @"COMMIT"];   // Nothing to commit, but ends the snapshot
+    [_readerPool checkIn: reader];
+}
+
+
 /** Posts a local NSNotification of a new revision of a document. */
 - (void) notifyChange: (CBLDatabaseChange*)change {
     LogTo(CBLDatabase, @"Added: %@ (seq=%lld)", change.addedRevision, change.addedRevision.sequence);
@@ -667,6 +1120,8 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     if (senderDB != self && [senderDB.path isEqualToString: _path]) {
         // Careful: I am being called on senderDB's thread, not my own!
         if ([[n name] isEqualToString: CBL_DatabaseChangesNotification]) {
+            // My cached document count & last sequence are out of date:
+            OSAtomicCompareAndSwap32Barrier(0, 1, &_countersStale);
             NSMutableArray* echoedChanges = $marray();
             for (CBLDatabaseChange* change in (n.userInfo)[@"changes"]) {
                 if (!change.echoed)
@@ -692,21 +1147,70 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 #pragma mark - GETTING DOCUMENTS:
 
 
+/** Reads the document count (as of the last commit) and last sequence from the database. */
+- (BOOL) readCounts: (CBL_FMDatabase*)fmdb
+      documentCount: (NSUInteger*)outDocumentCount
+       lastSequence: (SequenceNumber*)outLastSequence
+{
+    NSString* docCount = [fmdb stringForQuery: @"SELECT value FROM info WHERE key='doc_count'"];
+    if (!docCount)
+        return NO;
+    *outDocumentCount = (NSUInteger)docCount.longLongValue;
+    // See http://www.sqlite.org/fileformat2.html#seqtab
+    *outLastSequence = [fmdb longLongForQuery: @"SELECT seq FROM sqlite_sequence WHERE name='revs'"];
+    return YES;
+}
+
+/** Loads _documentCount and _lastSequence from the database. */
+- (BOOL) loadCounts {
+    // (Cleared before reading, so a change notified meanwhile will cause another reload.)
+    OSAtomicCompareAndSwap32Barrier(1, 0, &_countersStale);
+    if (![self readCounts: _fmdb documentCount: &_documentCount lastSequence: &_lastSequence]) {
+        OSAtomicCompareAndSwap32Barrier(0, 1, &_countersStale);
+        return NO;
+    }
+    return YES;
+}
+
+
 - (NSUInteger) documentCount {
-    NSUInteger result = NSNotFound;
-    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT COUNT(DISTINCT doc_id) FROM revs "
-                                           "WHERE current=1 AND deleted=0"];
-    if ([r next]) {
-        result = [r intForColumnIndex: 0];
+    CBL_FMDatabase* fmdb = self.fmdb;
+    if (fmdb != _fmdb) {
+        // In a read transaction on another connection; answer from its snapshot:
+        NSUInteger docCount;
+        SequenceNumber lastSeq;
+        return [self readCounts: fmdb documentCount: &docCount lastSequence: &lastSeq]
+                    ? docCount : NSNotFound;
     }
-    [r close];
-    return result;    
+    if (_countersStale && _transactionLevel == 0 && ![self loadCounts])
+        return NSNotFound;
+    return _documentCount;
 }
 
 
 - (SequenceNumber) lastSequenceNumber {
-    // See http://www.sqlite.org/fileformat2.html#seqtab
-    return [_fmdb longLongForQuery: @"SELECT seq FROM sqlite_sequence WHERE name='revs'"];
+    CBL_FMDatabase* fmdb = self.fmdb;
+    if (fmdb != _fmdb)
+        return [fmdb longLongForQuery: @"SELECT seq FROM sqlite_sequence WHERE name='revs'"];
+    if (_countersStale && _transactionLevel == 0 && ![self loadCounts])
+        return 0;
+    return _lastSequence;
+}
+
+
+/** Adjusts the in-memory document count. Called when a document's winning revision changes
+    between deleted and not-deleted; the new count is saved to the 'info' table on commit. */
+- (void) adjustDocumentCount: (NSInteger)delta {
+    Assert(_transactionLevel > 0);
+    Assert(delta >= 0 || _documentCount >= (NSUInteger)-delta);
+    _documentCount += delta;
+}
+
+
+/** Records the sequence number of a newly inserted revision. */
+- (void) noteInsertedSequence: (SequenceNumber)sequence {
+    if (sequence > _lastSequence)
+        _lastSequence = sequence;
 }
 
 
@@ -716,44 +1220,77 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
                             options: (CBLContentOptions)options
                                into: (NSMutableDictionary*)dst
 {
-    dst[@"_id"] = rev.docID;
-    dst[@"_rev"] = rev.revID;
-    if (rev.deleted)
-        dst[@"_deleted"] = $true;
+    [self extraPropertiesForRevisions: @[rev] options: options into: @[dst]];
+}
 
-    // Get attachment metadata, and optionally the contents:
-    if (!(options & kCBLNoAttachments)) {
-        NSDictionary* attachments = [self getAttachmentDictForSequence: rev.sequence
-                                                               options: options];
-        if (attachments)
-            dst[@"_attachments"] = attachments;
+
+/** Like -extraPropertiesForRevision:options:into:, for many revisions at once. The attachments,
+    revision trees and conflicts of the whole batch are each read with a few batched queries,
+    instead of one query apiece per revision. */
+- (void) extraPropertiesForRevisions: (NSArray*)revs
+                             options: (CBLContentOptions)options
+                                into: (NSArray*)dsts
+{
+    NSUInteger count = revs.count;
+    for (NSUInteger i = 0; i < count; ++i) {
+        CBL_Revision* rev = revs[i];
+        NSMutableDictionary* dst = dsts[i];
+        dst[@"_id"] = rev.docID;
+        dst[@"_rev"] = rev.revID;
+        if (rev.deleted)
+            dst[@"_deleted"] = $true;
+        if (options & kCBLIncludeLocalSeq)
+            dst[@"_local_seq"] = @(rev.sequence);
     }
-    
-    // Get more optional stuff to put in the properties:
-    //OPT: This probably ends up making redundant SQL queries if multiple options are enabled.
-    if (options & kCBLIncludeLocalSeq)
-        dst[@"_local_seq"] = @(rev.sequence);
 
-    if (options & kCBLIncludeRevs)
-        dst[@"_revisions"] = [self getRevisionHistoryDict: rev startingFromAnyOf: nil];
-    
-    if (options & kCBLIncludeRevsInfo) {
-        dst[@"_revs_info"] = [[self getRevisionHistory: rev] my_map: ^id(CBL_Revision* rev) {
-            NSString* status = @"available";
-            if (rev.deleted)
-                status = @"deleted";
-            else if (rev.missing)
-                status = @"missing";
-            return $dict({@"rev", [rev revID]}, {@"status", status});
+    // Get attachment metadata, and optionally the contents:
+    if (!(options & kCBLNoAttachments)) {
+        NSArray* sequences = [revs my_map: ^id(CBL_Revision* rev) {
+            return rev.sequence > 0 ? @(rev.sequence) : nil;
         }];
+        NSDictionary* attachments = [self getAttachmentDictsForSequences: sequences
+                                                                 options: options];
+        for (NSUInteger i = 0; i < count; ++i) {
+            NSDictionary* revAttachments = attachments[@([revs[i] sequence])];
+            if (revAttachments)
+                dsts[i][@"_attachments"] = revAttachments;
+        }
     }
-    
-    if (options & kCBLIncludeConflicts) {
-        CBL_RevisionList* revs = [self getAllRevisionsOfDocumentID: rev.docID onlyCurrent: YES];
-        if (revs.count > 1) {
-            dst[@"_conflicts"] = [revs.allRevisions my_map: ^(id aRev) {
-                return ($equal(aRev, rev) || [(CBL_Revision*)aRev deleted]) ? nil : [aRev revID];
+
+    // The history and conflicts both come from the documents' revision trees:
+    BOOL includeHistory = (options & (kCBLIncludeRevs | kCBLIncludeRevsInfo)) != 0;
+    if (!includeHistory && !(options & kCBLIncludeConflicts))
+        return;
+    NSDictionary* trees = [self getRevisionTreesOfDocumentIDs: [revs valueForKey: @"docID"]
+                                                  onlyCurrent: !includeHistory];
+    for (NSUInteger i = 0; i < count; ++i) {
+        CBL_Revision* rev = revs[i];
+        NSMutableDictionary* dst = dsts[i];
+        NSArray* tree = trees[rev.docID];
+        if (includeHistory) {
+            NSArray* history = historyFromRevisionTree(tree, rev.revID);
+            if (options & kCBLIncludeRevs)
+                dst[@"_revisions"] = makeRevisionHistoryDict(history, nil);
+            if (options & kCBLIncludeRevsInfo) {
+                dst[@"_revs_info"] = [history my_map: ^id(CBL_Revision* rev) {
+                    NSString* status = @"available";
+                    if (rev.deleted)
+                        status = @"deleted";
+                    else if (rev.missing)
+                        status = @"missing";
+                    return $dict({@"rev", [rev revID]}, {@"status", status});
+                }];
+            }
+        }
+        if (options & kCBLIncludeConflicts) {
+            NSArray* leaves = [tree my_map: ^id(CBLRevisionTreeNode* node) {
+                return node.current ? node.rev : nil;
             }];
+            if (leaves.count > 1) {
+                dst[@"_conflicts"] = [leaves my_map: ^(CBL_Revision* aRev) {
+                    return ($equal(aRev, rev) || aRev.deleted) ? nil : aRev.revID;
+                }];
+            }
         }
     }
 }
@@ -765,14 +1302,31 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
              intoRevision: (CBL_MutableRevision*)rev
                   options: (CBLContentOptions)options
 {
-    NSMutableDictionary* extra = $mdict();
-    [self extraPropertiesForRevision: rev options: options into: extra];
-    if (json.length > 0) {
-        rev.asJSON = [CBLJSON appendDictionary: extra toJSONDictionaryData: json];
-    } else {
-        rev.properties = extra;
-        if (json == nil)
-            rev.missing = true;
+    [self expandStoredJSONs: @[(json ?: $null)] intoRevisions: @[rev] options: options];
+}
+
+
+/** Like -expandStoredJSON:intoRevision:options:, for many revisions at once, with the extra
+    properties of all of them fetched together. 'jsons' contains an NSData or NSNull per revision. */
+- (void) expandStoredJSONs: (NSArray*)jsons
+             intoRevisions: (NSArray*)revs
+                   options: (CBLContentOptions)options
+{
+    NSArray* extras = [revs my_map: ^id(id rev) {return $mdict();}];
+    [self extraPropertiesForRevisions: revs options: options into: extras];
+    NSUInteger count = revs.count;
+    for (NSUInteger i = 0; i < count; ++i) {
+        CBL_MutableRevision* rev = revs[i];
+        NSDictionary* extra = extras[i];
+        NSData* json = $castIf(NSData, jsons[i]);
+        json = [self loadBodyKeysForBody: json] ? [_bodyCodec decode: json] : nil;
+        if (json.length > 0) {
+            rev.asJSON = [CBLJSON appendDictionary: extra toJSONDictionaryData: json];
+        } else {
+            rev.properties = extra;
+            if (json == nil)
+                rev.missing = true;
+        }
     }
 }
 
@@ -788,20 +1342,70 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
                                                                   deleted: deleted];
     rev.sequence = sequence;
     rev.missing = (json == nil);
-    NSMutableDictionary* docProperties;
-    if (json.length == 0 || (json.length==2 && memcmp(json.bytes, "{}", 2)==0))
-        docProperties = $mdict();      // optimization, and workaround for issue #44
-    else {
-        docProperties = [CBLJSON JSONObjectWithData: json
-                                            options: CBLJSONReadingMutableContainers
-                                              error: NULL];
+    return [self documentPropertiesFromJSONs: @[(json ?: $null)] revisions: @[rev]
+                                     options: options readOnly: NO][0];
+}
+
+
+- (NSDictionary*) readOnlyDocumentPropertiesFromJSON: (NSData*)json
+                                               docID: (NSString*)docID
+                                               revID: (NSString*)revID
+                                             deleted: (BOOL)deleted
+                                            sequence: (SequenceNumber)sequence
+                                             options: (CBLContentOptions)options
+{
+    CBL_MutableRevision* rev = [[CBL_MutableRevision alloc] initWithDocID: docID revID: revID
+                                                                  deleted: deleted];
+    rev.sequence = sequence;
+    rev.missing = (json == nil);
+    return [self documentPropertiesFromJSONs: @[(json ?: $null)] revisions: @[rev]
+                                     options: options readOnly: YES][0];
+}
+
+
+- (NSArray*) readOnlyDocumentPropertiesFromJSONs: (NSArray*)jsons
+                                       revisions: (NSArray*)revs
+                                         options: (CBLContentOptions)options
+{
+    return [self documentPropertiesFromJSONs: jsons revisions: revs options: options
+                                    readOnly: YES];
+}
+
+
+- (NSArray*) documentPropertiesFromJSONs: (NSArray*)jsons
+                               revisions: (NSArray*)revs
+                                 options: (CBLContentOptions)options
+                                readOnly: (BOOL)readOnly
+{
+    NSArray* extras = [revs my_map: ^id(id rev) {return $mdict();}];
+    [self extraPropertiesForRevisions: revs options: options into: extras];
+    NSMutableArray* result = [NSMutableArray arrayWithCapacity: revs.count];
+    NSUInteger count = revs.count;
+    for (NSUInteger i = 0; i < count; ++i) {
+        NSData* json = $castIf(NSData, jsons[i]);
+        NSDictionary* extra = extras[i];
+        // If read-only, a binary body isn't parsed here; its properties are only decoded as
+        // they're accessed. Read-only properties are immutable all the way down, since they
+        // may be shared between map blocks running on different threads.
+        BOOL keysLoaded = [self loadBodyKeysForBody: json];
+        if (readOnly) {
+            NSDictionary* attachments = extra[@"_attachments"];
+            if (attachments)
+                extras[i][@"_attachments"] = [[NSDictionary alloc] initWithDictionary: attachments
+                                                                            copyItems: YES];
+            extra = [extra copy];
+        }
+        NSDictionary* docProperties = nil;
+        if (keysLoaded)
+            docProperties = readOnly ? [_bodyCodec readOnlyPropertiesOfBody: json extra: extra]
+                                     : [_bodyCodec propertiesOfBody: json extra: extra];
         if (!docProperties) {
-            Warn(@"Unparseable JSON for doc=%@, rev=%@: %@", docID, revID, [json my_UTF8ToString]);
-            docProperties = $mdict();
+            Warn(@"Unparseable body for doc=%@, rev=%@", [revs[i] docID], [revs[i] revID]);
+            docProperties = extra;
         }
+        [result addObject: docProperties];
     }
-    [self extraPropertiesForRevision: rev options: options into: docProperties];
-    return docProperties;
+    return result;
 }
 
 
@@ -824,9 +1428,9 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     if (revID)
         [sql appendString: @" FROM revs WHERE revs.doc_id=? AND revid=? AND json notnull LIMIT 1"];
     else
-        [sql appendString: @" FROM revs WHERE revs.doc_id=? and current=1 and deleted=0 "
-                            "ORDER BY revid DESC LIMIT 1"];
-    CBL_FMResultSet *r = [_fmdb executeQuery: sql, @(docNumericID), revID];
+        [sql appendString: @" FROM docs, revs WHERE docs.doc_id=? AND winning_deleted=0 "
+                            "AND revs.sequence=docs.winning_seq"];
+    CBL_FMResultSet *r = [self.fmdb executeQuery: sql, @(docNumericID), revID];
     if (!r) {
         status = self.lastDbError;
     } else if (![r next]) {
@@ -878,7 +1482,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     SInt64 docNumericID = [self getDocNumericID: rev.docID];
     if (docNumericID <= 0)
         return kCBLStatusNotFound;
-    CBL_FMResultSet *r = [_fmdb executeQuery: @"SELECT sequence, json FROM revs "
+    CBL_FMResultSet *r = [self.fmdb executeQuery: @"SELECT sequence, json FROM revs "
                             "WHERE doc_id=? AND revid=? LIMIT 1",
                             @(docNumericID), rev.revID];
     if (!r)
@@ -911,17 +1515,132 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 }
 
 
+- (CBLStatus) loadRevisionBodies: (NSArray*)revs
+                         options: (CBLContentOptions)options
+{
+    NSMutableDictionary* jsonBySequence = $mdict();
+    CBL_FMDatabase* fmdb = self.fmdb;
+    NSArray* sequences = [revs my_map: ^id(CBL_Revision* rev) {
+        Assert(rev.sequence > 0);
+        return @(rev.sequence);
+    }];
+    for (NSUInteger start = 0; start < sequences.count; ) {
+        NSArray* args;
+        NSString* sql = $sprintf(@"SELECT sequence, json FROM revs WHERE %@",
+                                 CBLBatchMatch(@"sequence", sequences, &start, &args));
+        CBL_FMResultSet* r = [fmdb executeQuery: sql withArgumentsInArray: args];
+        if (!r)
+            return self.lastDbError;
+        while ([r next])
+            jsonBySequence[@([r longLongIntForColumnIndex: 0])] = [r dataForColumnIndex: 1] ?: $null;
+        [r close];
+    }
+
+    // Expand the bodies of the revisions that were found (if the JSON is null, the revision's
+    // body was compacted away, and it'll be marked as missing):
+    NSMutableArray* found = $marray(), *jsons = $marray();
+    for (CBL_MutableRevision* rev in revs) {
+        id json = jsonBySequence[@(rev.sequence)];
+        if (json) {
+            [found addObject: rev];
+            [jsons addObject: json];
+        }
+    }
+    [self expandStoredJSONs: jsons intoRevisions: found options: options];
+    return kCBLStatusOK;
+}
+
+
 - (SInt64) getDocNumericID: (NSString*)docID {
-    NSNumber* cached = [_docIDs objectForKey: docID];
-    if (cached) {
-        return cached.longLongValue;
-    } else {
-        SInt64 result = [_fmdb longLongForQuery: @"SELECT doc_id FROM docs WHERE docid=?", docID];
-        if (result <= 0)
-            return result;
-        [_docIDs setObject: @(result) forKey: docID];
-        return result;
+    SInt64 result = [_docIDMap docNumericIDForDocID: docID];
+    if (result == 0) {
+        result = [self.fmdb longLongForQuery: @"SELECT doc_id FROM docs WHERE docid=?", docID];
+        if (result > 0)
+            [_docIDMap setDocNumericID: result forDocID: docID];
+    }
+    return result;
+}
+
+
+/** Creates the codec for revision bodies, according to the 'body_codec' and 'body_format'
+    settings. */
+- (BOOL) loadBodyCodec {
+    NSString* codecName = [self infoForKey: @"body_codec"];
+    CBLBodyCompression compression = kCBLBodyCompressionNone;
+    if ($equal(codecName, @"deflate"))
+        compression = kCBLBodyCompressionDeflate;
+    else if ($equal(codecName, @"dictionary"))
+        compression = kCBLBodyCompressionDictionary;
+    _bodyCodec = [[CBLBodyCodec alloc] initWithCompression: compression];
+    _bodyCodec.binaryFormat = $equal([self infoForKey: @"body_format"], @"binary");
+
+    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT data FROM bodydicts ORDER BY dict_id"];
+    if (!r)
+        return NO;
+    while ([r next])
+        [_bodyCodec addDictionary: [r dataForColumnIndex: 0]];
+    [r close];
+
+    return [self loadBodyKeys];
+}
+
+
+/** Adds the property names in the 'bodykeys' table that aren't yet in the codec's key table,
+    i.e. all of them when opening, or those added since by another CBLDatabase on the same file. */
+- (BOOL) loadBodyKeys {
+    CBLBinaryKeyTable* keyTable = _bodyCodec.keyTable;
+    NSUInteger startID = keyTable.count;
+    CBL_FMResultSet* r = [self.fmdb executeQuery:
+                                @"SELECT name FROM bodykeys WHERE key_id >= ? ORDER BY key_id",
+                                @(startID)];
+    if (!r)
+        return NO;
+    NSMutableArray* names = $marray();
+    while ([r next])
+        [names addObject: [r stringForColumnIndex: 0]];
+    [r close];
+    // Key IDs are assigned consecutively, so appending the names in order recreates the table:
+    [keyTable addNames: names fromID: startID];
+    return YES;
+}
+
+
+/** Makes sure all the property names a stored body uses are in the codec's key table, reloading
+    it (through the current connection, so from the same snapshot the body came from) if the body
+    has key IDs beyond its end, which means another instance has added them. Returns NO if they're
+    still missing, in which case the body can't be decoded. */
+- (BOOL) loadBodyKeysForBody: (NSData*)stored {
+    NSUInteger needed = [CBLBinaryBody keyCountNeededByBody: stored];
+    if (needed <= _bodyCodec.keyTable.count)
+        return YES;
+    if (![self loadBodyKeys] || needed > _bodyCodec.keyTable.count) {
+        Warn(@"%@: Body uses property name IDs up to %u but 'bodykeys' only has %u",
+             self, (unsigned)needed - 1, (unsigned)_bodyCodec.keyTable.count);
+        return NO;
     }
+    return YES;
+}
+
+
+/** Fills the docID map from the 'docs' table, as far as its memory limit allows, so that
+    lookups of existing documents don't need a query. */
+- (void) preloadDocIDMap {
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT docid, doc_id FROM docs"];
+    while ([r next]) {
+        NSData* docID = [r dataNoCopyForColumnIndex: 0];
+        if (![_docIDMap preloadDocID: docID.bytes length: docID.length
+                        docNumericID: [r longLongIntForColumnIndex: 1]])
+            break;
+    }
+    [r close];
+    LogTo(CBLDatabase, @"%@: Preloaded %u docIDs in %.3f sec", self,
+          (unsigned)_docIDMap.count, CFAbsoluteTimeGetCurrent() - start);
+}
+
+
+- (NSDictionary*) docIDMapStats {
+    return _docIDMap.stats;
 }
 
 
@@ -931,14 +1650,14 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 {
     NSString* sql = $sprintf(@"SELECT sequence FROM revs WHERE doc_id=? AND revid=? %@ LIMIT 1",
                              (onlyCurrent ? @"AND current=1" : @""));
-    return [_fmdb longLongForQuery: sql, @(docNumericID), revID];
+    return [self.fmdb longLongForQuery: sql, @(docNumericID), revID];
 }
 
 
 - (NSString*) _indexedTextWithID: (UInt64)fullTextID {
     if (fullTextID == 0)
         return nil;
-    return [_fmdb stringForQuery: @"SELECT content FROM fulltext WHERE rowid=?", @(fullTextID)];
+    return [self.fmdb stringForQuery: @"SELECT content FROM fulltext WHERE rowid=?", @(fullTextID)];
 }
 
 
@@ -949,13 +1668,13 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     // First get the parent's sequence:
     SequenceNumber seq = rev.sequence;
     if (seq) {
-        seq = [_fmdb longLongForQuery: @"SELECT parent FROM revs WHERE sequence=?",
+        seq = [self.fmdb longLongForQuery: @"SELECT parent FROM revs WHERE sequence=?",
                                 @(seq)];
     } else {
         SInt64 docNumericID = [self getDocNumericID: rev.docID];
         if (!docNumericID)
             return nil;
-        seq = [_fmdb longLongForQuery: @"SELECT parent FROM revs WHERE doc_id=? and revid=?",
+        seq = [self.fmdb longLongForQuery: @"SELECT parent FROM revs WHERE doc_id=? and revid=?",
                                 @(docNumericID), rev.revID];
     }
     if (seq == 0)
@@ -963,7 +1682,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 
     // Now get its revID and deletion status:
     CBL_Revision* result = nil;
-    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT revid, deleted FROM revs WHERE sequence=?",
+    CBL_FMResultSet* r = [self.fmdb executeQuery: @"SELECT revid, deleted FROM revs WHERE sequence=?",
                                @(seq)];
     if ([r next]) {
         result = [[CBL_Revision alloc] initWithDocID: rev.docID
@@ -987,7 +1706,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     else
         sql = @"SELECT sequence, revid, deleted FROM revs "
                "WHERE doc_id=? ORDER BY sequence DESC";
-    CBL_FMResultSet* r = [_fmdb executeQuery: sql, @(docNumericID)];
+    CBL_FMResultSet* r = [self.fmdb executeQuery: sql, @(docNumericID)];
     if (!r)
         return nil;
     CBL_RevisionList* revs = [[CBL_RevisionList alloc] init];
@@ -1030,7 +1749,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     if (docNumericID <= 0)
         return nil;
     int sqlLimit = limit > 0 ? (int)limit : -1;     // SQL uses -1, not 0, to denote 'no limit'
-    CBL_FMResultSet* r = [_fmdb executeQuery:
+    CBL_FMResultSet* r = [self.fmdb executeQuery:
                       @"SELECT revid, sequence FROM revs WHERE doc_id=? and revid < ?"
                        " and deleted=0 and json not null"
                        " ORDER BY sequence DESC LIMIT ?",
@@ -1058,9 +1777,10 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
                               "WHERE doc_id=? and revid in (%@) and revid <= ? "
                               "ORDER BY revid DESC LIMIT 1", 
                               [CBLDatabase joinQuotedStrings: revIDs]);
-    _fmdb.shouldCacheStatements = NO;
-    NSString* ancestor = [_fmdb stringForQuery: sql, @(docNumericID), rev.revID];
-    _fmdb.shouldCacheStatements = YES;
+    CBL_FMDatabase* fmdb = self.fmdb;
+    fmdb.shouldCacheStatements = NO;
+    NSString* ancestor = [fmdb stringForQuery: sql, @(docNumericID), rev.revID];
+    fmdb.shouldCacheStatements = YES;
     return ancestor;
 }
     
@@ -1076,7 +1796,7 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
     else if (docNumericID == 0)
         return @[];
     
-    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT sequence, parent, revid, deleted, json isnull "
+    CBL_FMResultSet* r = [self.fmdb executeQuery: @"SELECT sequence, parent, revid, deleted, json isnull "
                                            "FROM revs WHERE doc_id=? ORDER BY sequence DESC",
                                           @(docNumericID)];
     if (!r)
@@ -1109,9 +1829,128 @@ NSString* const CBL_DatabaseWillBeDeletedNotification = @"CBL_DatabaseWillBeDele
 }
 
 
-static NSDictionary* makeRevisionHistoryDict(NSArray* history) {
+// Sizes of the batches matched by CBLBatchMatch. A partial batch is padded to the next size up.
+static const NSUInteger kBatchMatchSizes[] = {10, 100};
+#define kNumBatchMatchSizes (sizeof(kBatchMatchSizes) / sizeof(kBatchMatchSizes[0]))
+
+NSString* CBLBatchMatch(NSString* column, NSArray* values, NSUInteger* ioStart, NSArray** outArgs) {
+    NSUInteger start = *ioStart, n = values.count - start;
+    Assert(n > 0);
+    if (n == 1) {
+        *ioStart = start + 1;
+        *outArgs = @[values[start]];
+        return $sprintf(@"%@=?", column);
+    }
+    NSUInteger batchSize = kBatchMatchSizes[kNumBatchMatchSizes - 1];
+    for (NSUInteger i = 0; i < kNumBatchMatchSizes; ++i) {
+        if (kBatchMatchSizes[i] >= n) {
+            batchSize = kBatchMatchSizes[i];
+            break;
+        }
+    }
+    n = MIN(n, batchSize);
+    NSMutableArray* args = [[values subarrayWithRange: NSMakeRange(start, n)] mutableCopy];
+    while (args.count < batchSize)
+        [args addObject: args.lastObject];     // (repeating a value doesn't change the matches)
+    *ioStart = start + n;
+    *outArgs = args;
+    return $sprintf(@"%@ IN (%@)", column, [@"" stringByPaddingToLength: 2 * batchSize - 1
+                                                              withString: @"?,"
+                                                         startingAtIndex: 0]);
+}
+
+
+/** Reads the revision trees of many documents, with one query per batch of docs (or a simple
+    query if there's only one.) Returns a dictionary mapping each docID that exists to an array of
+    its CBLRevisionTreeNodes, in descending order of sequence. */
+- (NSDictionary*) getRevisionTreesOfDocumentIDs: (NSArray*)docIDs onlyCurrent: (BOOL)onlyCurrent {
+    docIDs = [[NSSet setWithArray: docIDs] allObjects];
+    NSMutableDictionary* trees = $mdict();
+    CBL_FMDatabase* fmdb = self.fmdb;
+    NSUInteger count = docIDs.count;
+    for (NSUInteger start = 0; start < count; ) {
+        NSArray* args;
+        NSString* docIDMatch = CBLBatchMatch(@"docid", docIDs, &start, &args);
+        NSString* sql = $sprintf(@"SELECT docid, sequence, parent, revid, deleted, json isnull, "
+                                  "current FROM revs, docs "
+                                  "WHERE %@ AND revs.doc_id = docs.doc_id %@"
+                                  "ORDER BY revs.doc_id, sequence DESC",
+                                 docIDMatch, (onlyCurrent ? @"AND current " : @""));
+        CBL_FMResultSet* r = [fmdb executeQuery: sql withArgumentsInArray: args];
+        if (!r)
+            return nil;
+        NSString* docID = nil;
+        NSMutableArray* tree = nil;
+        while ([r next]) {
+            NSString* rowDocID = [r stringForColumnIndex: 0];
+            if (!$equal(rowDocID, docID)) {
+                docID = rowDocID;
+                trees[docID] = tree = $marray();
+            }
+            CBL_MutableRevision* rev = [[CBL_MutableRevision alloc]
+                                                initWithDocID: docID
+                                                        revID: [r stringForColumnIndex: 3]
+                                                      deleted: [r boolForColumnIndex: 4]];
+            rev.sequence = [r longLongIntForColumnIndex: 1];
+            rev.missing = [r boolForColumnIndex: 5];
+            CBLRevisionTreeNode* node = [[CBLRevisionTreeNode alloc] init];
+            node.rev = rev;
+            node.parent = [r longLongIntForColumnIndex: 2];
+            node.current = [r boolForColumnIndex: 6];
+            [tree addObject: node];
+        }
+        [r close];
+    }
+    return trees;
+}
+
+
+/** Follows the parent links in a revision tree from the given revision back to the root, as
+    -getRevisionHistory: does. */
+static NSArray* historyFromRevisionTree(NSArray* tree, NSString* revID) {
+    NSMutableArray* history = $marray();
+    SequenceNumber lastSequence = 0;
+    for (CBLRevisionTreeNode* node in tree) {
+        BOOL matches;
+        if (lastSequence == 0)
+            matches = $equal(revID, node.rev.revID);
+        else
+            matches = (node.rev.sequence == lastSequence);
+        if (matches) {
+            [history addObject: node.rev];
+            lastSequence = node.parent;
+            if (lastSequence == 0)
+                break;
+        }
+    }
+    return history;
+}
+
+
+- (NSArray*) getRevisionHistories: (NSArray*)revs {
+    NSDictionary* trees = [self getRevisionTreesOfDocumentIDs: [revs valueForKey: @"docID"]
+                                                  onlyCurrent: NO];
+    if (!trees)
+        return nil;
+    return [revs my_map: ^id(CBL_Revision* rev) {
+        return historyFromRevisionTree(trees[rev.docID], rev.revID);
+    }];
+}
+
+
+static NSDictionary* makeRevisionHistoryDict(NSArray* history, NSArray* ancestorRevIDs) {
     if (!history)
         return nil;
+    // (history is in reverse order, newest..oldest)
+    if (ancestorRevIDs.count > 0) {
+        NSUInteger n = history.count;
+        for (NSUInteger i = 0; i < n; ++i) {
+            if ([ancestorRevIDs containsObject: [history[i] revID]]) {
+                history = [history subarrayWithRange: NSMakeRange(0, i+1)];
+                break;
+            }
+        }
+    }
     
     // Try to extract descending numeric prefixes:
     NSMutableArray* suffixes = $marray();
@@ -1140,26 +1979,23 @@ static NSDictionary* makeRevisionHistoryDict(NSArray* history) {
 }
 
 
++ (NSDictionary*) makeRevisionHistoryDict: (NSArray*)history
+                        startingFromAnyOf: (NSArray*)ancestorRevIDs
+{
+    return makeRevisionHistoryDict(history, ancestorRevIDs);
+}
+
+
 - (NSDictionary*) getRevisionHistoryDict: (CBL_Revision*)rev
                        startingFromAnyOf: (NSArray*)ancestorRevIDs
 {
-    NSArray* history = [self getRevisionHistory: rev]; // (this is in reverse order, newest..oldest
-    if (ancestorRevIDs.count > 0) {
-        NSUInteger n = history.count;
-        for (NSUInteger i = 0; i < n; ++i) {
-            if ([ancestorRevIDs containsObject: [history[i] revID]]) {
-                history = [history subarrayWithRange: NSMakeRange(0, i+1)];
-                break;
-            }
-        }
-    }
-    return makeRevisionHistoryDict(history);
+    return makeRevisionHistoryDict([self getRevisionHistory: rev], ancestorRevIDs);
 }
 
 
 - (NSString*) getParentRevID: (CBL_Revision*)rev {
     Assert(rev.sequence > 0);
-    return [_fmdb stringForQuery: @"SELECT parent.revid FROM revs, revs as parent"
+    return [self.fmdb stringForQuery: @"SELECT parent.revid FROM revs, revs as parent"
                                    " WHERE revs.sequence=? and parent.sequence=revs.parent",
                                   @(rev.sequence)];
 }
@@ -1171,17 +2007,16 @@ static NSDictionary* makeRevisionHistoryDict(NSArray* history) {
                               isConflict: (BOOL*)outIsConflict // optional
 {
     Assert(docNumericID > 0);
-    CBL_FMResultSet* r = [_fmdb executeQuery: @"SELECT revid, deleted FROM revs"
-                                           " WHERE doc_id=? and current=1"
-                                           " ORDER BY deleted asc, revid desc LIMIT 2",
+    // The winner is cached in the 'docs' row by -updateWinningRevisionOfDocNumericID:
+    CBL_FMResultSet* r = [self.fmdb executeQuery: @"SELECT winning_revid, winning_deleted, in_conflict"
+                                           " FROM docs WHERE doc_id=? AND winning_revid NOT NULL",
                                           @(docNumericID)];
     NSString* revID = nil;
     if ([r next]) {
         revID = [r stringForColumnIndex: 0];
         *outIsDeleted = [r boolForColumnIndex: 1];
-        // The document is in conflict if there are two+ result rows that are not deletions.
         if (outIsConflict)
-            *outIsConflict = !*outIsDeleted && [r next] && ![r boolForColumnIndex: 1];
+            *outIsConflict = [r boolForColumnIndex: 2];
     } else {
         *outIsDeleted = NO;
         if (outIsConflict)
@@ -1199,6 +2034,20 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
                                  options: (const CBLChangesOptions*)options
                                   filter: (CBLFilterBlock)filter
                                   params: (NSDictionary*)filterParams
+{
+    __block CBL_RevisionList* changes = nil;
+    [self _inReadTransaction: ^CBLStatus {
+        changes = [self _changesSinceSequence: lastSequence options: options
+                                       filter: filter params: filterParams];
+        return changes ? kCBLStatusOK : self.lastDbError;
+    }];
+    return changes;
+}
+
+- (CBL_RevisionList*) _changesSinceSequence: (SequenceNumber)lastSequence
+                                    options: (const CBLChangesOptions*)options
+                                     filter: (CBLFilterBlock)filter
+                                     params: (NSDictionary*)filterParams
 {
     // http://wiki.apache.org/couchdb/HTTP_database_API#Changes
     if (!options) options = &kDefaultCBLChangesOptions;
@@ -1209,10 +2058,27 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
                              "AND revs.doc_id = docs.doc_id "
                              "ORDER BY revs.doc_id, revid DESC",
                              (includeDocs ? @", json" : @""));
-    CBL_FMResultSet* r = [_fmdb executeQuery: sql, @(lastSequence)];
+    CBL_FMResultSet* r = [self.fmdb executeQuery: sql, @(lastSequence)];
     if (!r)
         return nil;
     CBL_RevisionList* changes = [[CBL_RevisionList alloc] init];
+
+    // Revisions are expanded (and then filtered) in batches, so that their attachments etc. can
+    // be looked up together:
+    NSMutableArray* pendingRevs = $marray(), *pendingJSON = $marray();
+    void (^flushPending)() = ^{
+        if (includeDocs) {
+            [self expandStoredJSONs: pendingJSON intoRevisions: pendingRevs
+                            options: options->contentOptions];
+        }
+        for (CBL_Revision* rev in pendingRevs) {
+            if ([self runFilter: filter params: filterParams onRevision: rev])
+                [changes addRev: rev];
+        }
+        [pendingRevs removeAllObjects];
+        [pendingJSON removeAllObjects];
+    };
+
     int64_t lastDocID = 0;
     while ([r next]) {
         @autoreleasepool {
@@ -1228,16 +2094,15 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
                                                           revID: [r stringForColumnIndex: 3]
                                                         deleted: [r boolForColumnIndex: 4]];
             rev.sequence = [r longLongIntForColumnIndex: 0];
-            if (includeDocs) {
-                [self expandStoredJSON: [r dataNoCopyForColumnIndex: 5]
-                          intoRevision: rev
-                               options: options->contentOptions];
-            }
-            if ([self runFilter: filter params: filterParams onRevision: rev])
-                [changes addRev: rev];
+            [pendingRevs addObject: rev];
+            if (includeDocs)
+                [pendingJSON addObject: [r dataForColumnIndex: 5] ?: $null];
+            if (pendingRevs.count >= kMaxDocsPerQuery)
+                flushPending();
         }
     }
     [r close];
+    flushPending();
     
     if (options->sortBySequence) {
         [changes sortBySequence];
@@ -1334,10 +2199,27 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
 
 
 - (CBLStatus) deleteViewNamed: (NSString*)name {
-    if (![_fmdb executeUpdate: @"DELETE FROM views WHERE name=?", name])
-        return self.lastDbError;
+    CBLView* view = [self existingViewNamed: name];
+    if (!view)
+        return kCBLStatusNotFound;
+    CBLStatus status = [self _inTransaction: ^CBLStatus {
+        CBLStatus status = [view _dropIndexTable];
+        if (CBLStatusIsError(status))
+            return status;
+        if (![_fmdb executeUpdate: @"DELETE FROM views WHERE name=?", name])
+            return self.lastDbError;
+        return _fmdb.changes ? kCBLStatusOK : kCBLStatusNotFound;
+    }];
+    [_indexUpdater removeView: view];
     [_views removeObjectForKey: name];
-    return _fmdb.changes ? kCBLStatusOK : kCBLStatusNotFound;
+    return status;
+}
+
+
+- (CBLViewIndexUpdater*) indexUpdater {
+    if (!_indexUpdater && _isOpen)
+        _indexUpdater = [[CBLViewIndexUpdater alloc] initWithDatabase: self];
+    return _indexUpdater;
 }
 
 
@@ -1467,29 +2349,99 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
     
 }
 
-//FIX: This has a lot of code in common with -[CBLView queryWithOptions:status:]. Unify the two!
 - (NSArray*) getAllDocs: (const CBLQueryOptions*)options {
+    __block NSArray* rows = nil;
+    [self _inReadTransaction: ^CBLStatus {
+        rows = [self _getAllDocs: options];
+        return rows ? kCBLStatusOK : self.lastDbError;
+    }];
+    return rows;
+}
+
+- (NSEnumerator*) streamAllDocs: (const CBLQueryOptions*)options status: (CBLStatus*)outStatus {
     if (!options)
         options = &kDefaultCBLQueryOptions;
+    if (options->keys || options->postFilter || options->sortDescriptors) {
+        // The rows have to be put into the order of the keys (or filtered and sorted before
+        // being returned), so they can't be streamed:
+        NSArray* rows = [self getAllDocs: options];
+        *outStatus = rows ? kCBLStatusOK : self.lastDbError;
+        return rows.objectEnumerator;
+    }
+
+    CBLAllDocsMode mode = options->allDocsMode;
+    BOOL includeDocs = options->includeDocs;
+    CBLContentOptions content = options->content;
+    return [CBLQueryRowStream streamWithDatabase: self
+                                           query: ^CBL_FMResultSet*(CBLStatus* queryStatus) {
+        CBL_FMResultSet* r = [self allDocsResultSet: options];
+        if (!r)
+            *queryStatus = self.lastDbError;
+        return r;
+    }
+                                       generator: ^CBLQueryRow*(CBL_FMResultSet* r, BOOL* outMore) {
+        NSDictionary* value;
+        NSData* json;
+        CBL_Revision* rev = [self readAllDocsRow: r mode: mode includeDocs: includeDocs
+                                           value: &value json: &json more: outMore];
+        if (!rev)
+            return nil;
+        NSDictionary* properties = nil;
+        if (includeDocs)
+            properties = [self readOnlyDocumentPropertiesFromJSON: json
+                                                            docID: rev.docID
+                                                            revID: rev.revID
+                                                          deleted: rev.deleted
+                                                         sequence: rev.sequence
+                                                          options: content];
+        return [[CBLQueryRow alloc] initWithDocID: rev.docID
+                                         sequence: rev.sequence
+                                              key: rev.docID
+                                            value: value
+                                    docProperties: properties];
+    }
+                                          status: outStatus];
+}
+
+
+// Generates and runs the SELECT statement of an _all_docs query, based on the options.
+- (CBL_FMResultSet*) allDocsResultSet: (const CBLQueryOptions*)options {
     BOOL includeDeletedDocs = (options->allDocsMode == kCBLIncludeDeleted);
     
+    // Unless conflicts were asked for, the winning revision cached in each 'docs' row is all we
+    // need, so there's no need to look at (and sort) every current revision:
+    BOOL onlyWinners = (options->allDocsMode < kCBLShowConflicts);
+
     // Generate the SELECT statement, based on the options:
     BOOL cacheQuery = YES;
-    NSMutableString* sql = [@"SELECT revs.doc_id, docid, revid, sequence" mutableCopy];
-    if (options->includeDocs)
-        [sql appendString: @", json"];
-    if (includeDeletedDocs)
-        [sql appendString: @", deleted"];
-    [sql appendString: @" FROM revs, docs WHERE"];
-    if (options->keys) {
-        if (options->keys.count == 0)
-            return @[];
-        [sql appendFormat: @" revs.doc_id IN (SELECT doc_id FROM docs WHERE docid IN (%@)) AND", [CBLDatabase joinQuotedStrings: options->keys]];
-        cacheQuery = NO; // we've put hardcoded key strings in the query
+    NSMutableString* sql;
+    if (onlyWinners) {
+        sql = [@"SELECT docs.doc_id, docid, winning_revid, winning_seq" mutableCopy];
+        if (options->includeDocs)
+            [sql appendString: @", json"];
+        if (includeDeletedDocs)
+            [sql appendString: @", winning_deleted AS deleted"];
+        [sql appendString: (options->includeDocs ? @" FROM docs, revs WHERE" : @" FROM docs WHERE")];
+        if (options->keys) {
+            [sql appendFormat: @" docid IN (%@) AND", [CBLDatabase joinQuotedStrings: options->keys]];
+            cacheQuery = NO; // we've put hardcoded key strings in the query
+        }
+        [sql appendString: @" winning_seq NOT NULL"];
+        if (options->includeDocs)
+            [sql appendString: @" AND revs.sequence = docs.winning_seq"];
+        if (!includeDeletedDocs)
+            [sql appendString: @" AND winning_deleted=0"];
+    } else {
+        sql = [@"SELECT revs.doc_id, docid, revid, sequence" mutableCopy];
+        if (options->includeDocs)
+            [sql appendString: @", json"];
+        [sql appendString: @" FROM revs, docs WHERE"];
+        if (options->keys) {
+            [sql appendFormat: @" revs.doc_id IN (SELECT doc_id FROM docs WHERE docid IN (%@)) AND", [CBLDatabase joinQuotedStrings: options->keys]];
+            cacheQuery = NO; // we've put hardcoded key strings in the query
+        }
+        [sql appendString: @" docs.doc_id = revs.doc_id AND current=1 AND deleted=0"];
     }
-    [sql appendString: @" docs.doc_id = revs.doc_id AND current=1"];
-    if (!includeDeletedDocs)
-        [sql appendString: @" AND deleted=0"];
 
     NSMutableArray* args = $marray();
     id minKey = options->startKey, maxKey = options->endKey;
@@ -1511,76 +2463,134 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
         [args addObject: maxKey];
     }
     
-    [sql appendFormat: @" ORDER BY docid %@, %@ revid DESC LIMIT ? OFFSET ?",
+    [sql appendFormat: @" ORDER BY docid %@%@ LIMIT ? OFFSET ?",
                        (options->descending ? @"DESC" : @"ASC"),
-                       (includeDeletedDocs ? @"deleted ASC," : @"")];
+                       (onlyWinners ? @"" : @", revid DESC")];
     [args addObject: @(options->limit)];
     [args addObject: @(options->skip)];
     
     // Now run the database query:
+    CBL_FMDatabase* fmdb = self.fmdb;
     if (!cacheQuery)
-        _fmdb.shouldCacheStatements = NO;
-    CBL_FMResultSet* r = [_fmdb executeQuery: sql withArgumentsInArray: args];
+        fmdb.shouldCacheStatements = NO;
+    CBL_FMResultSet* r = [fmdb executeQuery: sql withArgumentsInArray: args];
     if (!cacheQuery)
-        _fmdb.shouldCacheStatements = YES;
+        fmdb.shouldCacheStatements = YES;
+    return r;
+}
+
+
+// Reads the next document of an _all_docs query from the result set, which must be positioned on
+// an unread row. Advances past the row and any conflicting revisions after it that belong to
+// the same document, and sets *outMore to whether there are more rows. Returns nil if the
+// document is skipped because the mode is kCBLOnlyConflicts and it has no conflicts.
+- (CBL_Revision*) readAllDocsRow: (CBL_FMResultSet*)r
+                            mode: (CBLAllDocsMode)mode
+                     includeDocs: (BOOL)includeDocs
+                           value: (NSDictionary**)outValue
+                            json: (NSData**)outJSON
+                            more: (BOOL*)outMore
+{
+    // Get row values now, before the code below advances 'r':
+    int64_t docNumericID = [r longLongIntForColumnIndex: 0];
+    NSString* docID = [r stringForColumnIndex: 1];
+    NSString* revID = [r stringForColumnIndex: 2];
+    SequenceNumber sequence = [r longLongIntForColumnIndex: 3];
+    BOOL deleted = (mode == kCBLIncludeDeleted) && [r boolForColumn: @"deleted"];
+    NSData* json = includeDocs ? [r dataForColumnIndex: 4] : nil;
+
+    // Iterate over following rows with the same doc_id -- these are conflicts.
+    // Skip them, but collect their revIDs if the 'conflicts' option is set:
+    NSMutableArray* conflicts = nil;
+    BOOL more;
+    while ((more = [r next]) && [r longLongIntForColumnIndex: 0] == docNumericID) {
+        if (mode >= kCBLShowConflicts) {
+            if (!conflicts)
+                conflicts = $marray(revID);
+            [conflicts addObject: [r stringForColumnIndex: 2]];
+        }
+    }
+    *outMore = more;
+    if (mode == kCBLOnlyConflicts && !conflicts)
+        return nil;
+
+    CBL_MutableRevision* rev = [[CBL_MutableRevision alloc] initWithDocID: docID
+                                                                    revID: revID
+                                                                  deleted: deleted];
+    rev.sequence = sequence;
+    rev.missing = (json == nil);
+    *outValue = $dict({@"rev", revID},
+                      {@"deleted", (deleted ?$true : nil)},
+                      {@"_conflicts", conflicts});  // (not found in CouchDB)
+    *outJSON = json;
+    return rev;
+}
+
+
+//FIX: This has a lot of code in common with -[CBLView queryWithOptions:status:]. Unify the two!
+- (NSArray*) _getAllDocs: (const CBLQueryOptions*)options {
+    if (!options)
+        options = &kDefaultCBLQueryOptions;
+    if (options->keys && options->keys.count == 0)
+        return @[];
+    // With a post-filter or sort descriptors, skip and limit apply to the rows they select:
+    const CBLQueryOptions* selectOptions = NULL;
+    CBLQueryOptions scanOptions;
+    if (options->postFilter || options->sortDescriptors) {
+        selectOptions = options;
+        scanOptions = *options;
+        scanOptions.skip = 0;
+        scanOptions.limit = kDefaultCBLQueryOptions.limit;
+        options = &scanOptions;
+    }
+    CBL_FMResultSet* r = [self allDocsResultSet: options];
     if (!r)
         return nil;
     
-    NSMutableArray* rows = $marray();
-    NSMutableDictionary* docs = options->keys ? $mdict() : nil;
+    // The rows' revisions, values and JSON bodies are collected first, so that the documents'
+    // extra properties can be looked up in a batch:
+    NSMutableArray* revs = $marray(), *values = $marray(), *jsons = $marray();
 
     BOOL keepGoing = [r next]; // Go to first result row
     while (keepGoing) {
         @autoreleasepool {
-            // Get row values now, before the code below advances 'r':
-            int64_t docNumericID = [r longLongIntForColumnIndex: 0];
-            NSString* docID = [r stringForColumnIndex: 1];
-            NSString* revID = [r stringForColumnIndex: 2];
-            SequenceNumber sequence = [r longLongIntForColumnIndex: 3];
-            BOOL deleted = includeDeletedDocs && [r boolForColumn: @"deleted"];
-
-            NSDictionary* docContents = nil;
-            if (options->includeDocs) {
-                // Fill in the document contents:
-                NSData* json = [r dataNoCopyForColumnIndex: 4];
-                docContents = [self documentPropertiesFromJSON: json
-                                                         docID: docID
-                                                         revID: revID
-                                                       deleted: deleted
-                                                      sequence: sequence
-                                                       options: options->content];
-                Assert(docContents);
-            }
-            
-            // Iterate over following rows with the same doc_id -- these are conflicts.
-            // Skip them, but collect their revIDs if the 'conflicts' option is set:
-            NSMutableArray* conflicts = nil;
-            while ((keepGoing = [r next]) && [r longLongIntForColumnIndex: 0] == docNumericID) {
-                if (options->allDocsMode >= kCBLShowConflicts) {
-                    if (!conflicts)
-                        conflicts = $marray(revID);
-                    [conflicts addObject: [r stringForColumnIndex: 2]];
-                }
-            }
-            if (options->allDocsMode == kCBLOnlyConflicts && !conflicts)
+            NSDictionary* value;
+            NSData* json;
+            CBL_Revision* rev = [self readAllDocsRow: r mode: options->allDocsMode
+                                         includeDocs: options->includeDocs
+                                               value: &value json: &json more: &keepGoing];
+            if (!rev)
                 continue;
-
-            NSDictionary* value = $dict({@"rev", revID},
-                                        {@"deleted", (deleted ?$true : nil)},
-                                        {@"_conflicts", conflicts});  // (not found in CouchDB)
-            CBLQueryRow* row = [[CBLQueryRow alloc] initWithDocID: docID
-                                                         sequence: sequence
-                                                              key: docID
-                                                            value: value
-                                                    docProperties: docContents];
-            if (options->keys)
-                docs[docID] = row;
-            else
-                [rows addObject: row];
+            [revs addObject: rev];
+            [values addObject: value];
+            if (options->includeDocs)
+                [jsons addObject: json ?: $null];
         }
     }
     [r close];
 
+    // Fill in the document contents:
+    NSArray* docContents = nil;
+    if (options->includeDocs)
+        docContents = [self readOnlyDocumentPropertiesFromJSONs: jsons revisions: revs
+                                                        options: options->content];
+
+    NSMutableArray* rows = $marray();
+    NSMutableDictionary* docs = options->keys ? $mdict() : nil;
+    NSUInteger count = revs.count;
+    for (NSUInteger i = 0; i < count; ++i) {
+        CBL_Revision* rev = revs[i];
+        CBLQueryRow* row = [[CBLQueryRow alloc] initWithDocID: rev.docID
+                                                     sequence: rev.sequence
+                                                          key: rev.docID
+                                                        value: values[i]
+                                                docProperties: docContents[i]];
+        if (options->keys)
+            docs[rev.docID] = row;
+        else
+            [rows addObject: row];
+    }
+
     // If given doc IDs, sort the output into that order, and add entries for missing docs:
     if (options->keys) {
         for (NSString* docID in options->keys) {
@@ -1606,6 +2616,8 @@ const CBLChangesOptions kDefaultCBLChangesOptions = {UINT_MAX, 0, NO, NO, YES};
         }
     }
 
+    if (selectOptions)
+        return CBLQuerySelectRows(rows, selectOptions);
     return rows;
 }
 
@@ -1624,14 +2636,14 @@ static CBL_Revision* mkrev(NSString* revID) {
 
 TestCase(CBL_Database_MakeRevisionHistoryDict) {
     NSArray* revs = @[mkrev(@"4-jkl"), mkrev(@"3-ghi"), mkrev(@"2-def")];
-    CAssertEqual(makeRevisionHistoryDict(revs), $dict({@"ids", @[@"jkl", @"ghi", @"def"]},
-                                                      {@"start", @4}));
+    CAssertEqual(makeRevisionHistoryDict(revs, nil), $dict({@"ids", @[@"jkl", @"ghi", @"def"]},
+                                                           {@"start", @4}));
     
     revs = @[mkrev(@"4-jkl"), mkrev(@"2-def")];
-    CAssertEqual(makeRevisionHistoryDict(revs), $dict({@"ids", @[@"4-jkl", @"2-def"]}));
+    CAssertEqual(makeRevisionHistoryDict(revs, nil), $dict({@"ids", @[@"4-jkl", @"2-def"]}));
     
     revs = @[mkrev(@"12345"), mkrev(@"6789")];
-    CAssertEqual(makeRevisionHistoryDict(revs), $dict({@"ids", @[@"12345", @"6789"]}));
+    CAssertEqual(makeRevisionHistoryDict(revs, nil), $dict({@"ids", @[@"12345", @"6789"]}));
 }
 
 #endif
@@ -89,28 +89,50 @@
 }
 
 
+// Number of revisions looked up by each query in -findMissingRevisions:. Every full chunk uses the
+// same SQL, so its statement is cached. (3 parameters per revision; SQLite allows 999.)
+#define kFindMissingRevsChunkSize 100
+
 - (BOOL) findMissingRevisions: (CBL_RevisionList*)revs {
     if (revs.count == 0)
         return YES;
-    NSString* sql = $sprintf(@"SELECT docid, revid FROM revs, docs "
-                              "WHERE revid in (%@) AND docid IN (%@) "
-                              "AND revs.doc_id == docs.doc_id",
-                             [CBLDatabase joinQuotedStrings: revs.allRevIDs],
-                             [CBLDatabase joinQuotedStrings: revs.allDocIDs]);
-    _fmdb.shouldCacheStatements = NO;
-    CBL_FMResultSet* r = [_fmdb executeQuery: sql];
-    _fmdb.shouldCacheStatements = YES;
-    if (!r)
-        return NO;
-    while ([r next]) {
-        @autoreleasepool {
-            CBL_Revision* rev = [revs revWithDocID: [r stringForColumnIndex: 0]
-                                           revID: [r stringForColumnIndex: 1]];
-            if (rev)
-                [revs removeRev: rev];
+    // Join each chunk of (index, docID, revID) triples, bound as parameters, against docs and
+    // revs, so the lookup is linear in the number of revisions. It's only a read, so it runs on
+    // a pooled read-only connection and doesn't hold up writers.
+    NSArray* allRevs = revs.allRevisions;
+    NSMutableIndexSet* found = [NSMutableIndexSet indexSet];
+    CBLStatus status = [self _inReadTransaction: ^CBLStatus {
+        CBL_FMDatabase* fmdb = self.fmdb;
+        NSUInteger count = allRevs.count;
+        for (NSUInteger start = 0; start < count; start += kFindMissingRevsChunkSize) {
+            NSUInteger n = MIN(count - start, (NSUInteger)kFindMissingRevsChunkSize);
+            NSMutableString* sql = [NSMutableString stringWithString:
+                                        @"SELECT idx FROM (SELECT ? AS idx, ? AS docid, ? AS revid"];
+            NSMutableArray* args = [NSMutableArray arrayWithCapacity: 3 * n];
+            for (NSUInteger i = start; i < start + n; ++i) {
+                if (i > start)
+                    [sql appendString: @" UNION ALL SELECT ?, ?, ?"];
+                CBL_Revision* rev = allRevs[i];
+                [args addObject: @(i)];
+                [args addObject: rev.docID];
+                [args addObject: rev.revID];
+            }
+            [sql appendString: @") AS t, docs, revs "
+                                "WHERE docs.docid=t.docid "
+                                "AND revs.doc_id=docs.doc_id "
+                                "AND revs.revid=t.revid"];
+            CBL_FMResultSet* r = [fmdb executeQuery: sql withArgumentsInArray: args];
+            if (!r)
+                return self.lastDbError;
+            while ([r next])
+                [found addIndex: (NSUInteger)[r longLongIntForColumnIndex: 0]];
+            [r close];
         }
-    }
-    [r close];
+        return kCBLStatusOK;
+    }];
+    if (CBLStatusIsError(status))
+        return NO;
+    [revs removeRevsAtIndexes: found];
     return YES;
 }
 
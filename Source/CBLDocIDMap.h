@@ -0,0 +1,49 @@
+//
+//  CBLDocIDMap.h
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+
+/** A compact in-memory map from document IDs to their numeric IDs (the 'doc_id' column of the
+    'docs' table), used to avoid a SQL lookup on every document access.
+    Keys are stored as raw UTF-8 bytes in a single arena, and entries in an open-addressing hash
+    table with linear probing, so there's no per-entry object overhead. The memory allocated for
+    the table and the arena together never exceeds a fixed limit; when it's reached, entries are
+    evicted using the CLOCK algorithm (an approximation of least-recently-used.)
+    All methods are thread-safe. */
+@interface CBLDocIDMap : NSObject
+
+- (instancetype) initWithMemoryLimit: (size_t)memoryLimit;
+
+@property (readonly) size_t memoryLimit;
+
+/** Looks up a document ID. Returns its numeric ID, or 0 if it's not in the map. */
+- (SInt64) docNumericIDForDocID: (NSString*)docID;
+
+/** Adds or replaces a mapping, evicting older entries if necessary to make room. */
+- (void) setDocNumericID: (SInt64)docNumericID forDocID: (NSString*)docID;
+
+/** Adds a mapping given the UTF-8 bytes of the document ID, only if it fits without evicting
+    anything. Returns NO if the map is full. Used for bulk-loading when the database opens. */
+- (BOOL) preloadDocID: (const void*)utf8 length: (size_t)length
+         docNumericID: (SInt64)docNumericID;
+
+/** Removes a mapping, if present. */
+- (void) removeDocID: (NSString*)docID;
+
+/** Removes all mappings. */
+- (void) removeAllDocIDs;
+
+@property (readonly) NSUInteger count;
+/** Bytes allocated for the hash table and key arena (including unused and garbage space);
+    always <= memoryLimit. */
+@property (readonly) size_t memoryUsed;
+
+/** Statistics: count, memory usage, and the number of lookup hits, misses and evictions. */
+@property (readonly) NSDictionary* stats;
+
+@end
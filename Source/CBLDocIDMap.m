@@ -0,0 +1,439 @@
+//
+//  CBLDocIDMap.m
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CBLDocIDMap.h"
+#import <pthread.h>
+
+
+#define kInitialCapacity 256        // Initial number of hash table slots (must be a power of 2)
+#define kMinArenaSize 4096
+
+
+// A hash table slot. An empty slot has a docNumericID of 0 (SQLite row IDs start at 1.)
+typedef struct {
+    SInt64   docNumericID;
+    uint32_t hash;
+    uint32_t keyOffset;     // Offset of the docID's UTF-8 bytes in the arena
+    uint32_t keyLength;
+    uint32_t referenced;    // CLOCK bit: set on access, cleared as the hand sweeps past
+} DocIDSlot;
+
+
+// 32-bit FNV-1a hash
+static inline uint32_t hashBytes(const void* bytes, size_t length) {
+    const uint8_t* b = bytes;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= b[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+// Gets the UTF-8 bytes of a string, without allocating if possible.
+static const char* utf8Bytes(NSString* str, char* buf, size_t bufSize, size_t* outLength) {
+    const char* bytes = CFStringGetCStringPtr((__bridge CFStringRef)str, kCFStringEncodingUTF8);
+    if (!bytes) {
+        if ([str getCString: buf maxLength: bufSize encoding: NSUTF8StringEncoding])
+            bytes = buf;
+        else
+            bytes = str.UTF8String;
+    }
+    *outLength = strlen(bytes);
+    return bytes;
+}
+
+
+@implementation CBLDocIDMap
+{
+    size_t _memoryLimit;
+    pthread_mutex_t _mutex;
+    DocIDSlot* _slots;
+    NSUInteger _capacity;           // Number of slots; always a power of 2
+    NSUInteger _count;              // Number of occupied slots
+    NSUInteger _clockHand;
+    uint8_t* _arena;                // Key bytes, appended in order of insertion
+    size_t _arenaSize, _arenaUsed;
+    size_t _arenaGarbage;           // Bytes in the arena belonging to removed keys
+    UInt64 _hits, _misses, _evictions;
+}
+
+
+@synthesize memoryLimit=_memoryLimit;
+
+
+- (instancetype) initWithMemoryLimit: (size_t)memoryLimit {
+    self = [super init];
+    if (self) {
+        Assert(memoryLimit >= kInitialCapacity * sizeof(DocIDSlot) + kMinArenaSize);
+        _memoryLimit = memoryLimit;
+        pthread_mutex_init(&_mutex, NULL);
+        _capacity = kInitialCapacity;
+        _slots = calloc(_capacity, sizeof(DocIDSlot));
+        if (!_slots)
+            return nil;
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    free(_slots);
+    free(_arena);
+    pthread_mutex_destroy(&_mutex);
+}
+
+
+#pragma mark - INTERNALS (call with the mutex locked):
+
+
+// Bytes used by the table and by live keys (not counting garbage or unused arena space.)
+- (size_t) liveBytes {
+    return _capacity * sizeof(DocIDSlot) + (_arenaUsed - _arenaGarbage);
+}
+
+
+// Bytes allocated for the table and the arena. This never exceeds the memory limit.
+- (size_t) allocatedBytes {
+    return _capacity * sizeof(DocIDSlot) + _arenaSize;
+}
+
+
+// The largest the arena can be without going over the memory limit, given the table's size.
+- (size_t) maxArenaSize {
+    return _memoryLimit - _capacity * sizeof(DocIDSlot);
+}
+
+
+// Returns the index of the slot containing the key, or of the empty slot where it would go.
+- (NSUInteger) findSlot: (const void*)key length: (size_t)length hash: (uint32_t)hash {
+    NSUInteger mask = _capacity - 1;
+    for (NSUInteger i = hash & mask; ; i = (i + 1) & mask) {
+        DocIDSlot* slot = &_slots[i];
+        if (slot->docNumericID == 0)
+            return i;
+        if (slot->hash == hash && slot->keyLength == length
+                && memcmp(&_arena[slot->keyOffset], key, length) == 0)
+            return i;
+    }
+}
+
+
+// Removes the entry in slot i, shifting later entries of its probe run back to fill the gap
+// so that no tombstones are needed.
+- (void) removeSlot: (NSUInteger)i {
+    NSUInteger mask = _capacity - 1;
+    _arenaGarbage += _slots[i].keyLength;
+    --_count;
+    NSUInteger j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (_slots[j].docNumericID == 0)
+            break;
+        NSUInteger home = _slots[j].hash & mask;
+        // Leave the entry alone if its home position is cyclically within (i, j]:
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        _slots[i] = _slots[j];
+        i = j;
+    }
+    _slots[i].docNumericID = 0;
+}
+
+
+// Evicts one entry, chosen by the CLOCK algorithm. There must be at least one entry.
+- (void) evictOne {
+    Assert(_count > 0);
+    NSUInteger mask = _capacity - 1;
+    for (;;) {
+        DocIDSlot* slot = &_slots[_clockHand];
+        if (slot->docNumericID != 0) {
+            if (!slot->referenced) {
+                [self removeSlot: _clockHand];
+                ++_evictions;
+                return;     // (don't advance the hand; an entry may have shifted into this slot)
+            }
+            slot->referenced = 0;
+        }
+        _clockHand = (_clockHand + 1) & mask;
+    }
+}
+
+
+// Doubles the size of the hash table.
+- (BOOL) grow {
+    NSUInteger newCapacity = 2 * _capacity, mask = newCapacity - 1;
+    DocIDSlot* newSlots = calloc(newCapacity, sizeof(DocIDSlot));
+    if (!newSlots)
+        return NO;
+    for (NSUInteger i = 0; i < _capacity; i++) {
+        if (_slots[i].docNumericID != 0) {
+            NSUInteger j = _slots[i].hash & mask;
+            while (newSlots[j].docNumericID != 0)
+                j = (j + 1) & mask;
+            newSlots[j] = _slots[i];
+        }
+    }
+    free(_slots);
+    _slots = newSlots;
+    _capacity = newCapacity;
+    _clockHand = 0;
+    return YES;
+}
+
+
+// Copies the live keys into a fresh arena, discarding the garbage. The new arena has room for
+// at least `length` more bytes, but stays within the memory limit.
+- (BOOL) compactArenaWithRoomFor: (size_t)length {
+    size_t needed = _arenaUsed - _arenaGarbage + length;
+    size_t newSize = MIN(MAX(kMinArenaSize, 2 * needed), [self maxArenaSize]);
+    if (newSize < needed)
+        return NO;
+    uint8_t* newArena = malloc(newSize);
+    if (!newArena)
+        return NO;
+    size_t used = 0;
+    for (NSUInteger i = 0; i < _capacity; i++) {
+        DocIDSlot* slot = &_slots[i];
+        if (slot->docNumericID != 0) {
+            memcpy(&newArena[used], &_arena[slot->keyOffset], slot->keyLength);
+            slot->keyOffset = (uint32_t)used;
+            used += slot->keyLength;
+        }
+    }
+    free(_arena);
+    _arena = newArena;
+    _arenaSize = newSize;
+    _arenaUsed = used;
+    _arenaGarbage = 0;
+    return YES;
+}
+
+
+- (BOOL) insertKey: (const void*)key length: (size_t)length
+      docNumericID: (SInt64)docNumericID
+          canEvict: (BOOL)canEvict
+{
+    Assert(docNumericID > 0);
+    uint32_t hash = hashBytes(key, length);
+    NSUInteger i = [self findSlot: key length: length hash: hash];
+    if (_slots[i].docNumericID != 0) {
+        _slots[i].docNumericID = docNumericID;
+        _slots[i].referenced = 1;
+        return YES;
+    }
+
+    // Don't let one huge key flush out everything else:
+    if (length > _memoryLimit / 16)
+        return NO;
+
+    // Keep the table's load factor under 75%, growing it if that fits in the budget (shrinking
+    // the arena down to the live keys if it has to):
+    if (4 * (_count + 1) > 3 * _capacity) {
+        if ([self liveBytes] + _capacity * sizeof(DocIDSlot) + length <= _memoryLimit) {
+            if (![self grow])
+                return NO;
+            if ([self allocatedBytes] > _memoryLimit && ![self compactArenaWithRoomFor: length])
+                return NO;
+        } else if (canEvict) {
+            [self evictOne];
+        } else {
+            return NO;
+        }
+    }
+
+    // Evict entries until the new key fits in the budget:
+    while ([self liveBytes] + length > _memoryLimit) {
+        if (!canEvict || _count == 0)
+            return NO;
+        [self evictOne];
+    }
+
+    // Append the key to the arena, growing it no further than the memory limit allows. (The
+    // live keys plus this one fit, so if growing isn't enough, compacting is.)
+    if (_arenaUsed + length > _arenaSize) {
+        size_t newSize = MIN(MAX(MAX(kMinArenaSize, 2 * _arenaSize), _arenaUsed + length),
+                             [self maxArenaSize]);
+        if (newSize > UINT32_MAX)
+            return NO;
+        if (_arenaGarbage >= _arenaUsed / 2 || newSize < _arenaUsed + length) {
+            if (![self compactArenaWithRoomFor: length])
+                return NO;
+        } else {
+            uint8_t* newArena = realloc(_arena, newSize);
+            if (!newArena)
+                return NO;
+            _arena = newArena;
+            _arenaSize = newSize;
+        }
+    }
+    uint32_t keyOffset = (uint32_t)_arenaUsed;
+    memcpy(&_arena[keyOffset], key, length);
+    _arenaUsed += length;
+
+    // Eviction or growth may have moved things around, so find the empty slot again:
+    i = [self findSlot: key length: length hash: hash];
+    _slots[i] = (DocIDSlot){docNumericID, hash, keyOffset, (uint32_t)length, 0};
+    ++_count;
+    return YES;
+}
+
+
+#pragma mark - PUBLIC API:
+
+
+- (SInt64) docNumericIDForDocID: (NSString*)docID {
+    char buf[256];
+    size_t length;
+    const char* key = utf8Bytes(docID, buf, sizeof(buf), &length);
+    uint32_t hash = hashBytes(key, length);
+    pthread_mutex_lock(&_mutex);
+    DocIDSlot* slot = &_slots[[self findSlot: key length: length hash: hash]];
+    SInt64 result = slot->docNumericID;
+    if (result) {
+        slot->referenced = 1;
+        ++_hits;
+    } else {
+        ++_misses;
+    }
+    pthread_mutex_unlock(&_mutex);
+    return result;
+}
+
+
+- (void) setDocNumericID: (SInt64)docNumericID forDocID: (NSString*)docID {
+    char buf[256];
+    size_t length;
+    const char* key = utf8Bytes(docID, buf, sizeof(buf), &length);
+    pthread_mutex_lock(&_mutex);
+    [self insertKey: key length: length docNumericID: docNumericID canEvict: YES];
+    pthread_mutex_unlock(&_mutex);
+}
+
+
+- (BOOL) preloadDocID: (const void*)utf8 length: (size_t)length
+         docNumericID: (SInt64)docNumericID
+{
+    pthread_mutex_lock(&_mutex);
+    BOOL added = [self insertKey: utf8 length: length docNumericID: docNumericID canEvict: NO];
+    pthread_mutex_unlock(&_mutex);
+    return added;
+}
+
+
+- (void) removeDocID: (NSString*)docID {
+    char buf[256];
+    size_t length;
+    const char* key = utf8Bytes(docID, buf, sizeof(buf), &length);
+    uint32_t hash = hashBytes(key, length);
+    pthread_mutex_lock(&_mutex);
+    NSUInteger i = [self findSlot: key length: length hash: hash];
+    if (_slots[i].docNumericID != 0)
+        [self removeSlot: i];
+    pthread_mutex_unlock(&_mutex);
+}
+
+
+- (void) removeAllDocIDs {
+    pthread_mutex_lock(&_mutex);
+    memset(_slots, 0, _capacity * sizeof(DocIDSlot));
+    _count = 0;
+    _clockHand = 0;
+    _arenaUsed = _arenaGarbage = 0;
+    pthread_mutex_unlock(&_mutex);
+}
+
+
+- (NSUInteger) count {
+    pthread_mutex_lock(&_mutex);
+    NSUInteger count = _count;
+    pthread_mutex_unlock(&_mutex);
+    return count;
+}
+
+
+- (size_t) memoryUsed {
+    pthread_mutex_lock(&_mutex);
+    size_t used = [self allocatedBytes];
+    pthread_mutex_unlock(&_mutex);
+    return used;
+}
+
+
+- (NSDictionary*) stats {
+    pthread_mutex_lock(&_mutex);
+    NSDictionary* stats = $dict({@"count", @(_count)},
+                                {@"memory_used", @([self allocatedBytes])},
+                                {@"memory_limit", @(_memoryLimit)},
+                                {@"hits", @(_hits)},
+                                {@"misses", @(_misses)},
+                                {@"evictions", @(_evictions)});
+    pthread_mutex_unlock(&_mutex);
+    return stats;
+}
+
+
+@end
+
+
+
+TestCase(CBLDocIDMap) {
+    CBLDocIDMap* map = [[CBLDocIDMap alloc] initWithMemoryLimit: 1024*1024];
+    CAssertEq([map docNumericIDForDocID: @"foo"], 0);
+    [map setDocNumericID: 17 forDocID: @"foo"];
+    [map setDocNumericID: 23 forDocID: @"bär"];
+    CAssertEq([map docNumericIDForDocID: @"foo"], 17);
+    CAssertEq([map docNumericIDForDocID: @"bär"], 23);
+    CAssertEq([map docNumericIDForDocID: @"bar"], 0);
+    [map setDocNumericID: 18 forDocID: @"foo"];
+    CAssertEq([map docNumericIDForDocID: @"foo"], 18);
+    CAssertEq(map.count, 2u);
+
+    // Grow the table, then remove every other key (exercises the backward-shift deletion):
+    for (int i = 1; i <= 5000; i++)
+        [map setDocNumericID: i forDocID: $sprintf(@"doc-%d", i)];
+    CAssertEq(map.count, 5002u);
+    for (int i = 1; i <= 5000; i += 2)
+        [map removeDocID: $sprintf(@"doc-%d", i)];
+    CAssertEq(map.count, 2502u);
+    for (int i = 1; i <= 5000; i++)
+        CAssertEq([map docNumericIDForDocID: $sprintf(@"doc-%d", i)], (SInt64)((i % 2) ? 0 : i));
+    CAssertEq([map.stats[@"hits"] intValue], 3 + 2500);
+    [map removeAllDocIDs];
+    CAssertEq(map.count, 0u);
+    CAssertEq([map docNumericIDForDocID: @"foo"], 0);
+
+    // With a small budget, entries get evicted and memory stays bounded:
+    size_t limit = 32*1024;
+    map = [[CBLDocIDMap alloc] initWithMemoryLimit: limit];
+    BOOL full = NO;
+    int preloaded = 0;
+    while (!full) {
+        const char* key = [$sprintf(@"preload-%d", preloaded + 1) UTF8String];
+        full = ![map preloadDocID: key length: strlen(key) docNumericID: preloaded + 1];
+        if (!full)
+            ++preloaded;
+    }
+    CAssert(preloaded > 100);
+    CAssertEq(map.count, (NSUInteger)preloaded);
+    for (int i = 1; i <= 10000; i++) {
+        [map setDocNumericID: i forDocID: $sprintf(@"doc-%d", i)];
+        [map docNumericIDForDocID: @"preload-1"];     // keep this one referenced
+    }
+    CAssert(map.memoryUsed <= limit);
+    CAssert([map.stats[@"evictions"] intValue] > 0);
+    CAssertEq([map docNumericIDForDocID: @"preload-1"], 1);
+    CAssertEq([map docNumericIDForDocID: @"doc-10000"], 10000);
+}
@@ -42,6 +42,10 @@ TestCase(JSReduceFunction) {
     id result = reduceBlock(keys, values, false);
 
     CAssertEqual(result, (@[keys, values, @NO]));
+
+    // Built-in reduce functions are native:
+    CAssert([c compileReduceFunction: @"_count" language: @"javascript"]
+                == [CBLView reduceBlockNamed: @"_count"]);
 }
 
 
@@ -0,0 +1,43 @@
+//
+//  CBLQueryRowStream.h
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "CBLStatus.h"
+@class CBLDatabase, CBLQueryRow, CBL_FMDatabase, CBL_FMResultSet;
+
+
+/** Creates the next query row from a result set, which is positioned on an unread SQL row; it
+    then advances the result set past the row(s) it read, and sets *outMore to whether there are
+    any left. It may return nil to skip the row(s). */
+typedef CBLQueryRow* (^CBLQueryRowGenerator)(CBL_FMResultSet* r, BOOL* outMore);
+
+
+/** Enumerates the rows of a query as they're read from its SQLite statement, instead of reading
+    them all into an array first, so only one row at a time needs to be in memory.
+    It runs in a read snapshot (see -[CBLDatabase _beginReadSnapshot]) that lasts until all the
+    rows have been read or it's closed, so the rows are consistent with each other. Until then it
+    holds one of the database's pooled read-only connections, so it should be closed promptly.
+    Streams never take the pool's last free connection; if none can be spared, the stream reads
+    all its rows up front instead. It must only be used by one thread at a time. */
+@interface CBLQueryRowStream : NSEnumerator
+
+/** Runs a query in a new read snapshot, and returns a stream of the rows created from its result
+    set by the generator. The query block is called (in the snapshot) to create the result set;
+    on error it returns nil and sets *outStatus, and if there can't be any rows (for instance
+    because the table doesn't exist yet) it may just return nil. */
++ (instancetype) streamWithDatabase: (CBLDatabase*)db
+                              query: (CBL_FMResultSet* (^)(CBLStatus* outStatus))query
+                          generator: (CBLQueryRowGenerator)generator
+                             status: (CBLStatus*)outStatus;
+
+/** Returns the next row, or nil at the end. */
+- (CBLQueryRow*) nextRow;
+
+/** Stops reading rows, and ends the read snapshot. Called automatically after the last row. */
+- (void) close;
+
+@end
@@ -0,0 +1,149 @@
+//
+//  CBLQueryRowStream.m
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CBLQueryRowStream.h"
+#import "CouchbaseLitePrivate.h"
+#import "CBLInternal.h"
+#import "CBLMisc.h"
+
+#import "FMDatabase.h"
+#import "FMResultSet.h"
+
+
+@implementation CBLQueryRowStream
+{
+    CBLDatabase* _db;                   // Strong, so the snapshot can always be ended
+    CBL_FMDatabase* _reader;            // Connection the snapshot is on; nil once closed
+    CBL_FMResultSet* _resultSet;
+    CBLQueryRowGenerator _generator;
+    BOOL _more;                         // Is the result set positioned on an unread row?
+    NSMutableArray* _readRows;          // Rows read up front, if there was no reader to spare
+}
+
+
++ (instancetype) streamWithDatabase: (CBLDatabase*)db
+                              query: (CBL_FMResultSet* (^)(CBLStatus* outStatus))query
+                          generator: (CBLQueryRowGenerator)generator
+                             status: (CBLStatus*)outStatus
+{
+    CBLQueryRowStream* stream = [[self alloc] init];
+    stream->_db = db;
+    stream->_generator = [generator copy];
+    CBL_FMDatabase* reader = [db _beginReadSnapshot];
+    if (reader) {
+        stream->_reader = reader;
+        *outStatus = [db _inReadSnapshot: reader do: ^CBLStatus {
+            return [stream startQuery: query];
+        }];
+    } else {
+        // Other snapshots have all the pooled connections that can be spared, so instead of
+        // holding one, read all the rows now, in an ordinary read transaction:
+        LogTo(Query, @"%@: No reader to spare; reading all rows up front", stream);
+        *outStatus = [db _inReadTransaction: ^CBLStatus {
+            CBLStatus status = [stream startQuery: query];
+            if (CBLStatusIsError(status))
+                return status;
+            NSMutableArray* rows = [NSMutableArray array];
+            CBLQueryRow* row;
+            while ((row = [stream readRow]) != nil)
+                [rows addObject: row];
+            stream->_readRows = rows;
+            [stream->_resultSet close];
+            stream->_resultSet = nil;
+            return kCBLStatusOK;
+        }];
+    }
+    if (CBLStatusIsError(*outStatus)) {
+        [stream close];
+        return nil;
+    }
+    if (!stream->_more && stream->_readRows.count == 0)
+        [stream close];     // No rows, so don't hold onto the connection
+    return stream;
+}
+
+
+- (void) dealloc {
+    [self close];
+}
+
+
+// Runs the query and reads its first SQL row. Must be called in the snapshot or transaction.
+- (CBLStatus) startQuery: (CBL_FMResultSet* (^)(CBLStatus* outStatus))query {
+    CBLStatus status = kCBLStatusOK;
+    CBL_FMResultSet* r = query(&status);
+    if (!r)
+        return status;
+    _resultSet = r;
+    _more = [r next];
+    return kCBLStatusOK;
+}
+
+
+// Reads the next row from the result set, or returns nil at the end. Must be called in the
+// snapshot or transaction the query was started in.
+- (CBLQueryRow*) readRow {
+    CBLQueryRow* row = nil;
+    while (!row && _more) {
+        @autoreleasepool {
+            BOOL more = NO;
+            row = _generator(_resultSet, &more);
+            _more = more;
+        }
+    }
+    return row;
+}
+
+
+- (CBLQueryRow*) nextRow {
+    if (_readRows) {
+        CBLQueryRow* row = _readRows.firstObject;
+        if (row)
+            [_readRows removeObjectAtIndex: 0];
+        else
+            [self close];
+        return row;
+    }
+    if (!_reader)
+        return nil;
+    __block CBLQueryRow* row = nil;
+    [_db _inReadSnapshot: _reader do: ^CBLStatus {
+        row = [self readRow];
+        return kCBLStatusOK;
+    }];
+    if (!_more)
+        [self close];
+    return row;
+}
+
+
+- (id) nextObject {
+    return [self nextRow];
+}
+
+
+- (void) close {
+    _readRows = nil;
+    if (!_reader)
+        return;
+    [_resultSet close];
+    _resultSet = nil;
+    _generator = nil;
+    _more = NO;
+    [_db _endReadSnapshot: _reader];
+    _reader = nil;
+}
+
+
+@end
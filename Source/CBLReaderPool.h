@@ -0,0 +1,45 @@
+//
+//  CBLReaderPool.h
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class CBL_FMDatabase;
+
+
+/** A bounded pool of read-only SQLite connections to a database file.
+    Since the database uses a write-ahead log, a reader can run queries concurrently with the
+    database's writer connection (and with other readers), each seeing a consistent snapshot.
+    All methods are thread-safe; a checked-out connection must only be used by one thread at a time. */
+@interface CBLReaderPool : NSObject
+
+/** Initializes a pool.
+    @param path  The filesystem path of the SQLite database.
+    @param maxReaders  The maximum number of connections that can be open at once.
+    @param setup  A block that's called on every newly-opened connection to register collations, functions, encryption keys, etc. If it returns NO the connection is discarded. */
+- (instancetype) initWithPath: (NSString*)path
+                   maxReaders: (NSUInteger)maxReaders
+                        setup: (BOOL(^)(CBL_FMDatabase*))setup;
+
+@property (readonly) NSUInteger maxReaders;
+
+/** Returns an idle connection, opening a new one if necessary. If all the connections are in use,
+    blocks until one is checked back in. Returns nil if the pool is closed or on error. */
+- (CBL_FMDatabase*) checkOut;
+
+/** Like -checkOut, but for a connection that may stay checked out for a long time (as by a
+    streaming query.) It doesn't block, and returns nil rather than take the last connection that
+    is idle or could be opened, so that one is always left for -checkOut, whose callers only keep
+    theirs briefly; otherwise enough long-lived ones could make -checkOut wait forever. */
+- (CBL_FMDatabase*) checkOutSpare;
+
+/** Returns a connection to the pool after use. It must not have a transaction open. */
+- (void) checkIn: (CBL_FMDatabase*)reader;
+
+/** Closes all idle connections; connections still checked out are closed when checked in.
+    After this, -checkOut returns nil. */
+- (void) close;
+
+@end
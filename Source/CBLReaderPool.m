@@ -0,0 +1,143 @@
+//
+//  CBLReaderPool.m
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CBLReaderPool.h"
+#import "FMDatabase.h"
+#import <sqlite3.h>
+
+
+@implementation CBLReaderPool
+{
+    NSString* _path;
+    NSUInteger _maxReaders;
+    BOOL (^_setup)(CBL_FMDatabase*);
+    NSCondition* _lock;
+    NSMutableArray* _idle;          // Open connections that aren't checked out
+    NSUInteger _open;               // Total number of open connections (idle + checked out)
+    BOOL _closed;
+}
+
+
+@synthesize maxReaders=_maxReaders;
+
+
+- (instancetype) initWithPath: (NSString*)path
+                   maxReaders: (NSUInteger)maxReaders
+                        setup: (BOOL(^)(CBL_FMDatabase*))setup
+{
+    self = [super init];
+    if (self) {
+        Assert(maxReaders > 0);
+        _path = [path copy];
+        _maxReaders = maxReaders;
+        _setup = [setup copy];
+        _lock = [[NSCondition alloc] init];
+        _idle = [[NSMutableArray alloc] initWithCapacity: maxReaders];
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [self close];
+}
+
+
+- (CBL_FMDatabase*) openReader {
+    CBL_FMDatabase* reader = [[CBL_FMDatabase alloc] initWithPath: _path];
+    int flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_FILEPROTECTION_COMPLETEUNLESSOPEN;
+    if (![reader openWithFlags: flags]) {
+        Warn(@"CBLReaderPool: Couldn't open read-only connection to %@", _path);
+        return nil;
+    }
+    if (_setup && !_setup(reader)) {
+        [reader close];
+        return nil;
+    }
+    reader.shouldCacheStatements = YES;
+    LogTo(CBLDatabase, @"CBLReaderPool: Opened reader #%u on %@", (unsigned)_open + 1, _path);
+    return reader;
+}
+
+
+- (CBL_FMDatabase*) checkOut {
+    return [self checkOutLeaving: 0 wait: YES];
+}
+
+
+- (CBL_FMDatabase*) checkOutSpare {
+    return [self checkOutLeaving: 1 wait: NO];
+}
+
+
+// Checks out a connection if more than 'reserve' of them are idle or could still be opened;
+// otherwise, if 'wait' is set, blocks until that's true.
+- (CBL_FMDatabase*) checkOutLeaving: (NSUInteger)reserve wait: (BOOL)wait {
+    [_lock lock];
+    CBL_FMDatabase* reader = nil;
+    while (!_closed) {
+        if (_idle.count + (_maxReaders - _open) > reserve) {
+            reader = _idle.lastObject;
+            if (reader) {
+                [_idle removeLastObject];
+            } else {
+                // Reserve a slot, then open the connection without holding the lock:
+                ++_open;
+                [_lock unlock];
+                reader = [self openReader];
+                [_lock lock];
+                if (!reader) {
+                    --_open;
+                    [_lock signal];
+                }
+            }
+            break;
+        }
+        if (!wait)
+            break;
+        [_lock wait];
+    }
+    [_lock unlock];
+    return reader;
+}
+
+
+- (void) checkIn: (CBL_FMDatabase*)reader {
+    if (!reader)
+        return;
+    [_lock lock];
+    if (_closed) {
+        [reader close];
+        --_open;
+    } else {
+        [_idle addObject: reader];
+        [_lock signal];
+    }
+    [_lock unlock];
+}
+
+
+- (void) close {
+    [_lock lock];
+    _closed = YES;
+    for (CBL_FMDatabase* reader in _idle)
+        [reader close];
+    _open -= _idle.count;
+    [_idle removeAllObjects];
+    [_lock broadcast];
+    [_lock unlock];
+}
+
+
+@end
@@ -10,6 +10,7 @@
 #import "CBLDatabase+Internal.h"
 #import "CBLView.h"
 #import "CBLQuery.h"
+@class CBLQueryResultCache;
 
 
 /** Standard query options for views. */
@@ -17,7 +18,11 @@ typedef struct CBLQueryOptions {
     __unsafe_unretained id startKey;
     __unsafe_unretained id endKey;
     __unsafe_unretained NSArray* keys;
+    __unsafe_unretained NSString* startKeyDocID;   // Only used with startKey, in map queries
+    __unsafe_unretained NSString* endKeyDocID;     // Only used with endKey, in map queries
     __unsafe_unretained NSString* fullTextQuery;
+    __unsafe_unretained NSPredicate* postFilter;   // Applied to rows before skip and limit
+    __unsafe_unretained NSArray* sortDescriptors;  // Sorts rows before skip and limit
     const struct CBLGeoRect* bbox;
     unsigned skip;
     unsigned limit;
@@ -39,6 +44,31 @@ typedef struct CBLQueryOptions {
 
 extern const CBLQueryOptions kDefaultCBLQueryOptions;
 
+/** Returns a copy of the options with a limit one higher (if they have a limit), for a query of
+    the view (nil for _all_docs) whose result is to be passed to CBLQueryCursorAfterRows.
+    Reduced and grouped queries are left alone, since their limit applies before reducing. */
+CBLQueryOptions CBLQueryOptionsWithExtraRow(const CBLQueryOptions* options, CBLView* view);
+
+/** Given the rows returned by a query with CBLQueryOptionsWithExtraRow(options, view), removes the
+    extra row if there is one, and returns a token identifying the position just past the last of
+    the remaining rows. A later query can resume from there (see CBLQueryCursorDecode), seeking to
+    it in the index instead of skipping all the rows before it.
+    Returns nil if no rows follow (there was no extra row), or the query can't be resumed (if it's
+    reduced or grouped, a full-text or geo query, has a list of keys, or a post-filter or sort
+    descriptors.) */
+NSString* CBLQueryCursorAfterRows(NSArray** ioRows, const CBLQueryOptions* options,
+                                  CBLView* view);
+
+/** Decodes a token from CBLQueryCursorAfterRows into the query's new startKey, startKeyDocID and
+    skip. Returns NO if the token is invalid. */
+BOOL CBLQueryCursorDecode(NSString* cursor, id* outStartKey, NSString** outStartKeyDocID,
+                          unsigned* outSkip);
+
+/** Applies the options' postFilter and sortDescriptors to query rows, followed by its skip and
+    limit. (If sorting, only skip+limit rows are kept in memory at a time.) Returns the rows as-is
+    if the options have neither a postFilter nor sortDescriptors. */
+NSArray* CBLQuerySelectRows(NSArray* rows, const CBLQueryOptions* options);
+
 
 typedef enum {
     kCBLViewCollationUnicode,
@@ -56,6 +86,10 @@ typedef enum {
     uint8_t _collation;
     CBLContentOptions _mapContentOptions;
     BOOL _expectsJSONStringsInEmit;
+    BOOL _binaryKeys;
+    BOOL _updatesIndexInBackground;
+    NSTimeInterval _backgroundIndexDelay, _backgroundIndexMaxLag;
+    CBLQueryResultCache* _queryCache;
 }
 
 - (instancetype) initWithDatabase: (CBLDatabase*)db name: (NSString*)name;
@@ -68,7 +102,8 @@ typedef enum {
 
 @interface CBLView (Internal)
 
-+ (void) registerFunctions: (CBLDatabase*)db;
+/** Registers the SQL functions that view queries use, on a connection to the database. */
++ (void) registerFunctions: (CBL_FMDatabase*)fmdb;
 
 #if DEBUG  // for unit tests only
 - (void) setCollation: (CBLViewCollation)collation;
@@ -80,20 +115,122 @@ typedef enum {
                        version: (NSString*)version
                       userInfo: (NSDictionary*)userInfo;
 
+/** The SQL table holding the view's index: "maps_" followed by the view ID. */
+@property (readonly) NSString* mapTableName;
+
+/** The name of the SQL collation that orders the view's JSON keys, e.g. "JSON". */
+@property (readonly) NSString* sqlKeyCollation;
+
+/** Does the view's index table exist yet? (It's created when the view is first indexed.) */
+- (BOOL) _indexTableExists;
+
+/** Is the view's index table's key column in the view's collation? (It may not be if the table
+    was migrated from the old shared 'maps' table, which always used the default collation.)
+    Returns YES if the table doesn't exist. */
+- (BOOL) _indexTableMatchesCollation;
+
+/** Creates the view's index table if it doesn't exist, with the key column and its index in
+    the view's collation. */
+- (CBLStatus) _createIndexTable;
+
+/** Drops the view's index table, along with its full-text and geo entries. */
+- (CBLStatus) _dropIndexTable;
+
+/** The SQL table holding the view's stored reductions (see -materializesReductions):
+    "reduce_" followed by the view ID. */
+@property (readonly) NSString* reduceTableName;
+
+/** Does the view have stored reductions? They exist only while they're up to date with the
+    index, except for keys whose reduced value is NULL because rows have since been deleted. */
+- (BOOL) _reduceTableExists;
+
+/** Drops the view's stored reductions, if any. */
+- (CBLStatus) _dropReduceTable;
+
+/** Calls a reduce block, catching exceptions. The keys and values may be JSON data, which is
+    parsed only if the block accesses it; keys should be nil for a rereduce. Returns NSNull if the
+    block fails or returns nil, or nil if there's no block. */
++ (id) _callReduce: (CBLReduceBlock)reduceBlock
+              keys: (NSMutableArray*)keys
+            values: (NSMutableArray*)values
+          rereduce: (BOOL)rereduce;
+
+/** Reduces all the index rows whose key equals the given JSON key. Returns nil if there are none. */
+- (id) _reductionOfRowsWithKey: (NSData*)keyJSON reduceBlock: (CBLReduceBlock)reduceBlock;
+
 /** Updates the view's index (incrementally) if necessary.
  @return  200 if updated, 304 if already up-to-date, else an error code */
 - (CBLStatus) updateIndex;
 
+/** Updates the indexes of several views (all in the same database) in a single pass, reading and
+    parsing each new revision only once, and commits them together.
+ @return  200 if any were updated, 304 if all were already up-to-date, else an error code */
++ (CBLStatus) updateIndexes: (NSArray*)views;
+
+/** Like +updateIndexes:, but only indexes revisions up to the given sequence, leaving the views'
+    lastSequenceIndexed no higher than it.
+    Either way the update is committed in chunks, each in its own transaction, after each of which
+    the views' lastSequenceIndexed is advanced and kCBLViewIndexProgressNotification is posted. */
++ (CBLStatus) updateIndexes: (NSArray*)views throughSequence: (SequenceNumber)maxSequence;
+
+/** Like +updateIndexes:throughSequence:, but if 'pause' is YES, it briefly sleeps between chunks
+    to let other connections' writers take the write lock. Only for background indexing, where
+    nothing is waiting for the result. */
++ (CBLStatus) updateIndexes: (NSArray*)views
+            throughSequence: (SequenceNumber)maxSequence
+         pauseBetweenChunks: (BOOL)pause;
+
+/** Starts keeping track of the keys changed by each update of the view's index (by any CBLView
+    instance of it), for -_indexChangesFromSequence:mayAffectQuery:. */
+- (void) _trackIndexChanges;
+
+/** Returns NO if the index updates since it was up to date with the given sequence can't have
+    affected the results of a query with the given options (because no rows were added or removed
+    within its keys); YES if they may have, or if that's unknown. */
+- (BOOL) _indexChangesFromSequence: (SequenceNumber)sequence
+                    mayAffectQuery: (const CBLQueryOptions*)options;
+
+/** Converts an emitted key or value to the JSON string stored in the index. Thread-safe. */
+- (NSString*) _emittedJSON: (id)object;
+
+/** Encodes a key in the binary form stored in the index's 'ckey' column, using the view's
+    collation (see CBLCollatableKey). */
+- (NSData*) _collatableKey: (id)key;
+
 @end
 
 
 @interface CBLView (Querying)
 
 /** Queries the view. Does NOT first update the index.
+    The query runs in a read transaction (see -[CBLDatabase _inReadTransaction:]), so it isn't
+    blocked by another database instance's writes. Must be called on the database's thread: the
+    CBLView object's state is shared with the indexer and isn't thread-safe.
+    Unless the options include documents, the rows are remembered for as long as the index
+    doesn't change (within limits on their number and size), and a repeat of the query returns
+    the same rows without running it again.
     @param options  The options to use.
     @return  An array of CBLQueryRow. */
 - (NSArray*) _queryWithOptions: (const CBLQueryOptions*)options
                         status: (CBLStatus*)outStatus;
+
+/** Like -_queryWithOptions:status:, but returns an enumerator that reads each CBLQueryRow from
+    SQLite as it's requested, so the rows never all have to be in memory at once. The rows come
+    from one read snapshot, which lasts until the enumerator reaches the end (or is deallocated
+    or sent -close, if it's a CBLQueryRowStream.) Reduced, grouped and full-text queries can't be
+    streamed, so their rows are read into an array first. Must be called on the database's
+    thread, but the enumerator may then be used on another, by one thread at a time. */
+- (NSEnumerator*) _streamRowsWithOptions: (const CBLQueryOptions*)options
+                                  status: (CBLStatus*)outStatus;
+
+/** Empties the cache of recent query results used by -_queryWithOptions:status:. The cached
+    results are checked against the index before they're used, so this just frees their memory
+    early; it's called after the index is updated or deleted. */
+- (void) _invalidateQueryCache;
+
+/** Statistics of the query result cache: the number of "hits", "misses", "stores" and
+    "evictions" so far, and the current number of "entries" and their estimated "bytes". */
+@property (readonly) NSDictionary* queryCacheStats;
 #if DEBUG
 - (NSArray*) dump;
 #endif
@@ -20,6 +20,7 @@
 #import "CBLCanonicalJSON.h"
 #import "CBLMisc.h"
 #import "CBLGeometry.h"
+#import "CBL_Shared.h"
 
 #import "FMDatabase.h"
 #import "FMDatabaseAdditions.h"
@@ -27,9 +28,16 @@
 #import "ExceptionUtils.h"
 
 #include "sqlite3_unicodesn_tokenizer.h"
+#import <libkern/OSAtomic.h>
 
 
 static void CBLComputeFTSRank(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal);
+static void CBLGroupKey(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal);
+static void CBLCollatableKeyFunc(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal);
+
+
+// Number of documents read at a time when indexing with parallelism.
+#define kMapBatchSize 100
 
 
 // Special key object returned by CBLMapKey.
@@ -65,14 +73,95 @@ id CBLGeoJSONKey(NSDictionary* geoJSON) {
 }
 
 
+// A batch of documents whose map results are computed by concurrent worker threads during
+// -updateIndex. Each document's emitted rows go into its own buffer, so they can be written
+// in sequence order afterwards.
+@interface CBLMapBatch : NSObject
+- (void) addDocumentID: (NSString*)docID
+              sequence: (SequenceNumber)sequence
+            properties: (NSDictionary*)properties;
+@property (readonly) NSUInteger count;
+/** Starts calling the map block on the documents, on up to 'parallelism' threads at once. */
+- (void) startMapping: (CBLMapBlock)mapBlock
+          parallelism: (NSUInteger)parallelism
+                 view: (CBLView*)view;
+/** Waits for mapping to finish, then calls the block with each emitted row (the key being a
+    JSON string or a CBLSpecialKey), in document order. Stops at the first error, either from the
+    map block or returned by the block, and returns it. A nil block just waits. */
+- (CBLStatus) waitAndEnumerate: (CBLStatus(^)(SequenceNumber sequence, NSString* docID, id key,
+                                               NSString* valueJSON, NSData* collatableKey))block;
+@end
+
+
+// Number of index rows written by each multi-row INSERT while indexing. (Each row has 8
+// parameters, and SQLite allows at most 999 in a statement.)
+#define kInsertBatchSize 100
+
+// Index updates are committed in chunks of sequences; a chunk's size is adjusted so that indexing
+// it takes about kIndexChunkTime seconds, within the min/max sizes. Between chunks a background
+// indexer pauses for kIndexChunkPause seconds, giving other connections a chance to take the
+// write lock.
+#define kIndexChunkTime 0.25
+#define kIndexChunkInitialSize 1000
+#define kIndexChunkMinSize 100
+#define kIndexChunkMaxSize 1000000
+#define kIndexChunkPause 0.002
+
+// Maximum number of changed keys remembered by a CBLIndexChangeLog:
+#define kIndexChangeLogMaxKeys 10000
+
+
+// Buffers the rows emitted into a view's index during -updateIndexes, and writes them to its
+// index table kInsertBatchSize at a time, with a multi-row INSERT statement that's prepared once
+// per indexing pass and has the values bound to it directly. The rows' full-text and geo keys are
+// also written to the 'fulltext' and 'bboxes' tables a batch at a time.
+@interface CBLMapRowWriter : NSObject
+- (instancetype) initWithView: (CBLView*)view;
+/** Adds a row, whose key is either a JSON string or a CBLSpecialKey. Writes the buffered rows
+    if there are enough of them. */
+- (CBLStatus) addRowWithSequence: (SequenceNumber)sequence
+                           docID: (NSString*)docID
+                             key: (id)key
+                       valueJSON: (NSString*)valueJSON
+                   collatableKey: (NSData*)collatableKey;
+/** Writes all the buffered rows to the database. */
+- (CBLStatus) flush;
+/** Finalizes the prepared statements. Must be called before the database is closed. */
+- (void) close;
+/** If non-nil, the JSON keys of the rows added are added to this set (as NSNull for full-text and
+    geo keys), as are those of the rows passed to -noteKeysOfRowsWhere:... */
+@property NSMutableSet* changedKeys;
+/** Adds the keys of the index rows matching a WHERE clause to changedKeys, if it's non-nil. Call
+    this before deleting the rows. */
+- (BOOL) noteKeysOfRowsWhere: (NSString*)condition arguments: (NSArray*)arguments;
+@end
+
+
+// Records which keys each update of a view's index changed (i.e. the keys of the rows it added or
+// removed), so that a live query can tell whether the update can have affected its results. It's
+// shared by all CBLView instances of the view via CBL_Shared, and is thread-safe. It only remembers
+// an unbroken series of recent updates, up to kIndexChangeLogMaxKeys keys in all.
+@interface CBLIndexChangeLog : NSObject
+/** Records the keys changed by an update from one sequence to another; nil means all keys. */
+- (void) addKeys: (NSSet*)keys fromSequence: (SequenceNumber)from toSequence: (SequenceNumber)to;
+/** The sets of keys changed by the updates that together took the index from one sequence to the
+    other (and maybe some more), or nil if they're unknown. */
+- (NSArray*) keySetsFromSequence: (SequenceNumber)from toSequence: (SequenceNumber)to;
+@end
+
+
 @implementation CBLView (Internal)
 
 
-+ (void) registerFunctions:(CBLDatabase *)db {
-    sqlite3* dbHandle = db.fmdb.sqliteHandle;
++ (void) registerFunctions:(CBL_FMDatabase *)fmdb {
+    sqlite3* dbHandle = fmdb.sqliteHandle;
     register_unicodesn_tokenizer(dbHandle);
     sqlite3_create_function(dbHandle, "ftsrank", 1, SQLITE_ANY, NULL,
                             CBLComputeFTSRank, NULL, NULL);
+    sqlite3_create_function(dbHandle, "groupkey", 2, SQLITE_UTF8, NULL,
+                            CBLGroupKey, NULL, NULL);
+    sqlite3_create_function(dbHandle, "collatablekey", 1, SQLITE_UTF8, NULL,
+                            CBLCollatableKeyFunc, NULL, NULL);
 }
 
 
@@ -105,7 +194,9 @@ id CBLGeoJSONKey(NSDictionary* geoJSON) {
     NSString* reduceSource = viewProps[@"reduce"];
     CBLReduceBlock reduceBlock = NULL;
     if (reduceSource) {
-        reduceBlock =[[CBLView compiler] compileReduceFunction: reduceSource language: language userInfo: userInfo];
+        reduceBlock = [CBLView reduceBlockNamed: reduceSource];
+        if (!reduceBlock)
+            reduceBlock =[[CBLView compiler] compileReduceFunction: reduceSource language: language userInfo: userInfo];
         if (!reduceBlock) {
             Warn(@"View %@ has unknown reduce function: %@", _name, reduceSource);
             return NO;
@@ -128,6 +219,109 @@ id CBLGeoJSONKey(NSDictionary* geoJSON) {
 }
 
 
+#pragma mark - INDEX TABLE:
+
+
+- (NSString*) mapTableName {
+    return $sprintf(@"maps_%d", self.viewID);
+}
+
+
+- (BOOL) _indexTableExists {
+    return [_weakDB.fmdb boolForQuery: @"SELECT 1 FROM sqlite_master WHERE type='table' AND name=?",
+                                       self.mapTableName];
+}
+
+
+// The name of the SQL collation (registered by -[CBLDatabase setUpConnection:]) for a view's keys.
+static NSString* sqlCollation(CBLViewCollation collation) {
+    switch (collation) {
+        case kCBLViewCollationRaw:      return @"JSON_RAW";
+        case kCBLViewCollationASCII:    return @"JSON_ASCII";
+        default:                        return @"JSON";
+    }
+}
+
+
+- (NSString*) sqlKeyCollation {
+    return sqlCollation(_collation);
+}
+
+
+- (BOOL) _indexTableMatchesCollation {
+    NSString* schema = [_weakDB.fmdb stringForQuery: @"SELECT sql FROM sqlite_master "
+                                                      "WHERE type='table' AND name=?",
+                                                     self.mapTableName];
+    if (!schema)
+        return YES;
+    NSString* keyColumn = $sprintf(@"COLLATE %@,", sqlCollation(_collation));
+    return [schema rangeOfString: keyColumn].location != NSNotFound;
+}
+
+
+- (CBLStatus) _createIndexTable {
+    CBLDatabase* db = _weakDB;
+    CBL_FMDatabase* fmdb = db.fmdb;
+    NSString* table = self.mapTableName;
+    // The key column has the view's collation, so its index is sorted the way queries need.
+    // Each row also has its document's ID, and the key index covers every column a query without
+    // include_docs returns, so such a query reads only the index, without looking up the rows
+    // (or the 'revs' and 'docs' tables.)
+    NSString* collation = sqlCollation(_collation);
+    NSMutableArray* statements = $marray(
+        $sprintf(@"CREATE TABLE IF NOT EXISTS %@ ( \
+                    sequence INTEGER NOT NULL REFERENCES revs(sequence) ON DELETE CASCADE, \
+                    docid TEXT NOT NULL, \
+                    key TEXT NOT NULL COLLATE %@, \
+                    value TEXT, \
+                    fulltext_id INTEGER, \
+                    bbox_id INTEGER, \
+                    geokey BLOB, \
+                    ckey BLOB)", table, collation),
+        $sprintf(@"CREATE INDEX IF NOT EXISTS %@_covering ON %@(key, docid, sequence, value)",
+                 table, table),
+        $sprintf(@"CREATE INDEX IF NOT EXISTS %@_sequence ON %@(sequence)", table, table),
+        $sprintf(@"CREATE INDEX IF NOT EXISTS %@_fulltext ON %@(fulltext_id)", table, table),
+        $sprintf(@"CREATE TRIGGER IF NOT EXISTS del_%@_fulltext DELETE ON %@ \
+                    WHEN old.fulltext_id not null \
+                    BEGIN DELETE FROM fulltext WHERE rowid=old.fulltext_id; END", table, table),
+        $sprintf(@"CREATE TRIGGER IF NOT EXISTS del_%@_bbox DELETE ON %@ \
+                    WHEN old.bbox_id not null \
+                    BEGIN DELETE FROM bboxes WHERE rowid=old.bbox_id; END", table, table));
+    if (_binaryKeys)
+        [statements addObject: $sprintf(@"CREATE INDEX IF NOT EXISTS %@_ckeys_covering "
+                                         "ON %@(ckey, key, docid, sequence, value)",
+                                        table, table)];
+    for (NSString* sql in statements) {
+        if (![fmdb executeUpdate: sql])
+            return db.lastDbError;
+    }
+    return kCBLStatusOK;
+}
+
+
+- (CBLStatus) _dropIndexTable {
+    CBLStatus status = [self _dropReduceTable];
+    if (CBLStatusIsError(status))
+        return status;
+    if (![self _indexTableExists])
+        return kCBLStatusOK;
+    CBLDatabase* db = _weakDB;
+    CBL_FMDatabase* fmdb = db.fmdb;
+    NSString* table = self.mapTableName;
+    // Dropping the table doesn't fire its delete triggers, so do their work first:
+    if (![fmdb executeUpdate: $sprintf(@"DELETE FROM fulltext WHERE rowid IN "
+                                        "(SELECT fulltext_id FROM %@ WHERE fulltext_id NOT NULL)",
+                                       table)]
+            || ![fmdb executeUpdate: $sprintf(@"DELETE FROM bboxes WHERE rowid IN "
+                                               "(SELECT bbox_id FROM %@ WHERE bbox_id NOT NULL)",
+                                              table)]
+            || ![fmdb executeUpdate: $sprintf(@"DROP TABLE %@", table)])
+        return db.lastDbError;
+    return kCBLStatusOK;
+}
+
+
 #pragma mark - INDEXING:
 
 
@@ -140,70 +334,501 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
 }
 
 
+/** Converts an emitted key or value to the JSON stored in the index table. */
+- (NSString*) _emittedJSON: (id)object {
+    NSString* json = _expectsJSONStringsInEmit ? object : toJSONString(object);
+    return (json != nil) ? json : @"null";
+}
+
+
+static void* collationMode(CBLViewCollation collation) {
+    switch (collation) {
+        case kCBLViewCollationRaw:      return kCBLCollateJSON_Raw;
+        case kCBLViewCollationASCII:    return kCBLCollateJSON_ASCII;
+        default:                        return kCBLCollateJSON_Unicode;
+    }
+}
+
+
+- (NSData*) _collatableKey: (id)key {
+    return CBLCollatableKey(key, collationMode(_collation))
+        ?: CBLCollatableKey(nil, collationMode(_collation));
+}
+
+
+/** Returns the value for the 'ckey' column of an emitted key, or nil if the view's index doesn't
+    use binary keys. */
+- (NSData*) _collatableKeyForEmittedKey: (id)key {
+    if (!_binaryKeys)
+        return nil;
+    if ([key isKindOfClass: [CBLSpecialKey class]])
+        key = nil;
+    else if (_expectsJSONStringsInEmit && key)
+        key = [CBLJSON JSONObjectWithData: [key dataUsingEncoding: NSUTF8StringEncoding]
+                                  options: CBLJSONReadingAllowFragments error: NULL];
+    return [self _collatableKey: key];
+}
+
+
 /** The body of the emit() callback while indexing a view. */
-- (CBLStatus) _emitKey: (__unsafe_unretained id)key value: (__unsafe_unretained id)value forSequence: (SequenceNumber)sequence {
+- (CBLStatus) _emitKey: (__unsafe_unretained id)key
+                 value: (__unsafe_unretained id)value
+           forSequence: (SequenceNumber)sequence
+                 docID: (NSString*)docID
+              toWriter: (CBLMapRowWriter*)writer
+{
+    NSData* collatableKey = [self _collatableKeyForEmittedKey: key];
+    if (![key isKindOfClass: [CBLSpecialKey class]])
+        key = [self _emittedJSON: key];
+    return [writer addRowWithSequence: sequence docID: docID
+                                  key: key valueJSON: [self _emittedJSON: value]
+                        collatableKey: collatableKey];
+}
+
+
+#pragma mark - CHANGE TRACKING:
+
+
+- (CBLIndexChangeLog*) indexChangeLogCreatingIfMissing: (BOOL)create {
     CBLDatabase* db = _weakDB;
-    CBL_FMDatabase* fmdb = db.fmdb;
+    CBL_Shared* shared = db.shared;
+    @synchronized(shared) {
+        CBLIndexChangeLog* log = [shared valueForType: @"indexChangeLog" name: _name
+                                      inDatabaseNamed: db.name];
+        if (!log && create) {
+            log = [[CBLIndexChangeLog alloc] init];
+            [shared setValue: log forType: @"indexChangeLog" name: _name inDatabaseNamed: db.name];
+        }
+        return log;
+    }
+}
+
+
+- (void) _trackIndexChanges {
+    [self indexChangeLogCreatingIfMissing: YES];
+}
+
+
+// Does a key (as JSON) fall within the keys or key range of a query?
+static BOOL keyMatchesQuery(NSString* keyJSON, const CBLQueryOptions* options, void* mode,
+                            BOOL binaryKeys)
+{
+    NSData* key = binaryKeys ? CBLCollatableKeyFromJSON(keyJSON, mode)
+                             : [keyJSON dataUsingEncoding: NSUTF8StringEncoding];
+    // Compares the key to a query key the same way the SQL query does:
+    int (^compare)(id) = ^int(id queryKey) {
+        NSData* other = binaryKeys ? CBLCollatableKey(queryKey, mode)
+                                   : [toJSONString(queryKey) dataUsingEncoding: NSUTF8StringEncoding];
+        if (binaryKeys) {
+            int cmp = memcmp(key.bytes, other.bytes, MIN(key.length, other.length));
+            return cmp ? cmp : (int)key.length - (int)other.length;
+        }
+        return CBLCollateJSON(mode, (int)key.length, key.bytes, (int)other.length, other.bytes);
+    };
+
+    if (options->keys) {
+        for (id queryKey in options->keys) {
+            if (compare(queryKey) == 0)
+                return YES;
+        }
+        return NO;
+    }
+    id minKey = options->startKey, maxKey = options->endKey;
+    BOOL inclusiveMin = YES, inclusiveMax = options->inclusiveEnd;
+    if (options->descending) {
+        minKey = maxKey;
+        maxKey = options->startKey;
+        inclusiveMin = inclusiveMax;
+        inclusiveMax = YES;
+    }
+    if (minKey) {
+        int cmp = compare(minKey);
+        if (cmp < 0 || (cmp == 0 && !inclusiveMin))
+            return NO;
+    }
+    if (maxKey) {
+        int cmp = compare(maxKey);
+        if (cmp > 0 || (cmp == 0 && !inclusiveMax))
+            return NO;
+    }
+    return YES;
+}
 
-    NSNumber* fullTextID = nil, *bboxID = nil;
-    NSData* geoKey = nil;
-
-    NSString* keyJSON = nil;
-    if ([key isKindOfClass: [CBLSpecialKey class]]) {
-        CBLSpecialKey *specialKey = key;
-        BOOL ok;
-        NSString* text = specialKey.text;
-        if (text) {
-            ok = [fmdb executeUpdate: @"INSERT INTO fulltext (content) VALUES (?)", text];
-            fullTextID = @(fmdb.lastInsertRowId);
-        } else {
-            CBLGeoRect rect = specialKey.rect;
-            ok = [fmdb executeUpdate: @"INSERT INTO bboxes (x0,y0,x1,y1) VALUES (?,?,?,?)",
-                  @(rect.min.x), @(rect.min.y), @(rect.max.x), @(rect.max.y)];
-            bboxID = @(fmdb.lastInsertRowId);
-            geoKey = specialKey.geoJSONData;
+
+- (BOOL) _indexChangesFromSequence: (SequenceNumber)sequence
+                    mayAffectQuery: (const CBLQueryOptions*)options
+{
+    SequenceNumber lastSequence = self.lastSequenceIndexed;
+    if (lastSequence == sequence)
+        return NO;
+    NSArray* keySets = [[self indexChangeLogCreatingIfMissing: NO] keySetsFromSequence: sequence
+                                                                            toSequence: lastSequence];
+    if (!keySets)
+        return YES;
+    // Full-text and geo queries don't select by key, so any change may affect them:
+    BOOL anyKey = (options->fullTextQuery != nil || options->bbox != NULL);
+    void* mode = collationMode(_collation);
+    BOOL binaryKeys = [_weakDB.fmdb boolForQuery: @"SELECT binary_keys FROM views WHERE name=?",
+                                                  _name];
+    for (NSSet* keys in keySets) {
+        for (id key in keys) {
+            // (Rows with full-text or geo keys are stored with a null key)
+            NSString* keyJSON = (key == $null) ? @"null" : key;
+            if (anyKey || keyMatchesQuery(keyJSON, options, mode, binaryKeys))
+                return YES;
         }
-        if (!ok)
+    }
+    return NO;
+}
+
+
+#pragma mark - STORED REDUCTIONS:
+
+
+- (NSString*) reduceTableName {
+    return $sprintf(@"reduce_%d", self.viewID);
+}
+
+
+- (BOOL) _reduceTableExists {
+    return [_weakDB.fmdb boolForQuery: @"SELECT 1 FROM sqlite_master WHERE type='table' AND name=?",
+                                       self.reduceTableName];
+}
+
+
+/** Creates the table of reductions, which holds the reduced value of every distinct key in the
+    index table. A trigger marks a key's reduction as out of date (NULL) whenever one of its rows
+    is deleted from the index table -- including by a cascade when its revision is purged. */
+- (CBLStatus) _createReduceTable {
+    CBLDatabase* db = _weakDB;
+    CBL_FMDatabase* fmdb = db.fmdb;
+    NSString* table = self.reduceTableName, *mapTable = self.mapTableName;
+    NSArray* statements = @[
+        $sprintf(@"CREATE TABLE IF NOT EXISTS %@ ( \
+                    key TEXT PRIMARY KEY COLLATE %@, \
+                    value TEXT)", table, sqlCollation(_collation)),
+        $sprintf(@"CREATE TRIGGER IF NOT EXISTS del_%@_reduce DELETE ON %@ \
+                    BEGIN UPDATE %@ SET value=NULL WHERE key=old.key; END",
+                 mapTable, mapTable, table)];
+    for (NSString* sql in statements) {
+        if (![fmdb executeUpdate: sql])
             return db.lastDbError;
-        keyJSON = @"null";
-    } else {
-        keyJSON = _expectsJSONStringsInEmit ? key : toJSONString(key);
-        keyJSON = (keyJSON != nil) ? keyJSON : @"null";
     }
-    
-    NSString* valueJSON = _expectsJSONStringsInEmit ? value : toJSONString(value);
-    valueJSON = (valueJSON != nil) ? valueJSON : @"null";
-    
-    LogTo(ViewIndexVerbose, @" %@ emit(%@, %@) for sequence=%lld", _name, keyJSON, valueJSON, sequence);
-    
-    if (![fmdb executeUpdate: @"INSERT INTO maps (view_id, sequence, key, value, "
-                                   "fulltext_id, bbox_id, geokey) VALUES (?, ?, ?, ?, ?, ?, ?)",
-                                  @(self.viewID), @(sequence), keyJSON, valueJSON,
-                                  fullTextID, bboxID, geoKey])
+    return kCBLStatusOK;
+}
+
+
+- (CBLStatus) _dropReduceTable {
+    if (![self _reduceTableExists])
+        return kCBLStatusOK;
+    CBLDatabase* db = _weakDB;
+    CBL_FMDatabase* fmdb = db.fmdb;
+    if (![fmdb executeUpdate: $sprintf(@"DROP TRIGGER IF EXISTS del_%@_reduce", self.mapTableName)]
+            || ![fmdb executeUpdate: $sprintf(@"DROP TABLE %@", self.reduceTableName)])
+        return db.lastDbError;
+    return kCBLStatusOK;
+}
+
+
++ (id) _callReduce: (CBLReduceBlock)reduceBlock
+              keys: (NSMutableArray*)keys
+            values: (NSMutableArray*)values
+          rereduce: (BOOL)rereduce
+{
+    if (!reduceBlock)
+        return nil;
+    CBLLazyArrayOfJSON* lazyKeys = keys ? [[CBLLazyArrayOfJSON alloc] initWithMutableArray: keys]
+                                        : nil;
+    CBLLazyArrayOfJSON* lazyVals = [[CBLLazyArrayOfJSON alloc] initWithMutableArray: values];
+    @try {
+        id result = reduceBlock(lazyKeys, lazyVals, rereduce);
+        if (result)
+            return result;
+    } @catch (NSException *x) {
+        MYReportException(x, @"reduce block");
+    }
+    return $null;
+}
+
+
+- (id) _reductionOfRowsWithKey: (NSData*)keyJSON reduceBlock: (CBLReduceBlock)reduceBlock {
+    CBL_FMResultSet* r = [_weakDB.fmdb executeQuery:
+                                    $sprintf(@"SELECT key, value FROM %@ WHERE key=?",
+                                             self.mapTableName),
+                                    [keyJSON my_UTF8ToString]];
+    if (!r)
+        return nil;
+    NSMutableArray* keys = $marray(), *values = $marray();
+    while ([r next]) {
+        [keys addObject: [r dataForColumnIndex: 0]];
+        [values addObject: [r dataForColumnIndex: 1] ?: $null];
+    }
+    [r close];
+    if (keys.count == 0)
+        return nil;
+    return [[self class] _callReduce: reduceBlock keys: keys values: values rereduce: NO];
+}
+
+
+/** Adds the index rows with sequences greater than 'since' to the stored reductions: each
+    distinct key's new rows are reduced, then rereduced together with the key's stored value.
+    If 'since' is 0 the table is assumed to be empty, and is filled in from scratch. */
+- (CBLStatus) _addRowsSince: (SequenceNumber)since
+        toReductionsWithBlock: (CBLReduceBlock)reduceBlock
+{
+    CBLDatabase* db = _weakDB;
+    CBL_FMDatabase* fmdb = db.fmdb;
+    NSString* table = self.reduceTableName;
+    NSString* insertSQL = $sprintf(@"INSERT INTO %@ (key, value) VALUES (?, ?)", table);
+    NSString* selectSQL = $sprintf(@"SELECT value IS NULL, value FROM %@ WHERE key=?", table);
+    NSString* updateSQL = $sprintf(@"UPDATE %@ SET value=? WHERE key=?", table);
+    void* mode = collationMode(_collation);
+
+    NSMutableArray* keys = $marray(), *values = $marray();
+    // Reduces the rows collected in keys/values, which all have the same key, into the table:
+    CBLStatus (^flush)(void) = ^CBLStatus {
+        NSString* keyJSON = [keys[0] my_UTF8ToString];
+        id reduced = [CBLView _callReduce: reduceBlock keys: keys values: values rereduce: NO];
+        NSString* sql = insertSQL;
+        if (since > 0) {
+            CBL_FMResultSet* r = [fmdb executeQuery: selectSQL, keyJSON];
+            if (!r)
+                return db.lastDbError;
+            if ([r next]) {
+                BOOL outOfDate = [r boolForColumnIndex: 0];
+                NSData* storedValue = [r dataForColumnIndex: 1];
+                [r close];
+                if (outOfDate)
+                    return kCBLStatusOK;    // will be recomputed from all its rows
+                NSMutableArray* partials = [NSMutableArray arrayWithObjects: storedValue,
+                                                                             reduced, nil];
+                reduced = [CBLView _callReduce: reduceBlock keys: nil values: partials
+                                      rereduce: YES];
+                sql = updateSQL;
+            } else {
+                [r close];
+            }
+        }
+        NSString* valueJSON = toJSONString(reduced) ?: @"null";
+        BOOL ok = (sql == insertSQL) ? [fmdb executeUpdate: sql, keyJSON, valueJSON]
+                                     : [fmdb executeUpdate: sql, valueJSON, keyJSON];
+        return ok ? kCBLStatusOK : db.lastDbError;
+    };
+
+    CBL_FMResultSet* r = [fmdb executeQuery: $sprintf(@"SELECT key, value FROM %@ "
+                                                       "WHERE sequence>? ORDER BY key",
+                                                      self.mapTableName),
+                                             @(since)];
+    if (!r)
+        return db.lastDbError;
+    CBLStatus status = kCBLStatusOK;
+    while ([r next]) {
+        @autoreleasepool {
+            NSData* keyData = [r dataForColumnIndex: 0];
+            NSData* lastKeyData = keys.lastObject;
+            if (lastKeyData && CBLCollateJSON(mode, (int)keyData.length, keyData.bytes,
+                                              (int)lastKeyData.length, lastKeyData.bytes) != 0) {
+                status = flush();
+                [keys removeAllObjects];
+                [values removeAllObjects];
+                if (CBLStatusIsError(status))
+                    break;
+            }
+            [keys addObject: keyData];
+            [values addObject: [r dataForColumnIndex: 1] ?: $null];
+        }
+    }
+    [r close];
+    if (keys.count > 0 && !CBLStatusIsError(status))
+        status = flush();
+    return status;
+}
+
+
+/** Brings the stored reductions up to date after the index has been updated from 'lastSequence',
+    or creates them if there aren't any yet. If the view has no reduce block, any stored ones
+    can't be kept up to date, so they're dropped (to be rebuilt once there is one again.) */
+- (CBLStatus) _updateReductionsSince: (SequenceNumber)lastSequence {
+    if (!self.materializesReductions)
+        return kCBLStatusOK;
+    CBLReduceBlock reduceBlock = self.reduceBlock;
+    if (!reduceBlock)
+        return [self _dropReduceTable];
+    if (![self _reduceTableExists]) {
+        CBLStatus status = [self _createReduceTable];
+        if (CBLStatusIsError(status))
+            return status;
+        return [self _addRowsSince: 0 toReductionsWithBlock: reduceBlock];
+    }
+
+    CBLStatus status = [self _addRowsSince: lastSequence toReductionsWithBlock: reduceBlock];
+    if (CBLStatusIsError(status))
+        return status;
+
+    // Recompute the reductions of keys that have had rows deleted:
+    CBLDatabase* db = _weakDB;
+    CBL_FMDatabase* fmdb = db.fmdb;
+    NSString* table = self.reduceTableName;
+    CBL_FMResultSet* r = [fmdb executeQuery: $sprintf(@"SELECT key FROM %@ WHERE value IS NULL",
+                                                      table)];
+    if (!r)
         return db.lastDbError;
+    NSMutableArray* outOfDateKeys = $marray();
+    while ([r next])
+        [outOfDateKeys addObject: [r dataForColumnIndex: 0]];
+    [r close];
+    for (NSData* keyData in outOfDateKeys) {
+        @autoreleasepool {
+            NSString* keyJSON = [keyData my_UTF8ToString];
+            id reduced = [self _reductionOfRowsWithKey: keyData reduceBlock: reduceBlock];
+            BOOL ok;
+            if (reduced)
+                ok = [fmdb executeUpdate: $sprintf(@"UPDATE %@ SET value=? WHERE key=?", table),
+                                          toJSONString(reduced) ?: @"null", keyJSON];
+            else
+                ok = [fmdb executeUpdate: $sprintf(@"DELETE FROM %@ WHERE key=?", table),
+                                          keyJSON];
+            if (!ok)
+                return db.lastDbError;
+        }
+    }
+    LogTo(View, @"...Updated stored reductions of %@ (%u recomputed)",
+          _name, (unsigned)outOfDateKeys.count);
     return kCBLStatusOK;
 }
 
 
+#pragma mark - UPDATING:
+
+
 /** Updates the view's index, if necessary. (If no changes needed, returns kCBLStatusNotModified.)*/
 - (CBLStatus) updateIndex {
-    LogTo(View, @"Re-indexing view %@ ...", _name);
-    CBLMapBlock mapBlock = self.mapBlock;
-    Assert(mapBlock, @"Cannot reindex view %@ which has no map block set", _name);
-    
-    int viewID = self.viewID;
-    if (viewID <= 0)
-        return kCBLStatusNotFound;
-    CBLDatabase* db = _weakDB;
-    
+    return [[self class] updateIndexes: @[self]];
+}
+
+
+// The number of threads to call the map block on; 1 means to call it inline.
+// (Views compiled from JavaScript share one interpreter context, so they're always mapped
+// serially.)
+- (NSUInteger) effectiveMapParallelism {
+    return _expectsJSONStringsInEmit ? 1 : MAX(self.mapParallelism, (NSUInteger)1);
+}
+
+
+/** Updates the indexes of several views in a single pass over the new revisions.
+    (If no changes needed, returns kCBLStatusNotModified.)*/
++ (CBLStatus) updateIndexes: (NSArray*)views {
+    return [self updateIndexes: views throughSequence: INT64_MAX];
+}
+
+
++ (CBLStatus) updateIndexes: (NSArray*)views throughSequence: (SequenceNumber)maxSequence {
+    return [self updateIndexes: views throughSequence: maxSequence pauseBetweenChunks: NO];
+}
+
+
+/** Updates the indexes in chunks of sequences, each indexed and committed in its own transaction
+    so that the write lock is released periodically, and progress is saved along the way. The
+    chunk size adapts to the indexing rate, aiming for each chunk to take kIndexChunkTime. */
++ (CBLStatus) updateIndexes: (NSArray*)views
+            throughSequence: (SequenceNumber)maxSequence
+         pauseBetweenChunks: (BOOL)pause
+{
+    if (views.count == 0)
+        return kCBLStatusNotModified;
+    CBLDatabase* db = [views[0] database];
+    for (CBLView* view in views) {
+        Assert(view.mapBlock, @"Cannot reindex view %@ which has no map block set", view.name);
+        Assert(view.database == db, @"Views to reindex must be in the same database");
+        if (view.viewID <= 0)
+            return kCBLStatusNotFound;
+        if (![view _indexTableMatchesCollation]) {
+            // The index is in the wrong order for the view's collation, so start over:
+            LogTo(View, @"View %@'s index has the wrong collation; rebuilding it", view.name);
+            [view deleteIndex];
+        }
+    }
+
+    const SequenceNumber endSequence = MIN(db.lastSequenceNumber, maxSequence);
+    SequenceNumber chunkSize = kIndexChunkInitialSize;
+    CBLStatus result = kCBLStatusNotModified;
+    while (YES) {
+        SequenceNumber since = endSequence;
+        for (CBLView* view in views)
+            since = MIN(since, view.lastSequenceIndexed);
+        if (since < 0)
+            return db.lastDbError;
+        if (since >= endSequence)
+            break;
+        if (pause && result == kCBLStatusOK && !db.isInTransaction) {
+            // Between chunks, let writers that are waiting for the lock have a turn:
+            [db flushQueuedTransactions];
+            usleep((useconds_t)(kIndexChunkPause * 1.0e6));
+        }
+
+        SequenceNumber chunkEnd = MIN(since + chunkSize, endSequence);
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        CBLStatus status = [self _updateIndexes: views throughSequence: chunkEnd];
+        if (CBLStatusIsError(status))
+            return status;
+        result = kCBLStatusOK;
+
+        CFAbsoluteTime elapsed = MAX(CFAbsoluteTimeGetCurrent() - start, 0.001);
+        double rate = (chunkEnd - since) / elapsed;
+        chunkSize = (SequenceNumber)MIN(MAX(rate * kIndexChunkTime, kIndexChunkMinSize),
+                                        kIndexChunkMaxSize);
+        NSDictionary* progress = @{@"sequence": @(chunkEnd), @"endSequence": @(endSequence),
+                                   @"rate": @(rate)};
+        for (CBLView* view in views)
+            [[NSNotificationCenter defaultCenter]
+                            postNotificationName: kCBLViewIndexProgressNotification
+                                          object: view
+                                        userInfo: progress];
+    }
+    return result;
+}
+
+
+/** Indexes the revisions up to maxSequence in one transaction, and records it as the views'
+    lastSequence. */
++ (CBLStatus) _updateIndexes: (NSArray*)views throughSequence: (SequenceNumber)maxSequence {
+    CBLDatabase* db = [views[0] database];
+    LogTo(View, @"Re-indexing views %@ through sequence %lld ...",
+          [views my_map: ^(CBLView* view) {return view.name;}], maxSequence);
+
+    // The objects that write each stale view's new rows to its index table, each view's
+    // CBLIndexChangeLog (or NSNull), and blocks that add the changes to the logs after the commit:
+    NSMutableArray* writers = $marray();
+    NSMutableArray* changeLogs = $marray();
+    NSMutableArray* logChanges = $marray();
     CBLStatus status = [db _inTransaction: ^CBLStatus {
-        // Check whether we need to update at all:
-        const SequenceNumber lastSequence = self.lastSequenceIndexed;
-        const SequenceNumber dbMaxSequence = db.lastSequenceNumber;
-        if (lastSequence == dbMaxSequence) {
-            LogTo(View, @"...View %@ is up-to-date, sequence=%lld", _name, dbMaxSequence);
-            return kCBLStatusNotModified;
+        // Check which views need to be updated at all:
+        const SequenceNumber endSequence = MIN(db.lastSequenceNumber, maxSequence);
+        NSMutableArray* staleViews = $marray();
+        NSMutableArray* mapBlocks = $marray();
+        SequenceNumber lastSequences[views.count];
+        SequenceNumber minLastSequence = endSequence;
+        for (CBLView* view in views) {
+            const SequenceNumber lastSequence = view.lastSequenceIndexed;
+            if (lastSequence < 0)
+                return db.lastDbError;
+            if (lastSequence >= endSequence) {
+                LogTo(View, @"...View %@ is up-to-date, sequence=%lld", view.name, lastSequence);
+                continue;
+            }
+            if ([staleViews containsObject: view])
+                continue;
+            // Whether the index stores binary keys (see -setBinaryKeyFormat:), for the emit code:
+            view->_binaryKeys = [db.fmdb boolForQuery: @"SELECT binary_keys FROM views "
+                                                        "WHERE view_id=?", @(view.viewID)];
+            lastSequences[staleViews.count] = lastSequence;
+            minLastSequence = MIN(minLastSequence, lastSequence);
+            [staleViews addObject: view];
+            [mapBlocks addObject: view.mapBlock];
         }
+        const NSUInteger nViews = staleViews.count;
+        if (nViews == 0)
+            return kCBLStatusNotModified;
         
         CFAbsoluteTime updateIndexStart = CFAbsoluteTimeGetCurrent();
         
@@ -211,45 +836,104 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
         __block unsigned inserted = 0;
         CBL_FMDatabase* fmdb = db.fmdb;
         
-        // First remove obsolete emitted results from the 'maps' table:
-        __block SequenceNumber sequence = lastSequence;
-        if (lastSequence < 0)
-            return db.lastDbError;
-        BOOL ok;
-        if (lastSequence == 0) {
-            // If the lastSequence has been reset to 0, make sure to remove all map results:
-            ok = [fmdb executeUpdate: @"DELETE FROM maps WHERE view_id=?", @(_viewID)];
-        } else {
-            // Delete all obsolete map results (ones from since-replaced revisions):
-            ok = [fmdb executeUpdate: @"DELETE FROM maps WHERE view_id=? AND sequence IN ("
-                                            "SELECT parent FROM revs WHERE sequence>? "
-                                                "AND parent>0 AND parent<=?)",
-                                      @(_viewID), @(lastSequence), @(lastSequence)];
+        // First remove obsolete emitted results from the views' index tables:
+        unsigned deleted = 0;
+        for (NSUInteger v = 0; v < nViews; ++v) {
+            CBLView* view = staleViews[v];
+            const SequenceNumber lastSequence = lastSequences[v];
+            if (lastSequence == 0) {
+                // If the lastSequence has been reset to 0, start over with a new table:
+                CBLStatus status = [view _dropIndexTable];
+                if (CBLStatusIsError(status))
+                    return status;
+            }
+            CBLStatus status = [view _createIndexTable];
+            if (CBLStatusIsError(status))
+                return status;
+            CBLMapRowWriter* writer = [[CBLMapRowWriter alloc] initWithView: view];
+            [writers addObject: writer];
+            // If live queries are watching the view, keep track of the keys this update changes
+            // (unless it rebuilds the whole index, which changes all of them):
+            CBLIndexChangeLog* log = [view indexChangeLogCreatingIfMissing: NO];
+            if (log && lastSequence > 0)
+                writer.changedKeys = [NSMutableSet set];
+            [changeLogs addObject: log ?: $null];
+            if (lastSequence > 0) {
+                // Delete all obsolete map results (ones from since-replaced revisions):
+                NSString* condition = @"sequence IN (SELECT parent FROM revs WHERE sequence>? "
+                                            "AND sequence<=? AND parent>0 AND parent<=?)";
+                NSArray* args = @[@(lastSequence), @(endSequence), @(lastSequence)];
+                if (![writer noteKeysOfRowsWhere: condition arguments: args])
+                    return db.lastDbError;
+                NSString* sql = $sprintf(@"DELETE FROM %@ WHERE %@", view.mapTableName, condition);
+                if (![fmdb executeUpdate: sql withArgumentsInArray: args])
+                    return db.lastDbError;
+                deleted += fmdb.changes;
+            }
         }
-        if (!ok)
-            return db.lastDbError;
-#ifndef MY_DISABLE_LOGGING
-        unsigned deleted = fmdb.changes;
-#endif
         
         // This is the emit() block, which gets called from within the user-defined map() block
         // that's called down below.
+        __block CBLView* curView = nil;
+        __block CBLMapRowWriter* curWriter = nil;
+        __block SequenceNumber sequence = 0;
+        __block NSString* docID = nil;
         CBLMapEmitBlock emit = ^(id key, id value) {
-            int status = [self _emitKey: key value: value forSequence: sequence];
+            int status = [curView _emitKey: key value: value forSequence: sequence docID: docID
+                                  toWriter: curWriter];
             if (status != kCBLStatusOK)
                 emitStatus = status;
             else
                 inserted++;
         };
 
-        // Now scan every revision added since the last time the view was indexed:
+        // Views with parallelism read documents in batches; each batch is mapped by worker
+        // threads while the next one is read, and its rows are written once the next one has
+        // been started. These hold each view's batch being read and batch being mapped:
+        NSMutableArray* batches = $marray();
+        NSMutableArray* mappingBatches = $marray();
+        for (NSUInteger v = 0; v < nViews; ++v) {
+            [batches addObject: [NSNull null]];
+            [mappingBatches addObject: [NSNull null]];
+        }
+        // Starts mapping a view's current batch, then writes the rows of the batch before it:
+        CBLStatus (^cycleBatches)(NSUInteger) = ^CBLStatus(NSUInteger v) {
+            CBLView* view = staleViews[v];
+            CBLMapRowWriter* writer = writers[v];
+            CBLMapBatch* batch = $castIf(CBLMapBatch, batches[v]);
+            CBLMapBatch* prevBatch = $castIf(CBLMapBatch, mappingBatches[v]);
+            [batch startMapping: mapBlocks[v]
+                    parallelism: [view effectiveMapParallelism]
+                           view: view];
+            mappingBatches[v] = batch ?: [NSNull null];
+            batches[v] = [NSNull null];
+            if (!prevBatch)
+                return kCBLStatusOK;
+            return [prevBatch waitAndEnumerate: ^CBLStatus(SequenceNumber seq, NSString* rowDocID,
+                                                           id key, NSString* valueJSON,
+                                                           NSData* collatableKey) {
+                CBLStatus status = [writer addRowWithSequence: seq docID: rowDocID key: key
+                                                    valueJSON: valueJSON
+                                                collatableKey: collatableKey];
+                if (status == kCBLStatusOK)
+                    inserted++;
+                return status;
+            }];
+        };
+        // Waits for the workers to finish with every batch (after an error):
+        void (^abandonBatches)(void) = ^{
+            for (NSUInteger v = 0; v < nViews; ++v)
+                [$castIf(CBLMapBatch, mappingBatches[v]) waitAndEnumerate: nil];
+        };
+
+        // Now scan every revision added since the last time the views were indexed:
         CBL_FMResultSet* r;
         r = [fmdb executeQuery: @"SELECT revs.doc_id, sequence, docid, revid, json, no_attachments "
                                  "FROM revs, docs "
-                                 "WHERE sequence>? AND current!=0 AND deleted=0 "
+                                 "WHERE sequence>? AND sequence<=? AND current!=0 AND deleted=0 "
                                  "AND revs.doc_id = docs.doc_id "
                                  "ORDER BY revs.doc_id, revid DESC",
-                                 @(lastSequence)];
+                                 @(minLastSequence), @(endSequence)];
         if (!r)
             return db.lastDbError;
         
@@ -260,7 +944,7 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
                 // Get row values now, before the code below advances 'r':
                 int64_t doc_id = [r longLongIntForColumnIndex: 0];
                 sequence = [r longLongIntForColumnIndex: 1];
-                NSString* docID = [r stringForColumnIndex: 2];
+                docID = [r stringForColumnIndex: 2];
                 if ([docID hasPrefix: @"_design/"]) {     // design docs don't get indexed!
                     keepGoing = [r next];
                     continue;
@@ -268,6 +952,9 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
                 NSString* revID = [r stringForColumnIndex: 3];
                 NSData* json = [r dataForColumnIndex: 4];
                 BOOL noAttachments = [r boolForColumnIndex: 5];
+                // Sequences of all the doc's current revisions, and the newest of them:
+                NSMutableArray* currentSequences = [NSMutableArray arrayWithObject: @(sequence)];
+                SequenceNumber latestSequence = sequence;
             
                 // Iterate over following rows with the same doc_id -- these are conflicts.
                 // Skip them, but collect their revIDs:
@@ -276,32 +963,34 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
                     if (!conflicts)
                         conflicts = $marray();
                     [conflicts addObject: [r stringForColumnIndex: 3]];
+                    SequenceNumber conflictSequence = [r longLongIntForColumnIndex: 1];
+                    [currentSequences addObject: @(conflictSequence)];
+                    latestSequence = MAX(latestSequence, conflictSequence);
                 }
             
-                if (lastSequence > 0) {
+                if (minLastSequence > 0) {
                     // Find conflicts with documents from previous indexings.
                     BOOL first = YES;
                     CBL_FMResultSet* r2 = [fmdb executeQuery:
                                     @"SELECT revid, sequence FROM revs "
                                      "WHERE doc_id=? AND sequence<=? AND current!=0 AND deleted=0 "
                                      "ORDER BY revID DESC",
-                                    @(doc_id), @(lastSequence)];
+                                    @(doc_id), @(minLastSequence)];
                     if (!r2) {
                         [r close];
+                        abandonBatches();
                         return db.lastDbError;
                     }
                     while ([r2 next]) {
                         NSString* oldRevID = [r2 stringForColumnIndex:0];
+                        SequenceNumber oldSequence = [r2 longLongIntForColumnIndex: 1];
                         if (!conflicts)
                             conflicts = $marray();
                         [conflicts addObject: oldRevID];
+                        [currentSequences addObject: @(oldSequence)];
                         if (first) {
                             // This is the revision that used to be the 'winner'.
-                            // Remove its emitted rows:
                             first = NO;
-                            SequenceNumber oldSequence = [r2 longLongIntForColumnIndex: 1];
-                            [fmdb executeUpdate: @"DELETE FROM maps WHERE view_id=? AND sequence=?",
-                                                 @(_viewID), @(oldSequence)];
                             if (CBLCompareRevIDs(oldRevID, revID) > 0) {
                                 // It still 'wins' the conflict, so it's the one that
                                 // should be mapped [again], not the current revision!
@@ -323,16 +1012,45 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
                         }];
                     }
                 }
+
+                // The doc needs to be mapped by the views that haven't indexed its newest
+                // revision. Remove the rows they emitted from its older revisions, one of which
+                // used to be the 'winner':
+                BOOL needsMap[nViews];
+                BOOL anyNeedsMap = NO;
+                for (NSUInteger v = 0; v < nViews; ++v) {
+                    needsMap[v] = (latestSequence > lastSequences[v]);
+                    if (!needsMap[v])
+                        continue;
+                    anyNeedsMap = YES;
+                    if (lastSequences[v] == 0 || currentSequences.count < 2)
+                        continue;
+                    for (NSNumber* oldSequence in currentSequences) {
+                        if (oldSequence.longLongValue <= lastSequences[v]) {
+                            [writers[v] noteKeysOfRowsWhere: @"sequence=?"
+                                                  arguments: @[oldSequence]];
+                            [fmdb executeUpdate: $sprintf(@"DELETE FROM %@ WHERE sequence=?",
+                                                          [staleViews[v] mapTableName]),
+                                                 oldSequence];
+                        }
+                    }
+                }
+                if (!anyNeedsMap)
+                    continue;
                 
-                // Get the document properties, to pass to the map function:
-                CBLContentOptions contentOptions = _mapContentOptions;
+                // Get the document properties, to pass to the map functions:
+                CBLContentOptions contentOptions = 0;
+                for (NSUInteger v = 0; v < nViews; ++v)
+                    if (needsMap[v])
+                        contentOptions |= ((CBLView*)staleViews[v])->_mapContentOptions;
                 if (noAttachments)
                     contentOptions |= kCBLNoAttachments;
-                NSDictionary* properties = [db documentPropertiesFromJSON: json
-                                                                     docID: docID revID:revID
-                                                                   deleted: NO
-                                                                  sequence: sequence
-                                                                   options: contentOptions];
+                NSDictionary* properties = [db readOnlyDocumentPropertiesFromJSON: json
+                                                                             docID: docID
+                                                                             revID: revID
+                                                                           deleted: NO
+                                                                          sequence: sequence
+                                                                           options: contentOptions];
                 if (!properties) {
                     Warn(@"Failed to parse JSON of doc %@ rev %@", docID, revID);
                     continue;
@@ -341,42 +1059,107 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
                 if (conflicts) {
                     // Add a "_conflicts" property if there were conflicting revisions:
                     NSMutableDictionary* mutableProps = [properties mutableCopy];
-                    mutableProps[@"_conflicts"] = conflicts;
-                    properties = mutableProps;
-                }
-                
-                // Call the user-defined map() to emit new key/value pairs from this revision:
-                LogTo(ViewIndexVerbose, @" %@ call map(...) on doc %@ for sequence=%lld...",
-                      _name, docID, sequence);
-                @try {
-                    mapBlock(properties, emit);
-                    total++;
-                } @catch (NSException* x) {
-                    MYReportException(x, @"map block of view '%@'", _name);
-                    emitStatus = kCBLStatusCallbackError;
+                    mutableProps[@"_conflicts"] = [conflicts copy];
+                    properties = [mutableProps copy];
                 }
-                if (CBLStatusIsError(emitStatus)) {
-                    [r close];
-                    return emitStatus;
+                total++;
+
+                for (NSUInteger v = 0; v < nViews; ++v) {
+                    if (!needsMap[v])
+                        continue;
+                    curView = staleViews[v];
+                    curWriter = writers[v];
+                    if ([curView effectiveMapParallelism] > 1) {
+                        // Hand the document to the view's workers, a batch at a time:
+                        CBLMapBatch* batch = $castIf(CBLMapBatch, batches[v]);
+                        if (!batch) {
+                            batch = [[CBLMapBatch alloc] init];
+                            batches[v] = batch;
+                        }
+                        [batch addDocumentID: docID sequence: sequence properties: properties];
+                        if (batch.count >= kMapBatchSize)
+                            emitStatus = cycleBatches(v);
+                    } else {
+                        // Call the user-defined map() to emit new key/value pairs from this revision:
+                        LogTo(ViewIndexVerbose, @" %@ call map(...) on doc %@ for sequence=%lld...",
+                              curView.name, docID, sequence);
+                        CBLMapBlock mapBlock = mapBlocks[v];
+                        @try {
+                            mapBlock(properties, emit);
+                        } @catch (NSException* x) {
+                            MYReportException(x, @"map block of view '%@'", curView.name);
+                            emitStatus = kCBLStatusCallbackError;
+                        }
+                    }
+                    if (CBLStatusIsError(emitStatus)) {
+                        [r close];
+                        abandonBatches();
+                        return emitStatus;
+                    }
                 }
             }
         }
         [r close];
+
+        // Write the rows of the batches that are still in progress:
+        for (NSUInteger v = 0; v < nViews; ++v) {
+            emitStatus = cycleBatches(v);
+            if (!CBLStatusIsError(emitStatus))
+                emitStatus = cycleBatches(v);
+            if (CBLStatusIsError(emitStatus)) {
+                abandonBatches();
+                return emitStatus;
+            }
+        }
         
+        // Write the rows still buffered, then bring the views' stored reductions up to date:
+        for (NSUInteger v = 0; v < nViews; ++v) {
+            CBLStatus status = [writers[v] flush];
+            if (CBLStatusIsError(status))
+                return status;
+            status = [staleViews[v] _updateReductionsSince: lastSequences[v]];
+            if (CBLStatusIsError(status))
+                return status;
+        }
+
         // Finally, record the last revision sequence number that was indexed:
-        if (![fmdb executeUpdate: @"UPDATE views SET lastSequence=? WHERE view_id=?",
-                                   @(dbMaxSequence), @(viewID)])
-            return db.lastDbError;
+        for (NSUInteger v = 0; v < nViews; ++v) {
+            CBLView* view = staleViews[v];
+            if (![fmdb executeUpdate: @"UPDATE views SET lastSequence=? WHERE view_id=?",
+                                       @(endSequence), @(view.viewID)])
+                return db.lastDbError;
+            // ...and, once committed, log the keys that changed:
+            CBLIndexChangeLog* log = $castIf(CBLIndexChangeLog, changeLogs[v]);
+            if (log) {
+                NSSet* changedKeys = [writers[v] changedKeys];
+                SequenceNumber lastSequence = lastSequences[v];
+                [logChanges addObject: ^{
+                    [log addKeys: changedKeys fromSequence: lastSequence toSequence: endSequence];
+                }];
+            }
+        }
         
         CFAbsoluteTime updateIndexEnd = CFAbsoluteTimeGetCurrent();
         
-        LogTo(View, @"...Finished re-indexing view %@ to sequence=%lld (total %u, deleted %u, added %u), took %3.3fsec",
-              _name, dbMaxSequence, total, deleted, inserted, (updateIndexEnd - updateIndexStart));
+        LogTo(View, @"...Finished re-indexing %u views to sequence=%lld (total %u, deleted %u, added %u), took %3.3fsec",
+              (unsigned)nViews, endSequence, total, deleted, inserted,
+              (updateIndexEnd - updateIndexStart));
         return kCBLStatusOK;
     }];
+    for (CBLMapRowWriter* writer in writers)
+        [writer close];
+    if (!CBLStatusIsError(status)) {
+        for (void (^logChange)() in logChanges)
+            logChange();
+    }
+    if (status == kCBLStatusOK) {
+        for (CBLView* view in views)
+            [view _invalidateQueryCache];
+    }
     
     if (status >= kCBLStatusBadRequest)
-        Warn(@"CouchbaseLite: Failed to rebuild view '%@': %d", _name, status);
+        Warn(@"CouchbaseLite: Failed to rebuild views %@: %d",
+             [views my_map: ^(CBLView* view) {return view.name;}], status);
     return status;
 }
 
@@ -388,6 +1171,436 @@ static inline NSString* toJSONString(__unsafe_unretained id object ) {
 
 #pragma mark -
 
+@implementation CBLMapBatch
+{
+    NSMutableArray* _docIDs;
+    NSMutableArray* _sequences;
+    NSMutableArray* _properties;
+    NSMutableArray* _rows;          // one NSMutableArray of [key, valueJSON] pairs per document
+    NSMutableData* _statuses;       // one CBLStatus per document
+    int32_t _nextIndex;
+    NSUInteger _activeWorkers;
+    NSCondition* _condition;
+}
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _docIDs = [[NSMutableArray alloc] init];
+        _sequences = [[NSMutableArray alloc] init];
+        _properties = [[NSMutableArray alloc] init];
+        _rows = [[NSMutableArray alloc] init];
+        _condition = [[NSCondition alloc] init];
+    }
+    return self;
+}
+
+- (NSUInteger) count {
+    return _properties.count;
+}
+
+- (void) addDocumentID: (NSString*)docID
+              sequence: (SequenceNumber)sequence
+            properties: (NSDictionary*)properties
+{
+    [_docIDs addObject: docID];
+    [_sequences addObject: @(sequence)];
+    [_properties addObject: properties];
+    [_rows addObject: [[NSMutableArray alloc] init]];
+}
+
+- (void) startMapping: (CBLMapBlock)mapBlock
+          parallelism: (NSUInteger)parallelism
+                 view: (CBLView*)view
+{
+    _statuses = [NSMutableData dataWithLength: self.count * sizeof(CBLStatus)];
+    NSUInteger nWorkers = MIN(parallelism, self.count);
+    _activeWorkers = nWorkers;
+    for (NSUInteger i = 0; i < nWorkers; ++i) {
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            [self mapDocuments: mapBlock view: view];
+            [_condition lock];
+            --_activeWorkers;
+            [_condition broadcast];
+            [_condition unlock];
+        });
+    }
+}
+
+// Runs on a worker thread. Each worker claims the next unmapped document until none are left.
+- (void) mapDocuments: (CBLMapBlock)mapBlock view: (CBLView*)view {
+    NSUInteger count = self.count;
+    CBLStatus* statuses = _statuses.mutableBytes;
+    while (YES) {
+        NSUInteger index = (NSUInteger)OSAtomicIncrement32Barrier(&_nextIndex) - 1;
+        if (index >= count)
+            break;
+        @autoreleasepool {
+            NSMutableArray* rows = _rows[index];
+            CBLMapEmitBlock emit = ^(id key, id value) {
+                NSData* collatableKey = [view _collatableKeyForEmittedKey: key];
+                if (![key isKindOfClass: [CBLSpecialKey class]])
+                    key = [view _emittedJSON: key];
+                [rows addObject: @[key, [view _emittedJSON: value], collatableKey ?: $null]];
+            };
+            LogTo(ViewIndexVerbose, @" %@ call map(...) on doc %@ for sequence=%@...",
+                  view.name, _docIDs[index], _sequences[index]);
+            @try {
+                mapBlock(_properties[index], emit);
+            } @catch (NSException* x) {
+                MYReportException(x, @"map block of view '%@'", view.name);
+                statuses[index] = kCBLStatusCallbackError;
+            }
+        }
+    }
+}
+
+- (CBLStatus) waitAndEnumerate: (CBLStatus(^)(SequenceNumber sequence, NSString* docID, id key,
+                                               NSString* valueJSON, NSData* collatableKey))block
+{
+    [_condition lock];
+    while (_activeWorkers > 0)
+        [_condition wait];
+    [_condition unlock];
+    if (!block)
+        return kCBLStatusOK;
+
+    const CBLStatus* statuses = _statuses.bytes;
+    NSUInteger count = self.count;
+    for (NSUInteger i = 0; i < count; ++i) {
+        if (CBLStatusIsError(statuses[i]))
+            return statuses[i];
+        SequenceNumber sequence = [_sequences[i] longLongValue];
+        for (NSArray* row in _rows[i]) {
+            CBLStatus status = block(sequence, _docIDs[i], row[0], row[1],
+                                     $castIf(NSData, row[2]));
+            if (CBLStatusIsError(status))
+                return status;
+        }
+    }
+    return kCBLStatusOK;
+}
+
+@end
+
+
+
+
+@implementation CBLMapRowWriter
+{
+    CBLDatabase* _db;
+    NSString* _table;
+    NSMutableData* _sequences;      // one SequenceNumber per buffered row
+    NSMutableArray* _docIDs;
+    NSMutableArray* _keys;          // JSON strings or CBLSpecialKeys
+    NSMutableArray* _values;        // JSON strings
+    NSMutableArray* _collatableKeys;// NSData, or NSNull if the index doesn't use binary keys
+    sqlite3_stmt* _batchStatement;  // inserts kInsertBatchSize rows
+    sqlite3_stmt* _rowStatement;    // inserts a single row
+    sqlite3_stmt* _fullTextStatement, *_bboxStatement;     // insert full-text & geo keys...
+    NSUInteger _fullTextStatementRows, _bboxStatementRows; // ...this many at a time
+    NSMutableSet* _changedKeys;
+}
+
+@synthesize changedKeys=_changedKeys;
+
+- (instancetype) initWithView: (CBLView*)view {
+    self = [super init];
+    if (self) {
+        _db = view.database;
+        _table = view.mapTableName;
+        _sequences = [[NSMutableData alloc] initWithCapacity: kInsertBatchSize *
+                                                              sizeof(SequenceNumber)];
+        _docIDs = [[NSMutableArray alloc] initWithCapacity: kInsertBatchSize];
+        _keys = [[NSMutableArray alloc] initWithCapacity: kInsertBatchSize];
+        _values = [[NSMutableArray alloc] initWithCapacity: kInsertBatchSize];
+        _collatableKeys = [[NSMutableArray alloc] initWithCapacity: kInsertBatchSize];
+    }
+    return self;
+}
+
+- (void) dealloc {
+    [self close];
+}
+
+- (void) close {
+    sqlite3_finalize(_batchStatement);
+    _batchStatement = NULL;
+    sqlite3_finalize(_rowStatement);
+    _rowStatement = NULL;
+    sqlite3_finalize(_fullTextStatement);
+    _fullTextStatement = NULL;
+    sqlite3_finalize(_bboxStatement);
+    _bboxStatement = NULL;
+}
+
+- (CBLStatus) addRowWithSequence: (SequenceNumber)sequence
+                           docID: (NSString*)docID
+                             key: (id)key
+                       valueJSON: (NSString*)valueJSON
+                   collatableKey: (NSData*)collatableKey
+{
+    LogTo(ViewIndexVerbose, @" %@ emit(%@, %@) for sequence=%lld",
+          _table, key, valueJSON, sequence);
+    [_sequences appendBytes: &sequence length: sizeof(sequence)];
+    [_docIDs addObject: docID];
+    [_keys addObject: key];
+    [_changedKeys addObject: ([key isKindOfClass: [CBLSpecialKey class]] ? $null : key)];
+    [_values addObject: valueJSON];
+    [_collatableKeys addObject: collatableKey ?: $null];
+    if (_keys.count >= kInsertBatchSize)
+        return [self flush];
+    return kCBLStatusOK;
+}
+
+- (CBLStatus) flush {
+    NSUInteger count = _keys.count;
+    if (count == 0)
+        return kCBLStatusOK;
+    int64_t fullTextIDs[count], bboxIDs[count];
+    CBLStatus status = [self writeSpecialKeysWithFullTextIDs: fullTextIDs bboxIDs: bboxIDs];
+
+    // Insert the rows, kInsertBatchSize at a time and then any left over one at a time:
+    sqlite3* handle = _db.fmdb.sqliteHandle;
+    const SequenceNumber* sequences = _sequences.bytes;
+    NSUInteger row = 0;
+    while (row < count && !CBLStatusIsError(status)) {
+        @autoreleasepool {
+            NSUInteger nRows = (count - row >= kInsertBatchSize) ? kInsertBatchSize : 1;
+            sqlite3_stmt** statement = (nRows > 1) ? &_batchStatement : &_rowStatement;
+            if (!*statement) {
+                NSMutableString* sql = [$sprintf(@"INSERT INTO %@ (sequence, docid, key, value, "
+                                                  "fulltext_id, bbox_id, geokey, ckey) VALUES ",
+                                                 _table) mutableCopy];
+                for (NSUInteger i = 0; i < nRows; ++i)
+                    [sql appendString: (i ? @",(?,?,?,?,?,?,?,?)" : @"(?,?,?,?,?,?,?,?)")];
+                if (sqlite3_prepare_v2(handle, sql.UTF8String, -1, statement, NULL) != SQLITE_OK) {
+                    status = _db.lastDbError;
+                    break;
+                }
+            }
+            sqlite3_stmt* stmt = *statement;
+            int param = 0;
+            for (NSUInteger i = 0; i < nRows; ++i, ++row) {
+                CBLSpecialKey* specialKey = $castIf(CBLSpecialKey, _keys[row]);
+                NSString* keyJSON = specialKey ? @"null" : _keys[row];
+                NSData* geoKey = specialKey.geoJSONData;
+                NSData* collatableKey = $castIf(NSData, _collatableKeys[row]);
+                sqlite3_bind_int64(stmt, ++param, sequences[row]);
+                sqlite3_bind_text(stmt, ++param, [_docIDs[row] UTF8String], -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, ++param, keyJSON.UTF8String, -1, SQLITE_STATIC);
+                sqlite3_bind_text(stmt, ++param, [_values[row] UTF8String], -1, SQLITE_STATIC);
+                if (fullTextIDs[row])
+                    sqlite3_bind_int64(stmt, ++param, fullTextIDs[row]);
+                else
+                    sqlite3_bind_null(stmt, ++param);
+                if (bboxIDs[row])
+                    sqlite3_bind_int64(stmt, ++param, bboxIDs[row]);
+                else
+                    sqlite3_bind_null(stmt, ++param);
+                if (geoKey)     // (an empty geoKey, meaning a point, has to be bound as a blob)
+                    sqlite3_bind_blob(stmt, ++param, geoKey.bytes ?: "", (int)geoKey.length,
+                                      SQLITE_STATIC);
+                else
+                    sqlite3_bind_null(stmt, ++param);
+                if (collatableKey)
+                    sqlite3_bind_blob(stmt, ++param, collatableKey.bytes ?: "",
+                                      (int)collatableKey.length, SQLITE_STATIC);
+                else
+                    sqlite3_bind_null(stmt, ++param);
+            }
+            if (sqlite3_step(stmt) != SQLITE_DONE)
+                status = _db.lastDbError;
+            sqlite3_reset(stmt);
+            sqlite3_clear_bindings(stmt);
+        }
+    }
+
+    [_sequences setLength: 0];
+    [_docIDs removeAllObjects];
+    [_keys removeAllObjects];
+    [_values removeAllObjects];
+    [_collatableKeys removeAllObjects];
+    return status;
+}
+
+- (BOOL) noteKeysOfRowsWhere: (NSString*)condition arguments: (NSArray*)arguments {
+    if (!_changedKeys)
+        return YES;
+    NSString* sql = $sprintf(@"SELECT key, fulltext_id IS NOT NULL OR bbox_id IS NOT NULL "
+                              "FROM %@ WHERE %@", _table, condition);
+    CBL_FMResultSet* r = [_db.fmdb executeQuery: sql withArgumentsInArray: arguments];
+    if (!r)
+        return NO;
+    while ([r next])
+        [_changedKeys addObject: ([r boolForColumnIndex: 1] ? $null : [r stringForColumnIndex: 0])];
+    [r close];
+    return YES;
+}
+
+// Inserts the buffered rows' full-text and geo keys into the 'fulltext' and 'bboxes' tables, with
+// one multi-row INSERT each, and stores their row IDs into the arrays (or 0 for rows without one.)
+// The virtual tables assign the IDs themselves, each new row getting the next one after the
+// table's highest, so the rows of one INSERT have consecutive IDs ending at last_insert_rowid().
+- (CBLStatus) writeSpecialKeysWithFullTextIDs: (int64_t*)fullTextIDs bboxIDs: (int64_t*)bboxIDs {
+    NSUInteger count = _keys.count, nTexts = 0, nRects = 0;
+    for (NSUInteger i = 0; i < count; ++i) {
+        fullTextIDs[i] = bboxIDs[i] = 0;
+        CBLSpecialKey* specialKey = $castIf(CBLSpecialKey, _keys[i]);
+        if (specialKey.text)
+            ++nTexts;
+        else if (specialKey)
+            ++nRects;
+    }
+
+    if (nTexts > 0) {
+        sqlite3_stmt* stmt = [self statement: &_fullTextStatement rows: &_fullTextStatementRows
+                                    inserting: nTexts into: @"fulltext (content)" columns: 1];
+        if (!stmt)
+            return _db.lastDbError;
+        int param = 0;
+        for (NSUInteger i = 0; i < count; ++i) {
+            NSString* text = $castIf(CBLSpecialKey, _keys[i]).text;
+            if (text)
+                sqlite3_bind_text(stmt, ++param, text.UTF8String, -1, SQLITE_TRANSIENT);
+        }
+        int64_t nextID;
+        if (![self stepInsert: stmt rows: nTexts firstID: &nextID])
+            return _db.lastDbError;
+        for (NSUInteger i = 0; i < count; ++i) {
+            if ($castIf(CBLSpecialKey, _keys[i]).text)
+                fullTextIDs[i] = nextID++;
+        }
+    }
+
+    if (nRects > 0) {
+        sqlite3_stmt* stmt = [self statement: &_bboxStatement rows: &_bboxStatementRows
+                                    inserting: nRects into: @"bboxes (x0,y0,x1,y1)" columns: 4];
+        if (!stmt)
+            return _db.lastDbError;
+        int param = 0;
+        for (NSUInteger i = 0; i < count; ++i) {
+            CBLSpecialKey* specialKey = $castIf(CBLSpecialKey, _keys[i]);
+            if (specialKey && !specialKey.text) {
+                CBLGeoRect rect = specialKey.rect;
+                sqlite3_bind_double(stmt, ++param, rect.min.x);
+                sqlite3_bind_double(stmt, ++param, rect.min.y);
+                sqlite3_bind_double(stmt, ++param, rect.max.x);
+                sqlite3_bind_double(stmt, ++param, rect.max.y);
+            }
+        }
+        int64_t nextID;
+        if (![self stepInsert: stmt rows: nRects firstID: &nextID])
+            return _db.lastDbError;
+        for (NSUInteger i = 0; i < count; ++i) {
+            CBLSpecialKey* specialKey = $castIf(CBLSpecialKey, _keys[i]);
+            if (specialKey && !specialKey.text)
+                bboxIDs[i] = nextID++;
+        }
+    }
+    return kCBLStatusOK;
+}
+
+// Returns a prepared statement that inserts nRows rows into a table, reusing the one in
+// *ioStatement if it inserts the same number of rows (as it usually does, since a flush is
+// normally kInsertBatchSize rows) and otherwise replacing it.
+- (sqlite3_stmt*) statement: (sqlite3_stmt**)ioStatement
+                       rows: (NSUInteger*)ioRows
+                  inserting: (NSUInteger)nRows
+                       into: (NSString*)tableAndColumns
+                    columns: (NSUInteger)nColumns
+{
+    if (*ioStatement && *ioRows == nRows)
+        return *ioStatement;
+    sqlite3_finalize(*ioStatement);
+    *ioStatement = NULL;
+    NSMutableString* row = [@"(?" mutableCopy];
+    for (NSUInteger i = 1; i < nColumns; ++i)
+        [row appendString: @",?"];
+    [row appendString: @")"];
+    NSMutableString* sql = [$sprintf(@"INSERT INTO %@ VALUES %@", tableAndColumns, row)
+                                mutableCopy];
+    for (NSUInteger i = 1; i < nRows; ++i)
+        [sql appendFormat: @",%@", row];
+    if (sqlite3_prepare_v2(_db.fmdb.sqliteHandle, sql.UTF8String, -1, ioStatement, NULL)
+            != SQLITE_OK)
+        return NULL;
+    *ioRows = nRows;
+    return *ioStatement;
+}
+
+// Runs a statement from -statement:rows:inserting:into:columns:, and sets *outFirstID to the row
+// ID of the first of the nRows rows it inserted.
+- (BOOL) stepInsert: (sqlite3_stmt*)stmt rows: (NSUInteger)nRows firstID: (int64_t*)outFirstID {
+    sqlite3* handle = _db.fmdb.sqliteHandle;
+    BOOL ok = (sqlite3_step(stmt) == SQLITE_DONE);
+    if (ok)
+        *outFirstID = sqlite3_last_insert_rowid(handle) - (int64_t)nRows + 1;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return ok;
+}
+
+@end
+
+
+
+@implementation CBLIndexChangeLog
+{
+    SequenceNumber _startSequence, _endSequence;    // The updates logged span (start, end]
+    NSMutableArray* _entries;   // One per update: @[@(its end sequence), set of its keys]
+    NSUInteger _keyCount;       // Total number of keys in _entries
+}
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _startSequence = _endSequence = -1;     // nothing known yet
+        _entries = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void) addKeys: (NSSet*)keys fromSequence: (SequenceNumber)from toSequence: (SequenceNumber)to {
+    @synchronized(self) {
+        if (!keys || from != _endSequence) {
+            // All keys changed, or there was an update that wasn't logged, so start over:
+            [_entries removeAllObjects];
+            _keyCount = 0;
+            _startSequence = keys ? from : to;
+        }
+        if (keys) {
+            [_entries addObject: @[@(to), [keys copy]]];
+            _keyCount += keys.count;
+        }
+        _endSequence = to;
+        // Forget the oldest updates if there are too many keys:
+        while (_keyCount > kIndexChangeLogMaxKeys && _entries.count > 0) {
+            NSArray* entry = _entries[0];
+            _keyCount -= [entry[1] count];
+            _startSequence = [entry[0] longLongValue];
+            [_entries removeObjectAtIndex: 0];
+        }
+    }
+}
+
+- (NSArray*) keySetsFromSequence: (SequenceNumber)from toSequence: (SequenceNumber)to {
+    @synchronized(self) {
+        if (to < from || from < _startSequence || to > _endSequence)
+            return nil;
+        NSMutableArray* keySets = $marray();
+        for (NSArray* entry in _entries) {
+            if ([entry[0] longLongValue] > from)
+                [keySets addObject: entry[1]];
+        }
+        return keySets;
+    }
+}
+
+@end
+
+
+
 @implementation CBLSpecialKey
 {
     NSString* _text;
@@ -512,3 +1725,69 @@ static void CBLComputeFTSRank(sqlite3_context *pCtx, int nVal, sqlite3_value **a
     sqlite3_result_double(pCtx, score);
     return;
 }
+
+
+// SQL function collatablekey(key), used by the schema migration that moves index rows to
+// per-view tables: returns the CBLCollatableKey of a JSON key in the default collation, or null
+// if the key can't be parsed.
+static void CBLCollatableKeyFunc(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    const char* utf8 = (const char*)sqlite3_value_text(apVal[0]);
+    NSString* json = utf8 ? [[NSString alloc] initWithUTF8String: utf8] : nil;
+    NSData* key = json ? CBLCollatableKeyFromJSON(json, kCBLCollateJSON_Unicode) : nil;
+    if (key)
+        sqlite3_result_blob(pCtx, key.bytes, (int)key.length, SQLITE_TRANSIENT);
+    else
+        sqlite3_result_null(pCtx);
+}
+
+
+// SQL function groupkey(key, level), used for grouped queries with built-in reduce functions.
+// Returns the JSON of the first 'level' items of an array key, or the key itself if it isn't an
+// array with more items than that (like groupKey() in CBLView+Querying.m.) Since keys in the
+// index are compact JSON, this just has to find the comma after the last item to keep.
+static void CBLGroupKey(sqlite3_context *pCtx, int nVal, sqlite3_value **apVal) {
+    const char* json = (const char*)sqlite3_value_text(apVal[0]);
+    int length = sqlite3_value_bytes(apVal[0]);
+    int level = sqlite3_value_int(apVal[1]);
+    if (json && level > 0 && length > 0 && json[0] == '[') {
+        int depth = 0, items = 0;
+        bool inString = false;
+        for (int i = 1; i < length; i++) {
+            char c = json[i];
+            if (inString) {
+                if (c == '\\')
+                    i++;
+                else if (c == '"')
+                    inString = false;
+                continue;
+            }
+            switch (c) {
+                case '"':
+                    inString = true;
+                    break;
+                case '[':
+                case '{':
+                    depth++;
+                    break;
+                case ']':
+                case '}':
+                    depth--;
+                    break;
+                case ',':
+                    if (depth == 0 && ++items == level) {
+                        char* prefix = sqlite3_malloc(i + 1);
+                        if (!prefix) {
+                            sqlite3_result_error_nomem(pCtx);
+                            return;
+                        }
+                        memcpy(prefix, json, i);
+                        prefix[i] = ']';
+                        sqlite3_result_text(pCtx, prefix, i + 1, sqlite3_free);
+                        return;
+                    }
+                    break;
+            }
+        }
+    }
+    sqlite3_result_value(pCtx, apVal[0]);
+}
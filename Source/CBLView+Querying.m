@@ -17,7 +17,10 @@
 #import "CBLInternal.h"
 #import "CouchbaseLitePrivate.h"
 #import "CBLCollateJSON.h"
+#import "CBLBase64.h"
+#import "CBLCanonicalJSON.h"
 #import "CBLMisc.h"
+#import "CBLQueryRowStream.h"
 
 #import "FMDatabase.h"
 #import "FMDatabaseAdditions.h"
@@ -54,67 +57,518 @@ static id fromJSON( NSData* json ) {
 }
 
 
+#pragma mark - CURSORS:
+
+
+// A cursor is the URL-safe base64 encoding of the JSON array [key, docID, skip]: the key and doc
+// ID of the last row, and the number of rows at the end with that same key and doc ID (which can
+// happen if a document emits the same key more than once.)
+// A reduced or grouped query's limit applies to the map rows before they're reduced, so one more
+// map row wouldn't mean one more result row, just a different result. Those queries don't page.
+static BOOL queryIsPageable(const CBLQueryOptions* options, CBLView* view) {
+    if (options->group || options->groupLevel > 0)
+        return NO;
+    return !view.reduceBlock || (options->reduceSpecified && !options->reduce);
+}
+
+
+CBLQueryOptions CBLQueryOptionsWithExtraRow(const CBLQueryOptions* options, CBLView* view) {
+    CBLQueryOptions result = *options;
+    if (result.limit < kDefaultCBLQueryOptions.limit - 1 && queryIsPageable(options, view))
+        ++result.limit;
+    return result;
+}
+
+
+NSString* CBLQueryCursorAfterRows(NSArray** ioRows, const CBLQueryOptions* options,
+                                  CBLView* view)
+{
+    NSArray* rows = *ioRows;
+    if (options->limit == kDefaultCBLQueryOptions.limit || rows.count <= options->limit
+            || !queryIsPageable(options, view))
+        return nil;     // There are no more rows (or no extra row was asked for)
+    rows = [rows subarrayWithRange: NSMakeRange(0, options->limit)];
+    *ioRows = rows;
+    if (rows.count == 0 || options->keys || options->fullTextQuery || options->bbox
+            || options->postFilter || options->sortDescriptors)
+        return nil;
+    CBLQueryRow* last = rows.lastObject;
+    id key = last.key;
+    NSString* docID = last.sourceDocumentID;
+    if (!docID)
+        return nil;     // Reduced or grouped rows can't be resumed from
+    unsigned skip = 0;
+    for (CBLQueryRow* row in rows.reverseObjectEnumerator) {
+        if (!$equal(row.sourceDocumentID, docID) || !$equal(row.key, key))
+            break;
+        ++skip;
+    }
+    if (skip == rows.count && options->skip > 0) {
+        // Every row is at the same position; the rows skipped before them may be too:
+        if (!$equal(options->startKey, key) || !$equal(options->startKeyDocID, docID))
+            return nil;
+        skip += options->skip;
+    }
+    NSData* json = [CBLJSON dataWithJSONObject: @[key ?: $null, docID, @(skip)]
+                                       options: 0 error: NULL];
+    if (!json)
+        return nil;
+    NSString* cursor = [CBLBase64 encode: json];
+    cursor = [cursor stringByReplacingOccurrencesOfString: @"+" withString: @"-"];
+    cursor = [cursor stringByReplacingOccurrencesOfString: @"/" withString: @"_"];
+    return [cursor stringByReplacingOccurrencesOfString: @"=" withString: @""];
+}
+
+
+BOOL CBLQueryCursorDecode(NSString* cursor, id* outStartKey, NSString** outStartKeyDocID,
+                          unsigned* outSkip)
+{
+    NSData* json = [CBLBase64 decodeURLSafe: cursor];
+    NSArray* items = $castIf(NSArray, fromJSON(json));
+    if (items.count != 3)
+        return NO;
+    NSString* docID = $castIf(NSString, items[1]);
+    NSNumber* skip = $castIf(NSNumber, items[2]);
+    if (!docID || !skip)
+        return NO;
+    *outStartKey = items[0];
+    *outStartKeyDocID = docID;
+    *outSkip = skip.unsignedIntValue;
+    return YES;
+}
+
+
+#pragma mark - POST-FILTERING AND SORTING:
+
+
+// Selects the rows of a query with a postFilter and/or sortDescriptors, as they're read: it drops
+// the rows the filter rejects, and applies the sort, skip and limit. If sorting with a limit, it
+// only keeps the best skip+limit rows so far, in a heap whose root is the worst of them, so memory
+// use doesn't depend on the number of rows read. Rows that compare the same stay in the order
+// they were added.
+@interface CBLQueryRowSelector : NSObject
+- (instancetype) initWithOptions: (const CBLQueryOptions*)options;
+/** Adds a row. Returns NO if no more rows are needed (which only happens without sorting.) */
+- (BOOL) addRow: (CBLQueryRow*)row;
+/** The selected rows, in order. */
+@property (readonly) NSMutableArray* rows;
+@end
+
+
+@implementation CBLQueryRowSelector
+{
+    NSPredicate* _filter;
+    NSArray* _sortDescriptors;
+    NSUInteger _skip, _limit;
+    NSUInteger _capacity;           // If sorting, the max number of rows kept (skip + limit)
+    NSUInteger _nAdded;             // Number of rows passing the filter so far
+    NSMutableArray* _rows;          // If sorting, the heap; else the selected rows
+    NSMutableData* _orders;         // If sorting, the _nAdded count when each row was added
+}
+
+
+- (instancetype) initWithOptions: (const CBLQueryOptions*)options {
+    self = [super init];
+    if (self) {
+        _filter = options->postFilter;
+        _sortDescriptors = options->sortDescriptors.count > 0 ? options->sortDescriptors : nil;
+        _skip = options->skip;
+        _limit = options->limit;
+        _rows = $marray();
+        if (_sortDescriptors) {
+            _capacity = (_limit == kDefaultCBLQueryOptions.limit) ? NSUIntegerMax : _skip + _limit;
+            _orders = [NSMutableData data];
+        }
+    }
+    return self;
+}
+
+
+// Compares a row with a row of the heap by the sort descriptors.
+- (NSComparisonResult) compareRow: (CBLQueryRow*)row withRowAt: (NSUInteger)i {
+    for (NSSortDescriptor* sort in _sortDescriptors) {
+        NSComparisonResult result = [sort compareObject: row toObject: _rows[i]];
+        if (result != NSOrderedSame)
+            return result;
+    }
+    return NSOrderedSame;
+}
+
+
+// Compares two rows of the heap by the sort descriptors, then by the order they were added.
+- (NSComparisonResult) compareRowAt: (NSUInteger)i withRowAt: (NSUInteger)j {
+    NSComparisonResult result = [self compareRow: _rows[i] withRowAt: j];
+    if (result != NSOrderedSame)
+        return result;
+    if (i == j)
+        return NSOrderedSame;
+    const NSUInteger* orders = _orders.bytes;
+    return (orders[i] < orders[j]) ? NSOrderedAscending : NSOrderedDescending;
+}
+
+
+- (void) swapRowAt: (NSUInteger)i withRowAt: (NSUInteger)j {
+    [_rows exchangeObjectAtIndex: i withObjectAtIndex: j];
+    NSUInteger* orders = _orders.mutableBytes;
+    NSUInteger order = orders[i];
+    orders[i] = orders[j];
+    orders[j] = order;
+}
+
+
+- (void) siftUp: (NSUInteger)i {
+    while (i > 0) {
+        NSUInteger parent = (i - 1) / 2;
+        if ([self compareRowAt: i withRowAt: parent] != NSOrderedDescending)
+            break;
+        [self swapRowAt: i withRowAt: parent];
+        i = parent;
+    }
+}
+
+
+- (void) siftDown: (NSUInteger)i {
+    NSUInteger count = _rows.count;
+    for (;;) {
+        NSUInteger worst = i, child = 2 * i + 1;
+        if (child < count && [self compareRowAt: child withRowAt: worst] == NSOrderedDescending)
+            worst = child;
+        if (child + 1 < count
+                && [self compareRowAt: child + 1 withRowAt: worst] == NSOrderedDescending)
+            worst = child + 1;
+        if (worst == i)
+            break;
+        [self swapRowAt: i withRowAt: worst];
+        i = worst;
+    }
+}
+
+
+- (BOOL) addRow: (CBLQueryRow*)row {
+    if (_filter && ![_filter evaluateWithObject: row])
+        return YES;
+    NSUInteger order = _nAdded++;
+    if (!_sortDescriptors) {
+        if (_limit == 0)
+            return NO;
+        if (order >= _skip)
+            [_rows addObject: row];
+        return _rows.count < _limit;
+    }
+    if (_capacity == 0)
+        return YES;
+    if (_rows.count < _capacity) {
+        [_rows addObject: row];
+        [_orders appendBytes: &order length: sizeof(order)];
+        [self siftUp: _rows.count - 1];
+    } else {
+        // Replace the worst row kept, if this one is better (it's worse if they're the same,
+        // since it was added later):
+        if ([self compareRow: row withRowAt: 0] != NSOrderedAscending)
+            return YES;
+        _rows[0] = row;
+        ((NSUInteger*)_orders.mutableBytes)[0] = order;
+        [self siftDown: 0];
+    }
+    return YES;
+}
+
+
+- (NSMutableArray*) rows {
+    if (!_sortDescriptors)
+        return _rows;
+    // Sort what's left in the heap:
+    NSMutableArray* indexes = [NSMutableArray arrayWithCapacity: _rows.count];
+    for (NSUInteger i = 0; i < _rows.count; ++i)
+        [indexes addObject: @(i)];
+    [indexes sortUsingComparator: ^NSComparisonResult(NSNumber* i, NSNumber* j) {
+        return [self compareRowAt: i.unsignedIntegerValue withRowAt: j.unsignedIntegerValue];
+    }];
+    NSMutableArray* sorted = [NSMutableArray arrayWithCapacity: _rows.count];
+    for (NSNumber* i in indexes)
+        [sorted addObject: _rows[i.unsignedIntegerValue]];
+    NSUInteger count = sorted.count;
+    NSRange range = NSMakeRange(MIN(_skip, count), 0);
+    range.length = MIN(count - range.location, _limit);
+    return [[sorted subarrayWithRange: range] mutableCopy];
+}
+
+
+@end
+
+
+static NSMutableArray* selectRows(CBLQueryRowSelector* selector, NSArray* rows) {
+    if (!selector || !rows)
+        return (NSMutableArray*)rows;
+    for (CBLQueryRow* row in rows) {
+        if (![selector addRow: row])
+            break;
+    }
+    return selector.rows;
+}
+
+
+NSArray* CBLQuerySelectRows(NSArray* rows, const CBLQueryOptions* options) {
+    if (!options->postFilter && !options->sortDescriptors)
+        return rows;
+    return selectRows([[CBLQueryRowSelector alloc] initWithOptions: options], rows);
+}
+
+
+#pragma mark - RESULT CACHE:
+
+
+// Limits on the results a view's CBLQueryResultCache holds:
+#define kQueryCacheMaxEntries 50
+#define kQueryCacheMaxBytes (2*1024*1024)
+
+
+// Remembers the rows returned by a view's recent queries, so a query that's repeated before the
+// index changes can be answered without running it again. Every entry is only valid for the state
+// of the index it was read from (the view's ID, map version, key format and collation, and last
+// indexed sequence), so the cache is emptied whenever a lookup finds that state has changed. It's bounded by the number of
+// entries and the estimated memory size of their rows, evicting the least recently used first.
+// CBLQueryRows get modified by the enumerators they're returned through (which set their
+// database), so the cache keeps its own copies of the rows, and returns new copies of them.
+// Thread-safe.
+@interface CBLQueryResultCache : NSObject
+/** Incremented every time the cache is emptied. */
+@property (readonly) NSUInteger generation;
+/** Returns copies of the rows stored for a query, or nil if there are none for this index state. */
+- (NSArray*) rowsForKey: (NSString*)key indexState: (NSArray*)indexState;
+/** Stores copies of the rows of a query, unless the cache has been emptied since the given
+    generation (in which case they may be out of date.) */
+- (void) setRows: (NSArray*)rows forKey: (NSString*)key
+      indexState: (NSArray*)indexState generation: (NSUInteger)generation;
+- (void) removeAllRows;
+/** Counts of hits, misses, stored and evicted results, and the current entries and bytes. */
+@property (readonly) NSDictionary* stats;
+@end
+
+
+static NSArray* copyRows(NSArray* rows) {
+    NSMutableArray* copies = [NSMutableArray arrayWithCapacity: rows.count];
+    for (CBLQueryRow* row in rows)
+        [copies addObject: [row copy]];
+    return copies;
+}
+
+
+@implementation CBLQueryResultCache
+{
+    NSArray* _indexState;                   // Index state the entries were read from
+    NSMutableDictionary* _entries;          // Query key -> NSArray of rows
+    NSMutableDictionary* _sizes;            // Query key -> NSNumber, rows' estimated size
+    NSMutableArray* _recentKeys;            // Query keys, least recently used first
+    size_t _totalSize;
+    NSUInteger _generation;
+    uint64_t _hits, _misses, _stores, _evictions;
+}
+
+@synthesize generation=_generation;
+
+
+- (instancetype) init {
+    self = [super init];
+    if (self) {
+        _entries = [[NSMutableDictionary alloc] init];
+        _sizes = [[NSMutableDictionary alloc] init];
+        _recentKeys = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+
+- (NSArray*) rowsForKey: (NSString*)key indexState: (NSArray*)indexState {
+    NSArray* rows;
+    @synchronized(self) {
+        if (!$equal(indexState, _indexState))
+            [self _removeAll];
+        rows = _entries[key];
+        if (rows) {
+            ++_hits;
+            [_recentKeys removeObject: key];
+            [_recentKeys addObject: key];
+        } else {
+            ++_misses;
+            return nil;
+        }
+    }
+    return copyRows(rows);
+}
+
+
+- (void) setRows: (NSArray*)rows forKey: (NSString*)key
+      indexState: (NSArray*)indexState generation: (NSUInteger)generation
+{
+    size_t size = sizeof(NSArray*) * rows.count;
+    for (CBLQueryRow* row in rows)
+        size += row.estimatedMemorySize;
+    if (size > kQueryCacheMaxBytes / 4)
+        return;     // Not worth pushing out everything else
+    rows = copyRows(rows);
+    @synchronized(self) {
+        if (generation != _generation)
+            return;
+        if (!$equal(indexState, _indexState)) {
+            [self _removeAll];
+            _indexState = [indexState copy];
+        }
+        [self _removeKey: key];
+        while (_recentKeys.count >= kQueryCacheMaxEntries
+                    || (_recentKeys.count > 0 && _totalSize + size > kQueryCacheMaxBytes)) {
+            [self _removeKey: _recentKeys[0]];
+            ++_evictions;
+        }
+        _entries[key] = rows;
+        _sizes[key] = @(size);
+        [_recentKeys addObject: key];
+        _totalSize += size;
+        ++_stores;
+    }
+}
+
+
+- (void) _removeKey: (NSString*)key {
+    NSNumber* size = _sizes[key];
+    if (size) {
+        _totalSize -= size.unsignedLongLongValue;
+        [_entries removeObjectForKey: key];
+        [_sizes removeObjectForKey: key];
+        [_recentKeys removeObject: key];
+    }
+}
+
+
+- (void) _removeAll {
+    [_entries removeAllObjects];
+    [_sizes removeAllObjects];
+    [_recentKeys removeAllObjects];
+    _totalSize = 0;
+    _indexState = nil;
+    ++_generation;
+}
+
+
+- (void) removeAllRows {
+    @synchronized(self) {
+        [self _removeAll];
+    }
+}
+
+
+- (NSDictionary*) stats {
+    @synchronized(self) {
+        return @{@"hits": @(_hits), @"misses": @(_misses),
+                 @"stores": @(_stores), @"evictions": @(_evictions),
+                 @"entries": @(_entries.count), @"bytes": @(_totalSize)};
+    }
+}
+
+
+@end
+
+
 @implementation CBLView (Querying)
 
 
 #pragma mark - QUERYING:
 
 
-/** Generates and runs the SQL SELECT statement for a view query, and returns its iterator. */
-- (CBL_FMResultSet*) resultSetWithOptions: (const CBLQueryOptions*)options
-                               status: (CBLStatus*)outStatus
+/** Appends the WHERE condition for one end of a key range. If a document ID is given, rows whose
+    key equals the bound are only included if their docid is within the bound too. (The condition
+    on the key alone comes first so that SQLite can use it to seek in the index.) */
+static void appendKeyBound(NSMutableString* sql, NSMutableArray* args,
+                           NSString* keyColumn, id keyArg, NSString* docID,
+                           BOOL isMin, BOOL inclusive)
 {
-    if (!options)
-        options = &kDefaultCBLQueryOptions;
+    NSString* op = isMin ? @">" : @"<";
+    NSString* inclusiveOp = inclusive ? [op stringByAppendingString: @"="] : op;
+    if (docID) {
+        [sql appendFormat: @" AND %@ %@= ? AND (%@ %@ ? OR docid %@ ?)",
+                           keyColumn, op, keyColumn, op, inclusiveOp];
+        [args addObject: keyArg];
+        [args addObject: keyArg];
+        [args addObject: docID];
+    } else {
+        [sql appendFormat: @" AND %@ %@ ?", keyColumn, inclusiveOp];
+        [args addObject: keyArg];
+    }
+}
 
-    // OPT: It would be faster to use separate tables for raw-or ascii-collated views so that
-    // they could be indexed with the right collation, instead of having to specify it here.
-    NSString* collationStr = @"";
-    if (_collation == kCBLViewCollationASCII)
-        collationStr = @" COLLATE JSON_ASCII";
-    else if (_collation == kCBLViewCollationRaw)
-        collationStr = @" COLLATE JSON_RAW";
 
-    NSMutableString* sql = [NSMutableString stringWithString: @"SELECT key, value, docid, revs.sequence"];
-    if (options->includeDocs)
-        [sql appendString: @", revid, json"];
-    if (options->bbox)
-        [sql appendString: @", bboxes.x0, bboxes.y0, bboxes.x1, bboxes.y1, maps.geokey"];
-    [sql appendString: @" FROM maps, revs, docs"];
-    if (options->bbox)
-        [sql appendString: @", bboxes"];
-    [sql appendString: @" WHERE maps.view_id=?"];
-    NSMutableArray* args = $marray(@(_viewID));
+/** Appends the WHERE conditions for the query's startKey and endKey (and their document IDs, if
+    any) to the SQL, and their values to the arguments. */
+static void appendKeyRange(NSMutableString* sql, NSMutableArray* args,
+                           const CBLQueryOptions* options,
+                           NSString* keyColumn, id (^keyArg)(id))
+{
+    BOOL descending = options->descending;
+    if (options->startKey)
+        appendKeyBound(sql, args, keyColumn, keyArg(options->startKey), options->startKeyDocID,
+                       !descending, YES);
+    if (options->endKey)
+        appendKeyBound(sql, args, keyColumn, keyArg(options->endKey), options->endKeyDocID,
+                       descending, options->inclusiveEnd);
+}
+
+
+/** Appends the WHERE conditions for the query's keys, startKey and endKey to the SQL, and their
+    values to the arguments. If the index has binary keys, those are compared instead of the JSON
+    keys. Returns the name of the key column to sort by. */
+- (NSString*) appendKeyConditions: (NSMutableString*)sql
+                             args: (NSMutableArray*)args
+                          options: (const CBLQueryOptions*)options
+{
+    BOOL binaryKeys = [_weakDB.fmdb boolForQuery: @"SELECT binary_keys FROM views WHERE view_id=?",
+                                                  @(self.viewID)];
+    NSString* keyColumn = binaryKeys ? @"ckey" : @"key";
+    id (^keyArg)(id) = ^id(id key) {
+        return binaryKeys ? [self _collatableKey: key] : toJSONString(key);
+    };
 
     if (options->keys) {
-        [sql appendString:@" AND key in ("];
+        [sql appendFormat: @" AND %@ in (", keyColumn];
         NSString* item = @"?";
         for (NSString * key in options->keys) {
             [sql appendString: item];
             item = @",?";
-            [args addObject: toJSONString(key)];
+            [args addObject: keyArg(key)];
         }
         [sql appendString:@")"];
     }
     
-    id minKey = options->startKey, maxKey = options->endKey;
-    BOOL inclusiveMin = YES, inclusiveMax = options->inclusiveEnd;
-    if (options->descending) {
-        minKey = maxKey;
-        maxKey = options->startKey;
-        inclusiveMin = inclusiveMax;
-        inclusiveMax = YES;
-    }
-    if (minKey) {
-        [sql appendString: (inclusiveMin ? @" AND key >= ?" : @" AND key > ?")];
-        [sql appendString: collationStr];
-        [args addObject: toJSONString(minKey)];
-    }
-    if (maxKey) {
-        [sql appendString: (inclusiveMax ? @" AND key <= ?" :  @" AND key < ?")];
-        [sql appendString: collationStr];
-        [args addObject: toJSONString(maxKey)];
-    }
+    appendKeyRange(sql, args, options, keyColumn, keyArg);
+    return keyColumn;
+}
+
+
+/** Generates and runs the SQL SELECT statement for a view query, and returns its iterator. */
+- (CBL_FMResultSet*) resultSetWithOptions: (const CBLQueryOptions*)options
+                               status: (CBLStatus*)outStatus
+{
+    if (!options)
+        options = &kDefaultCBLQueryOptions;
+
+    NSMutableString* sql = [NSMutableString stringWithString:
+                                                @"SELECT key, value, maps.docid, maps.sequence"];
+    if (options->includeDocs)
+        [sql appendString: @", revid, json"];
+    if (options->bbox)
+        [sql appendString: @", bboxes.x0, bboxes.y0, bboxes.x1, bboxes.y1, maps.geokey"];
+    // (The index table's key column has the view's collation, so comparisons and sorting on it
+    // don't need a COLLATE clause; binary keys are already in collation order.)
+    // Index rows store their document's ID, so the 'revs' table is only needed for the document
+    // bodies; without it, a key-range query is answered by a scan of the covering key index.
+    [sql appendFormat: @" FROM %@ AS maps", self.mapTableName];
+    if (options->includeDocs)
+        [sql appendString: @", revs"];
+    if (options->bbox)
+        [sql appendString: @", bboxes"];
+    [sql appendString: (options->includeDocs ? @" WHERE revs.sequence = maps.sequence"
+                                             : @" WHERE 1")];
+    NSMutableArray* args = $marray();
+    NSString* keyColumn = [self appendKeyConditions: sql args: args options: options];
     
     if (options->bbox) {
         [sql appendString: @" AND (bboxes.x1 > ? AND bboxes.x0 < ?)"
@@ -126,15 +580,15 @@ static id fromJSON( NSData* json ) {
         [args addObject: @(options->bbox->max.y)];
     }
     
-    [sql appendString: @" AND revs.sequence = maps.sequence AND docs.doc_id = revs.doc_id "
-                        "ORDER BY"];
+    // Rows with equal keys are ordered by docid, so that a query can resume after any row (see
+    // CBLQueryCursorAfterRows.) This is also the order of the covering key index.
+    NSString* order = options->descending ? @" DESC" : @"";
     if (options->bbox)
-        [sql appendString: @" bboxes.y0, bboxes.x0"];
+        [sql appendFormat: @" ORDER BY bboxes.y0, bboxes.x0%@", order];
+    else if ([keyColumn isEqualToString: @"ckey"])
+        [sql appendFormat: @" ORDER BY ckey%@, key%@, docid%@", order, order, order];
     else
-        [sql appendString: @" key"];
-    [sql appendString: collationStr];
-    if (options->descending)
-        [sql appendString: @" DESC"];
+        [sql appendFormat: @" ORDER BY key%@, docid%@", order, order];
 
     [sql appendString: @" LIMIT ? OFFSET ?"];
     int limit = (options->limit != kDefaultCBLQueryOptions.limit) ? options->limit : -1;
@@ -154,18 +608,94 @@ static id fromJSON( NSData* json ) {
 /** Main internal call to query a view. */
 - (NSArray*) _queryWithOptions: (const CBLQueryOptions*)options
                         status: (CBLStatus*)outStatus
+{
+    if (!options)
+        options = &kDefaultCBLQueryOptions;
+    CBLQueryResultCache* cache = self.queryCache;
+    NSString* cacheKey = queryCacheKey(options);
+    NSUInteger generation = cache.generation;   // before the snapshot begins
+
+    // Run the query against a consistent snapshot, on a read-only connection if possible:
+    __block NSArray* rows = nil;
+    CBLStatus status = [_weakDB _inReadTransaction: ^CBLStatus {
+        NSArray* indexState = nil;
+        if (cacheKey) {
+            indexState = [self queryCacheIndexState];
+            rows = [cache rowsForKey: cacheKey indexState: indexState];
+            if (rows) {
+                LogTo(View, @"Query %@: Returning %u cached rows", _name, (unsigned)rows.count);
+                return kCBLStatusOK;
+            }
+        }
+        CBLStatus queryStatus = kCBLStatusOK;
+        rows = [self queryRowsWithOptions: options status: &queryStatus];
+        if (rows && indexState)
+            [cache setRows: rows forKey: cacheKey indexState: indexState generation: generation];
+        return queryStatus;
+    }];
+    *outStatus = status;
+    return rows;
+}
+
+
+/** Queries the view, returning an enumerator that reads the rows as they're needed. */
+- (NSEnumerator*) _streamRowsWithOptions: (const CBLQueryOptions*)options
+                                  status: (CBLStatus*)outStatus
+{
+    if (!options)
+        options = &kDefaultCBLQueryOptions;
+    BOOL reduce = options->reduceSpecified ? options->reduce : (self.reduceBlock != nil);
+    if (reduce || options->group || options->groupLevel > 0 || options->fullTextQuery
+            || options->postFilter || options->sortDescriptors) {
+        // Reduced, grouped and full-text rows aren't produced one SQL row at a time, and
+        // filtered or sorted ones are selected before being returned:
+        NSArray* rows = [self _queryWithOptions: options status: outStatus];
+        return rows.objectEnumerator;
+    }
+
+    BOOL includeDocs = options->includeDocs, geo = (options->bbox != NULL);
+    CBLContentOptions content = options->content;
+    return [CBLQueryRowStream streamWithDatabase: _weakDB
+                                           query: ^CBL_FMResultSet*(CBLStatus* queryStatus) {
+        if (![self _indexTableExists])
+            return nil;     // The view hasn't been indexed yet
+        return [self resultSetWithOptions: options status: queryStatus];
+    }
+                                       generator: ^CBLQueryRow*(CBL_FMResultSet* r, BOOL* outMore) {
+        CBLQueryRow* row = [self rowFromResultSet: r includeDocs: includeDocs
+                                          content: content geo: geo];
+        *outMore = [r next];
+        return row;
+    }
+                                          status: outStatus];
+}
+
+
+- (NSArray*) queryRowsWithOptions: (const CBLQueryOptions*)options
+                           status: (CBLStatus*)outStatus
 {
     CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
 
     if (!options)
         options = &kDefaultCBLQueryOptions;
 
+    if (![self _indexTableExists])
+        return @[];     // The view hasn't been indexed yet
+
+    // With a post-filter or sort descriptors, the rows are selected as they're read, and skip and
+    // limit apply to the ones selected:
+    CBLQueryRowSelector* selector = nil;
+    CBLQueryOptions scanOptions;
+    if (options->postFilter || options->sortDescriptors) {
+        selector = [[CBLQueryRowSelector alloc] initWithOptions: options];
+        scanOptions = *options;
+        scanOptions.skip = 0;
+        scanOptions.limit = kDefaultCBLQueryOptions.limit;
+        options = &scanOptions;
+    }
+
     if (options->fullTextQuery)
-        return [self _queryFullText: options status: outStatus];
-    
-    CBL_FMResultSet* r = [self resultSetWithOptions: options status: outStatus];
-    if (!r)
-        return nil;
+        return selectRows(selector, [self _queryFullText: options status: outStatus]);
     
     NSMutableArray* rows;
 
@@ -184,69 +714,57 @@ static id fromJSON( NSData* json ) {
         reduce = (self.reduceBlock != nil); // Reduce defaults to true iff there's a reduce block
     }
 
+    CBLQueryOptions mapOptions;
+    if ((reduce || group) && (options->startKeyDocID || options->endKeyDocID)) {
+        // Reduced and grouped rows don't come from single documents, so doc IDs don't apply:
+        mapOptions = *options;
+        mapOptions.startKeyDocID = mapOptions.endKeyDocID = nil;
+        options = &mapOptions;
+    }
+
+    if (reduce && !options->keys && !options->bbox && options->skip == 0
+            && options->limit == kDefaultCBLQueryOptions.limit && [self _reduceTableExists]) {
+        // Reduced query that can be answered from the stored reductions:
+        return selectRows(selector, [self reducedQueryFromStore: options group: group
+                                                     groupLevel: groupLevel status: outStatus]);
+    }
+
+    NSString* reducerName = reduce ? builtInReducerName(self.reduceBlock) : nil;
+    if (reducerName && !options->bbox) {
+        // Reduced query with a built-in reduce function, which SQLite can compute:
+        rows = [self reducedQueryInSQL: options reducer: reducerName
+                                 group: group groupLevel: groupLevel status: outStatus];
+        if (rows || *outStatus != kCBLStatusOK)
+            return selectRows(selector, rows);
+        // ...unless some values aren't numbers, so fall back to calling the reduce block.
+    }
+
+    CBL_FMResultSet* r = [self resultSetWithOptions: options status: outStatus];
+    if (!r)
+        return nil;
+
     if (reduce || group) {
         // Reduced or grouped query:
         rows = [self reducedQuery: r group: group groupLevel: groupLevel];
+        rows = selectRows(selector, rows);
 
     } else {
         // Regular query:
-        CBLDatabase* db = _weakDB;
+        BOOL includeDocs = options->includeDocs, geo = (options->bbox != NULL);
+        CBLContentOptions content = options->content;
         rows = $marray();
         while ([r next]) {
             @autoreleasepool {
-                NSData* keyData = [r dataForColumnIndex: 0];
-                NSData* valueData = [r dataForColumnIndex: 1];
-                Assert(keyData);
-                NSString* docID = [r stringForColumnIndex: 2];
-                SequenceNumber sequence = [r longLongIntForColumnIndex:3];
-                id docContents = nil;
-                if (options->includeDocs) {
-                    id value = fromJSON(valueData);
-                    NSString* linkedID = $castIf(NSDictionary, value)[@"_id"];
-                    if (linkedID) {
-                        // Linked document: http://wiki.apache.org/couchdb/Introduction_to_CouchDB_views#Linked_documents
-                        NSString* linkedRev = value[@"_rev"]; // usually nil
-                        CBLStatus linkedStatus;
-                        CBL_Revision* linked = [db getDocumentWithID: linkedID
-                                                          revisionID: linkedRev
-                                                             options: options->content
-                                                              status: &linkedStatus];
-                        docContents = linked ? linked.properties : $null;
-                        sequence = linked.sequence;
-                    } else {
-                        docContents = [db documentPropertiesFromJSON: [r dataNoCopyForColumnIndex: 5]
-                                                               docID: docID
-                                                               revID: [r stringForColumnIndex: 4]
-                                                             deleted: NO
-                                                            sequence: sequence
-                                                             options: options->content];
-                    }
-                }
-                LogTo(ViewVerbose, @"Query %@: Found row with key=%@, value=%@, id=%@",
-                      _name, [keyData my_UTF8ToString], [valueData my_UTF8ToString],
-                      toJSONString(docID));
-                CBLQueryRow* row;
-                if (options->bbox) {
-                    CBLGeoRect bbox = {{[r doubleForColumn: @"x0"],
-                                        [r doubleForColumn: @"y0"]},
-                                       {[r doubleForColumn: @"x1"],
-                                        [r doubleForColumn: @"y1"]}};
-                    row = [[CBLGeoQueryRow alloc] initWithDocID: docID
-                                                       sequence: sequence
-                                                    boundingBox: bbox
-                                                    geoJSONData: [r dataForColumn: @"geokey"]
-                                                          value: valueData
-                                                  docProperties: docContents];
-                } else {
-                    row = [[CBLQueryRow alloc] initWithDocID: docID
-                                                    sequence: sequence
-                                                         key: keyData
-                                                       value: valueData
-                                               docProperties: docContents];
-                }
-                [rows addObject: row];
+                CBLQueryRow* row = [self rowFromResultSet: r includeDocs: includeDocs
+                                                  content: content geo: geo];
+                if (!selector)
+                    [rows addObject: row];
+                else if (![selector addRow: row])
+                    break;      // It has all the rows it needs
             }
         }
+        if (selector)
+            rows = selector.rows;
     }
 
     [r close];
@@ -259,19 +777,77 @@ static id fromJSON( NSData* json ) {
 }
 
 
+/** Creates a query row from the current row of a regular (not reduced) query's result set. */
+- (CBLQueryRow*) rowFromResultSet: (CBL_FMResultSet*)r
+                      includeDocs: (BOOL)includeDocs
+                          content: (CBLContentOptions)content
+                              geo: (BOOL)geo
+{
+    CBLDatabase* db = _weakDB;
+    NSData* keyData = [r dataForColumnIndex: 0];
+    NSData* valueData = [r dataForColumnIndex: 1];
+    Assert(keyData);
+    NSString* docID = [r stringForColumnIndex: 2];
+    SequenceNumber sequence = [r longLongIntForColumnIndex:3];
+    id docContents = nil;
+    if (includeDocs) {
+        id value = fromJSON(valueData);
+        NSString* linkedID = $castIf(NSDictionary, value)[@"_id"];
+        if (linkedID) {
+            // Linked document: http://wiki.apache.org/couchdb/Introduction_to_CouchDB_views#Linked_documents
+            NSString* linkedRev = value[@"_rev"]; // usually nil
+            CBLStatus linkedStatus;
+            CBL_Revision* linked = [db getDocumentWithID: linkedID
+                                              revisionID: linkedRev
+                                                 options: content
+                                                  status: &linkedStatus];
+            docContents = linked ? linked.properties : $null;
+            sequence = linked.sequence;
+        } else {
+            docContents = [db readOnlyDocumentPropertiesFromJSON: [r dataNoCopyForColumnIndex: 5]
+                                                           docID: docID
+                                                           revID: [r stringForColumnIndex: 4]
+                                                         deleted: NO
+                                                        sequence: sequence
+                                                         options: content];
+        }
+    }
+    LogTo(ViewVerbose, @"Query %@: Found row with key=%@, value=%@, id=%@",
+          _name, [keyData my_UTF8ToString], [valueData my_UTF8ToString],
+          toJSONString(docID));
+    if (geo) {
+        CBLGeoRect bbox = {{[r doubleForColumn: @"x0"],
+                            [r doubleForColumn: @"y0"]},
+                           {[r doubleForColumn: @"x1"],
+                            [r doubleForColumn: @"y1"]}};
+        return [[CBLGeoQueryRow alloc] initWithDocID: docID
+                                            sequence: sequence
+                                         boundingBox: bbox
+                                         geoJSONData: [r dataForColumn: @"geokey"]
+                                               value: valueData
+                                       docProperties: docContents];
+    } else {
+        return [[CBLQueryRow alloc] initWithDocID: docID
+                                         sequence: sequence
+                                              key: keyData
+                                            value: valueData
+                                    docProperties: docContents];
+    }
+}
+
+
 /** Runs a full-text query of a view, using the FTS4 table. */
 - (NSArray*) _queryFullText: (const CBLQueryOptions*)options
                      status: (CBLStatus*)outStatus
 {
     CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
-    NSMutableString* sql = [@"SELECT docs.docid, maps.sequence, maps.fulltext_id, maps.value, "
+    NSMutableString* sql = [@"SELECT maps.docid, maps.sequence, maps.fulltext_id, maps.value, "
                              "offsets(fulltext)" mutableCopy];
     if (options->fullTextSnippets)
         [sql appendString: @", snippet(fulltext, '\001','\002','…')"];
-    [sql appendString: @" FROM maps, fulltext, revs, docs "
-                        "WHERE fulltext.content MATCH ? AND maps.fulltext_id = fulltext.rowid "
-                        "AND maps.view_id = ? "
-                        "AND revs.sequence = maps.sequence AND docs.doc_id = revs.doc_id "];
+    [sql appendFormat: @" FROM %@ AS maps, fulltext "
+                        "WHERE fulltext.content MATCH ? AND maps.fulltext_id = fulltext.rowid ",
+                       self.mapTableName];
     if (options->fullTextRanking)
         [sql appendString: @"ORDER BY - ftsrank(matchinfo(fulltext)) "];
     else
@@ -281,10 +857,10 @@ static id fromJSON( NSData* json ) {
     [sql appendString: @" LIMIT ? OFFSET ?"];
     int limit = (options->limit != kDefaultCBLQueryOptions.limit) ? options->limit : -1;
     
-    LogTo(View, @"Query %@: %@\n\tArguments: %@", _name, sql, @[options->fullTextQuery, @(self.viewID),
+    LogTo(View, @"Query %@: %@\n\tArguments: %@", _name, sql, @[options->fullTextQuery,
                                                                 @(limit), @(options->skip)]);
     CBLDatabase* db = _weakDB;
-    CBL_FMResultSet* r = [db.fmdb executeQuery: sql, options->fullTextQuery, @(self.viewID),
+    CBL_FMResultSet* r = [db.fmdb executeQuery: sql, options->fullTextQuery,
                                                 @(limit), @(options->skip)];
     if (!r) {
         *outStatus = db.lastDbError;
@@ -339,18 +915,7 @@ static id groupKey(NSData* keyJSON, unsigned groupLevel) {
 
 // Invokes the reduce function on the parallel arrays of keys and values
 static id callReduce(CBLReduceBlock reduceBlock, NSMutableArray* keys, NSMutableArray* values) {
-    if (!reduceBlock)
-        return nil;
-    CBLLazyArrayOfJSON* lazyKeys = [[CBLLazyArrayOfJSON alloc] initWithMutableArray: keys];
-    CBLLazyArrayOfJSON* lazyVals = [[CBLLazyArrayOfJSON alloc] initWithMutableArray: values];
-    @try {
-        id result = reduceBlock(lazyKeys, lazyVals, NO);
-        if (result)
-            return result;
-    } @catch (NSException *x) {
-        MYReportException(x, @"reduce block");
-    }
-    return $null;
+    return [CBLView _callReduce: reduceBlock keys: keys values: values rereduce: NO];
 }
 
 
@@ -408,6 +973,245 @@ static id callReduce(CBLReduceBlock reduceBlock, NSMutableArray* keys, NSMutable
 }
 
 
+// Returns the CouchDB name of a built-in reduce block (see +[CBLView reduceBlockNamed:]), or nil.
+static NSString* builtInReducerName(CBLReduceBlock reduceBlock) {
+    if (!reduceBlock)
+        return nil;
+    for (NSString* name in @[@"_count", @"_sum", @"_stats"]) {
+        if (reduceBlock == [CBLView reduceBlockNamed: name])
+            return name;
+    }
+    return nil;
+}
+
+
+/** Runs a reduced query with a built-in reduce function as a SQL aggregate over the index,
+    grouped by the key or key prefix, so the rows never have to be read. Like the regular query,
+    the skip and limit options apply to the rows before they're reduced.
+    SQLite reads a non-numeric value as 0, unlike the reduce blocks (a string like "12" is 12 to
+    -doubleValue), so if _sum or _stats find any values that aren't JSON numbers this returns nil
+    with a status of kCBLStatusOK, and the caller has to use the reduce block instead. */
+- (NSMutableArray*) reducedQueryInSQL: (const CBLQueryOptions*)options
+                              reducer: (NSString*)reducerName
+                                group: (BOOL)group
+                           groupLevel: (unsigned)groupLevel
+                               status: (CBLStatus*)outStatus
+{
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    // The rows to reduce, with their values as numbers:
+    // (JSON numbers are the only values that start with a digit or '-'.)
+    NSMutableString* rowsSQL = [$sprintf(@"SELECT key, CAST(value AS REAL) AS n, "
+                                          "(value GLOB '[-0-9]*') AS isnum FROM %@ WHERE 1",
+                                         self.mapTableName) mutableCopy];
+    NSMutableArray* args = $marray();
+    NSString* keyColumn = [self appendKeyConditions: rowsSQL args: args options: options];
+    if (options->skip > 0 || options->limit != kDefaultCBLQueryOptions.limit) {
+        [rowsSQL appendFormat: @" ORDER BY %@%@ LIMIT ? OFFSET ?",
+                               keyColumn, (options->descending ? @" DESC" : @"")];
+        int limit = (options->limit != kDefaultCBLQueryOptions.limit) ? options->limit : -1;
+        [args addObject: @(limit)];
+        [args addObject: @(options->skip)];
+    }
+
+    NSString* groupExpr = @"NULL";
+    if (group)
+        groupExpr = groupLevel > 0 ? $sprintf(@"groupkey(key, %u)", groupLevel) : @"key";
+    NSMutableString* sql = [$sprintf(@"SELECT %@ AS grp, count(*), total(n), min(n), max(n), "
+                                      "total(n*n), total(isnum) FROM (%@)",
+                                     groupExpr, rowsSQL) mutableCopy];
+    if (group) {
+        NSString* collation = self.sqlKeyCollation;
+        [sql appendFormat: @" GROUP BY grp COLLATE %@ ORDER BY grp COLLATE %@%@",
+                           collation, collation, (options->descending ? @" DESC" : @"")];
+    }
+    LogTo(View, @"Query %@: %@\n\tArguments: %@", _name, sql, args);
+    CBLDatabase* db = _weakDB;
+    CBL_FMResultSet* r = [db.fmdb executeQuery: sql withArgumentsInArray: args];
+    if (!r) {
+        *outStatus = db.lastDbError;
+        return nil;
+    }
+
+    BOOL countOnly = [reducerName isEqualToString: @"_count"];
+    NSMutableArray* rows = $marray();
+    while ([r next]) {
+        SInt64 count = [r longLongIntForColumnIndex: 1];
+        if (count == 0)
+            continue;   // (an ungrouped aggregate returns a row even if there's nothing to reduce)
+        if (!countOnly && [r longLongIntForColumnIndex: 6] < count) {
+            LogTo(View, @"Query %@: Non-numeric values; reducing with the block", _name);
+            [r close];
+            *outStatus = kCBLStatusOK;
+            return nil;
+        }
+        id key = group ? fromJSON([r dataForColumnIndex: 0]) : $null;
+        id value;
+        if (countOnly)
+            value = @(count);
+        else if ([reducerName isEqualToString: @"_sum"])
+            value = @([r doubleForColumnIndex: 2]);
+        else
+            value = @{@"sum": @([r doubleForColumnIndex: 2]),
+                      @"count": @(count),
+                      @"min": @([r doubleForColumnIndex: 3]),
+                      @"max": @([r doubleForColumnIndex: 4]),
+                      @"sumsqr": @([r doubleForColumnIndex: 5])};
+        [rows addObject: [[CBLQueryRow alloc] initWithDocID: nil
+                                                   sequence: 0
+                                                        key: key
+                                                      value: value
+                                              docProperties: nil]];
+    }
+    [r close];
+
+    *outStatus = kCBLStatusOK;
+    LogTo(View, @"Query %@: Returning %u rows reduced by %@, took %3.3fsec",
+          _name, (unsigned)rows.count, reducerName, CFAbsoluteTimeGetCurrent() - start);
+    return rows;
+}
+
+
+/** Answers a reduced query by rereducing the view's stored reductions (one per distinct key) in
+    the key range, instead of reducing every row. */
+- (NSMutableArray*) reducedQueryFromStore: (const CBLQueryOptions*)options
+                                    group: (BOOL)group
+                               groupLevel: (unsigned)groupLevel
+                                   status: (CBLStatus*)outStatus
+{
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    NSMutableString* sql = [$sprintf(@"SELECT key, value FROM %@ WHERE 1", self.reduceTableName)
+                                mutableCopy];
+    NSMutableArray* args = $marray();
+    appendKeyRange(sql, args, options, @"key", ^id(id key) {return toJSONString(key);});
+    [sql appendString: options->descending ? @" ORDER BY key DESC" : @" ORDER BY key"];
+    LogTo(View, @"Query %@: %@\n\tArguments: %@", _name, sql, args);
+    CBLDatabase* db = _weakDB;
+    CBL_FMResultSet* r = [db.fmdb executeQuery: sql withArgumentsInArray: args];
+    if (!r) {
+        *outStatus = db.lastDbError;
+        return nil;
+    }
+
+    CBLReduceBlock reduce = self.reduceBlock;
+    NSMutableArray* valuesToRereduce = [[NSMutableArray alloc] initWithCapacity: 100];
+    NSData* lastKeyData = nil;
+    NSMutableArray* rows = $marray();
+    // Adds a row for the values collected so far, rereducing them if there's more than one:
+    void (^addRow)(id) = ^(id key) {
+        id reduced;
+        if (valuesToRereduce.count == 1) {
+            reduced = valuesToRereduce[0];
+            if ([reduced isKindOfClass: [NSData class]])
+                reduced = fromJSON(reduced);
+        } else {
+            reduced = [CBLView _callReduce: reduce keys: nil values: valuesToRereduce
+                                  rereduce: YES];
+        }
+        [rows addObject: [[CBLQueryRow alloc] initWithDocID: nil
+                                                   sequence: 0
+                                                        key: key
+                                                      value: reduced
+                                              docProperties: nil]];
+        [valuesToRereduce removeAllObjects];
+    };
+
+    while ([r next]) {
+        @autoreleasepool {
+            NSData* keyData = [r dataForColumnIndex: 0];
+            id value = [r dataForColumnIndex: 1];
+            if (!value) {
+                // Some of this key's rows were deleted since the index was last updated, so its
+                // stored value is out of date; reduce its remaining rows instead:
+                value = [self _reductionOfRowsWithKey: keyData reduceBlock: reduce];
+                if (!value)
+                    continue;
+            }
+            if (group && !groupTogether(keyData, lastKeyData, groupLevel)) {
+                if (lastKeyData)
+                    addRow(groupKey(lastKeyData, groupLevel));
+                lastKeyData = [keyData copy];
+            }
+            [valuesToRereduce addObject: value];
+        }
+    }
+    [r close];
+    if (valuesToRereduce.count > 0)
+        addRow(group ? groupKey(lastKeyData, groupLevel) : $null);
+
+    *outStatus = kCBLStatusOK;
+    LogTo(View, @"Query %@: Returning %u rows from stored reductions, took %3.3fsec",
+          _name, (unsigned)rows.count, CFAbsoluteTimeGetCurrent() - start);
+    return rows;
+}
+
+
+#pragma mark - RESULT CACHE:
+
+
+// Returns a canonical encoding of the query options that affect the rows of a view query, or nil
+// if the rows shouldn't be cached. (Queries that include documents aren't, since the documents
+// can change without the index changing; nor are ones with a post-filter or sort descriptors,
+// which can't be encoded.)
+static NSString* queryCacheKey(const CBLQueryOptions* options) {
+    if (options->includeDocs || options->postFilter || options->sortDescriptors)
+        return nil;
+    id bbox = nil;
+    if (options->bbox)
+        bbox = @[@(options->bbox->min.x), @(options->bbox->min.y),
+                 @(options->bbox->max.x), @(options->bbox->max.y)];
+    NSDictionary* key = $dict({@"startkey", options->startKey},
+                              {@"endkey", options->endKey},
+                              {@"keys", options->keys},
+                              {@"startkey_docid", options->startKeyDocID},
+                              {@"endkey_docid", options->endKeyDocID},
+                              {@"fulltext", options->fullTextQuery},
+                              {@"bbox", bbox},
+                              {@"skip", @(options->skip)},
+                              {@"limit", @(options->limit)},
+                              {@"group_level", @(options->groupLevel)},
+                              {@"descending", @(options->descending)},
+                              {@"inclusive_end", @(options->inclusiveEnd)},
+                              {@"reduce", (options->reduceSpecified ? @(options->reduce) : nil)},
+                              {@"group", @(options->group)},
+                              {@"snippets", @(options->fullTextSnippets)},
+                              {@"ranking", @(options->fullTextRanking)});
+    return [CBLCanonicalJSON canonicalString: key];
+}
+
+
+- (CBLQueryResultCache*) queryCache {
+    @synchronized(self) {
+        if (!_queryCache)
+            _queryCache = [[CBLQueryResultCache alloc] init];
+        return _queryCache;
+    }
+}
+
+
+// The state of the index that query results depend on. Call this within the query's snapshot.
+- (NSArray*) queryCacheIndexState {
+    CBL_FMResultSet* r = [_weakDB.fmdb executeQuery: @"SELECT view_id, lastSequence, version, "
+                                                      "binary_keys FROM views WHERE name=?", _name];
+    NSArray* state = nil;
+    if ([r next])
+        state = @[@([r intForColumnIndex: 0]), @([r longLongIntForColumnIndex: 1]),
+                  [r stringForColumnIndex: 2] ?: $null, @([r boolForColumnIndex: 3]),
+                  @(_collation)];
+    [r close];
+    return state;
+}
+
+
+- (void) _invalidateQueryCache {
+    [_queryCache removeAllRows];
+}
+
+
+- (NSDictionary*) queryCacheStats {
+    return self.queryCache.stats;
+}
+
+
 #pragma mark - OTHER:
 
 // This is really just for unit tests & debugging
@@ -416,9 +1220,11 @@ static id callReduce(CBLReduceBlock reduceBlock, NSMutableArray* keys, NSMutable
     if (self.viewID <= 0)
         return nil;
 
-    CBL_FMResultSet* r = [_weakDB.fmdb executeQuery: @"SELECT sequence, key, value FROM maps "
-                                                      "WHERE view_id=? ORDER BY key",
-                                                     @(_viewID)];
+    if (![self _indexTableExists])
+        return @[];
+    NSString* sql = $sprintf(@"SELECT sequence, key, value FROM %@ ORDER BY key",
+                             self.mapTableName);
+    CBL_FMResultSet* r = [_weakDB.fmdb executeQuery: sql];
     if (!r)
         return nil;
     NSMutableArray* result = $marray();
@@ -0,0 +1,33 @@
+//
+//  CBLViewIndexUpdater.h
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+@class CBLDatabase, CBLView;
+
+
+/** Keeps the indexes of a database's views up to date in the background, for views whose
+    updatesIndexInBackground property is set. It watches the database for changes; once a view's
+    backgroundIndexDelay has passed without further changes (or its backgroundIndexMaxLag has
+    passed since the first change it hasn't indexed), the index is updated on the manager's
+    background server thread, at low priority and a limited number of sequences at a time.
+    Views that become due at the same time are updated together in one pass.
+    All methods must be called on the database's thread. */
+@interface CBLViewIndexUpdater : NSObject
+
+- (instancetype) initWithDatabase: (CBLDatabase*)db;
+
+/** Starts updating a view's index in the background. If it's already out of date, an update is
+    scheduled right away. */
+- (void) addView: (CBLView*)view;
+
+/** Stops updating a view's index in the background. (An update already running will finish.) */
+- (void) removeView: (CBLView*)view;
+
+/** Stops watching the database; called when it closes. */
+- (void) stop;
+
+@end
@@ -0,0 +1,227 @@
+//
+//  CBLViewIndexUpdater.m
+//  CouchbaseLite
+//
+//  Copyright (c) 2026 Couchbase, Inc. All rights reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License"); you may not use this file
+//  except in compliance with the License. You may obtain a copy of the License at
+//    http://www.apache.org/licenses/LICENSE-2.0
+//  Unless required by applicable law or agreed to in writing, software distributed under the
+//  License is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND,
+//  either express or implied. See the License for the specific language governing permissions
+//  and limitations under the License.
+
+#import "CBLViewIndexUpdater.h"
+#import "CouchbaseLitePrivate.h"
+#import "CBLView+Internal.h"
+#import "CBLInternal.h"
+#import "CBLMisc.h"
+
+
+// Maximum number of sequences indexed in one transaction by a background update:
+#define kChunkSize 500
+
+// Priority of the background thread while it's updating an index:
+#define kThreadPriority 0.1
+
+
+static void updateInChunks(CBLDatabase* db, NSArray* names, void (^onFinished)());
+
+
+@implementation CBLViewIndexUpdater
+{
+    CBLDatabase* __weak _db;
+    NSMutableSet* _viewNames;           // Names of the views being kept up to date
+    NSMutableDictionary* _pendingSince; // View name -> time of its oldest change not yet indexed
+    NSMutableDictionary* _deadlines;    // View name -> time its index should be updated
+    NSDate* _timerDate;                 // Time the scheduled call to -timerFired: is for, if any
+    BOOL _updating;                     // Is a background update running?
+}
+
+
+- (instancetype) initWithDatabase: (CBLDatabase*)db {
+    self = [super init];
+    if (self) {
+        _db = db;
+        _viewNames = [[NSMutableSet alloc] init];
+        _pendingSince = [[NSMutableDictionary alloc] init];
+        _deadlines = [[NSMutableDictionary alloc] init];
+        [[NSNotificationCenter defaultCenter] addObserver: self
+                                                 selector: @selector(dbChanged:)
+                                                     name: CBL_DatabaseChangesNotification
+                                                   object: db];
+    }
+    return self;
+}
+
+
+- (void) dealloc {
+    [[NSNotificationCenter defaultCenter] removeObserver: self];
+}
+
+
+- (void) stop {
+    [[NSNotificationCenter defaultCenter] removeObserver: self];
+    [_viewNames removeAllObjects];
+    [_pendingSince removeAllObjects];
+    [_deadlines removeAllObjects];
+    _timerDate = nil;
+}
+
+
+- (void) addView: (CBLView*)view {
+    [_viewNames addObject: view.name];
+    if (view.stale)
+        [self scheduleView: view];
+}
+
+
+- (void) removeView: (CBLView*)view {
+    NSString* name = view.name;
+    [_viewNames removeObject: name];
+    [_pendingSince removeObjectForKey: name];
+    [_deadlines removeObjectForKey: name];
+}
+
+
+- (void) dbChanged: (NSNotification*)n {
+    CBLDatabase* db = _db;
+    for (NSString* name in _viewNames.allObjects)
+        [self scheduleView: [db existingViewNamed: name]];
+}
+
+
+// Sets (or postpones) the time a view's index should be updated, after a change.
+- (void) scheduleView: (CBLView*)view {
+    if (!view)
+        return;
+    NSString* name = view.name;
+    NSDate* now = [NSDate date];
+    NSDate* since = _pendingSince[name];
+    if (!since)
+        _pendingSince[name] = since = now;
+    NSDate* deadline = [now dateByAddingTimeInterval: view.backgroundIndexDelay];
+    _deadlines[name] = [deadline earlierDate: [since dateByAddingTimeInterval:
+                                                                    view.backgroundIndexMaxLag]];
+    [self scheduleTimer];
+}
+
+
+// Makes sure -timerFired: will be called by the earliest deadline.
+- (void) scheduleTimer {
+    if (_updating)
+        return;     // -finishedUpdating will check the deadlines
+    NSDate* next = nil;
+    for (NSDate* deadline in _deadlines.objectEnumerator)
+        next = next ? [next earlierDate: deadline] : deadline;
+    if (!next || (_timerDate && [_timerDate compare: next] <= 0))
+        return;
+    _timerDate = next;
+    __weak CBLViewIndexUpdater* weakSelf = self;
+    [_db doAsyncAfterDelay: MAX(next.timeIntervalSinceNow, 0.0) block: ^{
+        [weakSelf timerFired: next];
+    }];
+}
+
+
+- (void) timerFired: (NSDate*)date {
+    if (date != _timerDate)
+        return;     // superseded by an earlier timer, or stopped
+    _timerDate = nil;
+    [self updateDueViews];
+}
+
+
+// Starts a background update of the views whose deadlines have passed.
+- (void) updateDueViews {
+    if (_updating)
+        return;
+    NSDate* now = [NSDate date];
+    NSMutableArray* dueNames = $marray();
+    for (NSString* name in _deadlines) {
+        if ([_deadlines[name] compare: now] <= 0)
+            [dueNames addObject: name];
+    }
+    [_deadlines removeObjectsForKeys: dueNames];
+    [_pendingSince removeObjectsForKeys: dueNames];
+    if (dueNames.count > 0)
+        [self updateViewsNamed: dueNames];
+    [self scheduleTimer];
+}
+
+
+- (void) finishedUpdating {
+    _updating = NO;
+    [self updateDueViews];
+}
+
+
+- (void) updateViewsNamed: (NSArray*)names {
+    CBLDatabase* db = _db;
+    // The background database instance has its own CBLView objects, but they share the map and
+    // reduce blocks and the views' settings with these:
+    names = [names my_map: ^id(NSString* name) {
+        return [db existingViewNamed: name].mapBlock ? name : nil;
+    }];
+    if (names.count == 0)
+        return;
+    LogTo(View, @"%@: Updating indexes of %@ in the background", db, names);
+    _updating = YES;
+
+    __weak CBLViewIndexUpdater* weakSelf = self;
+    __weak CBLDatabase* weakDB = db;
+    void (^onFinished)() = ^{
+        [weakDB doAsync: ^{
+            [weakSelf finishedUpdating];
+        }];
+    };
+    CBLManager* manager = db.manager;
+    if (manager) {
+        [manager backgroundTellDatabaseNamed: db.name to: ^(CBLDatabase* bgdb) {
+            updateInChunks(bgdb, names, onFinished);
+        }];
+    } else {
+        // A database without a manager (only created by unit tests) has no background thread:
+        [db doAsync: ^{
+            updateInChunks(db, names, onFinished);
+        }];
+    }
+}
+
+
+// Indexes the next chunk of sequences of the named views, then schedules itself to do the next
+// one (after anything else waiting to run on the thread), until the views are up to date.
+static void updateInChunks(CBLDatabase* db, NSArray* names, void (^onFinished)()) {
+    NSMutableArray* views = $marray();
+    SequenceNumber since = db.lastSequenceNumber;
+    for (NSString* name in names) {
+        CBLView* view = [db existingViewNamed: name];
+        if (!view.mapBlock)
+            continue;
+        [views addObject: view];
+        since = MIN(since, view.lastSequenceIndexed);
+    }
+
+    CBLStatus status = kCBLStatusNotModified;
+    if (views.count > 0 && since < db.lastSequenceNumber) {
+        double priority = [NSThread threadPriority];
+        [NSThread setThreadPriority: kThreadPriority];
+        status = [CBLView updateIndexes: views throughSequence: since + kChunkSize
+                     pauseBetweenChunks: YES];
+        [NSThread setThreadPriority: priority];
+    }
+
+    if (status == kCBLStatusOK && since + kChunkSize < db.lastSequenceNumber) {
+        [db doAsync: ^{
+            updateInChunks(db, names, onFinished);
+        }];
+    } else {
+        if (CBLStatusIsError(status))
+            Warn(@"%@: Background index update failed (status %d)", db, status);
+        onFinished();
+    }
+}
+
+
+@end
@@ -28,6 +28,9 @@
 #import "CBLInternal.h"
 #import "Test.h"
 #import "GTMNSData+zlib.h"
+#import "FMDatabase.h"
+#import "FMDatabaseAdditions.h"
+#import <libkern/OSAtomic.h>
 
 
 #if DEBUG
@@ -995,6 +998,415 @@ TestCase(CBL_Database_Purge) {
 }
 
 
+TestCase(CBL_Database_WinningRevision) {
+    // Checks the winning-revision info cached in the 'docs' table:
+    CBLDatabase* db = createDB();
+    CBL_Revision* rev1 = putDoc(db, $dict({@"_id", @"doc"}, {@"key", @"1"}));
+    CBL_Revision* rev2 = putDoc(db, $dict({@"_id", @"doc"}, {@"_rev", rev1.revID}, {@"key", @"2"}));
+    SInt64 docNumericID = [db getDocNumericID: @"doc"];
+    BOOL deleted, conflict;
+    CAssertEqual([db winningRevIDOfDocNumericID: docNumericID isDeleted: &deleted
+                                     isConflict: &conflict], rev2.revID);
+    CAssert(!deleted && !conflict);
+
+    // Create a conflict that wins:
+    CBL_MutableRevision* rev2b = [[CBL_MutableRevision alloc] initWithDocID: @"doc"
+                                                                      revID: @"2-zzzz"
+                                                                    deleted: NO];
+    rev2b.properties = $dict({@"_id", @"doc"}, {@"_rev", rev2b.revID}, {@"key", @"2b"});
+    CAssertEq([db forceInsert: rev2b revisionHistory: @[rev2b.revID, rev1.revID] source: nil],
+              kCBLStatusCreated);
+    CAssertEqual([db winningRevIDOfDocNumericID: docNumericID isDeleted: &deleted
+                                     isConflict: &conflict], rev2b.revID);
+    CAssert(!deleted && conflict);
+    CAssertEqual([db getDocumentWithID: @"doc" revisionID: nil].revID, rev2b.revID);
+
+    // Delete the winner; the other branch takes over:
+    putDoc(db, $dict({@"_id", @"doc"}, {@"_rev", rev2b.revID}, {@"_deleted", $true}));
+    CAssertEqual([db winningRevIDOfDocNumericID: docNumericID isDeleted: &deleted
+                                     isConflict: &conflict], rev2.revID);
+    CAssert(!deleted && !conflict);
+    CAssertEq(db.documentCount, 1u);
+
+    // Delete the other branch too; now the doc is deleted:
+    putDoc(db, $dict({@"_id", @"doc"}, {@"_rev", rev2.revID}, {@"_deleted", $true}));
+    NSString* winner = [db winningRevIDOfDocNumericID: docNumericID isDeleted: &deleted
+                                           isConflict: &conflict];
+    CAssert([winner hasPrefix: @"3-"]);
+    CAssert(deleted && !conflict);
+    CAssertNil([db getDocumentWithID: @"doc" revisionID: nil]);
+    CAssertEq(db.documentCount, 0u);
+
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    CAssertEq([db getAllDocs: &options].count, 0u);
+    options.allDocsMode = kCBLIncludeDeleted;
+    NSArray* rows = [db getAllDocs: &options];
+    CAssertEq(rows.count, 1u);
+    CAssertEqual([(CBLQueryRow*)rows[0] value], $dict({@"rev", winner}, {@"deleted", $true}));
+
+    // Purging all revisions clears the cached winner:
+    NSDictionary* result;
+    CAssertEq([db purgeRevisions: $dict({@"doc", @[@"*"]}) result: &result], kCBLStatusOK);
+    CAssertNil([db winningRevIDOfDocNumericID: docNumericID isDeleted: &deleted
+                                   isConflict: &conflict]);
+    CAssertEq([db getAllDocs: &options].count, 0u);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_ConcurrentReads) {
+    // Runs read transactions on other threads while this thread keeps writing.
+    CBLDatabase* db = createDB();
+    for (int i = 0; i < 100; i++)
+        putDoc(db, $dict({@"n", @(i)}));
+
+    __block int32_t failures = 0;
+    NSOperationQueue* queue = [[NSOperationQueue alloc] init];
+    queue.maxConcurrentOperationCount = 8;
+    for (int i = 0; i < 8; i++) {
+        [queue addOperationWithBlock: ^{
+            for (int j = 0; j < 20; j++) {
+                [db _inReadTransaction: ^CBLStatus {
+                    // Everything read within the transaction is from the same snapshot:
+                    CBLQueryOptions options = kDefaultCBLQueryOptions;
+                    NSArray* rows = [db getAllDocs: &options];
+                    CBL_RevisionList* changes = [db changesSinceSequence: 0 options: NULL
+                                                                  filter: NULL params: nil];
+                    if (rows.count < 100 || rows.count != db.documentCount
+                                         || changes.count != rows.count)
+                        OSAtomicIncrement32(&failures);
+                    return kCBLStatusOK;
+                }];
+            }
+        }];
+    }
+    for (int i = 100; i < 200; i++)
+        putDoc(db, $dict({@"n", @(i)}));
+    [queue waitUntilAllOperationsAreFinished];
+    CAssertEq(failures, 0);
+
+    // A read on this thread sees all the writes:
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    CAssertEq([db getAllDocs: &options].count, 200u);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_GroupCommit) {
+    CBLDatabase* db = createDB();
+    __block NSMutableArray* notified = $marray();
+    id observer = [[NSNotificationCenter defaultCenter]
+                   addObserverForName: CBL_DatabaseChangesNotification
+                   object: db
+                   queue: nil
+                   usingBlock: ^(NSNotification *n) {
+                       [notified addObject: n.userInfo[@"changes"]];
+                   }];
+
+    // Queue three writes; the second one fails and should be rolled back by itself:
+    NSMutableArray* results = $marray();
+    for (int i = 1; i <= 3; i++) {
+        [db _queueTransaction: ^CBLStatus {
+            CBL_Revision* rev = [[CBL_Revision alloc] initWithProperties:
+                                                        $dict({@"_id", $sprintf(@"doc%d", i)})];
+            CBLStatus status;
+            [db putRevision: rev prevRevisionID: nil allowConflict: NO status: &status];
+            return (i == 2) ? kCBLStatusBadRequest : status;
+        } onCompletion: ^(CBLStatus status) {
+            [results addObject: @(status)];
+        }];
+    }
+    CAssertEq(results.count, 0u);
+    [db flushQueuedTransactions];
+    CAssertEqual(results, (@[@(kCBLStatusCreated), @(kCBLStatusBadRequest),
+                             @(kCBLStatusCreated)]));
+
+    // All the successful changes are posted together, after the commit:
+    CAssertEq(notified.count, 1u);
+    NSArray* docIDs = [notified[0] my_map: ^id(CBLDatabaseChange* change) {
+        return change.addedRevision.docID;
+    }];
+    CAssertEqual(docIDs, (@[@"doc1", @"doc3"]));
+    CAssertEq(db.documentCount, 2u);
+    CAssertNil([db getDocumentWithID: @"doc2" revisionID: nil]);
+
+    [[NSNotificationCenter defaultCenter] removeObserver: observer];
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_DocIDMap) {
+    RequireTestCase(CBLDocIDMap);
+    CBLDatabase* db = createDB();
+    CBL_Revision* rev1 = putDoc(db, $dict({@"_id", @"doc1"}));
+    SInt64 doc1ID = [db getDocNumericID: @"doc1"];
+    CAssert(doc1ID > 0);
+    CAssertEq([db.docIDMapStats[@"count"] intValue], 1);
+    UInt64 hits = [db.docIDMapStats[@"hits"] unsignedLongLongValue];
+    CAssertEq([db getDocNumericID: @"doc1"], doc1ID);
+    CAssertEq([db.docIDMapStats[@"hits"] unsignedLongLongValue], hits + 1);
+
+    // A docID added by a transaction that's rolled back must be forgotten:
+    CBLStatus status = [db _inTransaction: ^CBLStatus {
+        putDoc(db, $dict({@"_id", @"doomed"}));
+        CAssert([db getDocNumericID: @"doomed"] > 0);
+        return kCBLStatusBadRequest;
+    }];
+    CAssertEq(status, kCBLStatusBadRequest);
+    CAssertEq([db getDocNumericID: @"doomed"], 0);
+    CAssertNil([db getDocumentWithID: @"doomed" revisionID: nil]);
+    CBL_Revision* rev2 = putDoc(db, $dict({@"_id", @"doomed"}));
+    CAssertEqual([db getDocumentWithID: @"doomed" revisionID: nil].revID, rev2.revID);
+    CAssertEqual([db getDocumentWithID: @"doc1" revisionID: nil].revID, rev1.revID);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_DocumentCount) {
+    CBLDatabase* db = createDB();
+    CAssertEq(db.documentCount, 0u);
+    CAssertEq(db.lastSequenceNumber, 0);
+    CBL_Revision* rev1 = putDoc(db, $dict({@"_id", @"doc1"}));
+    putDoc(db, $dict({@"_id", @"doc2"}));
+    CAssertEq(db.documentCount, 2u);
+    CAssertEq(db.lastSequenceNumber, 2);
+
+    // Deleting a doc decrements the count; updating one doesn't change it:
+    putDoc(db, $dict({@"_id", @"doc1"}, {@"_rev", rev1.revID}, {@"_deleted", $true}));
+    CBL_Revision* rev2 = [db getDocumentWithID: @"doc2" revisionID: nil];
+    putDoc(db, $dict({@"_id", @"doc2"}, {@"_rev", rev2.revID}, {@"updated", $true}));
+    CAssertEq(db.documentCount, 1u);
+    CAssertEq(db.lastSequenceNumber, 4);
+
+    // Changes made in a rolled-back transaction don't count:
+    CBLStatus status = [db _inTransaction: ^CBLStatus {
+        putDoc(db, $dict({@"_id", @"doc3"}));
+        CAssertEq(db.documentCount, 2u);
+        CAssertEq(db.lastSequenceNumber, 5);
+        return kCBLStatusBadRequest;
+    }];
+    CAssertEq(status, kCBLStatusBadRequest);
+    CAssertEq(db.documentCount, 1u);
+    CAssertEq(db.lastSequenceNumber, 4);
+
+    // The count is persisted:
+    NSString* path = db.path;
+    CAssert([db close]);
+    db = [[CBLDatabase alloc] _initWithPath: path name: nil manager: nil readOnly: NO];
+    CAssert([db open: nil]);
+    CAssertEq(db.documentCount, 1u);
+    CAssertEq(db.lastSequenceNumber, 4);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_BodyCompression) {
+    RequireTestCase(CBLBodyCodec);
+    __block CBLDatabase* db = createDB();
+    CAssertEq(db.bodyCompression, kCBLBodyCompressionNone);
+    NSMutableArray* revs = $marray();
+    for (int i = 0; i < 50; i++) {
+        [revs addObject: putDoc(db, $dict({@"_id", $sprintf(@"doc%02d", i)},
+                                          {@"type", @"contact"},
+                                          {@"firstName", $sprintf(@"Name%d", i)},
+                                          {@"emailAddress", @"someone@example.com"},
+                                          {@"tags", @[@"one", @"two", @"three"]}))];
+    }
+
+    // Switch to dictionary compression; existing and new bodies are both readable:
+    db.bodyCompression = kCBLBodyCompressionDictionary;
+    CAssertEq(db.bodyCompression, kCBLBodyCompressionDictionary);
+    [revs addObject: putDoc(db, $dict({@"_id", @"doc50"}, {@"type", @"contact"},
+                                      {@"firstName", @"Nifty"},
+                                      {@"emailAddress", @"nifty@example.com"}))];
+    void (^verify)(void) = ^{
+        for (CBL_Revision* rev in revs) {
+            CBL_Revision* readRev = [db getDocumentWithID: rev.docID revisionID: nil];
+            CAssertEqual(readRev.properties, rev.properties);
+        }
+        CBLQueryOptions options = kDefaultCBLQueryOptions;
+        options.includeDocs = YES;
+        NSArray* rows = [db getAllDocs: &options];
+        CAssertEq(rows.count, revs.count);
+        CAssertEqual([rows[3] documentProperties], [revs[3] properties]);
+    };
+    verify();
+
+    // Compaction recompresses the old bodies, and the setting persists:
+    CAssertEq([db compact], kCBLStatusOK);
+    verify();
+    NSString* path = db.path;
+    CAssert([db close]);
+    db = [[CBLDatabase alloc] _initWithPath: path name: nil manager: nil readOnly: NO];
+    CAssert([db open: nil]);
+    CAssertEq(db.bodyCompression, kCBLBodyCompressionDictionary);
+    verify();
+
+    // ...and back again:
+    db.bodyCompression = kCBLBodyCompressionNone;
+    CAssertEq([db compact], kCBLStatusOK);
+    verify();
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_BinaryBodies) {
+    RequireTestCase(CBLBinaryBody);
+    __block CBLDatabase* db = createDB();
+    NSMutableArray* revs = $marray();
+    [revs addObject: putDoc(db, $dict({@"_id", @"json"}, {@"type", @"contact"},
+                                      {@"firstName", @"Jason"}))];
+    db.binaryBodyFormat = YES;
+    CAssert(db.binaryBodyFormat);
+    for (int i = 0; i < 20; i++) {
+        [revs addObject: putDoc(db, $dict({@"_id", $sprintf(@"doc%02d", i)},
+                                          {@"type", @"contact"},
+                                          {@"firstName", $sprintf(@"Name%d", i)},
+                                          {@"age", @(20 + i)},
+                                          {@"address", $dict({@"city", @"Springfield"},
+                                                             {@"zip", @"12345"})},
+                                          {@"tags", @[@"one", @"two", @(3), $null]}))];
+    }
+    void (^verify)(void) = ^{
+        for (CBL_Revision* rev in revs) {
+            CBL_Revision* readRev = [db getDocumentWithID: rev.docID revisionID: nil];
+            CAssertEqual(readRev.properties, rev.properties);
+        }
+        CBLQueryOptions options = kDefaultCBLQueryOptions;
+        options.includeDocs = YES;
+        NSArray* rows = [db getAllDocs: &options];
+        CAssertEq(rows.count, revs.count);
+        for (NSUInteger i = 0; i < rows.count; i++)
+            CAssertEqual([rows[i] documentProperties], [revs[i] properties]);
+    };
+    verify();
+
+    // A rolled-back transaction's new property names are forgotten along with its revisions:
+    CBLStatus status = [db _inTransaction: ^CBLStatus {
+        putDoc(db, $dict({@"_id", @"rolledBack"}, {@"nowYouSeeMe", @YES}));
+        return kCBLStatusConflict;
+    }];
+    CAssertEq(status, kCBLStatusConflict);
+    [revs addObject: putDoc(db, $dict({@"_id", @"after"}, {@"somethingElse", @"hi"},
+                                      {@"type", @"contact"}))];
+    verify();
+
+    // Compaction converts the JSON body, and the format and key table persist:
+    CAssertEq([db compact], kCBLStatusOK);
+    verify();
+    NSString* path = db.path;
+    CAssert([db close]);
+    db = [[CBLDatabase alloc] _initWithPath: path name: nil manager: nil readOnly: NO];
+    CAssert([db open: nil]);
+    CAssert(db.binaryBodyFormat);
+    verify();
+
+    // ...and back to JSON:
+    db.binaryBodyFormat = NO;
+    CAssertEq([db compact], kCBLStatusOK);
+    verify();
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_IncrementalCompaction) {
+    CBLDatabase* db = createDB();
+    CAssertEq([db.fmdb intForQuery: @"PRAGMA auto_vacuum"], 2);     // INCREMENTAL
+    NSString* filler = [@"" stringByPaddingToLength: 4000 withString: @"blah " startingAtIndex: 0];
+    NSMutableArray* revs = $marray();
+    for (int i = 0; i < 200; i++) {
+        CBL_Revision* rev = putDoc(db, $dict({@"_id", $sprintf(@"doc%03d", i)},
+                                             {@"filler", filler}));
+        [revs addObject: putDoc(db, $dict({@"_id", rev.docID}, {@"_rev", rev.revID},
+                                          {@"n", @(i)}))];
+    }
+
+    // Use no time budget, so each call does only one step:
+    CBLCompactionProgress progress;
+    float lastFraction = 0.0;
+    unsigned steps = 0;
+    do {
+        NSError* error;
+        CAssert([db compactIncrementally: 0.0 progress: &progress error: &error]);
+        CAssert(progress.fractionComplete >= lastFraction);
+        lastFraction = progress.fractionComplete;
+        ++steps;
+    } while (!progress.finished && steps < 10000);
+    CAssert(progress.finished);
+    CAssert(steps > 1);
+    CAssertEq(progress.fractionComplete, 1.0f);
+    CAssert(progress.bytesReclaimed >= 200 * 4000);
+    CAssertEq([db.fmdb intForQuery: @"SELECT count(*) FROM revs WHERE current=0 AND json NOT NULL"],
+              0);
+    CAssertEq([db.fmdb intForQuery: @"PRAGMA freelist_count"], 0);
+
+    for (CBL_Revision* rev in revs) {
+        CBL_Revision* readRev = [db getDocumentWithID: rev.docID revisionID: nil];
+        CAssertEqual(readRev.properties, rev.properties);
+    }
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_Database_BatchExpansion) {
+    CBLDatabase* db = createDB();
+    NSMutableArray* revs = $marray();
+    for (int i = 0; i < 20; i++) {
+        CBL_Revision* rev = putDoc(db, $dict({@"_id", $sprintf(@"doc%02d", i)}, {@"n", @(i)}));
+        for (int j = 0; j < i % 3; j++)
+            rev = putDoc(db, $dict({@"_id", rev.docID}, {@"_rev", rev.revID}, {@"n", @(i)}));
+        [revs addObject: rev];
+    }
+    // Give one document a conflict:
+    CBL_MutableRevision* conflict = [[CBL_MutableRevision alloc] initWithDocID: @"doc05"
+                                                                         revID: @"2-aaaa"
+                                                                       deleted: NO];
+    conflict.properties = $dict({@"_id", @"doc05"}, {@"_rev", conflict.revID});
+    CAssertEq([db forceInsert: conflict revisionHistory: @[conflict.revID, @"1-ffff"]
+                       source: nil], kCBLStatusCreated);
+
+    // Batch histories match the ones read a revision at a time:
+    NSArray* histories = [db getRevisionHistories: revs];
+    CAssertEq(histories.count, revs.count);
+    for (NSUInteger i = 0; i < revs.count; i++)
+        CAssertEqual(histories[i], [db getRevisionHistory: revs[i]]);
+
+    // ...and so do the _revisions and _conflicts properties added by _all_docs:
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.includeDocs = YES;
+    options.content = kCBLIncludeRevs | kCBLIncludeConflicts;
+    NSArray* rows = [db getAllDocs: &options];
+    CAssertEq(rows.count, revs.count);
+    for (NSUInteger i = 0; i < revs.count; i++) {
+        NSDictionary* props = [rows[i] documentProperties];
+        CAssertEqual(props[@"n"], @(i));
+        CAssertEqual(props[@"_revisions"], [db getRevisionHistoryDict: revs[i]
+                                                    startingFromAnyOf: nil]);
+        if (i == 5)
+            CAssertEqual(props[@"_conflicts"], @[conflict.revID]);
+        else
+            CAssertNil(props[@"_conflicts"]);
+    }
+
+    // Loading many bodies at once gives the same results as loading them one by one:
+    NSArray* loaded = [revs my_map: ^id(CBL_Revision* rev) {
+        CBL_MutableRevision* nuRev = [[CBL_MutableRevision alloc] initWithDocID: rev.docID
+                                                                          revID: rev.revID
+                                                                        deleted: NO];
+        nuRev.sequence = rev.sequence;
+        return nuRev;
+    }];
+    CAssertEq([db loadRevisionBodies: loaded options: kCBLIncludeRevs], kCBLStatusOK);
+    for (NSUInteger i = 0; i < revs.count; i++) {
+        CBLStatus status;
+        CBL_Revision* single = [db revisionByLoadingBody: revs[i] options: kCBLIncludeRevs
+                                                  status: &status];
+        CAssertEqual([loaded[i] properties], single.properties);
+    }
+    CAssert([db close]);
+}
+
+
 TestCase(CBLDatabase) {
     RequireTestCase(CBL_Database_CRUD);
     RequireTestCase(CBL_Database_DeleteWithProperties);
@@ -1002,6 +1414,15 @@ TestCase(CBLDatabase) {
     RequireTestCase(CBL_Database_LocalDocs);
     RequireTestCase(CBL_Database_FindMissingRevisions);
     RequireTestCase(CBL_Database_Purge);
+    RequireTestCase(CBL_Database_WinningRevision);
+    RequireTestCase(CBL_Database_ConcurrentReads);
+    RequireTestCase(CBL_Database_GroupCommit);
+    RequireTestCase(CBL_Database_DocIDMap);
+    RequireTestCase(CBL_Database_DocumentCount);
+    RequireTestCase(CBL_Database_BodyCompression);
+    RequireTestCase(CBL_Database_BinaryBodies);
+    RequireTestCase(CBL_Database_IncrementalCompaction);
+    RequireTestCase(CBL_Database_BatchExpansion);
     RequireTestCase(CBL_Database_ReplicatorSequences);
     RequireTestCase(CBL_Database_Attachments);
     RequireTestCase(CBL_Database_PutAttachment);
@@ -224,36 +224,42 @@ static int findCommonAncestor(CBL_Revision* rev, NSArray* possibleIDs);
             // Go through the list of local changes again, selecting the ones the destination server
             // said were missing and mapping them to a JSON dictionary in the form _bulk_docs wants:
             CBLDatabase* db = _db;
+            NSMutableArray* revsToLoad = $marray();
+            for (CBL_Revision* rev in changes.allRevisions) {
+                // Is this revision in the server's 'missing' list?
+                NSArray* missing = results[rev.docID][@"missing"];
+                if ([missing containsObject: [rev revID]])
+                    [revsToLoad addObject: [rev mutableCopy]];
+                else
+                    [self removePending: rev];
+            }
+
+            // Get the revisions' properties and histories, in a few queries for the whole batch:
+            CBLContentOptions options = kCBLIncludeAttachments;
+            if (!_dontSendMultipart)
+                options |= kCBLBigAttachmentsFollow;
+            CBLStatus status = [db loadRevisionBodies: revsToLoad options: options];
+            NSArray* histories = CBLStatusIsError(status) ? nil
+                                                          : [db getRevisionHistories: revsToLoad];
+
             CBL_RevisionList* revsToSend = [[CBL_RevisionList alloc] init];
-            NSArray* docsToSend = [changes.allRevisions my_map: ^id(CBL_Revision* rev) {
+            __block NSUInteger index = 0;
+            NSArray* docsToSend = [revsToLoad my_map: ^id(CBL_MutableRevision* nuRev) {
+                CBL_Revision* rev = nuRev;
                 NSDictionary* properties;
                 @autoreleasepool {
-                    // Is this revision in the server's 'missing' list?
-                    NSDictionary* revResults = results[rev.docID];
-                    NSArray* missing = revResults[@"missing"];
-                    if (![missing containsObject: [rev revID]]) {
-                        [self removePending: rev];
-                        return nil;
-                    }
-                    
-                    // Get the revision's properties:
-                    CBLContentOptions options = kCBLIncludeAttachments;
-                    if (!_dontSendMultipart)
-                        options |= kCBLBigAttachmentsFollow;
-                    CBLStatus status;
-                    rev = [db revisionByLoadingBody: rev options: options status: &status];
-                    CBL_MutableRevision* nuRev = [rev mutableCopy];
-                    rev = nuRev;
-                    if (status >= 300) {
+                    NSArray* history = histories[index++];
+                    if (!nuRev.body || !history) {
                         Warn(@"%@: Couldn't get local contents of %@", self, nuRev);
                         [self revisionFailed];
                         return nil;
                     }
 
                     // Add the revision history:
+                    NSDictionary* revResults = results[rev.docID];
                     NSArray* possibleAncestors = revResults[@"possible_ancestors"];
-                    nuRev[@"_revisions"] = [db getRevisionHistoryDict: nuRev
-                                                     startingFromAnyOf: possibleAncestors];
+                    nuRev[@"_revisions"] = [CBLDatabase makeRevisionHistoryDict: history
+                                                              startingFromAnyOf: possibleAncestors];
                     properties = nuRev.properties;
 
                     // Strip any attachments already known to the target db:
@@ -93,6 +93,7 @@ typedef SInt64 SequenceNumber;
 
 - (void) addRev: (CBL_Revision*)rev;
 - (void) removeRev: (CBL_Revision*)rev;
+- (void) removeRevsAtIndexes: (NSIndexSet*)indexes;
 
 - (void) limit: (NSUInteger)limit;
 - (void) sortBySequence;
@@ -266,6 +266,10 @@
     [_revs removeObject: rev];
 }
 
+- (void) removeRevsAtIndexes: (NSIndexSet*)indexes {
+    [_revs removeObjectsAtIndexes: indexes];
+}
+
 - (CBL_Revision*) revWithDocID: (NSString*)docID revID: (NSString*)revID {
     for (CBL_Revision* rev in _revs) {
         if ($equal(rev.docID, docID) && $equal(rev.revID, revID))
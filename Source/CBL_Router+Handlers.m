@@ -38,6 +38,10 @@
 #import "Test.h"
 
 
+// Size of the pieces a streamed query response is sent in (see -sendRows:options:updateSeq:)
+#define kStreamedRowsChunkSize 16384
+
+
 @implementation CBL_Router (Handlers)
 
 
@@ -146,7 +150,8 @@
                                  {@"purge_seq", @(0)}, // TODO: Implement
                                  {@"disk_size", @(disk_size)},
                                  {@"instance_start_time", @(startTime)},
-                                 {@"disk_format_version", @(db.schemaVersion)});
+                                 {@"disk_format_version", @(db.schemaVersion)},
+                                 {@"docid_map", db.docIDMapStats});
     return kCBLStatusOK;
 }
 
@@ -209,15 +214,81 @@
     return [self doAllDocs: &options];
 }
 
+// Nonstandard: if there are more rows after those returned by a query with a 'limit', the
+// response includes a 'cursor' property, which can be passed as the 'cursor' option of the query
+// for the next page (see -getQueryOptions:). To find out, the query is run with a limit one
+// higher, and then the extra row is removed.
+- (NSDictionary*) responseWithRows: (NSArray*)rows
+                            ofView: (CBLView*)view
+                           options: (const CBLQueryOptions*)options
+                         updateSeq: (id)updateSeq
+{
+    NSString* cursor = CBLQueryCursorAfterRows(&rows, options, view);
+    rows = [rows my_map: ^id(CBLQueryRow* row) {return row.asJSONDictionary;}];
+    return $dict({@"rows", rows},
+                 {@"total_rows", @(rows.count)},
+                 {@"offset", @(options->skip)},
+                 {@"update_seq", updateSeq},
+                 {@"cursor", cursor});
+}
+
+// Nonstandard: with the 'stream' option, the rows of an _all_docs or view query are sent as
+// they're read from the database, instead of all being read into the response body first.
+// As without streaming, "total_rows" is the number of rows in the response; but there's no
+// "cursor". (Not streamed if the client wants the response as an object, since that has to be in
+// memory anyway.)
+- (BOOL) wantsStreamedRows {
+    return _onDataAvailable && !_onObjectAvailable && !$equal(_request.HTTPMethod, @"HEAD")
+        && [self boolQuery: @"stream"];
+}
+
+// Sends the response headers, then the rows one batch at a time, then the rest of the body.
+// Returns the status to finish the request with.
+- (CBLStatus) sendRows: (NSEnumerator*)rows
+               options: (const CBLQueryOptions*)options
+             updateSeq: (id)updateSeq
+{
+    _response[@"Content-Type"] = @"application/json";
+    [self sendResponseHeaders];
+    NSMutableData* json = [NSMutableData dataWithBytes: "{\"rows\":[" length: 9];
+    NSUInteger count = 0;       // the total number of rows in the response
+    for (CBLQueryRow* row in rows) {
+        @autoreleasepool {
+            if (count++ > 0)
+                [json appendBytes: "," length: 1];
+            [json appendData: [CBLJSON dataWithJSONObject: row.asJSONDictionary
+                                                  options: 0 error: NULL]];
+            if (json.length >= kStreamedRowsChunkSize) {
+                _onDataAvailable(json, NO);
+                json = [NSMutableData data];
+            }
+        }
+    }
+    NSData* rest = [CBLJSON dataWithJSONObject: $dict({@"total_rows", @(count)},
+                                                      {@"offset", @(options->skip)},
+                                                      {@"update_seq", updateSeq})
+                                       options: 0 error: NULL];
+    [json appendBytes: "]," length: 2];
+    [json appendBytes: (const char*)rest.bytes + 1 length: rest.length - 1];   // skip its '{'
+    _onDataAvailable(json, NO);
+    return kCBLStatusOK;
+}
+
 - (CBLStatus) doAllDocs: (const CBLQueryOptions*)options {
-    NSArray* result = [_db getAllDocs: options];
+    if ([self wantsStreamedRows]) {
+        CBLStatus status;
+        NSEnumerator* rows = [_db streamAllDocs: options status: &status];
+        if (!rows)
+            return status;
+        return [self sendRows: rows options: options
+                    updateSeq: (options->updateSeq ? @(_db.lastSequenceNumber) : nil)];
+    }
+    CBLQueryOptions pageOptions = CBLQueryOptionsWithExtraRow(options, nil);
+    NSArray* result = [_db getAllDocs: &pageOptions];
     if (!result)
         return _db.lastDbError;
-    result = [result my_map: ^id(CBLQueryRow* row) {return row.asJSONDictionary;}];
-    _response.bodyObject = $dict({@"rows", result},
-                                 {@"total_rows", @(result.count)},
-                                 {@"offset", @(options->skip)},
-                                 {@"update_seq", (options->updateSeq ? @(_db.lastSequenceNumber) : nil)});
+    _response.bodyObject = [self responseWithRows: result ofView: nil options: options
+                                        updateSeq: (options->updateSeq ? @(_db.lastSequenceNumber) : nil)];
     return kCBLStatusOK;
 }
 
@@ -1079,15 +1150,20 @@ static NSArray* parseJSONRevArrayQuery(NSString* queryStr) {
 
 - (CBLStatus) queryView: (CBLView*)view withOptions: (const CBLQueryOptions*)options {
     CBLStatus status;
-    NSArray* rows = [view _queryWithOptions: options status: &status];
+    if ([self wantsStreamedRows]) {
+        id updateSeq = options->updateSeq ? @(view.lastSequenceIndexed) : nil;
+        NSEnumerator* rows = [view _streamRowsWithOptions: options status: &status];
+        if (!rows)
+            return status;
+        return [self sendRows: rows options: options updateSeq: updateSeq];
+    }
+    CBLQueryOptions pageOptions = CBLQueryOptionsWithExtraRow(options, view);
+    NSArray* rows = [view _queryWithOptions: &pageOptions status: &status];
     if (!rows)
         return status;
-    rows = [rows my_map:^(CBLQueryRow* row) {return row.asJSONDictionary;}];
     id updateSeq = options->updateSeq ? @(view.lastSequenceIndexed) : nil;
-    _response.bodyObject = $dict({@"rows", rows},
-                                 {@"total_rows", @(rows.count)},
-                                 {@"offset", @(options->skip)},
-                                 {@"update_seq", updateSeq});
+    _response.bodyObject = [self responseWithRows: rows ofView: view options: options
+                                        updateSeq: updateSeq];
     return kCBLStatusOK;
 }
 
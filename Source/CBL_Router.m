@@ -237,6 +237,21 @@
         options->endKey = [self retainQuery: [self jsonQuery: @"endkey" error: &error]];
         if (error)
             return NO;
+        options->startKeyDocID = [self retainQuery: [self query: @"startkey_docid"]];
+        options->endKeyDocID = [self retainQuery: [self query: @"endkey_docid"]];
+
+        // Nonstandard 'cursor' option, from a previous response, resumes after its last row:
+        NSString* cursor = [self query: @"cursor"];
+        if (cursor) {
+            id startKey;
+            NSString* startKeyDocID;
+            unsigned skip;
+            if (!CBLQueryCursorDecode(cursor, &startKey, &startKeyDocID, &skip))
+                return NO;
+            options->startKey = [self retainQuery: startKey];
+            options->startKeyDocID = [self retainQuery: startKeyDocID];
+            options->skip = skip;
+        }
     }
 
     // Nonstandard full-text search options 'full_text', 'snippets', 'ranking':
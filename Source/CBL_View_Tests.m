@@ -17,6 +17,9 @@
 #import "CBLView+Internal.h"
 #import "CBLQuery+Geo.h"
 #import "CBLDatabase+Insertion.h"
+#import "CBLQueryRowStream.h"
+#import "FMDatabase.h"
+#import "FMDatabaseAdditions.h"
 #import "CBLInternal.h"
 #import "CouchbaseLitePrivate.h"
 #import "Test.h"
@@ -188,6 +191,626 @@ TestCase(CBL_View_Index) {
 }
 
 
+TestCase(CBL_View_ParallelIndex) {
+    RequireTestCase(CBL_View_Index);
+    CBLDatabase *db = createDB();
+    NSMutableArray* revs = $marray();
+    for (int i = 0; i < 1000; i++)
+        [revs addObject: putDoc(db, $dict({@"n", @(i)}, {@"key", $sprintf(@"k%d", i % 37)}))];
+
+    CBLMapBlock mapBlock = MAPBLOCK({
+        emit(doc[@"key"], doc[@"n"]);
+        if ([doc[@"n"] intValue] % 3 == 0)
+            emit(@[doc[@"n"], @"x"], nil);
+    });
+    CBLView* serialView = [db viewNamed: @"serial"];
+    [serialView setMapBlock: mapBlock reduceBlock: NULL version: @"1"];
+    CBLView* parallelView = [db viewNamed: @"parallel"];
+    [parallelView setMapBlock: mapBlock reduceBlock: NULL version: @"1"];
+    parallelView.mapParallelism = 4;
+
+    CAssertEq([serialView updateIndex], kCBLStatusOK);
+    CAssertEq([parallelView updateIndex], kCBLStatusOK);
+    CAssertEq(serialView.dump.count, 1334u);
+    CAssertEqual([NSSet setWithArray: parallelView.dump], [NSSet setWithArray: serialView.dump]);
+
+    // Update some docs and reindex incrementally:
+    for (int i = 0; i < 1000; i += 7) {
+        CBL_Revision* rev = revs[i];
+        CBL_MutableRevision* nuRev = [[CBL_MutableRevision alloc] initWithDocID: rev.docID
+                                                                          revID: nil deleted: NO];
+        nuRev.properties = $dict({@"n", @(i)}, {@"key", @"updated"});
+        CBLStatus status;
+        [db putRevision: nuRev prevRevisionID: rev.revID allowConflict: NO status: &status];
+        CAssert(status < 300);
+    }
+    CAssertEq([serialView updateIndex], kCBLStatusOK);
+    CAssertEq([parallelView updateIndex], kCBLStatusOK);
+    CAssertEqual([NSSet setWithArray: parallelView.dump], [NSSet setWithArray: serialView.dump]);
+
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_UpdateIndexes) {
+    RequireTestCase(CBL_View_ParallelIndex);
+    CBLDatabase *db = createDB();
+    NSArray* docs = putDocs(db);
+
+    __block int mapCalls = 0;
+    CBLMapBlock mapBlock1 = MAPBLOCK({
+        mapCalls++;
+        emit(doc[@"key"], doc[@"_conflicts"]);
+    });
+    CBLMapBlock mapBlock2 = MAPBLOCK({
+        emit(@[doc[@"_id"], @([doc[@"key"] length])], nil);
+    });
+    CBLView* view1 = [db viewNamed: @"view1"];
+    [view1 setMapBlock: mapBlock1 reduceBlock: NULL version: @"1"];
+    CBLView* view2 = [db viewNamed: @"view2"];
+    [view2 setMapBlock: mapBlock2 reduceBlock: NULL version: @"1"];
+    view2.mapParallelism = 2;
+    CAssertEq([view1 updateIndex], kCBLStatusOK);
+    CAssertEq(mapCalls, 5);
+
+    // Add a doc, update a doc, and create a conflict; view1 is now behind view2, which has
+    // never been indexed:
+    putDoc(db, $dict({@"_id", @"66666"}, {@"key", @"six"}));
+    CBL_Revision* rev = docs[0];
+    CBL_MutableRevision* nuRev = [[CBL_MutableRevision alloc] initWithDocID: rev.docID
+                                                                      revID: nil deleted: NO];
+    nuRev.properties = $dict({@"key", @"2wo"});
+    CBLStatus status;
+    [db putRevision: nuRev prevRevisionID: rev.revID allowConflict: NO status: &status];
+    CAssert(status < 300);
+    CBL_Revision* conflict = [[CBL_Revision alloc] initWithProperties:
+                                                $dict({@"_id", @"44444"},
+                                                      {@"_rev", @"1-~~~~~"},
+                                                      {@"key", @"40ur"})];
+    status = [db forceInsert: conflict revisionHistory: @[] source: nil];
+    CAssert(status < 300);
+
+    mapCalls = 0;
+    NSError* error;
+    CAssert([db updateIndexesOfViews: @[view1, view2] error: &error], @"Error: %@", error);
+    CAssertEq(mapCalls, 3);
+    CAssertEq(view1.lastSequenceIndexed, db.lastSequenceNumber);
+    CAssertEq(view2.lastSequenceIndexed, db.lastSequenceNumber);
+
+    // The results should be the same as indexing each view on its own:
+    CBLView* ref1 = [db viewNamed: @"ref1"];
+    [ref1 setMapBlock: mapBlock1 reduceBlock: NULL version: @"1"];
+    CBLView* ref2 = [db viewNamed: @"ref2"];
+    [ref2 setMapBlock: mapBlock2 reduceBlock: NULL version: @"1"];
+    CAssertEq([ref1 updateIndex], kCBLStatusOK);
+    CAssertEq([ref2 updateIndex], kCBLStatusOK);
+    CAssertEqual(view1.dump, ref1.dump);
+    CAssertEqual(view2.dump, ref2.dump);
+    CAssertEq(view1.dump.count, 6u);
+
+    // No-op update:
+    CAssertEq([CBLView updateIndexes: @[view1, view2, ref1, ref2]], kCBLStatusNotModified);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_ChunkedIndex) {
+    RequireTestCase(CBL_View_UpdateIndexes);
+    CBLDatabase *db = createDB();
+    // More revisions than are indexed in the first chunk:
+    const int kNDocs = 1500;
+    [db _inTransaction: ^CBLStatus {
+        for (int i = 0; i < kNDocs; i++)
+            putDoc(db, @{@"n": @(i)});
+        return kCBLStatusOK;
+    }];
+    CBLMapBlock mapBlock = MAPBLOCK({
+        emit(doc[@"n"], nil);
+    });
+    CBLView* view = [db viewNamed: @"chunked"];
+    [view setMapBlock: mapBlock reduceBlock: NULL version: @"1"];
+
+    // A partial update leaves the index part of the way through, with the rows indexed so far:
+    CAssertEq([CBLView updateIndexes: @[view] throughSequence: 100], kCBLStatusOK);
+    CAssertEq(view.lastSequenceIndexed, 100);
+    CAssertEq(view.dump.count, 100u);
+
+    // The rest is indexed in chunks, with a progress notification after each:
+    __block NSMutableArray* progress = $marray();
+    id observer = [[NSNotificationCenter defaultCenter]
+                            addObserverForName: kCBLViewIndexProgressNotification
+                                        object: view
+                                         queue: nil
+                                    usingBlock: ^(NSNotification *n) {
+        [progress addObject: n.userInfo[@"sequence"]];
+        CAssertEqual(n.userInfo[@"endSequence"], @(kNDocs));
+        CAssert([n.userInfo[@"rate"] doubleValue] > 0);
+    }];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+    [[NSNotificationCenter defaultCenter] removeObserver: observer];
+    CAssert(progress.count >= 2u);
+    CAssertEqual(progress.lastObject, @(kNDocs));
+    CAssertEq(view.lastSequenceIndexed, kNDocs);
+
+    // ...and ends up the same as indexing all at once:
+    CBLView* ref = [db viewNamed: @"ref"];
+    [ref setMapBlock: mapBlock reduceBlock: NULL version: @"1"];
+    CAssertEq([ref updateIndex], kCBLStatusOK);
+    CAssertEqual(view.dump, ref.dump);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_IndexChangeTracking) {
+    RequireTestCase(CBL_View_ChunkedIndex);
+    CBLDatabase *db = createDB();
+    for (int i = 0; i < 10; i++)
+        putDoc(db, @{@"n": @(i)});
+    CBLView* view = [db viewNamed: @"tracked"];
+    [view setMapBlock: MAPBLOCK({
+        emit(doc[@"n"], nil);
+    }) reduceBlock: NULL version: @"1"];
+    [view _trackIndexChanges];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+    SequenceNumber indexed = view.lastSequenceIndexed;
+
+    CBLQueryOptions low = kDefaultCBLQueryOptions, high = kDefaultCBLQueryOptions;
+    low.endKey = @4;
+    high.startKey = @5;
+    CBLQueryOptions some = kDefaultCBLQueryOptions;
+    some.keys = @[@2, @100];
+
+    // Nothing has changed since the index was up to date:
+    CAssert(![view _indexChangesFromSequence: indexed mayAffectQuery: &low]);
+
+    // A new row at key 100 only affects queries whose range includes it:
+    putDoc(db, @{@"n": @100});
+    CAssertEq([view updateIndex], kCBLStatusOK);
+    CAssert(![view _indexChangesFromSequence: indexed mayAffectQuery: &low]);
+    CAssert([view _indexChangesFromSequence: indexed mayAffectQuery: &high]);
+    CAssert([view _indexChangesFromSequence: indexed mayAffectQuery: &some]);
+    some.keys = @[@2, @3];
+    CAssert(![view _indexChangesFromSequence: indexed mayAffectQuery: &some]);
+    low.descending = YES;
+    low.startKey = @4;
+    low.endKey = nil;
+    CAssert(![view _indexChangesFromSequence: indexed mayAffectQuery: &low]);
+
+    // Changes from before tracking started, or past the index, are unknown:
+    CAssert([view _indexChangesFromSequence: 0 mayAffectQuery: &low]);
+    CAssert([view _indexChangesFromSequence: view.lastSequenceIndexed + 1 mayAffectQuery: &low]);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_IndexTables) {
+    RequireTestCase(CBL_View_Index);
+    CBLDatabase *db = createDB();
+    putDocs(db);
+    CBLView* view1 = createView(db);
+    CBLView* view2 = [db viewNamed: @"other"];
+    [view2 setMapBlock: MAPBLOCK({
+        emit(doc[@"key"], nil);
+    }) reduceBlock: NULL version: @"1"];
+    CAssert(![view1 _indexTableExists]);
+    CAssertEqual(view1.dump, @[]);
+    CAssertEq([CBLView updateIndexes: @[view1, view2]], kCBLStatusOK);
+    CAssert(![view1.mapTableName isEqualToString: view2.mapTableName]);
+    CAssert([view1 _indexTableExists]);
+    CAssert([view2 _indexTableExists]);
+    CAssertEq(view1.dump.count, 5u);
+    CAssertEq(view2.dump.count, 5u);
+
+    // Deleting one view's index drops its table and leaves the other's alone:
+    [view1 deleteIndex];
+    CAssert(![view1 _indexTableExists]);
+    CAssertEq(view1.lastSequenceIndexed, 0);
+    CAssertEqual(view1.dump, @[]);
+    CAssertEq(view2.dump.count, 5u);
+
+    // Reindexing recreates it:
+    CAssertEq([view1 updateIndex], kCBLStatusOK);
+    CAssertEq(view1.dump.count, 5u);
+
+    // A table in another collation than the view's gets rebuilt:
+    CAssert([view1 _indexTableMatchesCollation]);
+    view1.collation = kCBLViewCollationRaw;
+    CAssert(![view1 _indexTableMatchesCollation]);
+    CAssertEq([view1 updateIndex], kCBLStatusOK);
+    CAssert([view1 _indexTableMatchesCollation]);
+    CAssertEq(view1.dump.count, 5u);
+    view1.collation = kCBLViewCollationUnicode;
+
+    NSString* table2 = view2.mapTableName;
+    [view2 deleteView];
+    CAssertEq([db.fmdb intForQuery: @"SELECT count(*) FROM sqlite_master WHERE name=?", table2],
+              0);
+    CAssertEq(view1.dump.count, 5u);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_CoveringIndex) {
+    RequireTestCase(CBL_View_IndexTables);
+    CBLDatabase *db = createDB();
+    NSArray* docs = putDocs(db);
+    CBLView* view = createView(db);
+    CAssertEq([view updateIndex], kCBLStatusOK);
+
+    // Index rows know their document IDs, without joining the docs table:
+    NSString* table = view.mapTableName;
+    for (CBL_Revision* rev in docs) {
+        CAssertEqual([db.fmdb stringForQuery: $sprintf(@"SELECT docid FROM %@ WHERE sequence=?",
+                                                       table), @(rev.sequence)],
+                     rev.docID);
+    }
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.startKey = @"four";
+    options.endKey = @"three";
+    CBLStatus status;
+    NSArray* rows = [view _queryWithOptions: &options status: &status];
+    CAssertEq(status, kCBLStatusOK);
+    CAssertEqual([rows valueForKey: @"documentID"], (@[@"44444", @"11111", @"33333"]));
+
+    // A key-range query is answered from the covering index alone:
+    CBL_FMResultSet* r = [db.fmdb executeQuery: $sprintf(@"EXPLAIN QUERY PLAN SELECT key, value, "
+                                                          "maps.docid, maps.sequence FROM %@ AS maps "
+                                                          "WHERE 1 AND key >= ? ORDER BY key", table),
+                          @"\"four\""];
+    NSMutableString* plan = [NSMutableString string];
+    while ([r next])
+        [plan appendString: [r stringForColumn: @"detail"]];
+    [r close];
+    CAssert([plan rangeOfString: @"COVERING INDEX"].length > 0, @"Query plan: %@", plan);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_Pagination) {
+    RequireTestCase(CBL_View_CoveringIndex);
+    CBLDatabase *db = createDB();
+    for (int i = 0; i < 20; i++)
+        putDoc(db, @{@"_id": $sprintf(@"doc-%02d", i), @"n": @(i)});
+    CBLView* view = [db viewNamed: @"paged"];
+    [view setMapBlock: MAPBLOCK({
+        // Lots of rows with equal keys, and some documents emitting the same key twice:
+        int n = [doc[@"n"] intValue];
+        emit(@(n % 4), nil);
+        if (n % 5 == 0)
+            emit(@(n % 4), @"again");
+    }) reduceBlock: NULL version: @"1"];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+
+    CBLStatus status;
+    for (int descending = 0; descending <= 1; descending++) {
+        CBLQueryOptions options = kDefaultCBLQueryOptions;
+        options.descending = descending;
+        NSArray* allRows = [view _queryWithOptions: &options status: &status];
+        CAssertEq(allRows.count, 24u);
+
+        // Page through the rows, each page resuming from the cursor of the one before:
+        NSMutableArray* pagedRows = $marray();
+        options.limit = 5;
+        id startKey;
+        NSString* startKeyDocID;
+        unsigned skip;
+        for (int page = 0; page < 10; page++) {
+            CBLQueryOptions pageOptions = CBLQueryOptionsWithExtraRow(&options, view);
+            NSArray* rows = [view _queryWithOptions: &pageOptions status: &status];
+            CAssertEq(status, kCBLStatusOK);
+            NSString* cursor = CBLQueryCursorAfterRows(&rows, &options, view);
+            CAssert(rows.count <= 5);
+            [pagedRows addObjectsFromArray: rows];
+            if (pagedRows.count == allRows.count) {
+                CAssertNil(cursor);     // The last page has no cursor, even if it's full
+                break;
+            }
+            CAssertEq(rows.count, 5u);
+            CAssert(CBLQueryCursorDecode(cursor, &startKey, &startKeyDocID, &skip));
+            options.startKey = startKey;
+            options.startKeyDocID = startKeyDocID;
+            options.skip = skip;
+        }
+        CAssertEqual(pagedRows, allRows);
+    }
+
+    // startKeyDocID and endKeyDocID narrow down the rows with the start and end keys:
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.startKey = @1;
+    options.startKeyDocID = @"doc-09";
+    options.endKey = @2;
+    options.endKeyDocID = @"doc-06";
+    NSArray* rows = [view _queryWithOptions: &options status: &status];
+    CAssertEqual([rows valueForKey: @"documentID"], (@[@"doc-09", @"doc-13", @"doc-17",
+                                                       @"doc-02", @"doc-06"]));
+    options.inclusiveEnd = NO;
+    rows = [view _queryWithOptions: &options status: &status];
+    CAssertEqual([rows valueForKey: @"documentID"], (@[@"doc-09", @"doc-13", @"doc-17",
+                                                       @"doc-02"]));
+    NSArray* noRows = @[];
+    CAssertNil(CBLQueryCursorAfterRows(&noRows, &options, view));
+
+    // Reduced and grouped queries don't page, since their limit applies before reducing:
+    CBLView* reduced = [db viewNamed: @"pagedCount"];
+    [reduced setMapBlock: MAPBLOCK({
+        emit(@([doc[@"n"] intValue] % 4), nil);
+    }) reduceBlock: [CBLView reduceBlockNamed: @"_count"] version: @"1"];
+    CAssertEq([reduced updateIndex], kCBLStatusOK);
+    options = kDefaultCBLQueryOptions;
+    options.limit = 5;
+    for (int group = 0; group <= 1; group++) {
+        options.group = group;
+        CBLQueryOptions pageOptions = CBLQueryOptionsWithExtraRow(&options, reduced);
+        CAssertEq(pageOptions.limit, 5u);
+        rows = [reduced _queryWithOptions: &pageOptions status: &status];
+        CAssertEq(status, kCBLStatusOK);
+        NSArray* pageRows = rows;
+        CAssertNil(CBLQueryCursorAfterRows(&pageRows, &options, reduced));
+        CAssertEqual(pageRows, rows);
+    }
+    // (The first 5 map rows all have key 0; a 6th would have added a group for key 1.)
+    CAssertEqual(rowsToDicts(rows), (@[$dict({@"key", @0}, {@"value", @5})]));
+    // ...but map-only queries of the view do:
+    options.group = NO;
+    options.reduceSpecified = YES;
+    options.reduce = NO;
+    CAssertEq(CBLQueryOptionsWithExtraRow(&options, reduced).limit, 6u);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_QueryCache) {
+    RequireTestCase(CBL_View_Query);
+    CBLDatabase *db = createDB();
+    for (int i = 0; i < 10; i++)
+        putDoc(db, @{@"n": @(i)});
+    CBLView* view = [db viewNamed: @"cached"];
+    [view setMapBlock: MAPBLOCK({
+        emit(doc[@"n"], nil);
+    }) reduceBlock: NULL version: @"1"];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+
+    // Repeating a query returns equal rows, without running it again. (They're new row objects,
+    // since the caller may modify them, e.g. by setting their database.):
+    CBLStatus status;
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.startKey = @3;
+    NSArray* rows = [view _queryWithOptions: &options status: &status];
+    CAssertEq(rows.count, 7u);
+    NSArray* cachedRows = [view _queryWithOptions: &options status: &status];
+    CAssertEqual(cachedRows, rows);
+    CAssert(cachedRows[0] != rows[0]);
+    CBLQueryOptions options2 = kDefaultCBLQueryOptions;
+    options2.startKey = @3;
+    CAssertEqual([view _queryWithOptions: &options2 status: &status], rows);
+    options2.limit = 2;
+    CAssertEq([view _queryWithOptions: &options2 status: &status].count, 2u);
+    NSDictionary* stats = view.queryCacheStats;
+    CAssertEqual(stats[@"hits"], @2);
+    CAssertEqual(stats[@"misses"], @2);
+    CAssertEqual(stats[@"entries"], @2);
+    CAssert([stats[@"bytes"] unsignedIntValue] > 0);
+
+    // Queries that include documents aren't cached:
+    options2.includeDocs = YES;
+    CAssert([view _queryWithOptions: &options2 status: &status] !=
+            [view _queryWithOptions: &options2 status: &status]);
+    CAssertEqual(view.queryCacheStats[@"hits"], @2);
+
+    // Updating the index invalidates the cache:
+    putDoc(db, @{@"n": @20});
+    CAssertEq([view updateIndex], kCBLStatusOK);
+    CAssertEqual(view.queryCacheStats[@"entries"], @0);
+    CAssertEq([view _queryWithOptions: &options status: &status].count, 8u);
+
+    // ...even if it's updated by another CBLView instance:
+    putDoc(db, @{@"n": @21});
+    CBLView* view2 = [[CBLView alloc] initWithDatabase: db name: @"cached"];
+    CAssertEq([view2 updateIndex], kCBLStatusOK);
+    CAssertEqual(view.queryCacheStats[@"entries"], @1);
+    CAssertEq([view _queryWithOptions: &options status: &status].count, 9u);
+
+    // The number of cached results is limited:
+    for (unsigned skip = 0; skip < 60; skip++) {
+        options.skip = skip;
+        [view _queryWithOptions: &options status: &status];
+    }
+    stats = view.queryCacheStats;
+    CAssertEqual(stats[@"entries"], @50);
+    CAssert([stats[@"evictions"] unsignedIntValue] > 0);
+
+    [view deleteIndex];
+    CAssertEqual(view.queryCacheStats[@"entries"], @0);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_PostFilterAndSort) {
+    RequireTestCase(CBL_View_Query);
+    CBLDatabase *db = createDB();
+    for (int i = 0; i < 50; i++)
+        putDoc(db, @{@"_id": $sprintf(@"doc-%02d", i), @"n": @(i)});
+    CBLView* view = [db viewNamed: @"selected"];
+    [view setMapBlock: MAPBLOCK({
+        int n = [doc[@"n"] intValue];
+        emit(doc[@"n"], @{@"n": @(n), @"even": @(n % 2 == 0), @"bucket": @(n % 3)});
+    }) reduceBlock: NULL version: @"1"];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+
+    // Skip and limit apply after filtering and sorting:
+    CBLStatus status;
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.postFilter = [NSPredicate predicateWithFormat: @"value.even == YES"];
+    options.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey: @"value.n"
+                                                              ascending: NO]];
+    options.skip = 2;
+    options.limit = 5;
+    NSArray* rows = [view _queryWithOptions: &options status: &status];
+    CAssertEq(status, kCBLStatusOK);
+    CAssertEqual([rows valueForKey: @"key"], (@[@44, @42, @40, @38, @36]));
+
+    // Filtering without sorting keeps index order:
+    options.sortDescriptors = nil;
+    rows = [view _queryWithOptions: &options status: &status];
+    CAssertEqual([rows valueForKey: @"key"], (@[@4, @6, @8, @10, @12]));
+
+    // Rows that sort the same stay in index order:
+    options.postFilter = nil;
+    options.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey: @"value.bucket"
+                                                              ascending: YES]];
+    options.skip = 0;
+    options.limit = 4;
+    rows = [view _queryWithOptions: &options status: &status];
+    CAssertEqual([rows valueForKey: @"key"], (@[@0, @3, @6, @9]));
+
+    // A bounded sort returns the same rows as sorting all of them:
+    options.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey: @"value.bucket"
+                                                              ascending: NO],
+                                [NSSortDescriptor sortDescriptorWithKey: @"value.n"
+                                                              ascending: NO]];
+    options.skip = 3;
+    options.limit = 10;
+    rows = [view _queryWithOptions: &options status: &status];
+    CBLQueryOptions allOptions = kDefaultCBLQueryOptions;
+    NSArray* allRows = [view _queryWithOptions: &allOptions status: &status];
+    allRows = [allRows sortedArrayUsingDescriptors: options.sortDescriptors];
+    CAssertEqual(rows, [allRows subarrayWithRange: NSMakeRange(3, 10)]);
+
+    // The same options work for all-docs queries:
+    options = kDefaultCBLQueryOptions;
+    options.includeDocs = YES;
+    options.postFilter = [NSPredicate predicateWithFormat: @"documentProperties.n < 10"];
+    options.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey: @"key" ascending: NO]];
+    options.limit = 3;
+    rows = [db getAllDocs: &options];
+    CAssertEqual([rows valueForKey: @"key"], (@[@"doc-09", @"doc-08", @"doc-07"]));
+
+    // ...and through CBLQuery:
+    CBLQuery* query = [view createQuery];
+    query.postFilter = [NSPredicate predicateWithFormat: @"value.bucket == 1"];
+    query.sortDescriptors = @[[NSSortDescriptor sortDescriptorWithKey: @"value.n"
+                                                             ascending: NO]];
+    query.limit = 2;
+    NSError* error;
+    CBLQueryEnumerator* e = [query run: &error];
+    CAssertEqual([e.allObjects valueForKey: @"key"], (@[@49, @46]));
+    CAssertNil(e.cursor);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_StreamingQuery) {
+    RequireTestCase(CBL_View_Pagination);
+    CBLDatabase *db = createDB();
+    for (int i = 0; i < 50; i++)
+        putDoc(db, @{@"_id": $sprintf(@"doc-%02d", i), @"n": @(i)});
+    CBLView* view = [db viewNamed: @"streamed"];
+    [view setMapBlock: MAPBLOCK({
+        emit(@([doc[@"n"] intValue] % 7), doc[@"n"]);
+    }) reduceBlock: REDUCEBLOCK({
+        return @(values.count);
+    }) version: @"1"];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+
+    // Streamed rows are the same as the ones returned all at once:
+    CBLStatus status;
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.reduceSpecified = YES;
+    options.includeDocs = YES;
+    options.startKey = @2;
+    options.skip = 3;
+    NSArray* expected = [view _queryWithOptions: &options status: &status];
+    CAssertEq(expected.count, 32u);
+    NSEnumerator* e = [view _streamRowsWithOptions: &options status: &status];
+    CAssertEq(status, kCBLStatusOK);
+    CAssert([e isKindOfClass: [CBLQueryRowStream class]]);
+    CAssertEqual(e.allObjects, expected);
+    CAssertEqual([expected[0] documentProperties][@"n"], @23);
+
+    // The rows come from a snapshot, unaffected by changes made while they're being read:
+    options = kDefaultCBLQueryOptions;
+    options.reduceSpecified = YES;
+    e = [view _streamRowsWithOptions: &options status: &status];
+    CAssertEqual([e.nextObject key], @0);
+    putDoc(db, @{@"_id": @"doc-50", @"n": @50});
+    CAssertEq([view updateIndex], kCBLStatusOK);
+    CAssertEq(e.allObjects.count, 49u);
+    CAssertEq([view _queryWithOptions: &options status: &status].count, 51u);
+
+    // Reduced queries can't be streamed, but still work:
+    options.reduceSpecified = NO;
+    e = [view _streamRowsWithOptions: &options status: &status];
+    CAssertEqual(rowsToDicts(e.allObjects), (@[$dict({@"key", $null}, {@"value", @51})]));
+
+    // All-docs queries too:
+    options = kDefaultCBLQueryOptions;
+    options.includeDocs = YES;
+    options.limit = 10;
+    options.descending = YES;
+    e = [db streamAllDocs: &options status: &status];
+    CAssertEq(status, kCBLStatusOK);
+    CAssertEqual(e.allObjects, [db getAllDocs: &options]);
+
+    // A streaming query enumerator keeps the rows it's read, so it works like any other:
+    CBLQuery* query = [view createQuery];
+    query.mapOnly = YES;
+    CBLQueryEnumerator* allRows = [query run: NULL];
+    query.streamsRows = YES;
+    CBLQueryEnumerator* streamed = [query run: NULL];
+    CAssertEqual(streamed.nextRow, allRows.nextRow);
+    CAssertEq(streamed.count, allRows.count);
+    CAssertEqual(streamed, allRows);
+    [streamed reset];
+    NSUInteger n = 0;
+    while (streamed.nextRow)
+        ++n;
+    CAssertEq(n, allRows.count);
+    CAssertEq(streamed.count, allRows.count);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_BatchedInsert) {
+    RequireTestCase(CBL_View_IndexTables);
+    CBLDatabase *db = createDB();
+    // Enough rows to fill several insert batches, with some left over:
+    const int kNDocs = 250;
+    [db _inTransaction: ^CBLStatus {
+        for (int i = 0; i < kNDocs; i++)
+            putDoc(db, @{@"n": @(i)});
+        return kCBLStatusOK;
+    }];
+    CBLView* view = [db viewNamed: @"batched"];
+    [view setMapBlock: MAPBLOCK({
+        int n = [doc[@"n"] intValue];
+        emit(doc[@"n"], nil);
+        if (n % 10 == 0)
+            emit(CBLTextKey($sprintf(@"word%d", n)), doc[@"n"]);
+        if (n % 25 == 0)
+            emit(CBLGeoPointKey(n, -n), nil);
+    }) reduceBlock: NULL version: @"1"];
+    CAssertEq([view updateIndex], kCBLStatusOK);
+    CAssertEq(view.dump.count, (NSUInteger)(kNDocs + kNDocs/10 + kNDocs/25));
+
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.startKey = @100;
+    options.endKey = @199;
+    CBLStatus status;
+    NSArray* rows = [view _queryWithOptions: &options status: &status];
+    CAssertEq(rows.count, 100u);
+    CAssertEqual([rows[0] key], @100);
+    CAssertEqual([rows[99] key], @199);
+
+    // Each full-text key got its own row ID:
+    options = kDefaultCBLQueryOptions;
+    options.fullTextQuery = @"word120";
+    rows = [view _queryWithOptions: &options status: &status];
+    CAssertEq(rows.count, 1u);
+    CAssertEqual([rows[0] value], @120);
+    CAssert([db close]);
+}
+
+
 TestCase(CBL_View_MapConflicts) {
     RequireTestCase(CBL_View_Index);
     CBLDatabase *db = createDB();
@@ -695,6 +1318,203 @@ TestCase(CBL_View_GroupedStrings) {
 }
 
 
+TestCase(CBL_View_StoredReductions) {
+    RequireTestCase(CBL_View_Grouped);
+    CBLDatabase *db = createDB();
+    NSArray* tracks = @[@[@"Gang Of Four", @"Entertainment!", @"Ether", @231],
+                        @[@"Gang Of Four", @"Songs Of The Free", @"I Love A Man In Uniform", @248],
+                        @[@"Gang Of Four", @"Entertainment!", @"Natural's Not In It", @187],
+                        @[@"PiL", @"Metal Box", @"Memories", @309],
+                        @[@"Gang Of Four", @"Entertainment!", @"Not Great Men", @187],
+                        @[@"PiL", @"Metal Box", @"Memories", @309]];
+    NSMutableArray* revs = $marray();
+    int i = 0;
+    for (NSArray* track in tracks) {
+        [revs addObject: putDoc(db, $dict({@"_id", $sprintf(@"%d", ++i)},
+                                          {@"artist", track[0]}, {@"album", track[1]},
+                                          {@"track", track[2]}, {@"time", track[3]}))];
+    }
+
+    // Both views count their rows; the reduce block gives the wrong answer unless it's called
+    // with rereduce=YES when combining earlier reductions:
+    CBLMapBlock mapBlock = MAPBLOCK({
+        emit(@[doc[@"artist"], doc[@"album"], doc[@"track"]], doc[@"time"]);
+    });
+    CBLReduceBlock reduceBlock = REDUCEBLOCK({
+        return rereduce ? [CBLView totalValues: values] : @(values.count);
+    });
+    CBLView* stored = [db viewNamed: @"stored"];
+    [stored setMapBlock: mapBlock reduceBlock: reduceBlock version: @"1"];
+    stored.materializesReductions = YES;
+    CBLView* scanned = [db viewNamed: @"scanned"];
+    [scanned setMapBlock: mapBlock reduceBlock: reduceBlock version: @"1"];
+
+    // Every reduced query on the stored view should get the same results as on the other:
+    void (^check)(void) = ^{
+        CAssert([stored _reduceTableExists]);
+        CAssert(![scanned _reduceTableExists]);
+        for (int groupLevel = -1; groupLevel <= 3; ++groupLevel) {
+            for (int range = 0; range < 3; ++range) {
+                CBLQueryOptions options = kDefaultCBLQueryOptions;
+                options.group = (groupLevel >= 0);
+                options.groupLevel = MAX(groupLevel, 0);
+                if (range == 1) {
+                    options.startKey = @[@"Gang Of Four", @"Entertainment!", @"N"];
+                    options.endKey = @[@"PiL"];
+                } else if (range == 2) {
+                    options.descending = YES;
+                    options.startKey = @[@"PiL", @{}];
+                    options.endKey = @[@"Gang Of Four", @"Songs Of The Free"];
+                    options.inclusiveEnd = NO;
+                }
+                CBLStatus status;
+                NSArray* expected = rowsToDicts([scanned _queryWithOptions: &options
+                                                                    status: &status]);
+                CAssertEq(status, kCBLStatusOK);
+                NSArray* rows = rowsToDicts([stored _queryWithOptions: &options status: &status]);
+                CAssertEq(status, kCBLStatusOK);
+                CAssertEqual(rows, expected);
+            }
+        }
+    };
+
+    CAssertEq([CBLView updateIndexes: @[stored, scanned]], kCBLStatusOK);
+    check();
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.groupLevel = 1;
+    CBLStatus status;
+    CAssertEqual(rowsToDicts([stored _queryWithOptions: &options status: &status]),
+                 (@[$dict({@"key", @[@"Gang Of Four"]}, {@"value", @4}),
+                    $dict({@"key", @[@"PiL"]}, {@"value", @2})]));
+
+    // Update, delete and add documents; the stored reductions are updated incrementally:
+    CBL_Revision* rev = revs[1];
+    CBL_MutableRevision* nuRev = [[CBL_MutableRevision alloc] initWithDocID: rev.docID
+                                                                      revID: nil deleted: NO];
+    nuRev.properties = $dict({@"artist", @"Gang Of Four"}, {@"album", @"Solid Gold"},
+                             {@"track", @"Paralysed"}, {@"time", @216});
+    [db putRevision: nuRev prevRevisionID: rev.revID allowConflict: NO status: &status];
+    CAssertEq(status, kCBLStatusCreated);
+    rev = revs[3];
+    CBL_Revision* del = [[CBL_Revision alloc] initWithDocID: rev.docID revID: nil deleted: YES];
+    [db putRevision: del prevRevisionID: rev.revID allowConflict: NO status: &status];
+    CAssertEq(status, kCBLStatusOK);
+    putDoc(db, $dict({@"artist", @"Wire"}, {@"album", @"Pink Flag"},
+                     {@"track", @"Ex Lion Tamer"}, {@"time", @139}));
+    CAssertEq([CBLView updateIndexes: @[stored, scanned]], kCBLStatusOK);
+    check();
+    CAssertEq([db.fmdb intForQuery: $sprintf(@"SELECT count(*) FROM %@ WHERE value IS NULL",
+                                             stored.reduceTableName)], 0);
+
+    // Purging a document deletes its rows without updating the index; queries must notice:
+    CAssertEq([db purgeRevisions: @{[revs[4] docID]: @[@"*"]} result: NULL], kCBLStatusOK);
+    check();
+
+    // Another CBLView object for the same view (like the background updater's) keeps the
+    // reductions up to date too:
+    CBLView* other = [[CBLView alloc] initWithDatabase: db name: @"stored"];
+    CAssert(other.materializesReductions);
+    putDoc(db, $dict({@"artist", @"Wire"}, {@"album", @"Pink Flag"},
+                     {@"track", @"Three Girl Rhumba"}, {@"time", @82}));
+    CAssertEq([CBLView updateIndexes: @[other, scanned]], kCBLStatusOK);
+    CAssert([stored _reduceTableExists]);
+    check();
+
+    // Turning the setting off discards the stored reductions:
+    stored.materializesReductions = NO;
+    CAssert(![stored _reduceTableExists]);
+    putDoc(db, $dict({@"artist", @"Wire"}, {@"album", @"Chairs Missing"},
+                     {@"track", @"Outdoor Miner"}, {@"time", @105}));
+    CAssertEq([stored updateIndex], kCBLStatusOK);
+    CAssert(![stored _reduceTableExists]);
+    CAssert([db close]);
+}
+
+
+TestCase(CBL_View_BuiltInReduce) {
+    RequireTestCase(CBL_View_Grouped);
+    CBLDatabase *db = createDB();
+    NSArray* tracks = @[@[@"Gang Of Four", @"Entertainment!", @"Ether", @231],
+                        @[@"Gang Of Four", @"Songs Of The Free", @"I Love A Man In Uniform", @248],
+                        @[@"Gang Of Four", @"Entertainment!", @"Natural's Not In It", @187],
+                        @[@"PiL", @"Metal Box", @"Memories", @309],
+                        @[@"Gang Of Four", @"Entertainment!", @"Not Great Men", @187],
+                        @[@"PiL", @"Metal Box", @"Memories", @309],
+                        @[@"Wire", @{@"a,b": @"[,]"}, @"\"Ex\" Lion Tamer", @139]];
+    for (NSArray* track in tracks) {
+        putDoc(db, $dict({@"artist", track[0]}, {@"album", track[1]},
+                         {@"track", track[2]}, {@"time", track[3]}));
+    }
+    CBLMapBlock mapBlock = MAPBLOCK({
+        emit(@[doc[@"artist"], doc[@"album"], doc[@"track"]], doc[@"time"]);
+    });
+
+    for (NSString* reducerName in @[@"_count", @"_sum", @"_stats"]) {
+        // The native view's queries are computed by SQLite; the other view calls the same
+        // reduce block through a wrapper, so it's queried the usual way:
+        CBLReduceBlock reduceBlock = [CBLView reduceBlockNamed: reducerName];
+        CAssert(reduceBlock);
+        CBLView* native = [db viewNamed: $sprintf(@"native%@", reducerName)];
+        [native setMapBlock: mapBlock reduceBlock: reduceBlock version: @"1"];
+        CBLView* wrapped = [db viewNamed: $sprintf(@"wrapped%@", reducerName)];
+        [wrapped setMapBlock: mapBlock reduceBlock: REDUCEBLOCK({
+            return reduceBlock(keys, values, rereduce);
+        }) version: @"1"];
+        CAssertEq([CBLView updateIndexes: @[native, wrapped]], kCBLStatusOK);
+
+        for (int groupLevel = -1; groupLevel <= 3; ++groupLevel) {
+            for (int variant = 0; variant < 4; ++variant) {
+                CBLQueryOptions options = kDefaultCBLQueryOptions;
+                options.group = (groupLevel >= 0);
+                options.groupLevel = MAX(groupLevel, 0);
+                if (variant == 1) {
+                    options.startKey = @[@"Gang Of Four", @"Entertainment!", @"N"];
+                    options.endKey = @[@"Wire"];
+                } else if (variant == 2) {
+                    options.descending = YES;
+                    options.skip = 1;
+                    options.limit = 4;
+                } else if (variant == 3) {
+                    options.keys = @[@[@"PiL", @"Metal Box", @"Memories"],
+                                     @[@"Wire", @{@"a,b": @"[,]"}, @"\"Ex\" Lion Tamer"]];
+                }
+                CBLStatus status;
+                NSArray* expected = rowsToDicts([wrapped _queryWithOptions: &options
+                                                                    status: &status]);
+                CAssertEq(status, kCBLStatusOK);
+                CAssert(expected.count > 0);
+                NSArray* rows = rowsToDicts([native _queryWithOptions: &options status: &status]);
+                CAssertEq(status, kCBLStatusOK);
+                CAssertEqual(rows, expected);
+            }
+        }
+    }
+
+    CBLQueryOptions options = kDefaultCBLQueryOptions;
+    options.groupLevel = 1;
+    CBLStatus status;
+    CBLView* view = [db existingViewNamed: @"native_count"];
+    CAssertEqual(rowsToDicts([view _queryWithOptions: &options status: &status]),
+                 (@[$dict({@"key", @[@"Gang Of Four"]}, {@"value", @4}),
+                    $dict({@"key", @[@"PiL"]}, {@"value", @2}),
+                    $dict({@"key", @[@"Wire"]}, {@"value", @1})]));
+
+    // A value that isn't a JSON number gets reduced the same way as by the reduce block:
+    putDoc(db, $dict({@"artist", @"Wire"}, {@"album", @"Pink Flag"}, {@"track", @"Mr. Suit"},
+                     {@"time", @"105"}));
+    for (NSString* reducerName in @[@"_sum", @"_stats"]) {
+        CBLView* native = [db existingViewNamed: $sprintf(@"native%@", reducerName)];
+        CBLView* wrapped = [db existingViewNamed: $sprintf(@"wrapped%@", reducerName)];
+        CAssertEq([CBLView updateIndexes: @[native, wrapped]], kCBLStatusOK);
+        NSArray* expected = rowsToDicts([wrapped _queryWithOptions: &options status: &status]);
+        CAssertEq(status, kCBLStatusOK);
+        CAssertEqual(rowsToDicts([native _queryWithOptions: &options status: &status]), expected);
+        CAssertEq(status, kCBLStatusOK);
+    }
+    CAssert([db close]);
+}
+
+
 TestCase(CBL_View_Collation) {
     // Based on CouchDB's "view_collation.js" test
     NSArray* testKeys = @[$null,
@@ -785,6 +1605,68 @@ TestCase(CBL_View_CollationRaw) {
 }
 
 
+TestCase(CBL_View_BinaryKeys) {
+    RequireTestCase(CBL_View_Query);
+    NSArray* testKeys = @[$null, $false, $true, @0, @(-2.5), @(2.5), @(10), @" ", @"_", @"~", @"a",
+                          @"A", @"aa", @"aB", @"Ab", @"b", @"B", @"ba", @"bb", @[@"a"], @[@"b"],
+                          @[@"b", @"c"], @[@"b", @"c", @"a"], @[@"b", @"d"], @[@"b", @"d", @"e"],
+                          @[@"b", @2], @{}];
+    CBLDatabase *db = createDB();
+    int i = 0;
+    for (id key in testKeys)
+        putDoc(db, $dict({@"_id", $sprintf(@"%d", i++)}, {@"name", key}));
+
+    for (int collation = kCBLViewCollationUnicode; collation <= kCBLViewCollationASCII; ++collation) {
+        // A binary-keyed view should give the same results as a JSON-keyed one:
+        CBLView* jsonView = [db viewNamed: $sprintf(@"json%d", collation)];
+        CBLView* binaryView = [db viewNamed: $sprintf(@"binary%d", collation)];
+        for (CBLView* view in @[jsonView, binaryView]) {
+            [view setMapBlock: MAPBLOCK({
+                emit(doc[@"name"], nil);
+            }) reduceBlock: NULL version: @"1"];
+            view.collation = collation;
+        }
+        CAssert(!binaryView.binaryKeyFormat);
+        binaryView.binaryKeyFormat = YES;
+        CAssert(binaryView.binaryKeyFormat);
+        CAssertEq([CBLView updateIndexes: @[jsonView, binaryView]], kCBLStatusOK);
+
+        CBLQueryOptions options = kDefaultCBLQueryOptions;
+        CBLStatus status;
+        NSArray* rows = rowsToDicts([binaryView _queryWithOptions: &options status: &status]);
+        CAssertEq(status, kCBLStatusOK);
+        CAssertEq(rows.count, testKeys.count);
+        CAssertEqual(rows, rowsToDicts([jsonView _queryWithOptions: &options status: &status]));
+
+        options.startKey = @"a";
+        options.endKey = @[@"b", @"d"];
+        options.inclusiveEnd = NO;
+        rows = rowsToDicts([binaryView _queryWithOptions: &options status: &status]);
+        CAssert(rows.count > 0);
+        CAssertEqual(rows, rowsToDicts([jsonView _queryWithOptions: &options status: &status]));
+
+        options.descending = YES;
+        options.startKey = @[@"b"];
+        options.endKey = @(2.5);
+        options.inclusiveEnd = YES;
+        rows = rowsToDicts([binaryView _queryWithOptions: &options status: &status]);
+        CAssert(rows.count > 0);
+        CAssertEqual(rows, rowsToDicts([jsonView _queryWithOptions: &options status: &status]));
+
+        options = kDefaultCBLQueryOptions;
+        options.keys = @[@"aa", @(10), @[@"b", @"c"], @"missing"];
+        rows = rowsToDicts([binaryView _queryWithOptions: &options status: &status]);
+        CAssertEq(rows.count, 3u);
+        CAssertEqual(rows, rowsToDicts([jsonView _queryWithOptions: &options status: &status]));
+
+        // Changing the key format clears the index:
+        binaryView.binaryKeyFormat = NO;
+        CAssertEq(binaryView.lastSequenceIndexed, 0);
+    }
+    CAssert([db close]);
+}
+
+
 TestCase(CBL_View_LinkedDocs) {
     RequireTestCase(CBL_View_Query);
     CBLDatabase *db = createDB();
@@ -937,12 +1819,26 @@ TestCase(CBL_View_FullTextQuery) {
 }
 
 TestCase(CBLView) {
+    RequireTestCase(CBL_View_ParallelIndex);
+    RequireTestCase(CBL_View_UpdateIndexes);
+    RequireTestCase(CBL_View_ChunkedIndex);
+    RequireTestCase(CBL_View_IndexChangeTracking);
+    RequireTestCase(CBL_View_IndexTables);
+    RequireTestCase(CBL_View_CoveringIndex);
+    RequireTestCase(CBL_View_Pagination);
+    RequireTestCase(CBL_View_StreamingQuery);
+    RequireTestCase(CBL_View_QueryCache);
+    RequireTestCase(CBL_View_PostFilterAndSort);
+    RequireTestCase(CBL_View_BatchedInsert);
     RequireTestCase(CBL_View_MapConflicts);
     RequireTestCase(CBL_View_ConflictWinner);
     RequireTestCase(CBL_View_ConflictLoser);
     RequireTestCase(CBL_View_LinkedDocs);
+    RequireTestCase(CBL_View_StoredReductions);
+    RequireTestCase(CBL_View_BuiltInReduce);
     RequireTestCase(CBL_View_Collation);
     RequireTestCase(CBL_View_CollationRaw);
+    RequireTestCase(CBL_View_BinaryKeys);
     RequireTestCase(CBL_View_GeoQuery);
     RequireTestCase(CBL_View_FullTextQuery);
 }